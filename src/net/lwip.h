@@ -10,3 +10,9 @@
 #include <lwip/ip4_frag.h>
 #include <lwip/etharp.h>
 #include <lwip/dhcp.h>
+
+/* transmit batching; see net.c */
+void net_tx_batch_begin(void);
+void net_tx_batch_end(void);
+boolean net_tx_batching(void);
+void net_tx_register_flush(thunk flush);
@@ -1,6 +1,7 @@
 #include <runtime.h>
 #include <lwip.h>
 #include <lwip/priv/tcp_priv.h>
+#include <x86_64.h>
 
 static heap lwip_heap;
 
@@ -72,6 +73,8 @@ void lwip_status_callback(struct netif *netif)
 {
     u8 *n = (u8 *)&netif->ip_addr;
     rprintf("assigned: %d.%d.%d.%d\n", n[0], n[1], n[2], n[3]);
+    if (n[0] | n[1] | n[2] | n[3])
+        boot_phase_end(BOOT_PHASE_NETWORK);
 }
 
 /* unsigned only ... don't imagine we'd have negative interface numbers! */
@@ -112,6 +115,37 @@ int lwip_strncmp(const char *x, const char *y, unsigned long len)
     return 0;
 }
 
+/* Frames output while a transmit batch is open may be queued by the
+   driver instead of being posted to the device one at a time; closing
+   the outermost batch flushes them all in one pass. */
+static u64 tx_batch_depth;
+static vector tx_flush_handlers;
+
+void net_tx_register_flush(thunk flush)
+{
+    vector_push(tx_flush_handlers, flush);
+}
+
+boolean net_tx_batching(void)
+{
+    return tx_batch_depth > 0;
+}
+
+void net_tx_batch_begin(void)
+{
+    tx_batch_depth++;
+}
+
+void net_tx_batch_end(void)
+{
+    assert(tx_batch_depth > 0);
+    if (--tx_batch_depth > 0)
+        return;
+    thunk flush;
+    vector_foreach(tx_flush_handlers, flush)
+        apply(flush);
+}
+
 extern void lwip_init();
 
 void init_net(kernel_heaps kh)
@@ -119,5 +153,6 @@ void init_net(kernel_heaps kh)
     heap h = heap_general(kh);
     heap backed = heap_backed(kh);
     lwip_heap = allocate_mcache(h, backed, 5, 11, PAGESIZE);
+    tx_flush_handlers = allocate_vector(h, 1);
     lwip_init();
 }
@@ -1,4 +1,5 @@
 #define	ENOTSOCK	88	/* Socket operation on non-socket */
+#define	EMSGSIZE	90	/* Message too long */
 #define	ESOCKTNOSUPPORT 94	/* Socket type not supported */
 #define	EPFNOSUPPORT	96	/* Protocol family not supported */
 #define	EAFNOSUPPORT	97	/* Address family not supported by protocol */
@@ -32,6 +33,9 @@ enum protocol_type {
 // tuplify
 #define SOCK_NONBLOCK 00004000
 #define SOCK_CLOEXEC  02000000
+#define SOL_SOCKET		1
+#define SOL_TCP			6
+
 #define TCP_NODELAY		1	/* Turn off Nagle's algorithm. */
 #define TCP_MAXSEG		2	/* Limit MSS */
 #define TCP_CORK		3	/* Never send partially complete segments */
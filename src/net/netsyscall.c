@@ -105,6 +105,20 @@ enum tcp_socket_state {
     TCP_SOCK_LISTENING = 5,
 };
 
+/* Data queued to lwIP by reference (see socket_write_ref) must stay
+   valid until the peer has acknowledged it. Each txref covers one such
+   write and is released once lastack reaches its end. */
+typedef struct tcp_txref {
+    struct list l;
+    u32 end;                    /* sequence number following the data */
+    thunk release;
+} *tcp_txref;
+
+typedef struct tcp_txrefs {
+    heap h;
+    struct list refs;           /* in sequence order */
+} *tcp_txrefs;
+
 enum udp_socket_state {
     UDP_SOCK_UNDEFINED = 0,
     UDP_SOCK_CREATED = 1,
@@ -125,6 +139,16 @@ typedef struct sock {
 	struct {
 	    struct tcp_pcb *lw;
 	    enum tcp_socket_state state; // half open?
+	    tcp_txrefs txrefs;       /* allocated on first socket_write_ref */
+	    struct pbuf *rx_cur;     /* read cursor within the head of incoming */
+	    u16 rx_off;
+	    u64 rx_avail;            /* bytes queued and not yet read */
+	    u64 rx_unacked;          /* bytes read but not yet returned to the window */
+	    struct list output_l;    /* linked while output is pending, see tcp_output_pending */
+	    boolean nodelay;         /* also inherited by connections accepted from a listener */
+	    boolean cork;
+	    timer cork_timer;        /* armed while output is held for cork or MSG_MORE */
+	    thunk cork_expire;
 	} tcp;
 	struct {
 	    struct udp_pcb *lw;
@@ -243,10 +267,93 @@ static inline s64 lwip_to_errno(s8 err)
     return -EINVAL;		/* XXX unknown - check return value */
 }
 
-static inline void pbuf_consume(struct pbuf *p, u64 length)
+/* TCP receive data is read through a cursor into the pbuf chain at the
+   head of the incoming queue rather than by consuming the pbufs
+   themselves; reads copy (or reference, see socket_read_ref) the spans
+   ahead of the cursor, and a chain is freed once the cursor leaves it. */
+static u64 tcp_rx_span(sock s, void **data, struct pbuf **q)
+{
+    struct pbuf *cur = s->info.tcp.rx_cur;
+    if (!cur) {
+        cur = queue_peek(s->incoming);
+        assert(cur);
+        s->info.tcp.rx_cur = cur;
+        s->info.tcp.rx_off = 0;
+    }
+    while (s->info.tcp.rx_off == cur->len) {
+        cur = cur->next;
+        assert(cur);
+        s->info.tcp.rx_cur = cur;
+        s->info.tcp.rx_off = 0;
+    }
+    *data = cur->payload + s->info.tcp.rx_off;
+    if (q)
+        *q = cur;
+    return cur->len - s->info.tcp.rx_off;
+}
+
+/* Advance the cursor past length bytes of the current span. */
+static void tcp_rx_consume(sock s, u64 length)
+{
+    struct pbuf *cur = s->info.tcp.rx_cur;
+    assert(cur && s->info.tcp.rx_off + length <= cur->len);
+    s->info.tcp.rx_off += length;
+    s->info.tcp.rx_avail -= length;
+    s->info.tcp.rx_unacked += length;
+    while (cur && s->info.tcp.rx_off == cur->len) {
+        cur = cur->next;
+        s->info.tcp.rx_off = 0;
+    }
+    s->info.tcp.rx_cur = cur;
+    if (!cur) {
+        struct pbuf *p = dequeue(s->incoming);
+        assert(p);
+        pbuf_free(p);
+    }
+}
+
+/* Window updates are coalesced: rather than a tcp_recved per read, the
+   window is reopened once a quarter of it has been read or the queue
+   has drained. */
+static void tcp_rx_update_window(sock s)
+{
+    if (s->info.tcp.rx_unacked < TCP_WND_UPDATE_THRESHOLD && s->info.tcp.rx_avail > 0)
+        return;
+    while (s->info.tcp.rx_unacked > 0) {
+        u16 n = MIN(s->info.tcp.rx_unacked, 0xffff);
+        tcp_recved(s->info.tcp.lw, n);
+        s->info.tcp.rx_unacked -= n;
+    }
+}
+
+static u64 tcp_rx_copy(sock s, struct iovec *iov, u64 iovcnt)
+{
+    u64 total = 0;
+    u64 iv = 0, iov_off = 0;
+    while (iv < iovcnt && s->info.tcp.rx_avail > 0) {
+        if (iov_off == iov[iv].iov_len) {
+            iv++;
+            iov_off = 0;
+            continue;
+        }
+        void *data;
+        u64 xfer = MIN(tcp_rx_span(s, &data, 0), iov[iv].iov_len - iov_off);
+        runtime_memcpy(iov[iv].iov_base + iov_off, data, xfer);
+        tcp_rx_consume(s, xfer);
+        iov_off += xfer;
+        total += xfer;
+    }
+    tcp_rx_update_window(s);
+    return total;
+}
+
+static void tcp_rx_free(sock s)
 {
-    p->len -= length;
-    p->payload += length;
+    struct pbuf *p;
+    while ((p = dequeue(s->incoming)))
+        pbuf_free(p);
+    s->info.tcp.rx_cur = 0;
+    s->info.tcp.rx_avail = 0;
 }
 
 struct udp_entry {
@@ -255,6 +362,67 @@ struct udp_entry {
     u16 rport;
 };
 
+/* Report the source of the data at the head of the receive queue. */
+static void sock_src_addr(sock s, void *p, struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    struct sockaddr sa;
+    zero(&sa, sizeof(sa));
+    struct sockaddr_in * sin = (struct sockaddr_in *)&sa;
+    sin->family = AF_INET;
+    if (s->type == SOCK_STREAM) {
+        sin->address = ip4_addr_get_u32(&s->info.tcp.lw->remote_ip);
+        sin->port = htons(s->info.tcp.lw->remote_port);
+    } else {
+        struct udp_entry * e = p;
+        sin->address = e->raddr;
+        sin->port = htons(e->rport);
+    }
+    u32 len = MIN(sizeof(struct sockaddr), *addrlen);
+    *addrlen = sizeof(struct sockaddr);
+    runtime_memcpy(src_addr, sin, len);
+}
+
+/* Copy data at the head of the receive queue straight into an iovec
+   array: one datagram, or as much of the stream as fits (read through
+   the receive cursor). Sets *trunc if a datagram didn't fit; the rest of
+   it is discarded. */
+static u64 sock_dequeue_iov(sock s, struct iovec *iov, u64 iovcnt, boolean *trunc)
+{
+    u64 total = 0;
+    *trunc = false;
+    if (s->type == SOCK_STREAM) {
+        total = tcp_rx_copy(s, iov, iovcnt);
+    } else {
+        struct udp_entry *e = dequeue(s->incoming);
+        assert(e);
+        struct pbuf *cur_buf = e->pbuf;
+        u64 iv = 0, iov_off = 0, off = 0;
+        while (cur_buf && iv < iovcnt) {
+            if (off == cur_buf->len) {
+                cur_buf = cur_buf->next;
+                off = 0;
+                continue;
+            }
+            if (iov_off == iov[iv].iov_len) {
+                iv++;
+                iov_off = 0;
+                continue;
+            }
+            u64 xfer = MIN(cur_buf->len - off, iov[iv].iov_len - iov_off);
+            runtime_memcpy(iov[iv].iov_base + iov_off, cur_buf->payload + off, xfer);
+            off += xfer;
+            iov_off += xfer;
+            total += xfer;
+        }
+        *trunc = total < e->pbuf->tot_len;
+        pbuf_free(e->pbuf);
+        deallocate(s->h, e, sizeof(struct udp_entry));
+    }
+    if (!queue_peek(s->incoming))
+        notify_sock(s);         /* reset a triggered EPOLLIN condition */
+    return total;
+}
+
 static sysreturn sock_read_bh_internal(sock s, thread t, void * dest, u64 length, struct sockaddr * src_addr,
                                        socklen_t * addrlen, io_completion completion, u64 flags)
 {
@@ -295,59 +463,12 @@ static sysreturn sock_read_bh_internal(sock s, thread t, void * dest, u64 length
         return BLOCKQ_BLOCK_REQUIRED;               /* back to chewing more cud */
     }
 
-    if (src_addr) {
-        struct sockaddr sa;
-        zero(&sa, sizeof(sa));
-        struct sockaddr_in * sin = (struct sockaddr_in *)&sa;
-        sin->family = AF_INET;
-        if (s->type == SOCK_STREAM) {
-	    sin->address = ip4_addr_get_u32(&s->info.tcp.lw->remote_ip);
-	    sin->port = htons(s->info.tcp.lw->remote_port);
-        } else {
-            struct udp_entry * e = p;
-            sin->address = e->raddr;
-            sin->port = htons(e->rport);
-        }
-        u32 len = MIN(sizeof(struct sockaddr), *addrlen);
-        *addrlen = sizeof(struct sockaddr);
-        runtime_memcpy(src_addr, sin, len);
-    }
-
-    u64 xfer_total = 0;
-
-    /* TCP: consume multiple buffers to fill request, if available. */
-    do {
-        struct pbuf * pbuf = s->type == SOCK_STREAM ? (struct pbuf *)p :
-            ((struct udp_entry *)p)->pbuf;
-        struct pbuf *cur_buf = pbuf;
-
-        do {
-            if (cur_buf->len > 0) {
-                u64 xfer = MIN(length, cur_buf->len);
-                runtime_memcpy(dest, cur_buf->payload, xfer);
-                pbuf_consume(cur_buf, xfer);
-                length -= xfer;
-                xfer_total += xfer;
-                dest = (char *) dest + xfer;
-                if (s->type == SOCK_STREAM)
-                    tcp_recved(s->info.tcp.lw, xfer);
-            }
-            if (cur_buf->len == 0)
-                cur_buf = cur_buf->next;
-        } while ((length > 0) && cur_buf);
-
-        if (!cur_buf || (s->type == SOCK_DGRAM)) {
-            assert(dequeue(s->incoming) == p);
-            if (s->type == SOCK_DGRAM)
-                deallocate(s->h, p, sizeof(struct udp_entry));
-            pbuf_free(pbuf);
-            p = queue_peek(s->incoming);
-            if (!p)
-                notify_sock(s); /* reset a triggered EPOLLIN condition */
-        }
-    } while(s->type == SOCK_STREAM && length > 0 && p); /* XXX simplify expression */
+    if (src_addr)
+        sock_src_addr(s, p, src_addr, addrlen);
 
-    rv = xfer_total;
+    struct iovec iov = { .iov_base = dest, .iov_len = length };
+    boolean trunc;
+    rv = sock_dequeue_iov(s, &iov, 1, &trunc);
   out:
     net_debug("   completion %p, rv %ld\n", completion, rv);
     blockq_handle_completion(s->rxbq, flags, completion, t, rv);
@@ -421,10 +542,134 @@ closure_function(1, 6, sysreturn, socket_read,
     return blockq_check(s->rxbq, t, ba, bh);
 }
 
-static sysreturn socket_write_tcp_bh_internal(sock s, thread t, void * buf, u64 remain, io_completion completion, u64 flags)
+/* Release references for data acknowledged by the peer, or all of
+   them if pcb is null (connection gone). */
+static void tcp_txrefs_release(tcp_txrefs txr, struct tcp_pcb *pcb)
+{
+    list_foreach(&txr->refs, l) {
+        tcp_txref r = struct_from_list(l, tcp_txref, l);
+        if (pcb && (s32)(pcb->lastack - r->end) < 0)
+            break;
+        list_delete(l);
+        apply(r->release);
+        deallocate(txr->h, r, sizeof(struct tcp_txref));
+    }
+}
+
+static void tcp_txrefs_free(tcp_txrefs txr)
+{
+    tcp_txrefs_release(txr, 0);
+    deallocate(txr->h, txr, sizeof(struct tcp_txrefs));
+}
+
+/* After the socket is closed, lwIP may still be (re)transmitting data
+   queued by reference; the txrefs then become the callback argument
+   until everything is acknowledged or the pcb goes away. */
+static err_t tcp_txrefs_sent(void *arg, struct tcp_pcb *pcb, u16 len)
+{
+    if (!arg)
+        return ERR_OK;
+    tcp_txrefs txr = arg;
+    tcp_txrefs_release(txr, pcb);
+    if (list_empty(&txr->refs)) {
+        tcp_arg(pcb, 0);
+        tcp_txrefs_free(txr);
+    }
+    return ERR_OK;
+}
+
+static void tcp_txrefs_err(void *arg, err_t err)
+{
+    if (arg)
+        tcp_txrefs_free(arg);
+}
+
+/* Writes made from the bottom half, e.g. by writers woken as the send
+   buffer drains, don't call tcp_output themselves; the socket is put on
+   a list that is flushed once at the end of the bottom half pass.
+   Writes from syscall context are output before returning. Data written
+   with MSG_MORE or while corked is held instead, for up to
+   TCP_CORK_TIMEOUT, unless it has filled the send buffer. */
+#define TCP_CORK_TIMEOUT milliseconds(200)
+
+static struct list tcp_output_socks;
+static boolean tcp_output_queued;
+static thunk tcp_output_service;
+
+static void tcp_cork_cancel(sock s)
+{
+    if (s->info.tcp.cork_timer) {
+        remove_timer(s->info.tcp.cork_timer);
+        s->info.tcp.cork_timer = 0;
+    }
+}
+
+static void tcp_output_flush(sock s)
+{
+    if (!s->info.tcp.output_l.next)
+        return;
+    list_delete(&s->info.tcp.output_l);
+    tcp_cork_cancel(s);         /* held data goes out with the rest */
+    if (!s->info.tcp.lw || s->info.tcp.state != TCP_SOCK_OPEN)
+        return;
+    err_t err = tcp_output(s->info.tcp.lw);
+    if (err != ERR_OK)
+        net_debug("sock %d, tcp_output() lwip error: %d\n", s->fd, err);
+}
+
+static void tcp_output_pending(sock s)
+{
+    if (!s->info.tcp.output_l.next)
+        list_push_back(&tcp_output_socks, &s->info.tcp.output_l);
+    if (!in_bottom_half()) {
+        tcp_output_flush(s);
+        return;
+    }
+    if (!tcp_output_queued) {
+        tcp_output_queued = true;
+        assert(enqueue(bhqueue, tcp_output_service));
+    }
+}
+
+closure_function(0, 0, void, tcp_output_bh)
+{
+    list l;
+    tcp_output_queued = false;
+    while ((l = list_get_next(&tcp_output_socks)))
+        tcp_output_flush(struct_from_list(l, sock, info.tcp.output_l));
+}
+
+closure_function(1, 0, void, tcp_cork_expire,
+                 sock, s)
+{
+    sock s = bound(s);
+    s->info.tcp.cork_timer = 0;
+    tcp_output_pending(s);
+    tcp_output_flush(s);
+}
+
+static void tcp_cork_hold(sock s)
+{
+    if (s->info.tcp.cork_timer)
+        return;
+    if (!s->info.tcp.cork_expire) {
+        thunk t = closure(s->h, tcp_cork_expire, s);
+        if (t == INVALID_ADDRESS) {
+            tcp_output_pending(s);
+            return;
+        }
+        s->info.tcp.cork_expire = t;
+    }
+    s->info.tcp.cork_timer = register_timer(TCP_CORK_TIMEOUT, CLOCK_ID_MONOTONIC,
+                                            s->info.tcp.cork_expire);
+}
+
+static sysreturn socket_write_tcp_bh_internal(sock s, thread t, void * buf, u64 remain, thunk release,
+                                              boolean more, io_completion completion, u64 flags)
 {
     sysreturn rv = 0;
     err_t err = get_lwip_error(s);
+    tcp_txref r = 0;
     net_debug("fd %d, thread %ld, buf %p, remain %ld, flags 0x%lx, lwip err %d\n",
               s->fd, t->tid, buf, remain, flags, err);
     assert(remain > 0);
@@ -461,9 +706,21 @@ static sysreturn socket_write_tcp_bh_internal(sock s, thread t, void * buf, u64
         }
     }
 
+    /* Data queued by reference is held until acknowledged. */
+    if (release) {
+        r = allocate(s->h, sizeof(struct tcp_txref));
+        if (r == INVALID_ADDRESS) {
+            r = 0;
+            rv = -ENOMEM;
+            goto out;
+        }
+    }
+
     /* Figure actual length and flags */
     u64 n;
-    u8 apiflags = TCP_WRITE_FLAG_COPY;
+    u8 apiflags = release ? 0 : TCP_WRITE_FLAG_COPY;
+    if (more || s->info.tcp.cork)
+        apiflags |= TCP_WRITE_FLAG_MORE;
     if (avail < remain) {
         n = avail;
         apiflags |= TCP_WRITE_FLAG_MORE;
@@ -474,39 +731,51 @@ static sysreturn socket_write_tcp_bh_internal(sock s, thread t, void * buf, u64
     /* XXX need to pore over lwIP error conditions here */
     err = tcp_write(s->info.tcp.lw, buf, n, apiflags);
     if (err == ERR_OK) {
-        /* XXX prob add a flag to determine whether to continuously
-           post data, e.g. if used by send/sendto... */
-        err = tcp_output(s->info.tcp.lw);
-        if (err == ERR_OK) {
-            net_debug(" tcp_write and tcp_output successful for %ld bytes\n", n);
-            rv = n;
-            if (n == avail) {
-                notify_sock(s); /* reset a triggered EPOLLOUT condition */
-            }
+        if (r) {
+            r->end = s->info.tcp.lw->snd_lbb;
+            r->release = release;
+            list_push_back(&s->info.tcp.txrefs->refs, &r->l);
+            r = 0;
+            release = 0;
+        }
+        net_debug(" tcp_write successful for %ld bytes\n", n);
+        rv = n;
+        if (n == avail) {
+            notify_sock(s); /* reset a triggered EPOLLOUT condition */
+            tcp_output_pending(s);
+        } else if (more || s->info.tcp.cork) {
+            tcp_cork_hold(s);
         } else {
-            net_debug(" tcp_output() lwip error: %d\n", err);
-            rv = lwip_to_errno(err);
-            /* XXX map error to socket tcp state */
+            tcp_output_pending(s);
         }
     } else if (err == ERR_MEM) {
         /* XXX some ambiguity in lwIP - investigate */
         net_debug(" tcp_write() returned ERR_MEM\n");
+        if (r) {
+            deallocate(s->h, r, sizeof(struct tcp_txref));
+            r = 0;
+        }
         goto full;
     } else {
         net_debug(" tcp_write() lwip error: %d\n", err);
         rv = lwip_to_errno(err);
     }
   out:
+    if (r)
+        deallocate(s->h, r, sizeof(struct tcp_txref));
+    if (release)
+        apply(release);
     net_debug("   completion %p, rv %ld\n", completion, rv);
     blockq_handle_completion(s->txbq, flags, completion, t, rv);
     return rv;
 }
 
-closure_function(5, 1, sysreturn, socket_write_tcp_bh,
-                 sock, s, thread, t, void *, buf, u64, remain, io_completion, completion,
+closure_function(7, 1, sysreturn, socket_write_tcp_bh,
+                 sock, s, thread, t, void *, buf, u64, remain, thunk, release, boolean, more, io_completion, completion,
                  u64, flags)
 {
-    sysreturn rv = socket_write_tcp_bh_internal(bound(s), bound(t), bound(buf), bound(remain), bound(completion), flags);
+    sysreturn rv = socket_write_tcp_bh_internal(bound(s), bound(t), bound(buf), bound(remain),
+                                                bound(release), bound(more), bound(completion), flags);
     if (rv != BLOCKQ_BLOCK_REQUIRED)
         closure_finish();
     return rv;
@@ -526,6 +795,7 @@ static sysreturn socket_write_udp(sock s, void *source, u64 length)
     }
     runtime_memcpy(pbuf->payload, source, length);
     err = udp_send(s->info.udp.lw, pbuf);
+    pbuf_free(pbuf);
     if (err != ERR_OK) {
         net_debug("lwip error %d\n", err);
         return lwip_to_errno(err);
@@ -533,7 +803,7 @@ static sysreturn socket_write_udp(sock s, void *source, u64 length)
     return length;
 }
 
-static sysreturn socket_write_internal(sock s, void *source, u64 length,
+static sysreturn socket_write_internal(sock s, void *source, u64 length, boolean more,
                                        thread t, boolean bh, io_completion completion)
 {
     sysreturn rv;
@@ -546,7 +816,7 @@ static sysreturn socket_write_internal(sock s, void *source, u64 length,
             goto out;
         }
         blockq_action ba = closure(s->h, socket_write_tcp_bh, s, t,
-                                   source, length, completion);
+                                   source, length, 0, more, completion);
         rv = blockq_check(s->txbq, t, ba, bh);
     } else if (s->type == SOCK_DGRAM) {
         rv = socket_write_udp(s, source, length);
@@ -566,7 +836,99 @@ closure_function(1, 6, sysreturn, socket_write,
     sock s = bound(s);
     net_debug("sock %d, type %d, thread %ld, source %p, length %ld, offset %ld\n",
 	      s->fd, s->type, t->tid, source, length, offset);
-    return socket_write_internal(s, source, length, t, bh, completion);
+    return socket_write_internal(s, source, length, false, t, bh, completion);
+}
+
+/* Write to a socket from memory that stays valid until release is
+   applied, e.g. pinned cache pages. For TCP, the data is queued to
+   lwIP by reference rather than copied, and release is applied once the
+   peer has acknowledged it (or the connection is gone). Other socket
+   types copy the data and release it right away. Unlike the write
+   fdesc op, completion is applied in every case. f must be an lwIP
+   socket (FDESC_TYPE_SOCKET); socketpair ends have their own type. */
+sysreturn socket_write_ref(fdesc f, void *buf, u64 length, thunk release,
+                           thread t, boolean bh, io_completion completion)
+{
+    assert(f->type == FDESC_TYPE_SOCKET);
+    sock s = (sock)f;
+    sysreturn rv;
+    net_debug("sock %d, type %d, thread %ld, buf %p, length %ld\n",
+              s->fd, s->type, t->tid, buf, length);
+    assert(length > 0);
+    if (s->type != SOCK_STREAM) {
+        rv = s->type == SOCK_DGRAM ? socket_write_udp(s, buf, length) : -EINVAL;
+        goto out;
+    }
+    if (s->info.tcp.state != TCP_SOCK_OPEN) {
+        rv = -EPIPE;
+        goto out;
+    }
+    if (!s->info.tcp.txrefs) {
+        tcp_txrefs txr = allocate(s->h, sizeof(struct tcp_txrefs));
+        if (txr == INVALID_ADDRESS) {
+            rv = -ENOMEM;
+            goto out;
+        }
+        txr->h = s->h;
+        list_init(&txr->refs);
+        s->info.tcp.txrefs = txr;
+    }
+    blockq_action ba = closure(s->h, socket_write_tcp_bh, s, t, buf, length, release, false, completion);
+    return blockq_check(s->txbq, t, ba, bh);
+  out:
+    apply(release);
+    apply(completion, t, rv);
+    return rv;
+}
+
+closure_function(1, 0, void, tcp_rx_unref,
+                 struct pbuf *, q)
+{
+    pbuf_free(bound(q));
+    closure_finish();
+}
+
+/* Hand up to length bytes of queued TCP data, in at most maxsegs spans,
+   to h by reference. Each span holds a reference on its pbuf until the
+   release thunk passed with it is applied; a false return from h leaves
+   that span queued and ends the transfer. Returns the number of bytes
+   handed over, 0 at end of stream, -EAGAIN if nothing is queued or
+   -ENOMEM if no span could be handed over. */
+sysreturn socket_read_ref(fdesc f, u64 length, int maxsegs, socket_ref_handler h)
+{
+    assert(f->type == FDESC_TYPE_SOCKET);
+    sock s = (sock)f;
+    net_debug("sock %d, type %d, length %ld, maxsegs %d\n", s->fd, s->type, length, maxsegs);
+    if (s->type != SOCK_STREAM)
+        return -EOPNOTSUPP;
+    if (s->info.tcp.state != TCP_SOCK_OPEN)
+        return -ENOTCONN;
+    err_t err = get_lwip_error(s);
+    if (err != ERR_OK)
+        return lwip_to_errno(err);
+    if (s->info.tcp.rx_avail == 0)
+        return s->info.tcp.lw->state != ESTABLISHED ? 0 : -EAGAIN;
+
+    u64 total = 0;
+    while (total < length && maxsegs-- > 0 && s->info.tcp.rx_avail > 0) {
+        void *data;
+        struct pbuf *q;
+        u64 xfer = MIN(tcp_rx_span(s, &data, &q), length - total);
+        thunk release = closure(s->h, tcp_rx_unref, q);
+        if (release == INVALID_ADDRESS)
+            break;
+        pbuf_ref(q);
+        if (!apply(h, data, xfer, release)) {
+            apply(release);
+            break;
+        }
+        tcp_rx_consume(s, xfer);
+        total += xfer;
+    }
+    tcp_rx_update_window(s);
+    if (!queue_peek(s->incoming))
+        notify_sock(s);         /* reset a triggered EPOLLIN condition */
+    return total > 0 ? total : -ENOMEM;
 }
 
 closure_function(1, 2, sysreturn, socket_ioctl,
@@ -651,14 +1013,32 @@ closure_function(1, 0, sysreturn, socket_close,
     net_debug("sock %d, type %d\n", s->fd, s->type);
     switch (s->type) {
     case SOCK_STREAM:
+        tcp_cork_cancel(s);
+        if (s->info.tcp.output_l.next)
+            list_delete(&s->info.tcp.output_l);
+        if (s->info.tcp.cork_expire)
+            deallocate_closure(s->info.tcp.cork_expire);
         /* tcp_close() doesn't really stop everything synchronously; in order to
          * prevent any lwIP callback that might be called after tcp_close() from
          * using a stale reference to the socket structure, set the callback
          * argument to NULL. */
         if (s->info.tcp.lw) {
+            tcp_txrefs txr = s->info.tcp.txrefs;
+            if (txr && !list_empty(&txr->refs)) {
+                tcp_arg(s->info.tcp.lw, txr);
+                tcp_recv(s->info.tcp.lw, 0);
+                tcp_sent(s->info.tcp.lw, tcp_txrefs_sent);
+                tcp_err(s->info.tcp.lw, tcp_txrefs_err);
+                s->info.tcp.txrefs = 0;
+            } else {
+                tcp_arg(s->info.tcp.lw, 0);
+            }
             tcp_close(s->info.tcp.lw);
-            tcp_arg(s->info.tcp.lw, 0);
         }
+        if (s->info.tcp.txrefs)
+            tcp_txrefs_free(s->info.tcp.txrefs);
+        if (s->info.tcp.state != TCP_SOCK_LISTENING)
+            tcp_rx_free(s);     /* listeners queue pending connections instead */
         break;
     case SOCK_DGRAM:
         udp_remove(s->info.udp.lw);
@@ -808,6 +1188,16 @@ static int allocate_tcp_sock(process p, struct tcp_pcb *pcb, u32 flags)
     if (fd >= 0) {
 	s->info.tcp.lw = pcb;
 	s->info.tcp.state = TCP_SOCK_CREATED;
+	s->info.tcp.txrefs = 0;
+	s->info.tcp.rx_cur = 0;
+	s->info.tcp.rx_off = 0;
+	s->info.tcp.rx_avail = 0;
+	s->info.tcp.rx_unacked = 0;
+	s->info.tcp.output_l.next = s->info.tcp.output_l.prev = 0;
+	s->info.tcp.nodelay = false;
+	s->info.tcp.cork = false;
+	s->info.tcp.cork_timer = 0;
+	s->info.tcp.cork_expire = 0;
     }
     return fd;
 }
@@ -880,10 +1270,15 @@ static err_t tcp_input_lower(void *z, struct tcp_pcb *pcb, struct pbuf *p, err_t
 
     /* A null pbuf indicates connection closed. */
     if (p) {
+        if (p->tot_len == 0) {
+            pbuf_free(p);
+            return ERR_OK;
+        }
         if (!enqueue(s->incoming, p)) {
 	    msg_err("incoming queue full\n");
             return ERR_BUF;     /* XXX verify */
         }
+        s->info.tcp.rx_avail += p->tot_len;
         wakeup_sock(s, WAKEUP_SOCK_RX);
     } else {
         wakeup_sock(s, WAKEUP_SOCK_EXCEPT);
@@ -931,6 +1326,8 @@ static void lwip_tcp_conn_err(void * z, err_t err) {
 
     /* Don't try to use the pcb, it may have been deallocated already. */
     s->info.tcp.lw = 0;
+    if (s->info.tcp.txrefs)
+        tcp_txrefs_release(s->info.tcp.txrefs, 0);
 
     wakeup_sock(s, WAKEUP_SOCK_EXCEPT);
 }
@@ -942,6 +1339,8 @@ static err_t lwip_tcp_sent(void * arg, struct tcp_pcb * pcb, u16 len)
     }
     sock s = (sock)arg;
     net_debug("fd %d, pcb %p, len %d\n", s->fd, pcb, len);
+    if (s->info.tcp.txrefs)
+        tcp_txrefs_release(s->info.tcp.txrefs, pcb);
     wakeup_sock(s, WAKEUP_SOCK_TX);
     return ERR_OK;
 }
@@ -1065,6 +1464,9 @@ sysreturn connect(int sockfd, struct sockaddr * addr, socklen_t addrlen)
 #define MSG_NOSIGNAL    0x00004000
 #define MSG_MORE        0x00008000
 
+/* IPv4 datagram less IP and UDP headers */
+#define UDP_MAX_PAYLOAD 65507
+
 static sysreturn sendto_prepare(sock s, int flags, struct sockaddr *dest_addr,
         socklen_t addrlen)
 {
@@ -1085,9 +1487,6 @@ static sysreturn sendto_prepare(sock s, int flags, struct sockaddr *dest_addr,
 	return -EOPNOTSUPP;
     }
 
-    if (flags & MSG_MORE)
-	msg_warn("MSG_MORE unimplemented; ignored\n");
-
     if (flags & MSG_NOSIGNAL)
 	msg_warn("MSG_NOSIGNAL unimplemented; ignored\n");
 
@@ -1121,7 +1520,30 @@ sysreturn sendto(int sockfd, void * buf, u64 len, int flags,
     if (rv < 0) {
         return set_syscall_return(current, rv);
     }
-    return socket_write_internal(s, buf, len, current, false, syscall_io_complete);
+    if (!fault_in_user_range(buf, len, false))
+        return get_syscall_return(current);
+    return socket_write_internal(s, buf, len, (flags & MSG_MORE) != 0, current, false,
+                                 syscall_io_complete);
+}
+
+/* Make any file-backed pages that a message refers to resident before
+   data is moved; see fault_in_user_range. */
+static boolean fault_in_msghdr(const struct msghdr *msg, boolean write)
+{
+    return fault_in_user_range((void *)msg, sizeof(*msg), write) &&
+        fault_in_user_range(msg->msg_name, msg->msg_namelen, write) &&
+        fault_in_user_iov(msg->msg_iov, msg->msg_iovlen, write);
+}
+
+static boolean fault_in_msgvec(struct mmsghdr *msgvec, unsigned int vlen, boolean write)
+{
+    if (!fault_in_user_range(msgvec, vlen * sizeof(struct mmsghdr), true))
+        return false;
+    for (unsigned int i = 0; i < vlen; i++) {
+        if (!fault_in_msghdr(&msgvec[i].msg_hdr, write))
+            return false;
+    }
+    return true;
 }
 
 static sysreturn sendmsg_prepare(sock s, const struct msghdr *msg, int flags,
@@ -1180,13 +1602,15 @@ sysreturn sendmsg(int sockfd, const struct msghdr *msg, int flags)
     sysreturn rv;
 
     net_debug("sock %d, type %d, flags 0x%x\n", s->fd, s->type, flags);
+    if (!fault_in_msghdr(msg, false))
+        return get_syscall_return(current);
     rv = sendmsg_prepare(s, msg, flags, &buf, &len);
     if (rv <= 0) {
         return set_syscall_return(current, rv);
     }
     io_completion completion = closure(s->h, sendmsg_complete, s, buf, len,
             true);
-    rv = socket_write_internal(s, buf, len, current, false, completion);
+    rv = socket_write_internal(s, buf, len, (flags & MSG_MORE) != 0, current, false, completion);
     sendmsg_complete_internal(s, buf, len, false, current, rv);
     return rv;
 }
@@ -1199,6 +1623,13 @@ closure_function(3, 2, void, sendmmsg_buf_complete,
     closure_finish();
 }
 
+/* All but the last message of a call are sent as if with MSG_MORE, so
+   that small messages are coalesced into full segments. */
+static inline boolean sendmmsg_more(sock s, int flags, unsigned int vlen)
+{
+    return (flags & MSG_MORE) || s->msg_count + 1 < vlen;
+}
+
 closure_function(7, 1, sysreturn, sendmmsg_tcp_bh,
                  sock, s, thread, t, void *, buf, u64, len, int, flags, struct mmsghdr *, msgvec, unsigned int, vlen,
                  u64, bqflags)
@@ -1210,7 +1641,8 @@ closure_function(7, 1, sysreturn, sendmmsg_tcp_bh,
     struct mmsghdr * msgvec = bound(msgvec);
 
     io_completion completion = closure(s->h, sendmmsg_buf_complete, s, buf, len);
-    sysreturn rv = socket_write_tcp_bh_internal(s, t, buf, len, completion, bqflags | BLOCKQ_ACTION_BLOCKED);
+    sysreturn rv = socket_write_tcp_bh_internal(s, t, buf, len, 0, sendmmsg_more(s, bound(flags), bound(vlen)),
+                                                completion, bqflags | BLOCKQ_ACTION_BLOCKED);
 
     while (true) {
         if (rv == BLOCKQ_BLOCK_REQUIRED) {
@@ -1229,10 +1661,17 @@ closure_function(7, 1, sysreturn, sendmmsg_tcp_bh,
         rv = sendmsg_prepare(s, &msgvec[s->msg_count].msg_hdr, bound(flags), &buf, &len);
         if (rv > 0) {
             completion = closure(s->h, sendmmsg_buf_complete, s, buf, len);
-            rv = socket_write_tcp_bh_internal(s, t, buf, len, completion, bqflags | BLOCKQ_ACTION_BLOCKED);
+            rv = socket_write_tcp_bh_internal(s, t, buf, len, 0, sendmmsg_more(s, bound(flags), bound(vlen)),
+                                              completion, bqflags | BLOCKQ_ACTION_BLOCKED);
         }
     }
 
+    /* MSG_MORE implied by position is only good while later messages
+       follow; if the call ended on an empty message or an error, don't
+       leave the last write held */
+    if (!(bound(flags) & MSG_MORE) && !s->info.tcp.cork)
+        tcp_output_pending(s);
+
     if (bqflags & BLOCKQ_ACTION_BLOCKED)
         thread_wakeup(t);
 
@@ -1240,6 +1679,65 @@ closure_function(7, 1, sysreturn, sendmmsg_tcp_bh,
     return set_syscall_return(t, rv);
 }
 
+/* Send a datagram straight from the message's iovecs, copied once into
+   the pbuf handed to lwIP. */
+static sysreturn sendmsg_udp(sock s, const struct msghdr *msg)
+{
+    u64 len = 0;
+    for (size_t i = 0; i < msg->msg_iovlen; i++)
+        len += msg->msg_iov[i].iov_len;
+    if (len > UDP_MAX_PAYLOAD)
+        return -EMSGSIZE;
+
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+    if (!p)
+        return -ENOBUFS;
+    u64 offset = 0;
+    for (size_t i = 0; i < msg->msg_iovlen; i++) {
+        struct iovec *iov = &msg->msg_iov[i];
+        runtime_memcpy(p->payload + offset, iov->iov_base, iov->iov_len);
+        offset += iov->iov_len;
+    }
+
+    err_t err;
+    if (msg->msg_name) {
+        struct sockaddr_in *sin = msg->msg_name;
+        if (msg->msg_namelen < sizeof(*sin)) {
+            pbuf_free(p);
+            return -EINVAL;
+        }
+        ip_addr_t ipaddr = IPADDR4_INIT(sin->address);
+        err = udp_sendto(s->info.udp.lw, p, &ipaddr, ntohs(sin->port));
+    } else {
+        err = udp_send(s->info.udp.lw, p);
+    }
+    pbuf_free(p);
+    if (err != ERR_OK) {
+        net_debug("lwip error %d\n", err);
+        return lwip_to_errno(err);
+    }
+    return len;
+}
+
+/* The datagrams of one call are output as a transmit batch, so the
+   driver posts them to the device together. */
+static sysreturn sendmmsg_udp(sock s, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    sysreturn rv = sendto_prepare(s, flags, 0, 0);
+    if (rv < 0)
+        return rv;
+    unsigned int i;
+    net_tx_batch_begin();
+    for (i = 0; i < vlen; i++) {
+        rv = sendmsg_udp(s, &msgvec[i].msg_hdr);
+        if (rv < 0)
+            break;
+        msgvec[i].msg_len = rv;
+    }
+    net_tx_batch_end();
+    return i > 0 ? i : rv;
+}
+
 sysreturn sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
         int flags)
 {
@@ -1250,6 +1748,10 @@ sysreturn sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
 
     net_debug("sock %d, type %d, flags 0x%x, vlen %d\n", s->fd, s->type, flags,
             vlen);
+    if (!fault_in_msgvec(msgvec, vlen, false))
+        return get_syscall_return(current);
+    if (s->type == SOCK_DGRAM)
+        return set_syscall_return(current, sendmmsg_udp(s, msgvec, vlen, flags));
     for (s->msg_count = 0; s->msg_count < vlen; s->msg_count++) {
         struct msghdr *msg_hdr = &msgvec[s->msg_count].msg_hdr;
 
@@ -1261,19 +1763,12 @@ sysreturn sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
             msgvec[s->msg_count].msg_len = 0;
             continue;
         }
-        switch (s->type) {
-        case SOCK_STREAM:
-            if (s->info.tcp.state != TCP_SOCK_OPEN) {
-                rv = -EPIPE;
-                break;
-            }
+        if (s->info.tcp.state != TCP_SOCK_OPEN) {
+            rv = -EPIPE;
+        } else {
             blockq_action ba = closure(s->h, sendmmsg_tcp_bh, s, current,
                     buf, len, flags, msgvec, vlen);
             rv = blockq_check(s->txbq, current, ba, false);
-            break;
-        case SOCK_DGRAM:
-            rv = socket_write_udp(s, buf, len);
-            break;
         }
         deallocate(s->h, buf, len);
         if (rv < 0) {
@@ -1298,6 +1793,10 @@ sysreturn recvfrom(int sockfd, void * buf, u64 len, int flags,
 
     if (len == 0)
         return 0;
+    if (!fault_in_user_range(buf, len, true) ||
+        (src_addr && addrlen && (!fault_in_user_range(addrlen, sizeof(*addrlen), true) ||
+                                 !fault_in_user_range(src_addr, *addrlen, true))))
+        return get_syscall_return(current);
 
     blockq_action ba = closure(s->h, sock_read_bh, s, current, buf, len,
                                src_addr, addrlen, syscall_io_complete);
@@ -1314,6 +1813,8 @@ sysreturn recvmsg(int sockfd, struct msghdr *msg, int flags)
     if ((s->type == SOCK_STREAM) && (s->info.tcp.state != TCP_SOCK_OPEN)) {
         return set_syscall_error(current, ENOTCONN);
     }
+    if (!fault_in_msghdr(msg, true))
+        return get_syscall_return(current);
     total_len = 0;
     for (int i = 0; i < msg->msg_iovlen; i++) {
         total_len += msg->msg_iov[i].iov_len;
@@ -1332,6 +1833,80 @@ sysreturn recvmsg(int sockfd, struct msghdr *msg, int flags)
     return rv;
 }
 
+/* Block until at least one message is available, then drain up to vlen
+   of them in one pass; this behaves as if MSG_WAITFORONE were set. */
+closure_function(5, 1, sysreturn, recvmmsg_bh,
+                 sock, s, thread, t, struct mmsghdr *, msgvec, unsigned int, vlen, boolean, nonblock,
+                 u64, flags)
+{
+    sock s = bound(s);
+    thread t = bound(t);
+    struct mmsghdr *msgvec = bound(msgvec);
+    err_t err = get_lwip_error(s);
+    sysreturn rv = 0;
+
+    if (flags & BLOCKQ_ACTION_NULLIFY) {
+        rv = -EINTR;
+        goto out;
+    }
+    if (s->type == SOCK_STREAM && s->info.tcp.state != TCP_SOCK_OPEN) {
+        rv = -ENOTCONN;
+        goto out;
+    }
+    if (err != ERR_OK) {
+        rv = lwip_to_errno(err);
+        goto out;
+    }
+    if (!queue_peek(s->incoming)) {
+        if (s->type == SOCK_STREAM && s->info.tcp.lw->state != ESTABLISHED)
+            goto out;
+        if (bound(nonblock) || (s->f.flags & SOCK_NONBLOCK) ||
+            (flags & BLOCKQ_ACTION_TIMEDOUT)) {
+            rv = -EAGAIN;
+            goto out;
+        }
+        return BLOCKQ_BLOCK_REQUIRED;
+    }
+
+    void *p;
+    while (rv < bound(vlen) && (p = queue_peek(s->incoming))) {
+        struct msghdr *msg = &msgvec[rv].msg_hdr;
+        boolean trunc = false;
+        if (msg->msg_name)
+            sock_src_addr(s, p, msg->msg_name, &msg->msg_namelen);
+        msgvec[rv].msg_len = sock_dequeue_iov(s, msg->msg_iov, msg->msg_iovlen, &trunc);
+        msg->msg_controllen = 0;
+        msg->msg_flags = trunc ? MSG_TRUNC : 0;
+        rv++;
+    }
+  out:
+    net_debug("sock %d, rv %ld\n", s->fd, rv);
+    blockq_handle_completion(s->rxbq, flags, syscall_io_complete, t, rv);
+    closure_finish();
+    return rv;
+}
+
+sysreturn recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+                   int flags, struct timespec *timeout)
+{
+    sock s = resolve_socket(current->p, sockfd);
+
+    net_debug("sock %d, type %d, thread %ld, vlen %d, flags 0x%x\n",
+              s->fd, s->type, current->tid, vlen, flags);
+    if ((s->type == SOCK_STREAM) && (s->info.tcp.state != TCP_SOCK_OPEN))
+        return set_syscall_error(current, ENOTCONN);
+    if (vlen == 0)
+        return 0;
+    if (!fault_in_msgvec(msgvec, vlen, true))
+        return get_syscall_return(current);
+
+    /* a zero timeout polls */
+    timestamp t = timeout ? time_from_timespec(timeout) : 0;
+    boolean nonblock = (flags & MSG_DONTWAIT) || (timeout && t == 0);
+    blockq_action ba = closure(s->h, recvmmsg_bh, s, current, msgvec, vlen, nonblock);
+    return blockq_check_timeout(s->rxbq, current, ba, false, t, CLOCK_ID_MONOTONIC);
+}
+
 static err_t accept_tcp_from_lwip(void * z, struct tcp_pcb * lw, err_t err)
 {
     if (!z) {
@@ -1357,6 +1932,10 @@ static err_t accept_tcp_from_lwip(void * z, struct tcp_pcb * lw, err_t err)
     sock sn = vector_get(s->p->files, fd);
     sn->info.tcp.state = TCP_SOCK_OPEN;
     sn->fd = fd;
+    if (s->info.tcp.nodelay) {
+        sn->info.tcp.nodelay = true;
+        tcp_nagle_disable(lw);
+    }
     set_lwip_error(s, ERR_OK);
     tcp_arg(lw, sn);
     tcp_recv(lw, tcp_input_lower);
@@ -1500,12 +2079,49 @@ sysreturn getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
     return 0;    
 }
 
+static sysreturn setsockopt_tcp(sock s, int optname, int val)
+{
+    switch (optname) {
+    case TCP_NODELAY:
+        /* a listening pcb carries no options of its own; the setting is
+           applied to connections as they are accepted */
+        s->info.tcp.nodelay = val != 0;
+        if (s->info.tcp.state == TCP_SOCK_LISTENING || !s->info.tcp.lw)
+            break;
+        if (val) {
+            tcp_nagle_disable(s->info.tcp.lw);
+            tcp_output_pending(s);
+        } else {
+            tcp_nagle_enable(s->info.tcp.lw);
+        }
+        break;
+    case TCP_CORK:
+        s->info.tcp.cork = val != 0;
+        if (!val)
+            tcp_output_pending(s);   /* send whatever was held */
+        break;
+    default:
+        msg_warn("setsockopt unimplemented: fd %d, level %d, optname %d\n",
+                 s->fd, SOL_TCP, optname);
+        break;
+    }
+    return 0;
+}
+
 sysreturn setsockopt(int sockfd,
                      int level,
                      int optname,
                      void *optval,
                      socklen_t optlen)
 {
+    sock s = resolve_socket(current->p, sockfd);
+    net_debug("sock %d, type %d, level %d, optname %d, optlen %d\n",
+              s->fd, s->type, level, optname, optlen);
+    if (level == SOL_TCP && s->type == SOCK_STREAM) {
+        if (!optval || optlen < sizeof(int))
+            return -EINVAL;
+        return setsockopt_tcp(s, optname, *(int *)optval);
+    }
     msg_warn("setsockopt unimplemented: fd %d, level %d, optname %d\n",
 	    sockfd, level, optname);
     return 0;
@@ -1521,8 +2137,23 @@ sysreturn getsockopt(int sockfd, int level, int optname, void *optval, socklen_t
         int val;
     } ret_optval;
 
-    /* Only socket options supported at the moment... */
-    if (level != 1)
+    if (level == SOL_TCP && s->type == SOCK_STREAM) {
+        switch (optname) {
+        case TCP_NODELAY:
+            ret_optval.val = s->info.tcp.nodelay;
+            break;
+        case TCP_CORK:
+            ret_optval.val = s->info.tcp.cork;
+            break;
+        default:
+            msg_err("getsockopt unimplemented optname: fd %d, level %d, optname %d\n",
+                    sockfd, level, optname);
+            return -ENOPROTOOPT;
+        }
+        goto out;
+    }
+
+    if (level != SOL_SOCKET)
         return -EOPNOTSUPP;
 
     switch (optname) {
@@ -1541,6 +2172,7 @@ sysreturn getsockopt(int sockfd, int level, int optname, void *optval, socklen_t
         return -ENOPROTOOPT;
     }
 
+  out:
     if (optval && optlen) {
         int ret_optlen = MIN(*optlen, sizeof(ret_optval));
         runtime_memcpy(optval, &ret_optval, ret_optlen);
@@ -1563,6 +2195,7 @@ void register_net_syscalls(struct syscall *map)
     register_syscall(map, sendmmsg, sendmmsg);
     register_syscall(map, recvfrom, recvfrom);
     register_syscall(map, recvmsg, recvmsg);
+    register_syscall(map, recvmmsg, recvmmsg);
     register_syscall(map, setsockopt, setsockopt);
     register_syscall(map, getsockname, getsockname);
     register_syscall(map, getpeername, getpeername);
@@ -1577,6 +2210,11 @@ boolean netsyscall_init(unix_heaps uh)
 					  sizeof(struct sock), PAGESIZE);
     if (socket_cache == INVALID_ADDRESS)
 	return false;
+    objcache_set_name(socket_cache, "socket");
     uh->socket_cache = socket_cache;
+    list_init(&tcp_output_socks);
+    tcp_output_service = closure(heap_general(kh), tcp_output_bh);
+    if (tcp_output_service == INVALID_ADDRESS)
+        return false;
     return true;
 }
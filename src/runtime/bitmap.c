@@ -7,6 +7,17 @@
 
    The bitmap length may be arbitrarily sized. The bitmap buffer is
    allocated in ALLOC_EXTEND_BITS / 8 byte increments as needed.
+
+   Searches are guided by a summary of the map, built on the first
+   allocation: two hierarchies of bits over the map words, one marking
+   words with any free bit and one marking entirely free words. Each
+   level holds a bit for every word of the level below, so the next
+   candidate word from any position is found by walking up and back
+   down a few words rather than scanning the map. Sub-word allocations
+   search the non-full hierarchy; larger ones look for aligned runs of
+   empty words. In addition, each power-of-2 order keeps a hint below
+   which no free, aligned run of that order exists; searches advance
+   it and frees pull it back.
 */
 
 #include <runtime.h>
@@ -74,6 +85,218 @@ static boolean for_range_in_map(u64 * base, u64 start, u64 nbits, boolean set, b
     return true;
 }
 
+#define SUMMARY_LEVELS          11      /* 64^11 > 2^64 */
+
+struct summary_level {
+    u64 * w;
+    u64 nwords;
+    u64 capacity;
+};
+
+struct summary {
+    int levels;
+    struct summary_level l[SUMMARY_LEVELS];
+};
+
+struct bitmap_summary {
+    struct summary nonfull;
+    struct summary empty;
+    u64 mapwords;               /* map words covered */
+    u64 hint[64];
+};
+
+static inline void summary_set(struct summary * s, u64 i, boolean val)
+{
+    for (int n = 0; n < s->levels; n++) {
+        u64 * w = s->l[n].w + (i >> BITMAP_WORDLEN_LOG);
+        u64 old = *w;
+        u64 mask = 1ull << (i & BITMAP_WORDMASK);
+        u64 new = val ? old | mask : old & ~mask;
+        if (new == old)
+            return;
+        *w = new;
+        /* the parent bit only changes when a word becomes zero or nonzero */
+        if (old && new)
+            return;
+        i >>= BITMAP_WORDLEN_LOG;
+    }
+}
+
+/* first set bit at or after i in the bottom level, or infinity */
+static u64 summary_next(struct summary * s, u64 i)
+{
+    int n = 0;
+    while (1) {
+        if (n == s->levels)
+            return infinity;
+        u64 wi = i >> BITMAP_WORDLEN_LOG;
+        if (wi >= s->l[n].nwords)
+            return infinity;
+        u64 w = s->l[n].w[wi] & (-1ull << (i & BITMAP_WORDMASK));
+        if (w) {
+            i = (wi << BITMAP_WORDLEN_LOG) + lsb(w);
+            break;
+        }
+        i = wi + 1;
+        n++;
+    }
+    while (n-- > 0)
+        i = (i << BITMAP_WORDLEN_LOG) + lsb(s->l[n].w[i]);
+    return i;
+}
+
+/* first clear bit in the bottom level within [i, i + n), or infinity */
+static u64 summary_first_clear(struct summary * s, u64 i, u64 n)
+{
+    u64 * w = s->l[0].w;
+    u64 end = i + n;
+    while (i < end) {
+        u64 v = ~w[i >> BITMAP_WORDLEN_LOG] & (-1ull << (i & BITMAP_WORDMASK));
+        u64 base = i & ~BITMAP_WORDMASK;
+        if (v) {
+            i = base + lsb(v);
+            return i < end ? i : infinity;
+        }
+        i = base + BITMAP_WORDLEN;
+    }
+    return infinity;
+}
+
+/* set the bits of levels from onward to match the level below */
+static void summary_fill(struct summary * s, int from)
+{
+    for (int n = MAX(from, 1); n < s->levels; n++) {
+        struct summary_level * c = &s->l[n - 1];
+        for (u64 i = 0; i < c->nwords; i++) {
+            if (c->w[i])
+                s->l[n].w[i >> BITMAP_WORDLEN_LOG] |= 1ull << (i & BITMAP_WORDMASK);
+        }
+    }
+}
+
+/* grow to cover mapwords; newly covered words are left clear */
+static void summary_resize(heap h, struct summary * s, u64 mapwords)
+{
+    int levels = s->levels;
+    int n = 0;
+    u64 bits = mapwords;
+    do {
+        struct summary_level * l = &s->l[n];
+        u64 nwords = pad(bits, BITMAP_WORDLEN) >> BITMAP_WORDLEN_LOG;
+        if (nwords > l->capacity) {
+            u64 capacity = MAX(nwords, l->capacity * 2);
+            u64 * w = allocate(h, capacity * sizeof(u64));
+            assert(w != INVALID_ADDRESS);
+            if (l->w) {
+                runtime_memcpy(w, l->w, l->nwords * sizeof(u64));
+                deallocate(h, l->w, l->capacity * sizeof(u64));
+            }
+            zero(w + l->nwords, (capacity - l->nwords) * sizeof(u64));
+            l->w = w;
+            l->capacity = capacity;
+        }
+        l->nwords = nwords;
+        bits = nwords;
+        n++;
+    } while (bits > 1);
+    assert(n <= SUMMARY_LEVELS);
+    s->levels = n;
+    summary_fill(s, levels);
+}
+
+static void summary_release(heap h, struct summary * s)
+{
+    for (int n = 0; n < s->levels; n++)
+        deallocate(h, s->l[n].w, s->l[n].capacity * sizeof(u64));
+}
+
+static inline void summary_update_word(bitmap_summary bs, u64 * base, u64 wi)
+{
+    u64 w = base[wi];
+    summary_set(&bs->nonfull, wi, w != -1ull);
+    summary_set(&bs->empty, wi, w == 0);
+}
+
+static void summary_update_range(bitmap b, u64 start, u64 nbits)
+{
+    bitmap_summary bs = b->summary;
+    if (!bs || nbits == 0)
+        return;
+    u64 * base = bitmap_base(b);
+    u64 wend = (start + nbits - 1) >> BITMAP_WORDLEN_LOG;
+    for (u64 wi = start >> BITMAP_WORDLEN_LOG; wi <= wend; wi++)
+        summary_update_word(bs, base, wi);
+}
+
+/* bits from start onward were freed; no hint may remain above them */
+static void summary_freed(bitmap b, u64 start)
+{
+    bitmap_summary bs = b->summary;
+    if (!bs)
+        return;
+    for (int order = 0; order < 64; order++) {
+        if (bs->hint[order] > start)
+            bs->hint[order] = start & ~MASK(order);
+    }
+}
+
+static void bitmap_summary_build(bitmap b)
+{
+    bitmap_summary bs = allocate(b->h, sizeof(struct bitmap_summary));
+    assert(bs != INVALID_ADDRESS);
+    zero(bs, sizeof(struct bitmap_summary));
+    u64 mapwords = b->mapbits >> BITMAP_WORDLEN_LOG;
+    summary_resize(b->h, &bs->nonfull, mapwords);
+    summary_resize(b->h, &bs->empty, mapwords);
+    u64 * base = bitmap_base(b);
+    for (u64 wi = 0; wi < mapwords; wi++) {
+        u64 mask = 1ull << (wi & BITMAP_WORDMASK);
+        if (base[wi] != -1ull)
+            bs->nonfull.l[0].w[wi >> BITMAP_WORDLEN_LOG] |= mask;
+        if (base[wi] == 0)
+            bs->empty.l[0].w[wi >> BITMAP_WORDLEN_LOG] |= mask;
+    }
+    summary_fill(&bs->nonfull, 1);
+    summary_fill(&bs->empty, 1);
+    bs->mapwords = mapwords;
+    b->summary = bs;
+}
+
+static void bitmap_summary_discard(bitmap b)
+{
+    bitmap_summary bs = b->summary;
+    if (!bs)
+        return;
+    summary_release(b->h, &bs->nonfull);
+    summary_release(b->h, &bs->empty);
+    deallocate(b->h, bs, sizeof(struct bitmap_summary));
+    b->summary = 0;
+}
+
+/* called from bitmap_extend once the map has grown */
+void bitmap_summary_extend(bitmap b)
+{
+    bitmap_summary bs = b->summary;
+    u64 mapwords = b->mapbits >> BITMAP_WORDLEN_LOG;
+    summary_resize(b->h, &bs->nonfull, mapwords);
+    summary_resize(b->h, &bs->empty, mapwords);
+
+    /* the extension is zeroed */
+    for (u64 wi = bs->mapwords; wi < mapwords; wi++) {
+        summary_set(&bs->nonfull, wi, true);
+        summary_set(&bs->empty, wi, true);
+    }
+    bs->mapwords = mapwords;
+}
+
+/* called from bitmap_set for maps that carry a summary */
+void bitmap_summary_set(bitmap b, u64 i, boolean val)
+{
+    summary_update_word(b->summary, bitmap_base(b), i >> BITMAP_WORDLEN_LOG);
+    if (!val)
+        summary_freed(b, i);
+}
+
 /* Requesting beyond the end of maxbits isn't an error; the caller may
    use it to avoid an additional range check.
 
@@ -88,8 +311,92 @@ boolean bitmap_range_check_and_set(bitmap b, u64 start, u64 nbits, boolean valid
 
     bitmap_extend(b, start + nbits - 1);
     u64 * mapbase = bitmap_base(b);
-    return (!validate || for_range_in_map(mapbase, start, nbits, false, !set)) &&
-        for_range_in_map(mapbase, start, nbits, true, set);
+    if (validate && !for_range_in_map(mapbase, start, nbits, false, !set))
+        return false;
+    for_range_in_map(mapbase, start, nbits, true, set);
+    summary_update_range(b, start, nbits);
+    if (!set)
+        summary_freed(b, start);
+    return true;
+}
+
+/* first map word at or after wi found in the summary, counting words
+   beyond the end of the map, which are implicitly free */
+static inline u64 summary_next_word(bitmap b, struct summary * s, u64 wi)
+{
+    u64 mapwords = b->summary->mapwords;
+    if (wi >= mapwords)
+        return wi;
+    u64 next = summary_next(s, wi);
+    return next == infinity ? mapwords : next;
+}
+
+static u64 bitmap_alloc_subword(bitmap b, u64 nbits, u64 stride, u64 bit, u64 endbit)
+{
+    while (bit <= endbit) {
+        /* skip full words */
+        u64 wi = bit >> BITMAP_WORDLEN_LOG;
+        u64 next = summary_next_word(b, &b->summary->nonfull, wi);
+        if (next != wi) {
+            wi = next;
+            bit = wi << BITMAP_WORDLEN_LOG;
+        }
+
+        /* get offset (for start bit, 0 otherwise) and align bit to word boundary */
+        int word_offset = bit & BITMAP_WORDMASK;
+        bit -= word_offset;
+        bitmap_extend(b, bit + BITMAP_WORDMASK);
+
+        u64 * w = pointer_from_bit(bitmap_base(b), bit);
+        u64 mask = MASK(nbits) << word_offset;
+        do {
+            if (bit + word_offset > endbit)
+                return INVALID_PHYSICAL;
+
+            if ((*w & mask) == 0) {
+                *w |= mask;
+                summary_update_word(b->summary, bitmap_base(b), wi);
+                return bit + word_offset;
+            }
+
+            mask <<= stride;
+            word_offset += stride;
+        } while (word_offset < BITMAP_WORDLEN);
+        bit += BITMAP_WORDLEN;
+    }
+    return INVALID_PHYSICAL;
+}
+
+static u64 bitmap_alloc_multiword(bitmap b, u64 nbits, u64 stride, u64 bit, u64 endbit)
+{
+    struct summary * empty = &b->summary->empty;
+    u64 nwords = nbits >> BITMAP_WORDLEN_LOG;
+    u64 tail = nbits & BITMAP_WORDMASK;
+
+    while (bit <= endbit) {
+        /* runs must begin with an empty word */
+        u64 wi = bit >> BITMAP_WORDLEN_LOG;
+        u64 next = summary_next_word(b, empty, wi);
+        if (next != wi) {
+            bit = pad(next << BITMAP_WORDLEN_LOG, stride);
+            continue;
+        }
+
+        bitmap_extend(b, bit + nbits - 1);
+        u64 * mapbase = bitmap_base(b);
+        u64 busy = summary_first_clear(empty, wi, nwords);
+        if (busy != infinity) {
+            bit = pad((busy + 1) << BITMAP_WORDLEN_LOG, stride);
+            continue;
+        }
+        if (tail == 0 || (mapbase[wi + nwords] & MASK(tail)) == 0) {
+            for_range_in_map(mapbase, bit, nbits, true, true);
+            summary_update_range(b, bit, nbits);
+            return bit;
+        }
+        bit += stride;
+    }
+    return INVALID_PHYSICAL;
 }
 
 static inline u64 bitmap_alloc_internal(bitmap b, u64 nbits, u64 startbit, u64 endbit)
@@ -102,53 +409,24 @@ static inline u64 bitmap_alloc_internal(bitmap b, u64 nbits, u64 startbit, u64 e
     if (bit + nbits > endbit)
         return INVALID_PHYSICAL;
 
-    u64 * mapbase = bitmap_base(b);
-
-    endbit -= nbits;
-
-    if (nbits >= 64) {
-        /* multi-word */
-        while (bit <= endbit) {
-            if (bitmap_extend(b, bit + nbits))
-                mapbase = bitmap_base(b);
+    if (!b->summary)
+        bitmap_summary_build(b);
+    bitmap_summary bs = b->summary;
 
-            if (for_range_in_map(mapbase, bit, nbits, false, false)) {
-                for_range_in_map(mapbase, bit, nbits, true, true);
-                return bit;
-            }
+    /* power-of-2 searches from below the hint may start at it */
+    boolean hinted = nbits == stride && bit <= bs->hint[order];
+    if (hinted)
+        bit = bs->hint[order];
 
-            bit += stride;
-        }
-    } else {
-        for (; bit <= endbit; bit += 64) {
-            /* get offset (for start bit, 0 otherwise) and align bit to word boundary */
-            int word_offset = bit & 63;
-            bit -= word_offset;
-            if (bitmap_extend(b, bit + 64))
-                mapbase = bitmap_base(b);
-
-            u64 mask = MASK(nbits) << word_offset;
-            u64 bw = *pointer_from_bit(mapbase, bit);
-
-            if (bw == -1ull)    /* skip full words */
-                continue;
-
-            do {
-                if (bit + word_offset > endbit)
-                    return INVALID_PHYSICAL;
-
-                if ((bw & mask) == 0) {
-                    assert(for_range_in_map(mapbase, bit + word_offset, nbits, true, true));
-                    return bit + word_offset;
-                }
-
-                mask <<= stride;
-                word_offset += stride;
-            } while (word_offset < 64);
-        }
-    }
-
-    return INVALID_PHYSICAL;
+    endbit -= nbits;
+    u64 found = nbits >= BITMAP_WORDLEN ?
+        bitmap_alloc_multiword(b, nbits, stride, bit, endbit) :
+        bitmap_alloc_subword(b, nbits, stride, bit, endbit);
+
+    if (hinted)
+        bs->hint[order] = MAX(bs->hint[order], found == INVALID_PHYSICAL ?
+                              pad(endbit + 1, stride) : found + stride);
+    return found;
 }
 
 u64 bitmap_alloc(bitmap b, u64 nbits)
@@ -187,6 +465,8 @@ boolean bitmap_dealloc(bitmap b, u64 bit, u64 size)
     }
 
     for_range_in_map(mapbase, bit, size, true, false);
+    summary_update_range(b, bit, size);
+    summary_freed(b, bit);
     return true;
 }
 
@@ -197,6 +477,7 @@ static inline bitmap allocate_bitmap_internal(heap h, u64 length)
     if (b == INVALID_ADDRESS)
 	return b;
     b->h = h;
+    b->summary = 0;
     if (length == infinity)
 	length = -1ull << 6; /* don't pad to 0 */
     b->maxbits = length;
@@ -220,6 +501,7 @@ bitmap allocate_bitmap(heap h, u64 length)
 
 void deallocate_bitmap(bitmap b)
 {
+    bitmap_summary_discard(b);
     if (b->alloc_map)
 	deallocate_buffer(b->alloc_map);
     deallocate(b->h, b, sizeof(struct bitmap));
@@ -238,6 +520,7 @@ bitmap bitmap_wrap(heap h, u64 * map, u64 length)
 
 void bitmap_unwrap(bitmap b)
 {
+    bitmap_summary_discard(b);
     if (b->alloc_map)
 	unwrap_buffer(b->h, b->alloc_map);
     deallocate(b->h, b, sizeof(struct bitmap));
@@ -270,4 +553,6 @@ void bitmap_copy(bitmap dest, bitmap src)
 	bytes len = (dest->mapbits - src->mapbits) >> 3;
 	zero(buffer_ref(dest->alloc_map, off), len);
     }
+    /* rebuilt on the next allocation */
+    bitmap_summary_discard(dest);
 }
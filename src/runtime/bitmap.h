@@ -2,11 +2,14 @@
    page are b0rked */
 #define ALLOC_EXTEND_BITS	U64_FROM_BIT(12)
 
+typedef struct bitmap_summary *bitmap_summary;
+
 typedef struct bitmap {
     u64 maxbits;
     u64 mapbits;
     heap h;
     buffer alloc_map;
+    bitmap_summary summary;     /* allocation search index, built on first alloc */
 } *bitmap;
 
 boolean bitmap_range_check_and_set(bitmap b, u64 start, u64 nbits, boolean validate, boolean set);
@@ -19,6 +22,8 @@ bitmap bitmap_wrap(heap h, u64 * map, u64 length);
 void bitmap_unwrap(bitmap b);
 bitmap bitmap_clone(bitmap b);
 void bitmap_copy(bitmap dest, bitmap src);
+void bitmap_summary_extend(bitmap b);
+void bitmap_summary_set(bitmap b, u64 i, boolean val);
 
 #define bitmap_foreach_word(b, w, offset)				\
     for (u64 offset = 0, * __wp = bitmap_base(b), w = *__wp;		\
@@ -42,6 +47,8 @@ static inline boolean bitmap_extend(bitmap b, u64 i)
     if (i >= b->mapbits) {
 	b->mapbits = pad(i + 1, ALLOC_EXTEND_BITS);
 	extend_total(b->alloc_map, b->mapbits >> 3);
+	if (b->summary)
+	    bitmap_summary_extend(b);
 	return true;
     }
     return false;
@@ -64,4 +71,6 @@ static inline void bitmap_set(bitmap b, u64 i, int val)
 	*p |= mask;
     else
 	*p &= ~mask;
+    if (b->summary)
+	bitmap_summary_set(b, i, val);
 }
@@ -11,9 +11,11 @@ typedef struct id_range {
     struct rmnode n;            /* range in pages */
     bitmap b;
     u64 next_bit;               /* for next-fit search */
+    u64 fail_pages;             /* allocations this large fail until a free */
 } *id_range;
 
 #define ID_HEAP_FLAG_RANDOMIZE  1
+#define ID_HEAP_HINT_ORDERS     64
 
 typedef struct id_heap {
     struct heap h;
@@ -23,6 +25,11 @@ typedef struct id_heap {
     heap meta;
     heap parent;
     rangemap ranges;
+    /* Per-order summary across ranges: every range below hint[k] (in
+       pages) fails allocations of 2^k pages or more. hint_mask marks
+       the orders with a nonzero hint. */
+    u64 hint_mask;
+    u64 hint[ID_HEAP_HINT_ORDERS];
 } *id_heap;
 
 #define page_size(i) (i->h.pagesize)
@@ -34,6 +41,18 @@ static inline int pages_from_bytes(id_heap i, bytes alloc_size)
     return pad(alloc_size, page_size(i)) >> page_order(i);
 }
 
+/* pages freed or added in range r; pull back any hint past it */
+static void id_hint_reset(id_heap i, id_range r)
+{
+    u64 m = i->hint_mask;
+    while (m) {
+        int k = lsb(m);
+        m &= m - 1;
+        if (i->hint[k] > r->n.r.start)
+            i->hint[k] = r->n.r.start;
+    }
+}
+
 static id_range id_add_range(id_heap i, u64 base, u64 length)
 {
     id_debug("base 0x%lx, end 0x%lx\n", base, base + length);
@@ -67,6 +86,8 @@ static id_range id_add_range(id_heap i, u64 base, u64 length)
         goto fail;
     }
     ir->next_bit = 0;
+    ir->fail_pages = infinity;
+    id_hint_reset(i, ir);
     i->total += length;
     id_debug("added range base 0x%lx, end 0x%lx (length 0x%lx)\n", base, base + length, length);
     return ir;
@@ -94,7 +115,7 @@ static u64 id_alloc_from_range(id_heap i, id_range r, u64 pages, range subrange)
     /* find intersection, align start and end to 2^n and subtract range offset */
     range ri = range_intersection(r->n.r, subrange);
     id_debug("intersection %R, pages_rounded %ld\n", ri, pages_rounded);
-    if (range_empty(ri))
+    if (range_empty(ri) || pages >= r->fail_pages)
         return INVALID_PHYSICAL;
 
     /* align search start (but not end, for pages may fit in a
@@ -116,12 +137,19 @@ static u64 id_alloc_from_range(id_heap i, id_range r, u64 pages, range subrange)
         start_bit = r->next_bit;
 
     id_debug("start_bit 0x%lx, end 0x%lx\n", start_bit, ri.end);
-    /* search beginning at start_bit, wrapping around if needed */
+    /* search beginning at start_bit, wrapping around if needed to
+       cover runs that start below it */
     u64 bit = bitmap_alloc_within_range(r->b, pages, start_bit, ri.end);
     if (bit == INVALID_PHYSICAL && start_bit > ri.start)
-	bit = bitmap_alloc_within_range(r->b, pages, ri.start, start_bit);
-    if (bit == INVALID_PHYSICAL)
+	bit = bitmap_alloc_within_range(r->b, pages, ri.start,
+                                        MIN(ri.end, start_bit + pages - 1));
+    if (bit == INVALID_PHYSICAL) {
+        /* No run of this size is free, and so neither is any larger,
+           aligned one. Remember that for whole-range searches. */
+        if (range_contains(subrange, r->n.r))
+            r->fail_pages = MIN(r->fail_pages, pages);
         return bit;
+    }
 
     r->next_bit = bit;
     i->h.allocated += pages << page_order(i);
@@ -138,11 +166,21 @@ static u64 id_alloc(heap h, bytes count)
 	return INVALID_PHYSICAL;
     u64 pages = pages_from_bytes(i, count);
 
-    id_range r = (id_range)rangemap_first_node(i->ranges);
+    /* Start at the hint for the largest order not above pages, and
+       advance it over leading ranges that are now known to fail. */
+    int k = msb(pages);
+    boolean leading = true;
+    id_range r = (id_range)rangemap_lookup_at_or_next(i->ranges, i->hint[k]);
     while (r != INVALID_ADDRESS) {
 	u64 a = id_alloc_from_range(i, r, pages, WHOLE_RANGE);
 	if (a != INVALID_PHYSICAL)
 	    return a;
+        if (leading && r->fail_pages <= U64_FROM_BIT(k)) {
+            i->hint[k] = r->n.r.end;
+            i->hint_mask |= U64_FROM_BIT(k);
+        } else {
+            leading = false;
+        }
         r = (id_range)rangemap_next_node(i->ranges, (rmnode)r);
     }
 
@@ -172,6 +210,8 @@ closure_function(2, 1, void, dealloc_from_range,
 
     if (bit < r->next_bit)
         r->next_bit = bit;
+    r->fail_pages = infinity;
+    id_hint_reset(i, r);
 
     u64 deallocated = pages << page_order(i);
     assert(i->h.allocated >= deallocated);
@@ -230,6 +270,8 @@ heap allocate_id_heap(heap h, bytes pagesize)
 	return INVALID_ADDRESS;
     }
     i->flags = 0;
+    i->hint_mask = 0;
+    zero(i->hint, sizeof(i->hint));
     return (heap)i;
 }
 
@@ -239,8 +281,8 @@ boolean id_heap_add_range(heap h, u64 base, u64 length)
     return id_add_range((id_heap)h, base, length) != INVALID_ADDRESS;
 }
 
-closure_function(4, 1, void, set_intersection,
-                 range, q, boolean *, fail, boolean, validate, boolean, allocate,
+closure_function(5, 1, void, set_intersection,
+                 id_heap, i, range, q, boolean *, fail, boolean, validate, boolean, allocate,
                  rmnode, n)
 {
     range ri = range_intersection(bound(q), n->r);
@@ -249,6 +291,10 @@ closure_function(4, 1, void, set_intersection,
     int bit = ri.start - n->r.start;
     if (!bitmap_range_check_and_set(r->b, bit, range_span(ri), bound(validate), bound(allocate)))
         *bound(fail) = true;
+    else if (!bound(allocate)) {
+        r->fail_pages = infinity;
+        id_hint_reset(bound(i), r);
+    }
 }
 
 boolean id_heap_set_area(heap h, u64 base, u64 length, boolean validate, boolean allocate)
@@ -259,7 +305,7 @@ boolean id_heap_set_area(heap h, u64 base, u64 length, boolean validate, boolean
 
     range q = irange(base >> page_order(i), (base + length) >> page_order(i));
     boolean fail = false;
-    rmnode_handler nh = stack_closure(set_intersection, q, &fail, validate, allocate);
+    rmnode_handler nh = stack_closure(set_intersection, i, q, &fail, validate, allocate);
     boolean result = rangemap_range_lookup(i->ranges, q, nh);
     return result && !fail;
 }
@@ -293,7 +339,9 @@ u64 id_heap_alloc_subrange(heap h, bytes count, u64 start, u64 end)
     if (range_span(subrange) < pages)
         return INVALID_PHYSICAL;
 
-    id_range r = (id_range)rangemap_first_node(i->ranges);
+    /* ranges below the hint fail the whole-range search, so any subrange too */
+    id_range r = (id_range)rangemap_lookup_at_or_next(i->ranges,
+                                                      MAX(subrange.start, i->hint[msb(pages)]));
     while (r != INVALID_ADDRESS) {
         u64 a = id_alloc_from_range(i, r, pages, subrange);
         if (a != INVALID_PHYSICAL) {
@@ -10,12 +10,16 @@
 
 #include <runtime.h>
 
+/* find_order() of a u64 is at most 64 */
+#define MCACHE_ORDERS 65
+
 typedef struct mcache {
     struct heap h;
     heap parent;
     heap meta;
     vector caches;
     u64 pagesize;
+    heap orders[MCACHE_ORDERS];	/* cache for each alloc order; 0 if too large */
 } *mcache;
 
 u64 mcache_alloc(heap h, bytes b)
@@ -29,38 +33,36 @@ u64 mcache_alloc(heap h, bytes b)
     print_u64(b);
     console(": ");
 #endif
-    /* Could become a binary search if search set is large... */
-    vector_foreach(m->caches, o) {
-	if (o && b <= o->pagesize) {
+    o = m->orders[find_order(b)];
+    if (!o) {
 #ifdef MCACHE_DEBUG
-	    console("match cache ");
-	    print_u64(u64_from_pointer(o));
-	    console(" obj size ");
-	    print_u64(o->pagesize);
-	    console(", pre validate...");
-	    if (objcache_validate((heap)o))
-		console("pass, alloc ");
-	    else
-		halt("failed!\n");
+	console("no matching cache; fail\n");
 #endif
-	    u64 a = allocate_u64(o, o->pagesize);
-	    if (a != INVALID_PHYSICAL)
-		h->allocated += o->pagesize;
+	return INVALID_PHYSICAL;
+    }
 #ifdef MCACHE_DEBUG
-	    print_u64(a);
-	    console(", post validate...");
-	    if (objcache_validate((heap)o))
-		console("pass\n");
-	    else
-		halt("failed!\n");
+    console("match cache ");
+    print_u64(u64_from_pointer(o));
+    console(" obj size ");
+    print_u64(o->pagesize);
+    console(", pre validate...");
+    if (objcache_validate((heap)o))
+	console("pass, alloc ");
+    else
+	halt("failed!\n");
 #endif
-	    return a;
-	}
-    }
+    u64 a = allocate_u64(o, o->pagesize);
+    if (a != INVALID_PHYSICAL)
+	h->allocated += o->pagesize;
 #ifdef MCACHE_DEBUG
-    console("no matching cache; fail\n");
+    print_u64(a);
+    console(", post validate...");
+    if (objcache_validate((heap)o))
+	console("pass\n");
+    else
+	halt("failed!\n");
 #endif
-    return INVALID_PHYSICAL;
+    return a;
 }
 
 void mcache_dealloc(heap h, u64 a, bytes b)
@@ -136,6 +138,17 @@ void destroy_mcache(heap h)
     deallocate(m->meta, m, sizeof(struct mcache));
 }
 
+/* Name the size class caches for objcache stats. */
+void mcache_set_name(heap h, const char *name)
+{
+    mcache m = (mcache)h;
+    heap o;
+    vector_foreach(m->caches, o) {
+	if (o)
+	    objcache_set_name(o, name);
+    }
+}
+
 heap allocate_mcache(heap meta, heap parent, int min_order, int max_order, bytes pagesize)
 {
     if (pagesize < parent->pagesize ||
@@ -194,5 +207,9 @@ heap allocate_mcache(heap meta, heap parent, int min_order, int max_order, bytes
 	}
 	vector_set(m->caches, i, h);
     }
+
+    for (int order = 0; order < MCACHE_ORDERS; order++)
+	m->orders[order] = order <= max_order ?
+	    vector_get(m->caches, MAX(order, min_order) - min_order) : 0;
     return (heap)m;
 }
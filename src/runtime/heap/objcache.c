@@ -16,10 +16,16 @@
 
    - Round up cache occupancy and put in tuple space.
 
+   Recently freed objects are held in a small per-cache magazine and
+   handed back LIFO, bypassing the page footer and free list walk in
+   the common alloc/free/alloc pattern of short-lived objects.
+
 */
 
 #include <runtime.h>
 
+//#define OBJCACHE_DEBUG
+
 #define FOOTER_MAGIC	(u16)(0xcafe)
 
 typedef struct objcache *objcache;
@@ -32,17 +38,28 @@ typedef struct footer {
     struct list list;		/* full list if avail == 0, free otherwise */
 } *footer;
 
+#define OBJCACHE_MAGAZINE_SIZE 16
+
 typedef struct objcache {
     struct heap h;
     heap parent;
+    const char *name;           /* reported in stats if set */
+    struct list l;              /* on objcaches */
     struct list free;		/* pages with available objects */
     struct list full;		/* fully-occupied pages */
     bytes pagesize;		/* allocation size for parent heap */
     u64 objs_per_page;		/* objects per page */
     u64 total_objs;		/* total objects in cache */
     u64 alloced_objs;		/* total cache occupancy (of total_objs) */
+    u64 allocs;
+    u64 frees;
+    u64 magazine_hits;		/* allocs satisfied from the magazine */
+    u64 magazine_count;
+    u64 magazine[OBJCACHE_MAGAZINE_SIZE];
 } *objcache;
 
+static struct list objcaches = { &objcaches, &objcaches };
+
 typedef u64 page;
 
 #define object_size(o) (o->h.pagesize)
@@ -125,6 +142,37 @@ static inline boolean validate_page(objcache o, footer f)
     return true;
 }
 
+#ifdef OBJCACHE_DEBUG
+/* The magazine path never touches the footer, so a repeated free would
+   otherwise go unnoticed until two callers are handed the same object. */
+static boolean objcache_check_free(objcache o, footer f, page p, u64 x)
+{
+    if (!validate_page(o, f))
+	return false;
+
+    u16 i = index_from_obj(o, p, x);
+    if (i >= f->head) {
+	msg_err("objcache %p: obj %lx was never allocated\n", o, x);
+	return false;
+    }
+
+    for (int m = 0; m < o->magazine_count; m++) {
+	if (o->magazine[m] == x) {
+	    msg_err("objcache %p: obj %lx already in magazine\n", o, x);
+	    return false;
+	}
+    }
+
+    for (u16 n = f->free; is_valid_index(n); n = next_free_from_obj(obj_from_index(o, p, n))) {
+	if (n == i) {
+	    msg_err("objcache %p: obj %lx already on page free list\n", o, x);
+	    return false;
+	}
+    }
+    return true;
+}
+#endif
+
 static void objcache_deallocate(heap h, u64 x, bytes size)
 {
     objcache o = (objcache)h;
@@ -137,6 +185,21 @@ static void objcache_deallocate(heap h, u64 x, bytes size)
 	return;
     }
 
+#ifdef OBJCACHE_DEBUG
+    if (!objcache_check_free(o, f, p, x)) {
+	msg_err("double free or corruption; leaking object\n");
+	return;
+    }
+#endif
+
+    o->frees++;
+    if (o->magazine_count < OBJCACHE_MAGAZINE_SIZE) {
+	o->magazine[o->magazine_count++] = x;
+	assert(h->allocated >= size);
+	h->allocated -= size;
+	return;
+    }
+
     msg_debug("*** heap %p: objsize %d, per page %ld, total %ld, alloced %ld\n",
 	      h, object_size(o), o->objs_per_page, o->total_objs, o->alloced_objs);
     msg_debug(" -  obj %lx, page %p, footer: free %d, head %d, avail %d\n",
@@ -174,6 +237,13 @@ static u64 objcache_allocate(heap h, bytes size)
 	return INVALID_PHYSICAL;
     }
 
+    if (o->magazine_count > 0) {
+	o->allocs++;
+	o->magazine_hits++;
+	h->allocated += size;
+	return o->magazine[--o->magazine_count];
+    }
+
     msg_debug("*** heap %p: objsize %d, per page %ld, total %ld, alloced %ld\n",
 	      h, object_size(o), o->objs_per_page, o->total_objs, o->alloced_objs);
     
@@ -221,6 +291,7 @@ static u64 objcache_allocate(heap h, bytes size)
 
     assert(o->alloced_objs <= o->total_objs);
     o->alloced_objs++;
+    o->allocs++;
     h->allocated += size;
     msg_debug("returning obj %lx\n", obj);
     return obj;
@@ -237,6 +308,7 @@ static void objcache_destroy(heap h)
 	    o->alloced_objs, o);
     }
 
+    list_delete(&o->l);
     footer f;
     foreach_page_footer(&o->free, f)
 	deallocate_u64(o->parent, page_from_footer(o, f), page_size(o));
@@ -436,6 +508,35 @@ heap allocate_objcache(heap meta, heap parent, bytes objsize, bytes pagesize)
     o->objs_per_page = objs_per_page;
     o->total_objs = 0;
     o->alloced_objs = 0;
+    o->allocs = 0;
+    o->frees = 0;
+    o->magazine_hits = 0;
+    o->magazine_count = 0;
+    o->name = 0;
+    list_insert_before(&objcaches, &o->l);
 
     return (heap)o;
 }
+
+void objcache_set_name(heap h, const char *name)
+{
+    ((objcache)h)->name = name;
+}
+
+/* One line per named cache, followed by totals across all caches. */
+void objcache_format_stats(buffer b)
+{
+    u64 allocs = 0, frees = 0, hits = 0;
+    list_foreach(&objcaches, l) {
+	objcache o = struct_from_list(l, objcache, l);
+	allocs += o->allocs;
+	frees += o->frees;
+	hits += o->magazine_hits;
+	if (!o->name)
+	    continue;
+	bprintf(b, "%s %ld: allocs %ld frees %ld inuse %ld magazine %ld pages %ld\n",
+		o->name, object_size(o), o->allocs, o->frees, o->h.allocated / object_size(o),
+		o->magazine_hits, o->total_objs / o->objs_per_page);
+    }
+    bprintf(b, "total: allocs %ld frees %ld magazine %ld\n", allocs, frees, hits);
+}
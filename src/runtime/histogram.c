@@ -0,0 +1,60 @@
+#include <runtime.h>
+
+static struct list histograms = { &histograms, &histograms };
+
+void histogram_init(histogram h, const char *group, const char *name)
+{
+    zero(h, sizeof(struct histogram));
+    h->group = group;
+    h->name = name;
+    list_insert_before(&histograms, &h->l);
+}
+
+histogram allocate_histogram(heap h, const char *group, const char *name)
+{
+    histogram hg = allocate(h, sizeof(struct histogram));
+    if (hg != INVALID_ADDRESS)
+        histogram_init(hg, group, name);
+    return hg;
+}
+
+void histogram_clear_all(void)
+{
+    list_foreach(&histograms, l) {
+        histogram h = struct_from_list(l, histogram, l);
+        h->count = h->sum = h->max = 0;
+        zero(h->buckets, sizeof(h->buckets));
+    }
+}
+
+/* Upper bound of the bucket holding the given percentile. */
+static u64 histogram_percentile(histogram h, u64 percent)
+{
+    u64 target = (h->count * percent + 99) / 100;
+    u64 n = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        n += h->buckets[i];
+        if (n >= target)
+            return U64_FROM_BIT(i + 1);
+    }
+    return h->max;
+}
+
+/* One line per histogram with samples: summary figures, then each
+   non-empty bucket as log2(ns):count. */
+void histogram_format_all(buffer b)
+{
+    list_foreach(&histograms, l) {
+        histogram h = struct_from_list(l, histogram, l);
+        if (h->count == 0)
+            continue;
+        bprintf(b, "%s %s count %ld mean_ns %ld max_ns %ld p50_ns %ld p99_ns %ld buckets",
+                h->group, h->name, h->count, h->sum / h->count, h->max,
+                histogram_percentile(h, 50), histogram_percentile(h, 99));
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            if (h->buckets[i])
+                bprintf(b, " %d:%ld", i, h->buckets[i]);
+        }
+        bprintf(b, "\n");
+    }
+}
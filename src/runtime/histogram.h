@@ -0,0 +1,34 @@
+#pragma once
+/* Log2 latency histograms. Bucket i counts samples in [2^i, 2^(i+1))
+   nanoseconds (bucket 0 also takes zero). Updates are not atomic;
+   concurrent recording may lose the odd sample. */
+#define HISTOGRAM_BUCKETS 64
+
+typedef struct histogram {
+    struct list l;              /* on the list of all histograms */
+    const char *group;
+    const char *name;
+    u64 count;
+    u64 sum;
+    u64 max;
+    u64 buckets[HISTOGRAM_BUCKETS];
+} *histogram;
+
+void histogram_init(histogram h, const char *group, const char *name);
+histogram allocate_histogram(heap h, const char *group, const char *name);
+void histogram_clear_all(void);
+void histogram_format_all(buffer b);
+
+static inline void histogram_record(histogram h, u64 ns)
+{
+    h->count++;
+    h->sum += ns;
+    if (ns > h->max)
+        h->max = ns;
+    h->buckets[ns ? msb(ns) : 0]++;
+}
+
+static inline void histogram_record_since(histogram h, timestamp start)
+{
+    histogram_record(h, nsec_from_timestamp(now(CLOCK_ID_MONOTONIC) - start));
+}
@@ -1,24 +1,258 @@
 #include <runtime.h>
 
-boolean rangemap_insert(rangemap rm, rmnode n)
+/* red-black tree helpers; a null child is a black leaf */
+#define rb_red(n) ((n) && (n)->red)
+
+static void rb_rotate_left(rangemap rm, rmnode x)
 {
-    list_foreach(&rm->root, l) {
-        rmnode curr = struct_from_list(l, rmnode, l);
-        range i = range_intersection(curr->r, n->r);
-        if (range_span(i)) {
-            /* XXX bark for now until we know we have all potential cases handled... */
-            msg_warn("attempt to insert %p (%R) but overlap with %p (%R)\n", n, n->r, curr, curr->r);
-            return false;
+    rmnode y = x->right;
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    y->parent = x->parent;
+    if (!x->parent)
+        rm->tree = y;
+    else if (x == x->parent->left)
+        x->parent->left = y;
+    else
+        x->parent->right = y;
+    y->left = x;
+    x->parent = y;
+}
+
+static void rb_rotate_right(rangemap rm, rmnode x)
+{
+    rmnode y = x->left;
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    y->parent = x->parent;
+    if (!x->parent)
+        rm->tree = y;
+    else if (x == x->parent->right)
+        x->parent->right = y;
+    else
+        x->parent->left = y;
+    y->right = x;
+    x->parent = y;
+}
+
+static void rb_insert_fixup(rangemap rm, rmnode z)
+{
+    while (rb_red(z->parent)) {
+        rmnode p = z->parent;
+        rmnode g = p->parent;
+        if (p == g->left) {
+            rmnode u = g->right;
+            if (rb_red(u)) {
+                p->red = u->red = false;
+                g->red = true;
+                z = g;
+                continue;
+            }
+            if (z == p->right) {
+                z = p;
+                rb_rotate_left(rm, z);
+                p = z->parent;
+            }
+            p->red = false;
+            g->red = true;
+            rb_rotate_right(rm, g);
+        } else {
+            rmnode u = g->left;
+            if (rb_red(u)) {
+                p->red = u->red = false;
+                g->red = true;
+                z = g;
+                continue;
+            }
+            if (z == p->left) {
+                z = p;
+                rb_rotate_right(rm, z);
+                p = z->parent;
+            }
+            p->red = false;
+            g->red = true;
+            rb_rotate_left(rm, g);
         }
-        if (curr->r.start > n->r.start) {
-            list_insert_before(l, &n->l);
-            return true;
+    }
+    rm->tree->red = false;
+}
+
+static void rb_transplant(rangemap rm, rmnode u, rmnode v)
+{
+    if (!u->parent)
+        rm->tree = v;
+    else if (u == u->parent->left)
+        u->parent->left = v;
+    else
+        u->parent->right = v;
+    if (v)
+        v->parent = u->parent;
+}
+
+/* x may be null, so its parent is tracked separately */
+static void rb_remove_fixup(rangemap rm, rmnode x, rmnode xp)
+{
+    while (x != rm->tree && !rb_red(x)) {
+        if (x == xp->left) {
+            rmnode w = xp->right;
+            if (rb_red(w)) {
+                w->red = false;
+                xp->red = true;
+                rb_rotate_left(rm, xp);
+                w = xp->right;
+            }
+            if (!rb_red(w->left) && !rb_red(w->right)) {
+                w->red = true;
+                x = xp;
+                xp = x->parent;
+                continue;
+            }
+            if (!rb_red(w->right)) {
+                w->left->red = false;
+                w->red = true;
+                rb_rotate_right(rm, w);
+                w = xp->right;
+            }
+            w->red = xp->red;
+            xp->red = false;
+            w->right->red = false;
+            rb_rotate_left(rm, xp);
+        } else {
+            rmnode w = xp->left;
+            if (rb_red(w)) {
+                w->red = false;
+                xp->red = true;
+                rb_rotate_right(rm, xp);
+                w = xp->left;
+            }
+            if (!rb_red(w->left) && !rb_red(w->right)) {
+                w->red = true;
+                x = xp;
+                xp = x->parent;
+                continue;
+            }
+            if (!rb_red(w->left)) {
+                w->right->red = false;
+                w->red = true;
+                rb_rotate_left(rm, w);
+                w = xp->left;
+            }
+            w->red = xp->red;
+            xp->red = false;
+            w->left->red = false;
+            rb_rotate_right(rm, xp);
         }
+        x = rm->tree;
     }
-    list_insert_before(&rm->root, &n->l);
+    if (x)
+        x->red = false;
+}
+
+static void rb_remove(rangemap rm, rmnode z)
+{
+    rmnode x, xp;
+    boolean removed_red = z->red;
+
+    if (!z->left) {
+        x = z->right;
+        xp = z->parent;
+        rb_transplant(rm, z, z->right);
+    } else if (!z->right) {
+        x = z->left;
+        xp = z->parent;
+        rb_transplant(rm, z, z->left);
+    } else {
+        rmnode y = z->right;
+        while (y->left)
+            y = y->left;
+        removed_red = y->red;
+        x = y->right;
+        if (y->parent == z) {
+            xp = y;
+        } else {
+            xp = y->parent;
+            rb_transplant(rm, y, y->right);
+            y->right = z->right;
+            y->right->parent = y;
+        }
+        rb_transplant(rm, z, y);
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+    if (!removed_red)
+        rb_remove_fixup(rm, x, xp);
+    z->parent = z->left = z->right = 0;
+}
+
+/* return the last node starting at or before point, or 0 */
+static rmnode rb_floor(rangemap rm, u64 point)
+{
+    rmnode n = rm->tree;
+    rmnode floor = 0;
+    while (n) {
+        if (n->r.start <= point) {
+            floor = n;
+            n = n->right;
+        } else {
+            n = n->left;
+        }
+    }
+    return floor;
+}
+
+boolean rangemap_insert(rangemap rm, rmnode n)
+{
+    rmnode parent = 0;
+    rmnode *link = &rm->tree;
+    while (*link) {
+        parent = *link;
+        link = n->r.start < parent->r.start ? &parent->left : &parent->right;
+    }
+
+    /* only the in-order neighbors can overlap */
+    rmnode prev, next;
+    if (!parent) {
+        prev = next = INVALID_ADDRESS;
+    } else if (link == &parent->left) {
+        prev = rangemap_prev_node(rm, parent);
+        next = parent;
+    } else {
+        prev = parent;
+        next = rangemap_next_node(rm, parent);
+    }
+    rmnode conflict = INVALID_ADDRESS;
+    if (prev != INVALID_ADDRESS && range_span(range_intersection(prev->r, n->r)))
+        conflict = prev;
+    else if (next != INVALID_ADDRESS && range_span(range_intersection(next->r, n->r)))
+        conflict = next;
+    if (conflict != INVALID_ADDRESS) {
+        /* XXX bark for now until we know we have all potential cases handled... */
+        msg_warn("attempt to insert %p (%R) but overlap with %p (%R)\n", n, n->r, conflict, conflict->r);
+        return false;
+    }
+
+    n->parent = parent;
+    n->left = n->right = 0;
+    n->red = true;
+    *link = n;
+    rb_insert_fixup(rm, n);
+
+    if (next != INVALID_ADDRESS)
+        list_insert_before(&next->l, &n->l);
+    else
+        list_insert_before(&rm->root, &n->l);
     return true;
 }
 
+void rangemap_remove_node(rangemap rm, rmnode n)
+{
+    rb_remove(rm, n);
+    list_delete(&n->l);
+}
+
 boolean rangemap_reinsert(rangemap rm, rmnode n, range k)
 {
     rangemap_remove_node(rm, n);
@@ -29,16 +263,15 @@ boolean rangemap_reinsert(rangemap rm, rmnode n, range k)
 boolean rangemap_remove_range(rangemap rm, range k)
 {
     boolean match = false;
-    list l = list_get_next(&rm->root);
+    rmnode curr = rangemap_lookup_at_or_next(rm, k.start);
 
-    while (l && l != &rm->root) {
-        rmnode curr = struct_from_list(l, rmnode, l);
-        list next = list_get_next(l);
+    while (curr != INVALID_ADDRESS && curr->r.start < k.end) {
+        rmnode next = rangemap_next_node(rm, curr);
         range i = range_intersection(curr->r, k);
 
         /* no intersection */
         if (range_empty(i)) {
-            l = next;
+            curr = next;
             continue;
         }
 
@@ -47,7 +280,7 @@ boolean rangemap_remove_range(rangemap rm, range k)
         /* complete overlap (delete) */
         if (range_equal(curr->r, i)) {
             rangemap_remove_node(rm, curr);
-            l = next;
+            curr = next;
             continue;
         }
 
@@ -74,7 +307,7 @@ boolean rangemap_remove_range(rangemap rm, range k)
         } else if (curr->r.end > i.end) { /* head trim */
             curr->r.start = i.end;
         }
-        l = next;               /* valid even if we inserted one */
+        curr = next;            /* valid even if we inserted one */
     }
 
     return match;
@@ -82,32 +315,31 @@ boolean rangemap_remove_range(rangemap rm, range k)
 
 rmnode rangemap_lookup(rangemap rm, u64 point)
 {
-    list_foreach(&rm->root, i) {
-        rmnode curr = struct_from_list(i, rmnode, l);
-        if (point_in_range(curr->r, point))
-            return curr;
-    }
+    rmnode n = rb_floor(rm, point);
+    if (n && point_in_range(n->r, point))
+        return n;
     return INVALID_ADDRESS;
 }
 
 /* return either an exact match or the neighbor to the right */
 rmnode rangemap_lookup_at_or_next(rangemap rm, u64 point)
 {
-    list_foreach(&rm->root, i) {
-        rmnode curr = struct_from_list(i, rmnode, l);
-        if (point_in_range(curr->r, point) ||
-            curr->r.start > point)
-            return curr;
-    }
-    return INVALID_ADDRESS;
+    rmnode n = rb_floor(rm, point);
+    if (!n)
+        return rangemap_first_node(rm);
+    if (point_in_range(n->r, point))
+        return n;
+    return rangemap_next_node(rm, n);
 }
 
 /* can be called with rh == 0 for true/false match */
 boolean rangemap_range_lookup(rangemap rm, range q, rmnode_handler nh)
 {
     boolean match = false;
-    list_foreach(&rm->root, i) {
-        rmnode curr = struct_from_list(i, rmnode, l);
+    rmnode curr = rangemap_lookup_at_or_next(rm, q.start);
+    while (curr != INVALID_ADDRESS && curr->r.start < q.end) {
+        /* the handler may reinsert curr or add nodes ahead of next */
+        rmnode next = rangemap_next_node(rm, curr);
         range i = range_intersection(curr->r, q);
 
         if (!range_empty(i)) {
@@ -116,6 +348,7 @@ boolean rangemap_range_lookup(rangemap rm, range q, rmnode_handler nh)
                 return true;
             apply(nh, curr);
         }
+        curr = next;
     }
     return match;
 }
@@ -124,15 +357,18 @@ boolean rangemap_range_find_gaps(rangemap rm, range q, range_handler rh)
 {
     boolean match = false;
     u64 lastedge = q.start;
-    list_foreach(&rm->root, l) {
-        rmnode curr = struct_from_list(l, rmnode, l);
+    rmnode curr = rangemap_lookup_at_or_next(rm, q.start);
+    while (curr != INVALID_ADDRESS && curr->r.start < q.end) {
+        /* gaps may be filled by the handler; step past them */
+        rmnode next = rangemap_next_node(rm, curr);
         u64 edge = curr->r.start;
         range i = range_intersection(irange(lastedge, edge), q);
+        lastedge = curr->r.end;
         if (range_span(i)) {
             match = true;
             apply(rh, i);
         }
-        lastedge = curr->r.end;
+        curr = next;
     }
 
     /* check for a gap between the last node and q.end */
@@ -149,6 +385,7 @@ rangemap allocate_rangemap(heap h)
     rangemap rm = allocate(h, sizeof(struct rangemap));
     rm->h = h;
     list_init(&rm->root);
+    rm->tree = 0;
     return rm;
 }
 
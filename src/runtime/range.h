@@ -1,19 +1,24 @@
 #pragma once
-typedef struct rangemap {
-    heap h;
-    struct list root;
-} *rangemap;
-
 // [start, end)
 typedef struct range {
     u64 start, end;
 } range;
 
+/* Nodes are indexed by a red-black tree keyed on range start for
+   lookups, and threaded on a sorted list for in-order traversal. */
 typedef struct rmnode {
     range r;
     struct list l;
+    struct rmnode *parent, *left, *right;
+    boolean red;
 } *rmnode;
 
+typedef struct rangemap {
+    heap h;
+    struct list root;
+    rmnode tree;
+} *rangemap;
+
 #define irange(__s, __e)  (range){__s, __e}        
 #define point_in_range(__r, __p) ((__p >= __r.start) && (__p < __r.end))
 
@@ -24,6 +29,7 @@ typedef closure_type(range_handler, void, range);
 boolean rangemap_insert(rangemap rm, rmnode n);
 boolean rangemap_reinsert(rangemap rm, rmnode n, range k);
 boolean rangemap_remove_range(rangemap rm, range r);
+void rangemap_remove_node(rangemap rm, rmnode n);
 rmnode rangemap_lookup(rangemap rm, u64 point);
 rmnode rangemap_lookup_at_or_next(rangemap rm, u64 point);
 boolean rangemap_range_lookup(rangemap rm, range q, rmnode_handler nh);
@@ -45,6 +51,8 @@ static inline void rmnode_init(rmnode n, range r)
 {
     rmnode_set_range(n, r);
     list_init(&n->l);
+    n->parent = n->left = n->right = 0;
+    n->red = false;
 }
 
 static inline rmnode rangemap_prev_node(rangemap rm, rmnode n)
@@ -69,11 +77,6 @@ static inline rmnode rangemap_first_node(rangemap rm)
         return struct_from_list(rm->root.next, rmnode, l);
 }
 
-static inline void rangemap_remove_node(rangemap rm, rmnode n)
-{
-    list_delete(&n->l);
-}
-
 static inline range range_intersection(range a, range b)
 {
     range dest = {MAX(a.start, b.start), MIN(a.end, b.end)};
@@ -108,6 +108,7 @@ void sha256(buffer dest, buffer source);
 typedef struct buffer *buffer;
 
 void print_number(buffer s, u64 x, int base, int pad);
+void objcache_format_stats(buffer b);
 
 #include <text.h>
 #include <vector.h>
@@ -159,6 +160,7 @@ typedef closure_type(thunk, void);
 #include <clock.h>
 #include <timer.h>
 #include <range.h>
+#include <histogram.h>
 
 #define PAGELOG 12
 #define PAGESIZE U64_FROM_BIT(PAGELOG)
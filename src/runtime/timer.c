@@ -6,16 +6,44 @@
 #define timer_debug(x, ...)
 #endif
 
+/* Timers are kept in a hierarchical wheel. Time is quantized into ticks
+   of 2^TIMER_TICK_ORDER timestamp units (~15us); deadlines falling in
+   the same tick are coalesced and expire together. Level 0 holds timers
+   expiring within the current 64-tick block, and each higher level holds
+   timers expiring within the current block of the next level up, one
+   slot per block of the level below. Higher level slots are cascaded
+   down as the wheel clock reaches them. Timers beyond the top level are
+   parked in the last slot and re-inserted when reached.
+
+   Insert and remove are O(1); a per-level occupancy bitmap gives the
+   next event without scanning empty slots. */
+
+#define TIMER_TICK_ORDER        16
+#define TIMER_LEVEL_ORDER       6
+#define TIMER_LEVEL_SLOTS       U64_FROM_BIT(TIMER_LEVEL_ORDER)
+#define TIMER_LEVELS            6
+#define TIMER_DETACHED          ((u8)-1)
+
+#define level_shift(l) ((l) * TIMER_LEVEL_ORDER)
+
 struct timer {
+    struct list l;
     thunk t;
     timestamp expiry;
     timestamp interval;
     clock_id id;
     boolean disable;
+    u8 level;                   /* TIMER_DETACHED when off-wheel */
+    u8 slot;
 };
 
-// should pass a timer around
-static pqueue timers;
+static struct timer_level {
+    u64 occupied;
+    struct list slots[TIMER_LEVEL_SLOTS];
+} levels[TIMER_LEVELS];
+
+static u64 clk;                 /* ticks before clk have been processed */
+static timer running;           /* timer whose thunk is being applied */
 static heap theap;
 
 static inline timestamp expiry(timer t)
@@ -34,18 +62,114 @@ static inline timestamp expiry(timer t)
     }
 }
 
-/* The lower time expiry is the higher priority. */
-static boolean timer_compare(void *za, void *zb)
+static inline u64 tick_from_timestamp(timestamp t)
+{
+    return (t >> TIMER_TICK_ORDER) + ((t & MASK(TIMER_TICK_ORDER)) != 0);
+}
+
+static void timer_insert(timer t)
+{
+    u64 etick = tick_from_timestamp(expiry(t));
+    if (etick < clk)
+        etick = clk;
+    u64 top = level_shift(TIMER_LEVELS);
+    if ((etick >> top) != (clk >> top))
+        etick = clk | MASK(top);
+
+    int l = 0;
+    while ((etick >> level_shift(l + 1)) != (clk >> level_shift(l + 1)))
+        l++;
+    u64 slot = (etick >> level_shift(l)) & (TIMER_LEVEL_SLOTS - 1);
+    t->level = l;
+    t->slot = slot;
+    list_push_back(&levels[l].slots[slot], &t->l);
+    levels[l].occupied |= U64_FROM_BIT(slot);
+}
+
+static void timer_unlink(timer t)
+{
+    list_delete(&t->l);
+    if (t->level != TIMER_DETACHED) {
+        struct timer_level *tl = &levels[t->level];
+        if (list_empty(&tl->slots[t->slot]))
+            tl->occupied &= ~U64_FROM_BIT(t->slot);
+        t->level = TIMER_DETACHED;
+    }
+}
+
+/* Move the contents of a slot onto an empty local list head. */
+static void timer_detach_slot(int l, int slot, struct list *head)
+{
+    struct list *s = &levels[l].slots[slot];
+    list_init(head);
+    if (!list_empty(s)) {
+        head->next = s->next;
+        head->prev = s->prev;
+        head->next->prev = head;
+        head->prev->next = head;
+        list_init(s);
+    }
+    levels[l].occupied &= ~U64_FROM_BIT(slot);
+    list_foreach(head, e)
+        struct_from_list(e, timer, l)->level = TIMER_DETACHED;
+}
+
+/* The next tick at which a level 0 slot expires or a higher level slot
+   must be cascaded, or infinity if the wheel is empty. */
+static u64 timer_next_event(void)
+{
+    u64 next = infinity;
+    for (int l = 0; l < TIMER_LEVELS; l++) {
+        u64 occ = levels[l].occupied;
+        if (!occ)
+            continue;
+        u64 block = clk & ~MASK(level_shift(l + 1));
+        u64 t = block | ((u64)lsb(occ) << level_shift(l));
+        if (t < next)
+            next = t;
+    }
+    return next;
+}
+
+/* Earliest deadline, in ticks, among timers in the first occupied slot
+   of each level. Programming this rather than the cascade point avoids
+   waking just to move timers down the wheel. */
+static u64 timer_next_deadline(void)
+{
+    u64 next = infinity;
+    for (int l = 0; l < TIMER_LEVELS; l++) {
+        u64 occ = levels[l].occupied;
+        if (!occ)
+            continue;
+        if (l == 0) {
+            next = MIN(next, (clk & ~MASK(level_shift(1))) | lsb(occ));
+            continue;
+        }
+        list_foreach(&levels[l].slots[lsb(occ)], e) {
+            u64 etick = tick_from_timestamp(expiry(struct_from_list(e, timer, l)));
+            next = MIN(next, MAX(etick, clk));
+        }
+    }
+    return next;
+}
+
+static void timer_free(timer t)
 {
-    return expiry((timer)za) > expiry((timer)zb);
+    deallocate(theap, t, sizeof(struct timer));
 }
 
 /* returns time remaining or 0 if elapsed */
 timestamp remove_timer(timer t)
 {
-    t->disable = true;
     timestamp x = expiry(t);
     timestamp n = now(CLOCK_ID_MONOTONIC);
+    if (t == running) {
+        /* freed by timer_check once the thunk returns */
+        t->disable = true;
+    } else {
+        timer_unlink(t);
+        timer_free(t);
+    }
     return x > n ? x - n : 0;
 }
 
@@ -63,7 +187,7 @@ static timer __register_timer(timestamp interval, clock_id id, thunk n, boolean
     t->expiry = tn + interval;
     t->interval = (periodic) ? interval : 0;
     t->id = id;
-    pqueue_insert(timers, t);
+    timer_insert(t);
 
     timer_debug("register %s timer: %p, interval %T, now %T, expiry %T\n",
                 (periodic) ? "periodic" : "one-shot", t, interval, tn, t->expiry);
@@ -80,33 +204,70 @@ timer register_periodic_timer(timestamp interval, clock_id id, thunk n)
 {
     return __register_timer(interval, id, n, true);
 }
-    
+
+static void timer_expire(timer t, timestamp here)
+{
+    if (expiry(t) > here) {
+        /* parked beyond the top level, or the realtime clock moved */
+        timer_insert(t);
+        return;
+    }
+    running = t;
+    apply(t->t);
+    running = 0;
+    if (t->interval && !t->disable) {
+        t->expiry += t->interval;
+        timer_insert(t);
+    } else {
+        timer_free(t);
+    }
+}
+
 /* Presently called with ints off. Address thread safety with
-   pqueue before using with ints enabled.
+   the wheel before using with ints enabled.
 */
 timestamp timer_check()
 {
-    timestamp here = 0;
-    timer t = 0;
+    timestamp here = now(CLOCK_ID_MONOTONIC);
+    u64 here_tick = here >> TIMER_TICK_ORDER;
+    u64 next;
+    struct list batch;
+
+    while ((next = timer_next_event()) <= here_tick) {
+        clk = next;
 
-    while ((t = pqueue_peek(timers)) && (here = now(CLOCK_ID_MONOTONIC), expiry(t) <= here)) {
-        pqueue_pop(timers);
-        if (!t->disable) {
-            apply(t->t);
-            if (t->interval) {
-                t->expiry += t->interval;
-                pqueue_insert(timers, t);
+        /* cascade from the top down so that timers land in lower
+           levels before those are expired */
+        for (int l = TIMER_LEVELS - 1; l > 0; l--) {
+            if (clk & MASK(level_shift(l)))
                 continue;
+            timer_detach_slot(l, (clk >> level_shift(l)) & (TIMER_LEVEL_SLOTS - 1), &batch);
+            list_foreach(&batch, e) {
+                timer t = struct_from_list(e, timer, l);
+                list_delete(e);
+                timer_insert(t);
             }
         }
-        deallocate(theap, t, sizeof(struct timer));
-    }
-    if (t) {
-    	timestamp dt = expiry(t) - here;
-    	timer_debug("check returning dt: %d\n", dt);
-    	return dt;
+
+        /* thunks may remove other timers in the batch or add to this
+           slot, so pop one at a time */
+        timer_detach_slot(0, clk & (TIMER_LEVEL_SLOTS - 1), &batch);
+        struct list *e;
+        while ((e = list_get_next(&batch))) {
+            list_delete(e);
+            timer_expire(struct_from_list(e, timer, l), here);
+        }
     }
-    return infinity;
+    clk = here_tick + 1;
+
+    next = timer_next_deadline();
+    if (next == infinity)
+        return infinity;
+    here = now(CLOCK_ID_MONOTONIC);
+    timestamp dt = next << TIMER_TICK_ORDER;
+    dt = dt > here ? dt - here : 0;
+    timer_debug("check returning dt: %d\n", dt);
+    return dt;
 }
 
 timestamp parse_time(string b)
@@ -151,8 +312,19 @@ void print_timestamp(string b, timestamp t)
 
 void initialize_timers(kernel_heaps kh)
 {
-    heap h = heap_general(kh);
-    assert(!timers);
-    timers = allocate_pqueue(h, timer_compare);
-    theap = h;
+    assert(!theap);
+    for (int l = 0; l < TIMER_LEVELS; l++) {
+        levels[l].occupied = 0;
+        for (int i = 0; i < TIMER_LEVEL_SLOTS; i++)
+            list_init(&levels[l].slots[i]);
+    }
+    clk = 0;
+
+#ifdef STAGE3
+    theap = allocate_objcache(heap_general(kh), heap_backed(kh), sizeof(struct timer), PAGESIZE);
+    assert(theap != INVALID_ADDRESS);
+    objcache_set_name(theap, "timer");
+#else
+    theap = heap_general(kh);
+#endif
 }
@@ -58,6 +58,12 @@ static inline extent allocate_extent(heap h, range init_range, u64 block_start,
     return e;
 }
 
+/* whether file offset off within node would lie at block_start on disk */
+static inline boolean extent_maps(rmnode node, u64 off, u64 block_start)
+{
+    return ((extent)node)->block_start + (off - node->r.start) == block_start;
+}
+
 static void filesystem_flush_log(filesystem fs)
 {
     log_flush(fs->tl);
@@ -178,14 +184,19 @@ closure_function(4, 1, void, fs_read_extent_complete,
     closure_finish();
 }
 
-closure_function(4, 1, void, fs_read_extent,
-                 filesystem, fs, buffer, target, merge, m, range, q,
-                 rmnode, node)
+/* Extents may be much larger than a sensible single I/O, so requests
+   are broken on MAX_EXTENT_SIZE boundaries relative to the extent
+   start, which keeps them block-aligned on disk. */
+static inline range extent_io_chunk(rmnode node, range i)
+{
+    u64 rel = i.start - node->r.start;
+    return irange(i.start, MIN(i.end, node->r.start + (rel & ~(MAX_EXTENT_SIZE - 1)) +
+                               MAX_EXTENT_SIZE));
+}
+
+static void fs_read_extent_range(filesystem fs, buffer target, merge m, range q, rmnode node,
+                                 range i)
 {
-    filesystem fs = bound(fs);
-    buffer target = bound(target);
-    range q = bound(q);
-    range i = range_intersection(q, node->r);
     u64 target_offset = i.start - q.start;
     void *target_start = buffer_ref(target, target_offset);
 
@@ -197,10 +208,6 @@ closure_function(4, 1, void, fs_read_extent,
         return;
     }
 #ifdef BOOT
-    /* XXX To skip the copy in stage2, we're banking on the kernel
-       being loaded in its entirety, with no partial-block reads
-       (except the end, but that's fine). */
-    assert(i.start == node->r.start);
     db->buf = target_start;
 #endif
 
@@ -209,12 +216,30 @@ closure_function(4, 1, void, fs_read_extent,
               q, node->r, db->blocks, db->start_offset, i,
               target_offset, target_start, db->data_length, (u64)fs->blocksize);
 
-    status_handler f = apply_merge(bound(m));
+    status_handler f = apply_merge(m);
     fetch_and_add(&target->end, db->data_length);
     status_handler copy = closure(fs->h, fs_read_extent_complete, fs, db, target_start, f);
     apply(fs->r, db->buf, db->blocks, copy);
 }
 
+closure_function(4, 1, void, fs_read_extent,
+                 filesystem, fs, buffer, target, merge, m, range, q,
+                 rmnode, node)
+{
+    range i = range_intersection(bound(q), node->r);
+#ifdef BOOT
+    /* XXX To skip the copy in stage2, we're banking on the kernel
+       being loaded in its entirety, with no partial-block reads
+       (except the end, but that's fine). */
+    assert(i.start == node->r.start);
+#endif
+    while (i.start < i.end) {
+        range chunk = extent_io_chunk(node, i);
+        fs_read_extent_range(bound(fs), bound(target), bound(m), bound(q), node, chunk);
+        i.start = chunk.end;
+    }
+}
+
 closure_function(3, 1, void, fs_zero_hole,
                  filesystem, fs, buffer, target, range, q,
                  range, z)
@@ -372,9 +397,10 @@ static void fs_write_extent_read_block(filesystem fs, fs_dma_buf db, u64 offset_
     apply(fs->r, buf, r, sh);
 }
 
-static void fs_write_extent(filesystem fs, buffer source, merge m, range q, rmnode node)
+/* write the portion i of query q, which must lie within node */
+static void fs_write_extent_range(filesystem fs, buffer source, merge m, range q, rmnode node,
+                                  range i)
 {
-    range i = range_intersection(q, node->r);
     u64 source_offset = i.start - q.start;
     void * source_start = buffer_ref(source, source_offset);
 
@@ -422,6 +448,21 @@ static void fs_write_extent(filesystem fs, buffer source, merge m, range q, rmno
     fs_write_extent_aligned(fs, db, source_start, sh, STATUS_OK);
 }
 
+static void fs_write_extent_chunked(filesystem fs, buffer source, merge m, range q, rmnode node,
+                                    range i)
+{
+    while (i.start < i.end) {
+        range chunk = extent_io_chunk(node, i);
+        fs_write_extent_range(fs, source, m, q, node, chunk);
+        i.start = chunk.end;
+    }
+}
+
+static void fs_write_extent(filesystem fs, buffer source, merge m, range q, rmnode node)
+{
+    fs_write_extent_chunked(fs, source, m, q, node, range_intersection(q, node->r));
+}
+
 // wrap in an interface
 static tuple soft_create(filesystem fs, tuple t, symbol a, merge m)
 {
@@ -509,27 +550,117 @@ void ingest_extent(fsfile f, symbol off, tuple value)
     tfs_debug("ingest_extent: f %p, off %b, value %v\n", f, symbol_string(off), value);
     u64 length, file_offset, block_start, allocated;
     assert(off);
-    assert(parse_int(alloca_wrap(symbol_string(off)), 10, &file_offset));
-    assert(ingest_parse_int(value, sym(length), &length));
-    assert(ingest_parse_int(value, sym(offset), &block_start));
-    assert(ingest_parse_int(value, sym(allocated), &allocated));
+    if (!parse_int(alloca_wrap(symbol_string(off)), 10, &file_offset) ||
+        !ingest_parse_int(value, sym(length), &length) ||
+        !ingest_parse_int(value, sym(offset), &block_start) ||
+        !ingest_parse_int(value, sym(allocated), &allocated)) {
+        msg_err("malformed extent record at offset %b; skipped\n", symbol_string(off));
+        return;
+    }
     tfs_debug("   file offset %ld, length %ld, block_start 0x%lx, allocated %ld\n",
               file_offset, length, block_start, allocated);
+    range r = irange(file_offset, file_offset + length);
+
+    /* A merged extent supersedes the records of the extents that it
+       absorbed, which remain in the log until it is compacted. The
+       records may be ingested in any order. */
+    boolean validate = true;
+    rmnode n = rangemap_lookup(f->extentmap, r.start);
+    if (n != INVALID_ADDRESS && n->r.end >= r.end &&
+        extent_maps(n, r.start, block_start)) {
+        tfs_debug("   superseded by extent %R\n", n->r);
+        return;
+    }
+
+    /* Any extents that this record overlaps must be ones that it absorbed.
+       Anything else means a corrupt log (or one written with a different
+       extent layout); keep the extents already ingested and drop the
+       record rather than build an inconsistent map. */
+    rmnode first = rangemap_lookup_at_or_next(f->extentmap, r.start);
+    for (n = first; n != INVALID_ADDRESS && n->r.start < r.end;
+         n = rangemap_next_node(f->extentmap, n)) {
+        if (n->r.start < r.start || n->r.end > r.end ||
+            !extent_maps(n, r.start, block_start)) {
+            msg_err("extent %R at block 0x%lx conflicts with extent %R at block 0x%lx; "
+                    "skipped\n", r, block_start, n->r, ((extent)n)->block_start);
+            return;
+        }
+    }
+    n = first;
+    while (n != INVALID_ADDRESS && n->r.start < r.end) {
+        rmnode next = rangemap_next_node(f->extentmap, n);
+        tfs_debug("   supersedes extent %R\n", n->r);
+        rangemap_remove_node(f->extentmap, n);
+        deallocate(f->fs->h, n, sizeof(struct extent));
+        validate = false;
+        n = next;
+    }
 #ifndef BOOT
-    if (!id_heap_set_area(f->fs->storage, block_start, allocated, true, true)) {
+    if (!id_heap_set_area(f->fs->storage, block_start, allocated, validate, true)) {
         /* soft error... */
         msg_err("unable to reserve storage at start 0x%lx, len 0x%lx\n",
                 block_start, allocated);
     }
 #endif
-    range r = irange(file_offset, file_offset + length);
     extent ex = allocate_extent(f->fs->h, r, block_start, allocated);
     if (ex == INVALID_ADDRESS)
         halt("out of memory\n");
     assert(rangemap_insert(f->extentmap, &ex->node));
 }
 
-boolean set_extent_length(fsfile f, extent ex, u64 length, merge m)
+static void extent_update_tuple(tuple extent_tuple, extent ex, heap h)
+{
+    table_set(extent_tuple, sym(length), aprintf(h, "%ld", range_span(ex->node.r)));
+    table_set(extent_tuple, sym(allocated), aprintf(h, "%ld", ex->allocated));
+}
+
+/* Merge extents which are contiguous both in the file and on disk,
+   where the first fills its allocation, and drop the records of
+   superseded extents. This only updates the resident metadata; the
+   merged records reach the log when it is next compacted, or when the
+   merged extent is next updated. */
+void coalesce_extents(fsfile f)
+{
+    tuple extents = table_find(f->md, sym(extents));
+    if (!extents)
+        return;
+    heap h = f->fs->h;
+    rmnode n = rangemap_first_node(f->extentmap);
+    while (n != INVALID_ADDRESS) {
+        rmnode next = rangemap_next_node(f->extentmap, n);
+        extent ex = (extent)n;
+        if (next == INVALID_ADDRESS || next->r.start != n->r.end ||
+            range_span(n->r) != ex->allocated || !extent_maps(n, next->r.start, ((extent)next)->block_start)) {
+            n = next;
+            continue;
+        }
+        tfs_debug("coalesce_extents: %R and %R\n", n->r, next->r);
+        ex->allocated += ((extent)next)->allocated;
+        range r = irange(n->r.start, next->r.end);
+        rangemap_remove_node(f->extentmap, next);
+        deallocate(h, next, sizeof(struct extent));
+        assert(rangemap_reinsert(f->extentmap, n, r));
+        tuple extent_tuple = table_find(extents, intern_u64(r.start));
+        if (extent_tuple)
+            extent_update_tuple(extent_tuple, ex, h);
+    }
+
+    vector stale = allocate_vector(h, 1);
+    table_foreach(extents, off, e) {
+        (void)e;
+        u64 file_offset;
+        assert(parse_int(alloca_wrap(symbol_string(off)), 10, &file_offset));
+        n = rangemap_lookup(f->extentmap, file_offset);
+        if (n == INVALID_ADDRESS || n->r.start != file_offset)
+            vector_push(stale, off);
+    }
+    symbol off;
+    vector_foreach(stale, off)
+        table_set(extents, off, 0);
+    deallocate_vector(stale);
+}
+
+static boolean set_extent_length(fsfile f, extent ex, u64 length, merge m)
 {
     tfs_debug("set_extent_length: range %R, allocated %ld, new length %ld\n",
               ex->node.r, ex->allocated, length);
@@ -542,7 +673,9 @@ boolean set_extent_length(fsfile f, extent ex, u64 length, merge m)
     range r = ex->node.r;
     r.end = ex->node.r.start + length;
 
-    if (rangemap_range_lookup(f->extentmap, r, 0)) {
+    /* only the area gained by growing the extent may collide */
+    if (r.end > ex->node.r.end &&
+        rangemap_range_lookup(f->extentmap, irange(ex->node.r.end, r.end), 0)) {
         tfs_debug("failed: collides with existing extent\n");
         return false;
     }
@@ -561,20 +694,56 @@ boolean set_extent_length(fsfile f, extent ex, u64 length, merge m)
     }
 
     /* re-insert in rangemap */
-    rangemap_remove_node(f->extentmap, &ex->node);
-
-    if (!rangemap_insert(f->extentmap, &ex->node)) {
-        tfs_debug("failed: rangemap_insert failed\n");
+    if (!rangemap_reinsert(f->extentmap, &ex->node, r)) {
+        tfs_debug("failed: rangemap_reinsert failed\n");
         return false;
     }
 
-    /* update length in tuple and log */
-    string v = aprintf(f->fs->h, "%ld", length);
-    table_set(extent_tuple, sym(length), v);
-    filesystem_write_eav(f->fs, extents, offs, extent_tuple, apply_merge(m));
+    /* Update length and allocation in tuple and log. The extent tuple
+       is already recorded in the log, so update it by reference;
+       encoding it anew would desync the log dictionary. */
+    extent_update_tuple(extent_tuple, ex, f->fs->h);
+    filesystem_write_eav(f->fs, extent_tuple, sym(length),
+                         table_find(extent_tuple, sym(length)), apply_merge(m));
+    filesystem_write_eav(f->fs, extent_tuple, sym(allocated),
+                         table_find(extent_tuple, sym(allocated)), apply_merge(m));
     return true;
 }
 
+/* Grow an extent towards end, first within its allocation and then by
+   claiming the storage immediately following it, if free. Returns the
+   new end of the extent; storage claimed for a growth that can't be
+   recorded is given back. */
+static u64 inflate_extent(fsfile f, extent ex, u64 end, merge m)
+{
+    heap storage = f->fs->storage;
+    u64 alloc_end = ex->node.r.start + ex->allocated;
+    u64 block_end = ex->block_start + ex->allocated;
+    u64 grown = 0;
+    if (end > alloc_end) {
+        u64 grow = pad(end - alloc_end, MIN_EXTENT_SIZE);
+        if (block_end + grow <= id_heap_total(storage) &&
+            id_heap_set_area(storage, block_end, grow, true, true)) {
+            tfs_debug("inflate_extent: %R claimed 0x%lx bytes at 0x%lx\n",
+                      ex->node.r, grow, block_end);
+            ex->allocated += grow;
+            grown = grow;
+        }
+    }
+    end = MIN(end, ex->node.r.start + ex->allocated);
+    if (end > ex->node.r.end) {
+        if (set_extent_length(f, ex, end - ex->node.r.start, m))
+            return end;
+        if (grown) {
+            tfs_debug("inflate_extent: %R releasing 0x%lx bytes at 0x%lx\n",
+                      ex->node.r, grown, block_end);
+            id_heap_set_area(storage, block_end, grown, true, false);
+            ex->allocated -= grown;
+        }
+    }
+    return ex->node.r.end;
+}
+
 closure_function(2, 1, void, filesystem_write_meta_complete,
                  range, q, io_status_handler, ish,
                  status, s)
@@ -673,15 +842,25 @@ void filesystem_write(filesystem fs, tuple t, buffer b, u64 offset, io_status_ha
             range hole = irange(curr, limit);
             range fill = range_intersection(q, hole);
 
-            /* XXX optimization: check for a preceding extent and
-               inflate if possible */
-
-            /* just doing min-sized extents for now */
-            s64 remain = range_span(fill);
+            while (curr < fill.end) {
+                /* Inflate a preceding, adjoining extent into the hole
+                   if its allocation, or the storage following it,
+                   allows. Sequential writes then extend one large
+                   extent and its record rather than creating an
+                   extent for each write. */
+                rmnode prev = curr > 0 ? rangemap_lookup(f->extentmap, curr - 1) : INVALID_ADDRESS;
+                if (prev != INVALID_ADDRESS) {
+                    u64 end = inflate_extent(f, (extent)prev, fill.end, m_meta);
+                    if (end > curr) {
+                        tfs_debug("   inflated extent to %R\n", prev->r);
+                        fs_write_extent_chunked(f->fs, b, m_data, q, prev, irange(curr, end));
+                        curr = end;
+                        continue;
+                    }
+                }
 
-            do {
                 /* create_extent will allocate a minimum of pagesize */
-                u64 length = MIN(MAX_EXTENT_SIZE, remain);
+                u64 length = MIN(MAX_EXTENT_SIZE, fill.end - curr);
                 range r = irange(curr, curr + length);
                 extent ex = create_extent(f, r, m_meta);
                 if (ex == INVALID_ADDRESS) {
@@ -691,8 +870,7 @@ void filesystem_write(filesystem fs, tuple t, buffer b, u64 offset, io_status_ha
                 tfs_debug("   writing new extent %R\n", r);
                 fs_write_extent(f->fs, b, m_data, q, &ex->node);
                 curr += length;
-                remain -= length;
-            } while (remain > 0);
+            }
         }
 
         if (node != INVALID_ADDRESS) {
@@ -815,6 +993,13 @@ static void fs_set_dir_entry(filesystem fs, tuple parent, symbol name_sym,
     }
 }
 
+typedef struct transient_entry {
+    tuple c;
+    symbol name;
+    tuple entry;
+    boolean detached;
+} *transient_entry;
+
 static void do_mkentry(filesystem fs, tuple parent, const char *name, tuple entry, boolean persistent)
 {
     symbol name_sym = sym_this(name);
@@ -825,11 +1010,47 @@ static void do_mkentry(filesystem fs, tuple parent, const char *name, tuple entr
     if (persistent) {
         filesystem_write_eav(fs, c, name_sym, entry, ignore_status);
         filesystem_flush_log(fs);
+    } else {
+        /* remembered so as to be left out of log snapshots */
+        transient_entry te = allocate(fs->h, sizeof(struct transient_entry));
+        assert(te != INVALID_ADDRESS);
+        te->c = c;
+        te->name = name_sym;
+        te->entry = entry;
+        te->detached = false;
+        vector_push(fs->transient, te);
     }
 
     fixup_directory(parent, entry);
 }
 
+/* Strip the tree of everything that must not be written in the log -
+   non-persistent entries and the . and .. directory entries - so that
+   it may be encoded as a whole. Undone by filesystem_snapshot_end(). */
+void filesystem_snapshot_begin(filesystem fs)
+{
+    transient_entry te;
+    vector_foreach(fs->transient, te) {
+        if (table_find(te->c, te->name) == te->entry) {
+            table_set(te->c, te->name, 0);
+            te->detached = true;
+        }
+    }
+    cleanup_directory(fs->root);
+}
+
+void filesystem_snapshot_end(filesystem fs)
+{
+    transient_entry te;
+    vector_foreach(fs->transient, te) {
+        if (te->detached) {
+            table_set(te->c, te->name, te->entry);
+            te->detached = false;
+        }
+    }
+    fixup_directory(fs->root, fs->root);
+}
+
 fs_status filesystem_mkentry(filesystem fs, tuple cwd, const char *fp, tuple entry, boolean persistent, boolean recursive)
 {
     tuple parent = cwd ? cwd : fs->root;
@@ -1001,6 +1222,7 @@ void create_filesystem(heap h,
     fs->h = h;
     fs->w = write;
     fs->root = root;
+    fs->transient = allocate_vector(h, 8);
     fs->alignment = alignment;
     fs->blocksize = SECTOR_SIZE;
 #ifndef BOOT
@@ -26,16 +26,21 @@ typedef struct filesystem {
     block_io w;
     log tl;
     tuple root;
+    vector transient;   // non-persistent directory entries
     bytes blocksize;
 } *filesystem;
 
 void ingest_extent(fsfile f, symbol foff, tuple value);
+void coalesce_extents(fsfile f);
+void filesystem_snapshot_begin(filesystem fs);
+void filesystem_snapshot_end(filesystem fs);
 
 log log_create(heap h, filesystem fs, status_handler sh);
 void log_write(log tl, tuple t, status_handler sh);
 void log_write_eav(log tl, tuple e, symbol a, value v, status_handler sh);
 
 #define INITIAL_LOG_SIZE (512*KB)
+#define LOG_EXTENSION_SIZE (256*KB)
 void read_log(log tl, u64 offset, u64 size, status_handler sh);
 void log_flush(log tl);
 boolean log_flush_complete(log tl, status_handler completion);
@@ -11,100 +11,311 @@
 #define TUPLE_AVAILABLE 2
 #define END_OF_SEGMENT 3
 
+#define LOG_EXTENSION_LINK 4
+
+/* room kept at the end of a segment for an extension link and END_OF_LOG */
+#define LOG_LINK_RESERVE 32
+
+/* The log is a chain of segments, starting with the one at the start
+   of the filesystem. When a segment fills, a new one is allocated
+   from storage and linked from the end of the current one. */
+typedef struct log_segment {
+    buffer b;                   /* staged contents; 0 once retired and written */
+    u64 offset;                 /* on disk, in bytes */
+    u64 size;
+    u64 flushed;                /* bytes of b written to disk */
+} *log_segment;
+
 typedef struct log {
     filesystem fs;
-    u64 remainder;
-    buffer staging;
-    vector completions;
+    vector segments;            /* chain, head first */
+    log_segment current;        /* segment taking new records */
+    buffer record;              /* scratch for encoding a record */
+    vector completions;         /* waiting on the next flush */
+    vector flush_completions;   /* waiting on the flush in flight */
     table dictionary;
-    u64 offset;
+    tuple root;                 /* first tuple in the log */
+    u64 log_bytes;              /* total record bytes in the chain */
+    u64 compacted_bytes;        /* size of the log after last compaction */
     int dirty;              /* cas boolean */
+    boolean flushing;
     heap h;
 } *log;
 
+static log_segment log_segment_create(log tl, buffer b, u64 offset, u64 size)
+{
+    log_segment seg = allocate(tl->h, sizeof(struct log_segment));
+    if (seg == INVALID_ADDRESS)
+        halt("out of memory\n");
+    seg->b = b;
+    seg->offset = offset;
+    seg->size = size;
+    seg->flushed = 0;
+    vector_push(tl->segments, seg);
+    tl->current = seg;
+    return seg;
+}
+
+static void log_segment_deallocate(log tl, log_segment seg)
+{
+    if (seg->b)
+        deallocate_buffer(seg->b);
+    deallocate(tl->h, seg, sizeof(struct log_segment));
+}
+
 closure_function(1, 1, void, log_write_completion,
-                 vector, v,
+                 log, tl,
                  status, s)
 {
-    // reclaim the buffer now and the vector...make it a whole thing
+    log tl = bound(tl);
+    vector v = tl->flush_completions;
     status_handler i;
-    int len = vector_length(bound(v));
+    int len = vector_length(v);
     for (int count = 0; count < len; count++) {
-        i = vector_delete(bound(v), 0);
+        i = vector_delete(v, 0);
         apply(i, s);
     }
+
+    /* records added while the flush was in flight go out together */
+    tl->flushing = false;
+    if (tl->dirty)
+        log_flush(tl);
     closure_finish();
 }
 
-// xxx  currently we cant take writes during the flush
-
 /* XXX it's not right to just stick SECTOR_{SIZE,OFFSET} everywhere...
    and add block_log2 to fs */
-range log_block_range(log tl, u64 length)
+static range log_block_range(log tl, log_segment seg, u64 start, u64 end)
+{
+    return irange((seg->offset + start) >> SECTOR_OFFSET,
+                  (seg->offset + pad(end, tl->fs->blocksize)) >> SECTOR_OFFSET);
+}
+
+/* Write the blocks of a segment that changed since it was last
+   written. The current segment is terminated with END_OF_LOG, which
+   the next record will overwrite. */
+static void log_segment_write(log tl, log_segment seg, status_handler sh)
 {
-    return irange(tl->offset >> SECTOR_OFFSET,
-                  (tl->offset + pad(length, tl->fs->blocksize)) >> SECTOR_OFFSET);
+    buffer b = seg->b;
+    u64 start = seg->flushed & ~(tl->fs->blocksize - 1);
+    boolean current = seg == tl->current;
+    if (current)
+        push_u8(b, END_OF_LOG);
+    range r = log_block_range(tl, seg, start, b->end);
+    if (current)
+        b->end -= 1;
+    seg->flushed = b->end;
+    tlog_debug("%s: segment at 0x%lx, blocks %R\n", __func__, seg->offset, r);
+    apply(tl->fs->w, b->contents + start, r, sh);
 }
 
-/* XXX we're just writing the whole log - instead write only from
-   block of buffer start forward */
+closure_function(3, 1, void, log_segment_write_complete,
+                 log, tl, int, index, status_handler, done,
+                 status, s)
+{
+    log tl = bound(tl);
+    int index = bound(index);
+    status_handler done = bound(done);
+    closure_finish();
+    if (is_ok(s)) {
+        log_segment seg = vector_get(tl->segments, index);
+        if (seg != tl->current && seg->flushed == seg->b->end) {
+            deallocate_buffer(seg->b);
+            seg->b = 0;
+        }
+
+        /* Write any retired segments, newest first, so that a link
+           is never on disk ahead of the segment it points to. */
+        while (--index >= 0) {
+            seg = vector_get(tl->segments, index);
+            if (seg->b && seg->flushed < seg->b->end) {
+                log_segment_write(tl, seg, closure(tl->h, log_segment_write_complete,
+                                                   tl, index, done));
+                return;
+            }
+        }
+    }
+    apply(done, s);
+}
+
+static void log_flush_segments(log tl, status_handler done)
+{
+    vector v = tl->flush_completions;
+    tl->flush_completions = tl->completions;
+    tl->completions = v;
+    int index = vector_length(tl->segments) - 1;
+    log_segment_write(tl, tl->current, closure(tl->h, log_segment_write_complete,
+                                               tl, index, done));
+}
+
+#ifndef BOOT
+closure_function(2, 1, void, log_compact_complete,
+                 log, tl, vector, old,
+                 status, s)
+{
+    log tl = bound(tl);
+    vector old = bound(old);
+    log_segment seg;
+    if (is_ok(s)) {
+        /* the old chain is no longer referenced from the log head */
+        vector_foreach(old, seg) {
+            deallocate_u64(tl->fs->storage, seg->offset, seg->size);
+            log_segment_deallocate(tl, seg);
+        }
+    } else {
+        msg_err("log compaction failed: %v\n", s);
+        vector_foreach(old, seg)
+            log_segment_deallocate(tl, seg);
+    }
+    deallocate_vector(old);
+    apply(closure(tl->h, log_write_completion, tl), s);
+    closure_finish();
+}
+
+/* Replace the log with a single segment holding an encoding of the
+   live tuple tree, discarding the history of updates to it. The new
+   segment is written first, followed by a link to it at the log
+   head, so a crash at any point leaves a complete log. */
+static boolean log_compact(log tl)
+{
+    filesystem fs = tl->fs;
+    heap h = tl->h;
+    if (!tl->root)
+        return false;
+
+    table dictionary = allocate_table(h, identity_key, pointer_equal);
+    buffer b = allocate_buffer(h, tl->compacted_bytes + PAGESIZE);
+    filesystem_snapshot_begin(fs);
+    push_u8(b, TUPLE_AVAILABLE);
+    encode_tuple(b, dictionary, tl->root);
+    filesystem_snapshot_end(fs);
+
+    /* resident file lengths are more recent than those in the tuples */
+    table_foreach(fs->files, t, f) {
+        if (!table_find(dictionary, t))
+            continue;           /* deleted */
+        push_u8(b, TUPLE_AVAILABLE);
+        encode_eav(b, dictionary, t, sym(filelength),
+                   value_from_u64(h, fsfile_get_length((fsfile)f)));
+    }
+
+    u64 length = buffer_length(b);
+    u64 size = U64_FROM_BIT(find_order(length + LOG_EXTENSION_SIZE));
+    u64 offset = allocate_u64(fs->storage, size);
+    if (offset == u64_from_pointer(INVALID_ADDRESS)) {
+        msg_err("unable to allocate storage for log compaction\n");
+        deallocate_buffer(b);
+        deallocate_table(dictionary);
+        return false;
+    }
+    tlog_debug("%s: %ld bytes -> %ld bytes at 0x%lx\n", __func__, tl->log_bytes, length, offset);
+
+    /* All staged records are covered by the new encoding, and the
+       old chain stays on disk until the head link is replaced. */
+    vector old = tl->segments;
+    log_segment head = vector_delete(old, 0);
+    if (head->b)
+        deallocate_buffer(head->b);
+    head->b = allocate_buffer(h, SECTOR_SIZE);
+    head->flushed = 0;
+    push_u8(head->b, LOG_EXTENSION_LINK);
+    push_varint(head->b, offset);
+    push_varint(head->b, size);
+    tl->segments = allocate_vector(h, vector_length(old) + 1);
+    vector_push(tl->segments, head);
+
+    buffer staging = allocate_buffer(h, size);
+    push_buffer(staging, b);
+    deallocate_buffer(b);
+    log_segment_create(tl, staging, offset, size);
+    deallocate_table(tl->dictionary);
+    tl->dictionary = dictionary;
+    tl->log_bytes = tl->compacted_bytes = length;
+
+    log_flush_segments(tl, closure(h, log_compact_complete, tl, old));
+    return true;
+}
+#endif
+
 void log_flush(log tl)
 {
+    /* Only one flush is in flight at a time; subsequent requests are
+       batched into a single flush once it completes. */
+    if (tl->flushing)
+        return;
     if (!__sync_bool_compare_and_swap(&tl->dirty, 1, 0))
         return;
+    tl->flushing = true;
 
     tlog_debug("log_flush: log %p dirty\n", tl);
-    buffer b = tl->staging;
-    push_u8(b, END_OF_LOG);
-#ifdef TLOG_DEBUG
-    u64 z = tl->staging->end;
-    tl->staging->start = 0;
-    tl->staging->end = 1024;
-    rprintf("staging contains:\n%X\n", b);
-    tl->staging->end = z;
+#ifndef BOOT
+    /* Compact once the log has grown to twice its live size. */
+    if (tl->log_bytes > MAX(INITIAL_LOG_SIZE, tl->compacted_bytes * 2) && log_compact(tl))
+        return;
 #endif
-
-    void * buf = b->contents;
-    u64 length = b->end;
-    range r = log_block_range(tl, length);
-    apply(tl->fs->w, buf, r, closure(tl->h, log_write_completion, tl->completions));
-    b->end -= 1;                /* next write removes END_OF_LOG */
-//    rprintf("was %d now %d\n", b->start, b->end);
-//    b->start = b->end;          /* pick up next write here */
+    log_flush_segments(tl, closure(tl->h, log_write_completion, tl));
 }
 
 boolean log_flush_complete(log tl, status_handler completion)
 {
     if (!tl->dirty) {
-        return true;
+        if (!tl->flushing)
+            return true;
+        vector_push(tl->flush_completions, completion);
+        return false;
     }
     vector_push(tl->completions, completion);
     log_flush(tl);
     return false;
 }
 
-void log_write_eav(log tl, tuple e, symbol a, value v, status_handler sh)
+/* Chain a new segment large enough for a record of the given length. */
+static void log_extend(log tl, u64 length)
 {
-    tlog_debug("log_write_eav: tl %p, e %p (%t), a \"%b\", v %v\n", tl, e, e, symbol_string(a), v);
-    /* XXX make log extendable */
-    if (tl->staging->end > INITIAL_LOG_SIZE - 32)
+    u64 size = MAX(LOG_EXTENSION_SIZE, U64_FROM_BIT(find_order(length + LOG_LINK_RESERVE)));
+    u64 offset = allocate_u64(tl->fs->storage, size);
+    if (offset == u64_from_pointer(INVALID_ADDRESS))
         halt("log full\n");
-    push_u8(tl->staging, TUPLE_AVAILABLE);
-    encode_eav(tl->staging, tl->dictionary, e, a, v);
+    tlog_debug("%s: new segment at 0x%lx, size %ld\n", __func__, offset, size);
+    buffer b = tl->current->b;
+    push_u8(b, LOG_EXTENSION_LINK);
+    push_varint(b, offset);
+    push_varint(b, size);
+    log_segment_create(tl, allocate_buffer(tl->h, size), offset, size);
+}
+
+/* Append the encoded record to the current segment. Segments are
+   never resized, as their buffers may be under I/O. */
+static void log_append(log tl, status_handler sh)
+{
+    buffer r = tl->record;
+    u64 length = buffer_length(r);
+    if (tl->current->b->end + length + LOG_LINK_RESERVE > tl->current->size)
+        log_extend(tl, length);
+    push_buffer(tl->current->b, r);
+    buffer_clear(r);
+    tl->log_bytes += length;
     vector_push(tl->completions, sh);
     tl->dirty = true;
 }
 
+void log_write_eav(log tl, tuple e, symbol a, value v, status_handler sh)
+{
+    tlog_debug("log_write_eav: tl %p, e %p (%t), a \"%b\", v %v\n", tl, e, e, symbol_string(a), v);
+    push_u8(tl->record, TUPLE_AVAILABLE);
+    encode_eav(tl->record, tl->dictionary, e, a, v);
+    log_append(tl, sh);
+}
+
 void log_write(log tl, tuple t, status_handler sh)
 {
     tlog_debug("log_write: tl %p, t %p (%t)\n", tl, t, t);
-    if (tl->staging->end > INITIAL_LOG_SIZE - 32)
-        halt("log full\n");
-    push_u8(tl->staging, TUPLE_AVAILABLE);
+    if (!tl->root)
+        tl->root = t;
+    push_u8(tl->record, TUPLE_AVAILABLE);
     // this should be incremental on root!
-    encode_tuple(tl->staging, tl->dictionary, t);
-    vector_push(tl->completions, sh);
-    tl->dirty = true;
+    encode_tuple(tl->record, tl->dictionary, t);
+    log_append(tl, sh);
 }
 
 closure_function(2, 1, void, log_read_complete,
@@ -113,7 +324,8 @@ closure_function(2, 1, void, log_read_complete,
 {
     log tl = bound(tl);
     status_handler sh = bound(sh);
-    buffer b = tl->staging;
+    log_segment seg = tl->current;
+    buffer b = seg->b;
     u8 frame = 0;
 
     tlog_debug("log_read_complete: buffer len %d, status %v\n", buffer_length(b), s);
@@ -162,12 +374,32 @@ closure_function(2, 1, void, log_read_complete,
         }
     }
 
+    if (frame == LOG_EXTENSION_LINK) {
+        u64 offset = pop_varint(b);
+        u64 size = pop_varint(b);
+        tlog_debug("-> extension segment at 0x%lx, size %ld\n", offset, size);
+        tl->log_bytes += b->start;
+        deallocate_buffer(b);
+        seg->b = 0;
+#ifndef BOOT
+        if (!id_heap_set_area(tl->fs->storage, offset, size, true, true))
+            msg_err("unable to reserve log segment at 0x%lx, size %ld\n", offset, size);
+#endif
+        read_log(tl, offset, size, sh);
+        closure_finish();
+        return;
+    }
+
     if (frame == END_OF_LOG) {
         *(u8*)(b->contents + b->start - 1) = END_OF_SEGMENT;
     }
     /* mark end of log */
     b->end = b->start;
     b->start = 0;
+    /* rewrite from the end marker on the next flush */
+    seg->flushed = b->end > 0 ? b->end - 1 : 0;
+    tl->log_bytes += b->end;
+    tl->compacted_bytes = tl->log_bytes;
     tlog_debug("   log parse finished, end now at %d\n", b->end);
 
     /* XXX this will only work for reading the log a single time
@@ -178,10 +410,15 @@ closure_function(2, 1, void, log_read_complete,
             ingest_extent((fsfile)f, off, e);
         }
     }
+    table_foreach(tl->fs->extents, t, f) {
+        (void)t;
+        coalesce_extents((fsfile)f);
+    }
 
     // not sure we should be passing the root.. anyways, splat the
     // log root onto the given root
     table logroot = (table)table_find(tl->dictionary, pointer_from_u64(1));
+    tl->root = logroot;
     if (logroot) {
         // XXX prob better way
         table_foreach (logroot, k, v) {
@@ -208,11 +445,11 @@ closure_function(2, 1, void, log_read_complete,
 
 void read_log(log tl, u64 offset, u64 size, status_handler sh)
 {
-    tl->staging = allocate_buffer(tl->h, size);
+    log_segment seg = log_segment_create(tl, allocate_buffer(tl->h, size), offset, size);
     status_handler tlc = closure(tl->h, log_read_complete, tl, sh);
-    range r = log_block_range(tl, tl->staging->length);
+    range r = log_block_range(tl, seg, 0, size);
 //    rprintf("blocks %R\n", r);
-    apply(tl->fs->r, tl->staging->contents, r, tlc);
+    apply(tl->fs->r, seg->b->contents, r, tlc);
 }
 
 log log_create(heap h, filesystem fs, status_handler sh)
@@ -220,12 +457,17 @@ log log_create(heap h, filesystem fs, status_handler sh)
     tlog_debug("log_create: heap %p, fs %p, sh %p\n", h, fs, sh);
     log tl = allocate(h, sizeof(struct log));
     tl->h = h;
-    tl->offset = 0;
     tl->fs = fs;
+    tl->segments = allocate_vector(h, 1);
+    tl->current = 0;
+    tl->record = allocate_buffer(h, 256);
     tl->completions = allocate_vector(h, 10);
+    tl->flush_completions = allocate_vector(h, 10);
     tl->dictionary = allocate_table(h, identity_key, pointer_equal);
+    tl->root = 0;
+    tl->log_bytes = tl->compacted_bytes = 0;
     tl->dirty = false;
-    tl->staging = 0;
+    tl->flushing = false;
     fs->tl = tl;
     read_log(tl, 0, INITIAL_LOG_SIZE, sh);
     return tl;
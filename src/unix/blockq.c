@@ -81,17 +81,38 @@ struct blockq {
     sysreturn completion_rv;
 };
 
-typedef struct blockq_item {
+typedef struct blockq_item *blockq_item;
+
+declare_closure_struct(2, 0, void, blockq_item_timeout,
+                       blockq, bq, blockq_item, bi);
+
+struct blockq_item {
     thread t;           /* waiting thread */
     timer timeout;      /* timer for this item (could be zero) */
+    closure_struct(blockq_item_timeout, timeout_handler);
     blockq_action a;    /* action to test for resource avail. */
     struct list l;      /* embedding on blockq->waiters_head */
-} *blockq_item;
+    timestamp queued;   /* for the wait latency histogram */
+};
+
+static struct histogram blockq_wait_latency;
+
+boolean blockq_init(unix_heaps uh)
+{
+    uh->blockq_item_cache = allocate_objcache(heap_general((kernel_heaps)uh),
+                                              heap_backed((kernel_heaps)uh),
+                                              sizeof(struct blockq_item), PAGESIZE);
+    if (uh->blockq_item_cache == INVALID_ADDRESS)
+        return false;
+    objcache_set_name(uh->blockq_item_cache, "blockq_item");
+    histogram_init(&blockq_wait_latency, "blockq", "wait");
+    return true;
+}
 
 static inline void free_blockq_item(blockq bq, blockq_item bi)
 {
     list_delete(&bi->l);
-    deallocate(bq->h, bi, sizeof(struct blockq_item));
+    unix_cache_free(get_unix_heaps(), blockq_item, bi);
 }
 
 static void blockq_item_finish(blockq bq, blockq_item bi)
@@ -101,6 +122,7 @@ static void blockq_item_finish(blockq bq, blockq_item bi)
 
     if (bi->timeout)
         remove_timer(bi->timeout);
+    histogram_record_since(&blockq_wait_latency, bi->queued);
 
     if (bq->completion) {
         io_completion completion = bq->completion;
@@ -154,8 +176,8 @@ static void blockq_apply_bi_locked(blockq bq, blockq_item bi, u64 flags)
  * Invoke its action and remove it from the list of waiters,
  * if applicable
  */
-closure_function(2, 0, void, blockq_item_timeout,
-                 blockq, bq, blockq_item, bi)
+define_closure_function(2, 0, void, blockq_item_timeout,
+                        blockq, bq, blockq_item, bi)
 {
     blockq bq = bound(bq);
     blockq_item bi = bound(bi);
@@ -168,7 +190,6 @@ closure_function(2, 0, void, blockq_item_timeout,
     /* XXX take irqsafe spinlock */
     blockq_apply_bi_locked(bq, bi, BLOCKQ_ACTION_BLOCKED | BLOCKQ_ACTION_TIMEDOUT);
     /* XXX release lock */
-    closure_finish();
 }
 
 /*
@@ -226,8 +247,7 @@ sysreturn blockq_check_timeout(blockq bq, thread t, blockq_action a, boolean in_
         return rv;
     }
 
-    // XXX make cache
-    blockq_item bi = allocate(bq->h, sizeof(struct blockq_item));
+    blockq_item bi = unix_cache_alloc(get_unix_heaps(), blockq_item);
     if (bi == INVALID_ADDRESS) {
         msg_err("unable to allocate blockq_item\n");
         return -EAGAIN;
@@ -239,10 +259,10 @@ sysreturn blockq_check_timeout(blockq bq, thread t, blockq_action a, boolean in_
 
     if (timeout > 0) {
         bi->timeout = register_timer(timeout, id,
-                                     closure(bq->h, blockq_item_timeout, bq, bi));
+                                     init_closure(&bi->timeout_handler, blockq_item_timeout, bq, bi));
         if (bi->timeout == INVALID_ADDRESS) {
             msg_err("failed to allocate blockq timer\n");
-            deallocate(bq->h, bi, sizeof(struct blockq_item));
+            unix_cache_free(get_unix_heaps(), blockq_item, bi);
             return -EAGAIN;
         }
     } else {
@@ -250,6 +270,7 @@ sysreturn blockq_check_timeout(blockq bq, thread t, blockq_action a, boolean in_
     }
 
     blockq_debug("queuing bi %p, a %p, tid %d\n", bi, bi->a, bi->t->tid);
+    bi->queued = now(CLOCK_ID_MONOTONIC);
     list_insert_before(&bq->waiters_head, &bi->l);
     t->blocked_on = bq;
 
@@ -315,7 +336,8 @@ int blockq_transfer_waiters(blockq dest, blockq src, int n)
         if (bi->timeout) {
             timestamp remain = remove_timer(bi->timeout);
             bi->timeout = remain == 0 ? 0 :
-                register_timer(remain, CLOCK_ID_MONOTONIC, closure(dest->h, blockq_item_timeout, dest, bi));
+                register_timer(remain, CLOCK_ID_MONOTONIC,
+                               init_closure(&bi->timeout_handler, blockq_item_timeout, dest, bi));
         }
         list_delete(&bi->l);
         assert(bi->t->blocked_on == src);
@@ -132,80 +132,310 @@ void start_process(thread t, void *start)
     }
 }
 
-closure_function(0, 1, void, load_interp_fail,
+/* Only the ELF file and program headers, and the interpreter path if
+   any, are read before the program starts. PT_LOAD segments are mapped
+   as private file mappings and demand-paged through the page cache, so
+   exec time does not scale with the size of the image. */
+
+#define ELF_HEADER_READ_SIZE PAGESIZE
+
+/* Length of the file prefix holding the headers, as far as can be
+   determined from the bytes in b. */
+static u64 elf_headers_length(buffer b)
+{
+    if (buffer_length(b) < sizeof(Elf64_Ehdr))
+        return sizeof(Elf64_Ehdr);
+    Elf64_Ehdr *e = buffer_ref(b, 0);
+    u64 need = e->e_phoff + e->e_phnum * e->e_phentsize;
+    if (need > buffer_length(b))
+        return need;
+    foreach_phdr(e, p) {
+        if (p->p_type == PT_INTERP)
+            need = MAX(need, p->p_offset + p->p_filesz);
+    }
+    return need;
+}
+
+static void read_elf_headers(heap h, pagecache_node pn, u64 length, buffer_handler complete);
+
+closure_function(4, 2, void, elf_headers_read,
+                 heap, h, pagecache_node, pn, buffer, b, buffer_handler, complete,
+                 status, s, bytes, length)
+{
+    buffer b = bound(b);
+    if (!is_ok(s))
+        halt("failed to read ELF headers: %v\n", s);
+    u64 requested = b->length;
+    buffer_produce(b, length);
+    u64 need = elf_headers_length(b);
+    if (need > length) {
+        if (length < requested)
+            halt("ELF file truncated: headers need %ld bytes, file has %ld\n", need, length);
+        deallocate_buffer(b);
+        read_elf_headers(bound(h), bound(pn), need, bound(complete));
+    } else {
+        apply(bound(complete), b);
+    }
+    closure_finish();
+}
+
+static void read_elf_headers(heap h, pagecache_node pn, u64 length, buffer_handler complete)
+{
+    buffer b = allocate_buffer(h, length);
+    assert(b != INVALID_ADDRESS);
+    pagecache_read(pn, buffer_ref(b, 0), length, 0,
+                   closure(h, elf_headers_read, h, pn, b, complete));
+}
+
+closure_function(2, 2, void, elf_read_complete,
+                 buffer, b, status_handler, sh,
+                 status, s, bytes, length)
+{
+    if (bound(b))
+        buffer_produce(bound(b), length);
+    apply(bound(sh), s);
+    closure_finish();
+}
+
+closure_function(3, 2, void, elf_partial_page_read,
+                 u64, vaddr, u64, flags, status_handler, sh,
+                 status, s, bytes, length)
+{
+    /* mapped writable for the fill */
+    if ((bound(flags) & PAGE_WRITABLE) == 0)
+        update_map_flags(bound(vaddr), PAGESIZE, bound(flags));
+    apply(bound(sh), s);
+    closure_finish();
+}
+
+/* Map the PT_LOAD segments of e. Whole file pages are demand-paged from
+   pn and whole bss pages are demand-zeroed. A page holding both the end
+   of the file data and the start of bss is filled now, so that the bss
+   part is zero rather than whatever follows in the file. Any such
+   fills are joined to m. */
+static void map_elf_segments(process proc, pagecache_node pn, Elf64_Ehdr *e,
+                             u64 load_offset, merge m)
+{
+    kernel_heaps kh = (kernel_heaps)proc->uh;
+    foreach_phdr(e, p) {
+        if (p->p_type != PT_LOAD)
+            continue;
+        if (p->p_memsz < p->p_filesz)
+            halt("exec with p->p_memsz (%ld) < p->p_filesz (%ld)\n",
+                 p->p_memsz, p->p_filesz);
+
+        u64 vmflags = VMAP_FLAG_MMAP;
+        u64 flags = PAGE_USER;
+        if (p->p_flags & PF_X)
+            vmflags |= VMAP_FLAG_EXEC;
+        else
+            flags |= PAGE_NO_EXEC;
+        if (p->p_flags & PF_W) {
+            vmflags |= VMAP_FLAG_WRITABLE;
+            flags |= PAGE_WRITABLE;
+        }
+
+        u64 start = (p->p_vaddr & ~MASK(PAGELOG)) + load_offset;
+        u64 file_start = p->p_offset & ~MASK(PAGELOG);
+        u64 file_end = p->p_vaddr + load_offset + p->p_filesz;
+        u64 file_map_end = pad(file_end, PAGESIZE);
+        u64 mem_end = pad(p->p_vaddr + load_offset + p->p_memsz, PAGESIZE);
+        exec_debug("segment %R: file-backed to 0x%lx from offset 0x%lx, bss to 0x%lx\n",
+                   irange(start, mem_end), file_map_end, file_start, mem_end);
+
+        if (file_map_end > start) {
+            vmap vm = allocate_vmap(proc->vmaps, irange(start, file_map_end), vmflags);
+            assert(vm != INVALID_ADDRESS);
+            vm->cache_node = pn;
+            vm->file_base = start - file_start;
+        }
+
+        if ((file_end & MASK(PAGELOG)) && p->p_memsz > p->p_filesz) {
+            u64 page = file_end & ~MASK(PAGELOG);
+            u64 paddr = allocate_u64(heap_physical(kh), PAGESIZE);
+            assert(paddr != INVALID_PHYSICAL);
+            map(page, paddr, PAGESIZE, flags | PAGE_WRITABLE, heap_pages(kh));
+            zero(pointer_from_u64(page), PAGESIZE);
+            pagecache_read(pn, pointer_from_u64(page), file_end - page,
+                           file_start + (page - start),
+                           closure(heap_general(kh), elf_partial_page_read, page, flags,
+                                   apply_merge(m)));
+        }
+
+        if (mem_end > file_map_end)
+            assert(allocate_vmap(proc->vmaps, irange(file_map_end, mem_end), vmflags) != INVALID_ADDRESS);
+    }
+}
+
+
+/* Program symbols come from .symtab and its linked string table, read
+   in the background once the program has started. */
+closure_function(3, 1, void, exec_symbols_read,
+                 buffer, symtab, u64, entsize, buffer, strtab,
                  status, s)
 {
-    console("interp fail\n");
+    if (is_ok(s))
+        add_elf_syms_from_tables(bound(symtab), bound(entsize), bound(strtab));
+    else
+        msg_err("failed to read program symbols: %v\n", s);
+    deallocate_buffer(bound(symtab));
+    deallocate_buffer(bound(strtab));
     closure_finish();
-    halt("read interp failed %v\n", s);
 }
 
-closure_function(2, 4, void, exec_elf_map,
-                 process, p, kernel_heaps, kh,
-                 u64, vaddr, u64, paddr, u64, size, u64, flags)
+closure_function(4, 1, void, exec_section_headers_read,
+                 heap, h, pagecache_node, pn, buffer, shb, u64, shentsize,
+                 status, s)
 {
-    kernel_heaps kh = bound(kh);
-    u64 target = vaddr;
-    u64 vmflags = 0;
-    if ((flags & PAGE_NO_EXEC) == 0)
-        vmflags |= VMAP_FLAG_EXEC;
-    if (flags & PAGE_WRITABLE)
-        vmflags |= VMAP_FLAG_WRITABLE;
-
-    assert(allocate_vmap(bound(p)->vmaps, irange(target, target + size), vmflags) != INVALID_ADDRESS);
-    boolean is_bss = paddr == INVALID_PHYSICAL;
-    if (is_bss) {
-        /* bss */
-        paddr = allocate_u64(heap_physical(kh), size);
-        assert(paddr != INVALID_PHYSICAL);
+    heap h = bound(h);
+    pagecache_node pn = bound(pn);
+    buffer shb = bound(shb);
+    u64 shentsize = bound(shentsize);
+    u64 shnum = buffer_length(shb) / shentsize;
+    Elf64_Shdr *symtab = 0, *strtab = 0;
+
+    if (!is_ok(s)) {
+        msg_err("failed to read program section headers: %v\n", s);
+        goto out;
     }
-    map(target, paddr, size, flags | PAGE_USER, heap_pages(kh));
-    if (is_bss) {
-        zero(pointer_from_u64(target), size);
+    for (u64 i = 0; i < shnum; i++) {
+        Elf64_Shdr *sh = buffer_ref(shb, i * shentsize);
+        if (sh->sh_type == SHT_SYMTAB && sh->sh_link < shnum) {
+            symtab = sh;
+            strtab = buffer_ref(shb, sh->sh_link * shentsize);
+            break;
+        }
+    }
+    if (!symtab) {
+        msg_warn("program symtab not found\n");
+        goto out;
     }
+
+    buffer symb = allocate_buffer(h, symtab->sh_size);
+    buffer strb = allocate_buffer(h, strtab->sh_size);
+    if (symb == INVALID_ADDRESS || strb == INVALID_ADDRESS) {
+        msg_err("failed to allocate symbol table buffers\n");
+        if (symb != INVALID_ADDRESS)
+            deallocate_buffer(symb);
+        if (strb != INVALID_ADDRESS)
+            deallocate_buffer(strb);
+        goto out;
+    }
+    merge m = allocate_merge(h, closure(h, exec_symbols_read, symb, symtab->sh_entsize, strb));
+    status_handler k = apply_merge(m);
+    pagecache_read(pn, buffer_ref(symb, 0), symtab->sh_size, symtab->sh_offset,
+                   closure(h, elf_read_complete, symb, apply_merge(m)));
+    pagecache_read(pn, buffer_ref(strb, 0), strtab->sh_size, strtab->sh_offset,
+                   closure(h, elf_read_complete, strb, apply_merge(m)));
+    apply(k, STATUS_OK);
+  out:
+    deallocate_buffer(shb);
+    closure_finish();
 }
 
+closure_function(2, 1, status, exec_symbols_ehdr_read,
+                 heap, h, pagecache_node, pn,
+                 buffer, b)
+{
+    heap h = bound(h);
+    Elf64_Ehdr *e = buffer_ref(b, 0);
+    u64 shentsize = e->e_shentsize;
+    u64 length = e->e_shnum * shentsize;
+    u64 offset = e->e_shoff;
+    deallocate_buffer(b);
+
+    if (length > 0 && shentsize >= sizeof(Elf64_Shdr)) {
+        buffer shb = allocate_buffer(h, length);
+        assert(shb != INVALID_ADDRESS);
+        status_handler sh = closure(h, exec_section_headers_read, h, bound(pn), shb, shentsize);
+        pagecache_read(bound(pn), buffer_ref(shb, 0), length, offset,
+                       closure(h, elf_read_complete, shb, sh));
+    }
+    closure_finish();
+    return STATUS_OK;
+}
+
+declare_closure_struct(4, 1, void, exec_elf_mapped,
+                       thread, t, void *, entry, pagecache_node, interp, pagecache_node, pn,
+                       status, s);
+declare_closure_function(4, 1, void, exec_elf_mapped,
+                         thread, t, void *, entry, pagecache_node, interp, pagecache_node, pn,
+                         status, s);
+
 closure_function(2, 1, status, load_interp_complete,
-                 thread, t, kernel_heaps, kh,
+                 thread, t, pagecache_node, pn,
                  buffer, b)
 {
     thread t = bound(t);
-    kernel_heaps kh = bound(kh);
+    kernel_heaps kh = (kernel_heaps)t->p->uh;
+    heap h = heap_general(kh);
+    Elf64_Ehdr *e = buffer_ref(b, 0);
 
-    exec_debug("interpreter load complete, reading elf\n");
+    exec_debug("interpreter headers read, mapping\n");
     u64 where = allocate_u64(heap_virtual_huge(kh), HUGE_PAGESIZE);
-    void * start = load_elf(b, where, stack_closure(exec_elf_map, t->p, kh));
-    exec_debug("starting process tid %d, start %p\n", t->tid, start);
-    start_process(t, start);
+    assert(where != INVALID_PHYSICAL);
+    void *start = pointer_from_u64(e->e_entry + where);
+    merge m = allocate_merge(h, closure(h, exec_elf_mapped, t, start, 0, 0));
+    status_handler k = apply_merge(m);
+    map_elf_segments(t->p, bound(pn), e, where, m);
+    deallocate_buffer(b);
+    apply(k, STATUS_OK);
     closure_finish();
     return STATUS_OK;
 }
 
-process exec_elf(buffer ex, process kp)
+/* All segments of the program (or the interpreter, once it has been
+   mapped in turn) are in place. */
+define_closure_function(4, 1, void, exec_elf_mapped,
+                        thread, t, void *, entry, pagecache_node, interp, pagecache_node, pn,
+                        status, s)
 {
-    // is process md always root?
-    // set cwd
-    unix_heaps uh = kp->uh;
-    kernel_heaps kh = (kernel_heaps)uh;
-    tuple root = kp->process_root;
-    filesystem fs = kp->fs;
-    process proc = create_process(uh, root, fs);
-    thread t = create_thread(proc);
+    thread t = bound(t);
+    heap h = heap_general((kernel_heaps)t->p->uh);
+    if (!is_ok(s))
+        halt("exec failed to map program: %v\n", s);
+
+    if (bound(interp)) {
+        exec_debug("reading interp...\n");
+        read_elf_headers(h, bound(interp), ELF_HEADER_READ_SIZE,
+                         closure(h, load_interp_complete, t, bound(interp)));
+    } else {
+        exec_debug("starting process tid %d, start %p\n", t->tid, bound(entry));
+        boot_phase_end(BOOT_PHASE_EXEC);
+        start_process(t, bound(entry));
+    }
+    if (bound(pn))
+        read_elf_headers(h, bound(pn), sizeof(Elf64_Ehdr),
+                         closure(h, exec_symbols_ehdr_read, h, bound(pn)));
+    closure_finish();
+}
+
+closure_function(2, 1, status, exec_elf_headers,
+                 thread, t, pagecache_node, pn,
+                 buffer, ex)
+{
+    thread t = bound(t);
+    process proc = t->p;
+    kernel_heaps kh = (kernel_heaps)proc->uh;
+    heap h = heap_general(kh);
+    tuple root = proc->process_root;
     tuple interp = 0;
+    pagecache_node interp_pn = 0;
     Elf64_Ehdr *e = (Elf64_Ehdr *)buffer_ref(ex, 0);
     boolean aslr = table_find(root, sym(noaslr)) == 0;
 
-    proc->brk = 0;
-
-    exec_debug("exec_elf enter\n");
+    exec_debug("exec_elf headers read\n");
 
     range load_range = irange(infinity, 0);
     foreach_phdr(e, p) {
         if (p->p_type == PT_INTERP) {
             char *n = (void *)e + p->p_offset;
-            interp = resolve_path(root, split(heap_general(kh), alloca_wrap_buffer(n, runtime_strlen(n)), '/'));
-            if (!interp) 
+            interp = resolve_path(root, split(h, alloca_wrap_buffer(n, runtime_strlen(n)), '/'));
+            if (!interp)
                 halt("couldn't find program interpreter %s\n", n);
+            interp_pn = pagecache_get_node(proc->fs, interp);
+            if (interp_pn == INVALID_ADDRESS)
+                halt("couldn't open program interpreter %s\n", n);
         } else if (p->p_type == PT_LOAD) {
             if (p->p_vaddr < load_range.start)
                 load_range.start = p->p_vaddr;
@@ -238,7 +468,13 @@ process exec_elf(buffer ex, process kp)
 
     exec_debug("offset 0x%lx, range after adjustment: %R, span 0x%lx\n",
                load_offset, load_range, range_span(load_range));
-    void * entry = load_elf(ex, load_offset, stack_closure(exec_elf_map, proc, kh));
+    void *entry = pointer_from_u64(e->e_entry + load_offset);
+
+    /* symbols are only loaded for static programs, as before */
+    merge m = allocate_merge(h, closure(h, exec_elf_mapped, t, entry, interp_pn,
+                                        interp ? 0 : bound(pn)));
+    status_handler k = apply_merge(m);
+    map_elf_segments(proc, bound(pn), e, load_offset, m);
 
     u64 brk_offset = aslr ? get_aslr_offset(PROCESS_HEAP_ASLR_RANGE) : 0;
     u64 brk = pad(load_range.end, PAGESIZE) + brk_offset;
@@ -249,18 +485,31 @@ process exec_elf(buffer ex, process kp)
     exec_debug("entry %p, brk %p (offset 0x%lx)\n", entry, proc->brk, brk_offset);
 
     build_exec_stack(proc, t, e, entry, load_range.start, root, aslr);
+    deallocate_buffer(ex);
+    apply(k, STATUS_OK);
+    closure_finish();
+    return STATUS_OK;
+}
 
-    if (interp) {
-        exec_debug("reading interp...\n");
-        filesystem_read_entire(fs, interp, heap_backed(kh),
-                               closure(heap_general(kh), load_interp_complete, t, kh),
-                               closure(heap_general(kh), load_interp_fail));
-        return proc;
-    }
+process exec_elf(tuple program, process kp)
+{
+    // is process md always root?
+    // set cwd
+    unix_heaps uh = kp->uh;
+    kernel_heaps kh = (kernel_heaps)uh;
+    heap h = heap_general(kh);
+    tuple root = kp->process_root;
+    filesystem fs = kp->fs;
+    process proc = create_process(uh, root, fs);
+    thread t = create_thread(proc);
 
-    exec_debug("starting process...\n");
-    start_process(t, entry);
-    add_elf_syms(ex);
-    return proc;    
-}
+    proc->brk = 0;
 
+    exec_debug("exec_elf enter\n");
+    boot_phase_begin(BOOT_PHASE_EXEC);
+    pagecache_node pn = pagecache_get_node(fs, program);
+    if (pn == INVALID_ADDRESS)
+        halt("exec_elf failed: unable to open program\n");
+    read_elf_headers(h, pn, ELF_HEADER_READ_SIZE, closure(h, exec_elf_headers, t, pn));
+    return proc;
+}
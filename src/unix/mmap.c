@@ -10,7 +10,8 @@
 
 static boolean vmap_attr_equal(vmap a, vmap b)
 {
-    return a->flags == b->flags;
+    return a->flags == b->flags && a->cache_node == b->cache_node &&
+        a->file_base == b->file_base;
 }
 
 static inline u64 page_map_flags(u64 vmflags)
@@ -24,10 +25,10 @@ static inline u64 page_map_flags(u64 vmflags)
 }
 
 static void
-deliver_segv(u64 vaddr, s32 si_code)
+deliver_fault_signal(thread t, u32 signo, u64 vaddr, s32 si_code)
 {
     struct siginfo s = {
-        .si_signo = SIGSEGV,
+        .si_signo = signo,
          /* man sigaction: "si_errno is generally unused on Linux" */
         .si_errno = 0,
         .si_code = si_code,
@@ -36,15 +37,259 @@ deliver_segv(u64 vaddr, s32 si_code)
         }
     };
 
+    deliver_signal_to_thread(t, &s);
+}
+
+static void
+deliver_segv(u64 vaddr, s32 si_code)
+{
     pf_debug("delivering SIGSEGV; vaddr 0x%lx si_code %s",
         vaddr, (si_code == SEGV_MAPERR) ? "SEGV_MAPPER" : "SEGV_ACCERR"
     );
 
-    deliver_signal_to_thread(current, &s); 
+    deliver_fault_signal(current, SIGSEGV, vaddr, si_code);
     thread_yield();
 }
 
-static boolean do_demand_page(vmap vm, u64 vaddr)
+closure_function(1, 1, void, dealloc_phys_page,
+                 heap, physical,
+                 range, r)
+{
+    /* pages shared with the page cache are only dereferenced */
+    if (pagecache_release_mapped_page(r.start))
+        return;
+    if (!id_heap_set_area(bound(physical), r.start, range_span(r), true, false))
+        msg_err("some of physical range %R not allocated in heap\n", r);
+}
+
+closure_function(0, 1, void, mark_cache_page_dirty,
+                 range, r)
+{
+    pagecache_dirty_mapped_page(r.start);
+}
+
+/* Stores through a shared file mapping go straight to the cached page
+   and are only seen in the page table entry. Hand them to the page
+   cache for writeback; this must precede any unmapping, after which
+   the page may be evicted as clean. If nodes is given, the page cache
+   node of each such mapping is added to it. */
+closure_function(2, 1, void, vmap_collect_dirty,
+                 range, q, vector, nodes,
+                 rmnode, node)
+{
+    vmap vm = (vmap)node;
+    if (!vm->cache_node || (vm->flags & VMAP_FLAG_SHARED) == 0)
+        return;
+    range ri = range_intersection(bound(q), node->r);
+    collect_dirty_pages(ri.start, range_span(ri), stack_closure(mark_cache_page_dirty));
+
+    vector nodes = bound(nodes);
+    if (!nodes)
+        return;
+    pagecache_node pn;
+    vector_foreach(nodes, pn) {
+        if (pn == vm->cache_node)
+            return;
+    }
+    vector_push(nodes, vm->cache_node);
+}
+
+static struct histogram fault_latency;
+
+closure_function(3, 1, void, pending_fault_complete,
+                 thread, t, u64, vaddr, timestamp, start,
+                 status, s)
+{
+    thread t = bound(t);
+    histogram_record_since(&fault_latency, bound(start));
+    if (t) {
+        if (!is_ok(s)) {
+            thread_log(t, "page fill failed for vaddr 0x%lx; delivering SIGBUS", bound(vaddr));
+            deliver_fault_signal(t, SIGBUS, bound(vaddr), BUS_ADRERR);
+        }
+        file_op_maybe_wake(t);
+    }
+    closure_finish();
+}
+
+/* Wait for a page fill issued on behalf of a thread faulting in user
+   mode. The thread resumes at the faulting instruction with the page
+   resident or a SIGBUS pending. */
+static void __attribute__((noreturn)) pending_fault_sleep(thread t)
+{
+    t->syscall = -1;
+    disable_interrupts();
+    if (!t->file_op_is_complete)
+        thread_sleep_uninterruptible();
+    /* completed synchronously; reschedule to pick up any signal */
+    enqueue(runqueue, t->run);
+    runloop();
+}
+
+/* Fail the syscall in progress with EFAULT after it touched a file
+   page that was not resident. Nothing is mapped at the page, so a
+   later user access faults in the real file data. */
+static void __attribute__((noreturn)) kernel_fault_abort_syscall(thread t, u64 vaddr)
+{
+    thread_log(t, "file page at vaddr 0x%lx not resident in syscall; returning EFAULT", vaddr);
+    set_syscall_error(t, EFAULT);
+    t->syscall = -1;
+    disable_interrupts();
+    enqueue(runqueue, t->run);
+    runloop();
+}
+
+static boolean demand_file_page(vmap vm, u64 vaddr, context frame, boolean write,
+                                timestamp start)
+{
+    u64 vaddr_aligned = vaddr & ~MASK(PAGELOG);
+    u64 offset = vaddr_aligned - vm->file_base;
+    pagecache_node pn = vm->cache_node;
+
+    /* Shared mappings map the cached page directly. Private mappings
+       share it read-only until written, when they get a copy. */
+    u64 flags = page_map_flags(vm->flags);
+    boolean copy = false;
+    if ((vm->flags & VMAP_FLAG_SHARED) == 0) {
+        if (write)
+            copy = true;
+        else
+            flags &= ~PAGE_WRITABLE;
+    }
+
+    /* A fill can only be waited on from user context. Syscalls that
+       access user buffers after taking effect fault those buffers in
+       beforehand (see fault_in_user_range), so a kernel fault here is
+       either on a page that is already resident or is a stray access,
+       which fails the syscall. The fill still goes ahead to warm the
+       cache. */
+    boolean user = (frame[FRAME_ERROR_CODE] & FRAME_ERROR_PF_US) != 0;
+    thread t = user ? current : 0;
+    heap h = heap_general(get_kernel_heaps());
+    status_handler complete = closure(h, pending_fault_complete, t, vaddr, start);
+    if (complete == INVALID_ADDRESS) {
+        msg_err("failed to allocate fault completion\n");
+        return false;
+    }
+
+    if (t)
+        file_op_begin(t);
+    if (pagecache_map_page(pn, offset, vaddr_aligned, flags, copy, 1, complete)) {
+        deallocate_closure(complete);
+        histogram_record_since(&fault_latency, start);
+        return true;
+    }
+
+    if (!t) {
+        if (is_syscall_context(frame))
+            kernel_fault_abort_syscall(current, vaddr);
+        msg_err("file page at vaddr 0x%lx not resident in kernel access outside of syscall\n",
+                vaddr);
+        return false;
+    }
+    pf_debug("waiting on fill for vaddr 0x%lx, offset 0x%lx", vaddr, offset);
+    pending_fault_sleep(t);
+}
+
+closure_function(2, 1, void, fault_in_complete,
+                 thread, t, timestamp, start,
+                 status, s)
+{
+    thread t = bound(t);
+    histogram_record_since(&fault_latency, bound(start));
+    if (is_ok(s)) {
+        syscall_restart(t);
+    } else {
+        thread_log(t, "page fill failed for user buffer; returning EFAULT");
+        set_syscall_error(t, EFAULT);
+    }
+    file_op_maybe_wake(t);
+    closure_finish();
+}
+
+closure_function(3, 1, void, fault_in_vmap,
+                 range, q, boolean, write, boolean *, waiting,
+                 rmnode, node)
+{
+    vmap vm = (vmap)node;
+    if (!vm->cache_node || *bound(waiting))
+        return;
+    range ri = range_intersection(bound(q), node->r);
+    u64 file_end = vm->file_base + pad(pagecache_node_length(vm->cache_node), PAGESIZE);
+    ri.end = MIN(ri.end, file_end);
+
+    u64 flags = page_map_flags(vm->flags);
+    boolean copy = false;
+    if ((vm->flags & VMAP_FLAG_SHARED) == 0) {
+        if (bound(write))
+            copy = true;
+        else
+            flags &= ~PAGE_WRITABLE;
+    }
+
+    thread t = current;
+    heap h = heap_general(get_kernel_heaps());
+    for (u64 va = ri.start; va < ri.end; va += PAGESIZE) {
+        if (physical_from_virtual(pointer_from_u64(va)) != INVALID_PHYSICAL)
+            continue;
+        status_handler complete = closure(h, fault_in_complete, t, now(CLOCK_ID_MONOTONIC));
+        if (complete == INVALID_ADDRESS)
+            return;
+        file_op_begin(t);
+        if (pagecache_map_page(vm->cache_node, va - vm->file_base, va, flags, copy,
+                               (ri.end - va) >> PAGELOG, complete)) {
+            deallocate_closure(complete);
+            continue;
+        }
+        /* complete sets the return value, or arranges for a restart */
+        *bound(waiting) = true;
+        return;
+    }
+}
+
+/* Make the file-backed pages of a user buffer resident and mapped
+   before a syscall starts to act on it, so that the kernel never
+   faults on a page that must be read from storage partway through.
+   Returns true if the syscall may go ahead. Otherwise the thread has
+   waited on a fill, and the syscall must return the value in the
+   thread frame, which will either reissue it or report EFAULT. */
+boolean fault_in_user_range(void *addr, u64 length, boolean write)
+{
+    u64 start = u64_from_pointer(addr);
+    u64 end = start + length;
+    if (length == 0 || end < start)
+        return true;            /* nothing to do, or left for the syscall to reject */
+    range q = irange(start & ~MASK(PAGELOG), pad(end, PAGESIZE));
+    boolean waiting = false;
+    rangemap_range_lookup(current->p->vmaps, q, stack_closure(fault_in_vmap, q, write, &waiting));
+    if (!waiting)
+        return true;
+    file_op_maybe_sleep(current);
+    return false;
+}
+
+/* Hand every store made through the process's shared file mappings to
+   the page cache, ahead of a sync of all files. */
+void mmap_collect_dirty(process p)
+{
+    range q = irange(0, infinity);
+    rangemap_range_lookup(p->vmaps, q, stack_closure(vmap_collect_dirty, q, 0));
+}
+
+boolean fault_in_user_iov(struct iovec *iov, int iovcnt, boolean write)
+{
+    if (iovcnt <= 0 || iovcnt > IOV_MAX)
+        return true;            /* rejected by the caller */
+    if (!fault_in_user_range(iov, iovcnt * sizeof(struct iovec), false))
+        return false;
+    for (int i = 0; i < iovcnt; i++) {
+        if (!fault_in_user_range(iov[i].iov_base, iov[i].iov_len, write))
+            return false;
+    }
+    return true;
+}
+
+static boolean do_demand_page(vmap vm, u64 vaddr, context frame)
 {
     if ((vm->flags & VMAP_FLAG_MMAP) == 0) {
         msg_err("vaddr 0x%lx matched vmap with invalid flags (0x%x)\n",
@@ -52,9 +297,19 @@ static boolean do_demand_page(vmap vm, u64 vaddr)
         return false;
     }
 
+    /* file-backed pages up to end of file come from the page cache;
+       any pages beyond it are zero-filled */
+    timestamp start = now(CLOCK_ID_MONOTONIC);
+    if (vm->cache_node &&
+        (vaddr - vm->file_base) < pad(pagecache_node_length(vm->cache_node), PAGESIZE))
+        return demand_file_page(vm, vaddr, frame,
+                                (frame[FRAME_ERROR_CODE] & FRAME_ERROR_PF_RW) != 0, start);
+
     /* XXX make free list */
     kernel_heaps kh = get_kernel_heaps();
     u64 paddr = allocate_u64(heap_physical(kh), PAGESIZE);
+    if (paddr == INVALID_PHYSICAL && pagecache_drain(PAGESIZE))
+        paddr = allocate_u64(heap_physical(kh), PAGESIZE);
     if (paddr == INVALID_PHYSICAL) {
         msg_err("cannot get physical page; OOM\n");
         return false;
@@ -63,7 +318,7 @@ static boolean do_demand_page(vmap vm, u64 vaddr)
     u64 vaddr_aligned = vaddr & ~MASK(PAGELOG);
     map(vaddr_aligned, paddr, PAGESIZE, page_map_flags(vm->flags), heap_pages(kh));
     zero(pointer_from_u64(vaddr_aligned), PAGESIZE);
-
+    histogram_record_since(&fault_latency, start);
     return true;
 }
 
@@ -102,6 +357,15 @@ boolean unix_fault_page(u64 vaddr, context frame)
             return false;
         }
 
+        /* first write to a private file mapping: copy the cached page */
+        if ((error_code & FRAME_ERROR_PF_RW) && vm->cache_node &&
+            (vm->flags & (VMAP_FLAG_WRITABLE | VMAP_FLAG_SHARED)) == VMAP_FLAG_WRITABLE) {
+            u64 vaddr_aligned = vaddr & ~MASK(PAGELOG);
+            unmap_pages_with_handler(vaddr_aligned, PAGESIZE,
+                                     stack_closure(dealloc_phys_page, heap_physical(get_kernel_heaps())));
+            return do_demand_page(vm, vaddr, frame);
+        }
+
         pf_debug("page protection violation\naddr 0x%lx, rip 0x%lx, "
                  "error %s%s%s vm->flags (%s%s%s%s)", 
                  vaddr, frame[FRAME_RIP],
@@ -118,7 +382,7 @@ boolean unix_fault_page(u64 vaddr, context frame)
     }
 
     /* vmap, no prot violation --> demand paging */
-    return do_demand_page(vm, vaddr);
+    return do_demand_page(vm, vaddr, frame);
 
 }
 
@@ -129,6 +393,8 @@ vmap allocate_vmap(rangemap rm, range r, u64 flags)
         return vm;
     rmnode_init(&vm->node, r);
     vm->flags = flags;
+    vm->cache_node = 0;
+    vm->file_base = 0;
     if (!rangemap_insert(rm, &vm->node)) {
         deallocate(rm->h, vm, sizeof(struct vmap));
         return INVALID_ADDRESS;
@@ -136,6 +402,17 @@ vmap allocate_vmap(rangemap rm, range r, u64 flags)
     return vm;
 }
 
+/* allocate a vmap for part of src, retaining its file backing */
+static vmap allocate_vmap_from(rangemap rm, range r, u64 flags, vmap src)
+{
+    vmap vm = allocate_vmap(rm, r, flags);
+    if (vm == INVALID_ADDRESS)
+        return vm;
+    vm->cache_node = src->cache_node;
+    vm->file_base = src->file_base;
+    return vm;
+}
+
 boolean adjust_vmap_range(rangemap rm, vmap v, range new)
 {
     return rangemap_reinsert(rm, &v->node, new);
@@ -304,59 +581,6 @@ static sysreturn mincore(void *addr, u64 length, u8 *vec)
     return 0;
 }
 
-closure_function(1, 1, void, dealloc_phys_page,
-                 heap, physical,
-                 range, r)
-{
-    if (!id_heap_set_area(bound(physical), r.start, range_span(r), true, false))
-        msg_err("some of physical range %R not allocated in heap\n", r);
-}
-
-closure_function(5, 2, void, mmap_read_complete,
-                 thread, t, u64, where, u64, buf_len, buffer, b, u64, mapflags,
-                 status, s, bytes, length)
-{
-    thread t = bound(t);
-    u64 where = bound(where);
-    buffer b = bound(b);
-    u64 mapflags = bound(mapflags);
-
-    if (!is_ok(s)) {
-        deallocate_buffer(b);
-        set_syscall_error(t, EACCES);
-        goto out;
-    }
-
-    kernel_heaps kh = (kernel_heaps)&t->uh;
-    heap pages = heap_pages(kh);
-
-    u64 buf_len = bound(buf_len);
-    assert((buf_len & (PAGESIZE - 1)) == 0);
-    void * buf = buffer_ref(b, 0);
-
-    /* free existing pages */
-    unmap_pages_with_handler(where, buf_len, stack_closure(dealloc_phys_page, heap_physical(kh)));
-
-    /* Note that we rely on the backed heap being physically
-       contiguous. If this behavior changes or faulted-in pages are
-       ever used, revise this to use the page walker. */
-    map(where, physical_from_virtual(buf), buf_len, mapflags, pages);
-
-    /* zero pad */
-    if (length < buf_len)
-        zero(pointer_from_u64(where + length), buf_len - length);
-
-    /* XXX This is gross. Either support this within the buffer interface or use something besides
-       a buffer... */
-    physically_backed_dealloc_virtual(b->h, u64_from_pointer(buf), pad(bound(buf_len), b->h->pagesize));
-    deallocate(b->h, b, sizeof(struct buffer));
-
-    set_syscall_return(t, where);
-  out:
-    file_op_maybe_wake(t);
-    closure_finish();
-}
-
 #if 0
 closure_function(0, 1, void, vmap_dump_node,
                  rmnode, n)
@@ -433,13 +657,13 @@ closure_function(3, 1, void, vmap_attribute_update_intersection,
         assert(rangemap_reinsert(pvmap, node, rhl));
 
         /* create node for intersection */
-        vmap mh = allocate_vmap(pvmap, ri, newflags);
+        vmap mh = allocate_vmap_from(pvmap, ri, newflags, match);
         assert(mh != INVALID_ADDRESS);
         
         if (tail) {
             /* create node at tail end */
             range rt = { ri.end, rtend };
-            vmap mt = allocate_vmap(pvmap, rt, match->flags);
+            vmap mt = allocate_vmap_from(pvmap, rt, match->flags, match);
             assert(mt != INVALID_ADDRESS);
         }
     } else if (tail) {
@@ -448,7 +672,7 @@ closure_function(3, 1, void, vmap_attribute_update_intersection,
         assert(rangemap_reinsert(pvmap, node, rt));
 
         /* create node for intersection */
-        vmap mt = allocate_vmap(pvmap, ri, newflags);
+        vmap mt = allocate_vmap_from(pvmap, ri, newflags, match);
         assert(mt != INVALID_ADDRESS);
     } else {
         /* key (range) remains the same, no need to reinsert */
@@ -456,6 +680,29 @@ closure_function(3, 1, void, vmap_attribute_update_intersection,
     }
 }
 
+closure_function(1, 3, boolean, cache_page_protect,
+                 u64, flags,
+                 int, level, u64, addr, u64 *, entry)
+{
+    u64 e = *entry;
+    if (pt_entry_is_present(e) && pt_entry_is_pte(level, e) &&
+        pagecache_is_mapped_page(phys_from_pte(e)))
+        update_map_flags(addr, PAGESIZE, bound(flags));
+    return true;
+}
+
+closure_function(1, 1, void, vmap_protect_cache_pages,
+                 range, rq,
+                 rmnode, node)
+{
+    vmap vm = (vmap)node;
+    if (!vm->cache_node || (vm->flags & VMAP_FLAG_SHARED))
+        return;
+    range ri = range_intersection(bound(rq), node->r);
+    traverse_ptes(ri.start, range_span(ri),
+                  stack_closure(cache_page_protect, page_map_flags(vm->flags) & ~PAGE_WRITABLE));
+}
+
 static void vmap_attribute_update(heap h, rangemap pvmap, vmap q)
 {
     range rq = q->node.r;
@@ -467,6 +714,10 @@ static void vmap_attribute_update(heap h, rangemap pvmap, vmap q)
     rangemap_range_lookup(pvmap, rq, nh);
 
     update_map_flags(rq.start, range_span(rq), page_map_flags(q->flags));
+
+    /* pages shared with the page cache stay read-only in private mappings */
+    if ((q->flags & VMAP_FLAG_WRITABLE))
+        rangemap_range_lookup(pvmap, rq, stack_closure(vmap_protect_cache_pages, rq));
 }
 
 sysreturn mprotect(void * addr, u64 len, int prot)
@@ -493,6 +744,8 @@ sysreturn mprotect(void * addr, u64 len, int prot)
     struct vmap q;
     q.node.r = r;
     q.flags = new_vmflags;
+    q.cache_node = 0;
+    q.file_base = 0;
 
     vmap_attribute_update(h, pvmap, &q);
     return 0;
@@ -523,6 +776,8 @@ closure_function(3, 1, void, vmap_paint_intersection,
     if (range_equal(ri, rn)) {
         /* key (range) remains the same, no need to reinsert */
         match->flags = q->flags;
+        match->cache_node = q->cache_node;
+        match->file_base = q->file_base;
         return;
     }
 
@@ -539,7 +794,7 @@ closure_function(3, 1, void, vmap_paint_intersection,
         if (tail) {
             /* create node at tail end */
             range rt = { ri.end, rtend };
-            vmap mt = allocate_vmap(pvmap, rt, match->flags);
+            vmap mt = allocate_vmap_from(pvmap, rt, match->flags, match);
             assert(mt != INVALID_ADDRESS);
         }
     } else if (tail) {
@@ -553,7 +808,7 @@ closure_function(3, 1, void, vmap_paint_gap,
                  heap, h, rangemap, pvmap, vmap, q,
                  range, r)
 {
-    vmap mt = allocate_vmap(bound(pvmap), r, bound(q)->flags);
+    vmap mt = allocate_vmap_from(bound(pvmap), r, bound(q)->flags, bound(q));
     assert(mt != INVALID_ADDRESS);
 }
 
@@ -629,6 +884,27 @@ static sysreturn mmap(void *target, u64 size, int prot, int flags, int fd, u64 o
         vmflags |= VMAP_FLAG_EXEC;
     if ((prot & PROT_WRITE))
         vmflags |= VMAP_FLAG_WRITABLE;
+    if ((flags & MAP_SHARED))
+        vmflags |= VMAP_FLAG_SHARED;
+
+    /* File mappings are demand-paged from the page cache. */
+    pagecache_node cache_node = 0;
+    if ((flags & MAP_ANONYMOUS) == 0) {
+        file f = resolve_fd(p, fd);
+        if (f->f.type != FDESC_TYPE_REGULAR || is_special(f->n)) {
+            thread_log(current, "   fail: fd %d is not a regular file", fd);
+            return -ENODEV;
+        }
+        if (offset & MASK(PAGELOG)) {
+            thread_log(current, "   fail: offset 0x%lx not page-aligned", offset);
+            return -EINVAL;
+        }
+        cache_node = pagecache_get_node(p->fs, f->n);
+        if (cache_node == INVALID_ADDRESS) {
+            msg_err("failed to allocate page cache node\n");
+            return -ENOMEM;
+        }
+    }
 
     /* Don't really try to honor a hint, only fixed. */
     boolean fixed = (flags & MAP_FIXED) != 0;
@@ -672,29 +948,23 @@ static sysreturn mmap(void *target, u64 size, int prot, int flags, int fd, u64 o
         }
     }
 
-    /* Paint into process vmap */
+    /* Paint into process vmap, first saving any writes to shared file
+       mappings that this one replaces */
+    rangemap_range_lookup(p->vmaps, irange(where, where + len),
+                          stack_closure(vmap_collect_dirty, irange(where, where + len), 0));
     struct vmap q;
     q.flags = vmflags;
     q.node.r = irange(where, where + len);
+    q.cache_node = cache_node;
+    q.file_base = where - offset;
     vmap_paint(h, p->vmaps, &q);
 
-    if (flags & MAP_ANONYMOUS) {
-        thread_log(current, "   anon target: 0x%lx, len: 0x%lx (given size: 0x%lx)", where, len, size);
-        /* If mmap this intersects an existing one, zero any mapped pages. */
-        zero_mapped_pages(where, len);
-        return where;
-    }
-
-    file f = resolve_fd(current->p, fd);
-    u64 flen = MIN(pad(f->length, PAGESIZE), len);
-    heap mh = heap_backed(kh);
-    buffer b = allocate_buffer(mh, pad(flen, mh->pagesize));
-
-    thread_log(current, "  read file at 0x%lx, flen %ld, blocking...", where, flen);
-    file_op_begin(current);
-    filesystem_read(p->fs, f->n, buffer_ref(b, 0), flen, offset,
-                    closure(h, mmap_read_complete, current, where, flen, b, page_map_flags(vmflags)));
-    return file_op_maybe_sleep(current);
+    /* If this mmap intersects an existing one, release any mapped
+       pages; they may be shared with the page cache. */
+    unmap_pages_with_handler(where, len, stack_closure(dealloc_phys_page, heap_physical(kh)));
+    thread_log(current, "   %s target: 0x%lx, len: 0x%lx (given size: 0x%lx)",
+               cache_node ? "file" : "anon", where, len, size);
+    return where;
 }
 
 closure_function(2, 1, void, process_unmap_intersection,
@@ -723,7 +993,7 @@ closure_function(2, 1, void, process_unmap_intersection,
         if (tail) {
             /* create node for tail end */
             range rt = { ri.end, rtend };
-            vmap mt = allocate_vmap(p->vmaps, rt, match->flags);
+            vmap mt = allocate_vmap_from(p->vmaps, rt, match->flags, match);
             assert(mt != INVALID_ADDRESS);
         }
     } else if (tail) {
@@ -737,6 +1007,8 @@ closure_function(2, 1, void, process_unmap_intersection,
 
     /* unmap any mapped pages and return to physical heap */
     u64 len = range_span(ri);
+    if (match->cache_node && (match->flags & VMAP_FLAG_SHARED))
+        collect_dirty_pages(ri.start, len, stack_closure(mark_cache_page_dirty));
     unmap_pages_with_handler(ri.start, len, stack_closure(dealloc_phys_page, heap_physical(kh)));
 
     /* return virtual mapping to heap, if any ... assuming a vmap cannot span heaps!
@@ -771,6 +1043,55 @@ static sysreturn munmap(void *addr, u64 length)
     return 0;
 }
 
+closure_function(1, 1, void, msync_complete,
+                 thread, t,
+                 status, s)
+{
+    thread t = bound(t);
+    thread_log(t, "%s: status %v", __func__, s);
+    set_syscall_return(t, is_ok(s) ? 0 : -EIO);
+    file_op_maybe_wake(t);
+    closure_finish();
+}
+
+static sysreturn msync(void *addr, u64 length, int flags)
+{
+    thread_log(current, "msync: addr %p, length 0x%lx, flags 0x%x", addr, length, flags);
+
+    u64 where = u64_from_pointer(addr);
+    if ((where & MASK(PAGELOG)) || (flags & ~(MS_ASYNC | MS_INVALIDATE | MS_SYNC)) ||
+        ((flags & MS_ASYNC) && (flags & MS_SYNC)))
+        return -EINVAL;
+
+    /* written pages are always queued for writeback; MS_SYNC also
+       waits for them to reach the filesystem */
+    heap h = heap_general(get_kernel_heaps());
+    vector nodes = 0;
+    if (flags & MS_SYNC) {
+        nodes = allocate_vector(h, 1);
+        if (nodes == INVALID_ADDRESS)
+            return -ENOMEM;
+    }
+    range q = irange(where, where + pad(length, PAGESIZE));
+    rangemap_range_lookup(current->p->vmaps, q, stack_closure(vmap_collect_dirty, q, nodes));
+    if (!nodes)
+        return 0;
+
+    thread t = current;
+    file_op_begin(t);
+    merge m = allocate_merge(h, closure(h, msync_complete, t));
+    status_handler sh = apply_merge(m);
+    pagecache_node pn;
+    vector_foreach(nodes, pn) {
+        status_handler k = apply_merge(m);
+        if (pagecache_node_sync(pn, k))
+            apply(k, STATUS_OK);
+    }
+    deallocate_vector(nodes);
+    apply(sh, STATUS_OK);
+    return file_op_maybe_sleep(t);
+}
+
 /* kernel start */
 extern void * START;
 
@@ -784,6 +1105,11 @@ static void add_varea(process p, u64 start, u64 end, heap vheap, boolean allow_f
         id_heap_set_area(vheap, start, end - start, true, true);
 }
 
+void mmap_init(void)
+{
+    histogram_init(&fault_latency, "fault", "page");
+}
+
 void mmap_process_init(process p)
 {
     kernel_heaps kh = &p->uh->kh;
@@ -837,5 +1163,6 @@ void register_mmap_syscalls(struct syscall *map)
     register_syscall(map, mremap, mremap);
     register_syscall(map, munmap, munmap);
     register_syscall(map, mprotect, mprotect);
+    register_syscall(map, msync, msync);
     register_syscall(map, madvise, syscall_ignore);
 }
@@ -12,6 +12,17 @@ struct notify_set {
     struct list entries;
 };
 
+boolean notify_init(unix_heaps uh)
+{
+    uh->notify_entry_cache = allocate_objcache(heap_general((kernel_heaps)uh),
+                                               heap_backed((kernel_heaps)uh),
+                                               sizeof(struct notify_entry), PAGESIZE);
+    if (uh->notify_entry_cache == INVALID_ADDRESS)
+        return false;
+    objcache_set_name(uh->notify_entry_cache, "notify_entry");
+    return true;
+}
+
 notify_set allocate_notify_set(heap h)
 {
     notify_set s = allocate(h, sizeof(struct notify_set));
@@ -31,8 +42,7 @@ void deallocate_notify_set(notify_set s)
 
 notify_entry notify_add(notify_set s, u32 eventmask, event_handler eh)
 {
-    // XXX make cache
-    notify_entry n = allocate(s->h, sizeof(struct notify_entry));
+    notify_entry n = unix_cache_alloc(get_unix_heaps(), notify_entry);
     if (n == INVALID_ADDRESS)
         return n;
     n->eventmask = eventmask;
@@ -48,19 +58,31 @@ void notify_remove(notify_set s, notify_entry e, boolean release)
     list_delete(&e->l);
     if (release)
         apply(e->eh, NOTIFY_EVENTS_RELEASE);
-    deallocate(s->h, e, sizeof(struct notify_entry));
+    unix_cache_free(get_unix_heaps(), notify_entry, e);
 }
 
 void notify_dispatch(notify_set s, u32 events)
 {
+    notify_entry woken = 0;
+
     /* XXX take mutex */
     list_foreach(&s->entries, l) {
         notify_entry n = struct_from_list(l, notify_entry, l);
+        boolean exclusive = (n->eventmask & NOTIFY_EXCLUSIVE) != 0;
+        if (exclusive && woken)
+            continue;
 
         /* no guarantee that a transition is represented here; event
            handler needs to keep track itself if edge trigger is used */
         assert(n->eh);
-        apply(n->eh, events & n->eventmask);
+        if (apply(n->eh, events & n->eventmask & ~NOTIFY_EXCLUSIVE) && exclusive)
+            woken = n;
+    }
+
+    /* rotate exclusive waiters */
+    if (woken && woken->l.next != &s->entries) {
+        list_delete(&woken->l);
+        list_insert_before(&s->entries, &woken->l);
     }
     /* XXX release mutex */
 }
@@ -72,7 +94,7 @@ void notify_release(notify_set s)
         notify_entry n = struct_from_list(l, notify_entry, l);
         apply(n->eh, NOTIFY_EVENTS_RELEASE);
         list_delete(l);
-        deallocate(s->h, n, sizeof(struct notify_entry));
+        unix_cache_free(get_unix_heaps(), notify_entry, n);
     }
     /* XXX release mutex */
 }
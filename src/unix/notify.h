@@ -1,7 +1,8 @@
 typedef struct notify_set *notify_set;
 typedef struct notify_entry *notify_entry;
 
-typedef closure_type(event_handler, void, u32 events);
+/* An event_handler returns true if it woke a waiter with the events. */
+typedef closure_type(event_handler, boolean, u32 events);
 
 /* NOTIFY_EVENTS_RELEASE is a special value of events to signal to the
    event_handler that a notify_set is being deallocated.
@@ -9,6 +10,11 @@ typedef closure_type(event_handler, void, u32 events);
    resources (e.g. epollfd) accordingly. */
 #define NOTIFY_EVENTS_RELEASE (-1u)
 
+/* Entries registered with NOTIFY_EXCLUSIVE in their eventmask are
+   dispatched to in turn only until one wakes a waiter; that entry then
+   moves to the back of the set so the next dispatch favors another. */
+#define NOTIFY_EXCLUSIVE EPOLLEXCLUSIVE
+
 notify_set allocate_notify_set(heap h);
 
 void deallocate_notify_set(notify_set s);
@@ -0,0 +1,971 @@
+#include <unix_internal.h>
+#include <page.h>
+
+//#define PAGECACHE_DEBUG
+#ifdef PAGECACHE_DEBUG
+#define pagecache_debug(x, ...) do {rprintf("PGC: " x, ##__VA_ARGS__);} while(0)
+#else
+#define pagecache_debug(x, ...)
+#endif
+
+#define PAGECACHE_PAGESTATE_READING 0
+#define PAGECACHE_PAGESTATE_FILLED  1
+
+/* maximum number of pages read from the filesystem with a single request */
+#define PAGECACHE_MAX_FILL_PAGES    64
+
+/* maximum number of dirty pages written back with a single request */
+#define PAGECACHE_MAX_WRITEBACK_PAGES   (MAX_EXTENT_SIZE >> PAGELOG)
+
+/* start evicting once less than 1/2^n of physical memory is free */
+#define PAGECACHE_RESERVE_SHIFT     4
+
+/* default delay before dirty pages are written back */
+#define PAGECACHE_WRITEBACK_INTERVAL_MS 1000
+
+typedef struct pagecache {
+    heap h;
+    heap backed;                /* cache pages; kernel mapped, physically contiguous */
+    heap physical;              /* private copies */
+    heap pages;
+    table nodes;                /* file tuple -> pagecache_node */
+    table mapped;               /* physical address -> pagecache_page */
+    struct list lru;            /* evictable pages, least recently used first */
+    struct list dirty_nodes;    /* nodes with dirty pages */
+    boolean writeback;          /* writes complete once cached */
+    timestamp writeback_interval;
+    boolean writeback_timer_pending;
+    thunk writeback_timer;
+    u64 total_pages;
+    u64 dirty_pages;
+    u64 hits;
+    u64 misses;
+    u64 evictions;
+    u64 writebacks;
+} *pagecache;
+
+struct pagecache_node {
+    pagecache pc;
+    filesystem fs;
+    tuple t;
+    fsfile fsf;
+    rangemap pages;             /* ranges in page index units */
+    u64 pending_length;         /* file length including data not yet written back */
+    struct list dirty_l;        /* on pc->dirty_nodes while dirty_pages > 0 */
+    u64 dirty_pages;
+    u64 writes_inflight;
+    u64 truncate_length;        /* truncation overlapping writes in flight */
+    status write_error;         /* reported on next sync */
+    vector sync_waiters;        /* status_handlers waiting for writes in flight */
+};
+
+struct pagecache_page {
+    struct rmnode node;         /* [index, index + 1) */
+    struct list l;              /* lru; only while filled and unmapped */
+    pagecache_node pn;
+    void *kvirt;
+    u64 phys;
+    u64 refcount;               /* user mappings */
+    u64 pins;                   /* kernel references, e.g. queued for transmit */
+    int state;
+    boolean stale;              /* overtaken by a write or truncate while busy */
+    boolean dirty;              /* written in cache but not yet to the filesystem */
+    boolean writing;            /* writeback in flight */
+    vector completions;         /* status_handlers waiting on fill */
+};
+
+static pagecache global_pagecache;
+
+static inline u64 page_index(u64 offset)
+{
+    return offset >> PAGELOG;
+}
+
+static inline u64 page_offset(pagecache_page pp)
+{
+    return pp->node.r.start << PAGELOG;
+}
+
+static inline pagecache_page page_lookup(pagecache_node pn, u64 index)
+{
+    return (pagecache_page)rangemap_lookup(pn->pages, index);
+}
+
+/* LRU maintenance; only clean, filled pages without user mappings
+   are eligible */
+static inline void page_lru_touch(pagecache_page pp)
+{
+    if (pp->state != PAGECACHE_PAGESTATE_FILLED || pp->refcount > 0 || pp->pins > 0 ||
+        pp->dirty || pp->writing || pp->stale)
+        return;
+    if (pp->l.next)
+        list_delete(&pp->l);
+    list_push_back(&pp->pn->pc->lru, &pp->l);
+}
+
+static inline void page_lru_remove(pagecache_page pp)
+{
+    if (pp->l.next)
+        list_delete(&pp->l);
+}
+
+static void deallocate_page(pagecache_page pp)
+{
+    pagecache pc = pp->pn->pc;
+    assert(pp->refcount == 0 && pp->pins == 0);
+    page_lru_remove(pp);
+    rangemap_remove_node(pp->pn->pages, &pp->node);
+    if (pp->completions)
+        deallocate_vector(pp->completions);
+    deallocate(pc->backed, pp->kvirt, PAGESIZE);
+    deallocate(pc->h, pp, sizeof(struct pagecache_page));
+    pc->total_pages--;
+}
+
+static boolean pagecache_evict_page(pagecache pc)
+{
+    if (list_empty(&pc->lru))
+        return false;
+    pagecache_page pp = struct_from_list(list_begin(&pc->lru), pagecache_page, l);
+    pagecache_debug("%s: evict index %ld\n", __func__, pp->node.r.start);
+    deallocate_page(pp);
+    pc->evictions++;
+    return true;
+}
+
+static inline boolean pagecache_under_pressure(pagecache pc)
+{
+    u64 total = id_heap_total(pc->physical);
+    return pc->physical->allocated + (total >> PAGECACHE_RESERVE_SHIFT) > total;
+}
+
+static void pagecache_writeback_all(pagecache pc);
+
+/* Release up to length bytes of unused cache pages back to the
+   physical heap, least recently used first. Returns the number of
+   bytes released. Dirty pages can't be released until written back,
+   so start that if needed. */
+u64 pagecache_drain(u64 length)
+{
+    pagecache pc = global_pagecache;
+    u64 drained = 0;
+    while (drained < length && pagecache_evict_page(pc))
+        drained += PAGESIZE;
+    if (drained < length && pc->dirty_pages > 0)
+        pagecache_writeback_all(pc);
+    return drained;
+}
+
+static pagecache_page allocate_page(pagecache_node pn, u64 index)
+{
+    pagecache pc = pn->pc;
+    while (pagecache_under_pressure(pc) && pagecache_evict_page(pc));
+    if (pc->dirty_pages > 0 && pagecache_under_pressure(pc))
+        pagecache_writeback_all(pc);
+
+    pagecache_page pp = allocate(pc->h, sizeof(struct pagecache_page));
+    if (pp == INVALID_ADDRESS)
+        return pp;
+    do {
+        pp->kvirt = allocate(pc->backed, PAGESIZE);
+    } while (pp->kvirt == INVALID_ADDRESS && pagecache_evict_page(pc));
+    if (pp->kvirt == INVALID_ADDRESS) {
+        deallocate(pc->h, pp, sizeof(struct pagecache_page));
+        return INVALID_ADDRESS;
+    }
+    pp->completions = allocate_vector(pc->h, 1);
+    if (pp->completions == INVALID_ADDRESS) {
+        deallocate(pc->backed, pp->kvirt, PAGESIZE);
+        deallocate(pc->h, pp, sizeof(struct pagecache_page));
+        return INVALID_ADDRESS;
+    }
+    rmnode_init(&pp->node, irange(index, index + 1));
+    pp->l.prev = pp->l.next = 0;
+    pp->pn = pn;
+    pp->phys = physical_from_virtual(pp->kvirt);
+    pp->refcount = 0;
+    pp->pins = 0;
+    pp->state = PAGECACHE_PAGESTATE_READING;
+    pp->stale = false;
+    pp->dirty = false;
+    pp->writing = false;
+    assert(rangemap_insert(pn->pages, &pp->node));
+    pc->total_pages++;
+    return pp;
+}
+
+/* Mark a page filled and release anyone waiting on it. */
+static void page_fill_done(pagecache_page pp, status s)
+{
+    vector completions = pp->completions;
+    pp->completions = 0;
+    if (is_ok(s))
+        pp->state = PAGECACHE_PAGESTATE_FILLED;
+    status_handler sh;
+    vector_foreach(completions, sh)
+        apply(sh, s);
+    deallocate_vector(completions);
+    if (!is_ok(s) || pp->stale)
+        deallocate_page(pp);
+    else
+        page_lru_touch(pp);
+}
+
+closure_function(4, 2, void, pagecache_fill_complete,
+                 pagecache_node, pn, u64, index, u64, count, void *, buf,
+                 status, s, bytes, length)
+{
+    pagecache_node pn = bound(pn);
+    void *buf = bound(buf);
+    pagecache_debug("%s: index %ld, count %ld, status %v, length %ld\n", __func__,
+                    bound(index), bound(count), s, length);
+    if (!is_ok(s))
+        msg_err("failed to fill pages at offset 0x%lx: %v\n", bound(index) << PAGELOG, s);
+    for (u64 i = 0; i < bound(count); i++) {
+        pagecache_page pp = page_lookup(pn, bound(index) + i);
+        assert(pp != INVALID_ADDRESS && pp->state == PAGECACHE_PAGESTATE_READING);
+        if (is_ok(s)) {
+            /* zero any part of the page beyond the end of file */
+            u64 valid = length > i * PAGESIZE ? MIN(length - i * PAGESIZE, PAGESIZE) : 0;
+            if (buf)
+                runtime_memcpy(pp->kvirt, buf + i * PAGESIZE, valid);
+            if (valid < PAGESIZE)
+                zero(pp->kvirt + valid, PAGESIZE - valid);
+        }
+        page_fill_done(pp, s);
+    }
+    if (buf)
+        deallocate(pn->pc->backed, buf, bound(count) * PAGESIZE);
+    closure_finish();
+}
+
+/* Read up to count absent pages, starting at index, with a single
+   filesystem request. Returns the number of pages issued. The fill
+   may complete before this returns. */
+static u64 pagecache_fill(pagecache_node pn, u64 index, u64 count)
+{
+    pagecache pc = pn->pc;
+    u64 end_index = page_index(pad(pagecache_node_length(pn), PAGESIZE));
+    count = MIN(count, PAGECACHE_MAX_FILL_PAGES);
+    if (end_index > index)
+        count = MIN(count, end_index - index);
+    else
+        count = 1;
+
+    pagecache_page first = INVALID_ADDRESS;
+    u64 n;
+    for (n = 0; n < count; n++) {
+        if (n > 0 && page_lookup(pn, index + n) != INVALID_ADDRESS)
+            break;
+        pagecache_page pp = allocate_page(pn, index + n);
+        if (pp == INVALID_ADDRESS)
+            break;
+        if (n == 0)
+            first = pp;
+    }
+    if (n == 0)
+        return 0;
+
+    /* multi-page fills are staged in a contiguous buffer */
+    void *buf = 0;
+    if (n > 1) {
+        buf = allocate(pc->backed, n * PAGESIZE);
+        if (buf == INVALID_ADDRESS) {
+            buf = 0;
+            while (n > 1)
+                deallocate_page(page_lookup(pn, index + --n));
+        }
+    }
+
+    pagecache_debug("%s: fill index %ld, count %ld\n", __func__, index, n);
+    pc->misses += n;
+    filesystem_read(pn->fs, pn->t, buf ? buf : first->kvirt, n * PAGESIZE, index << PAGELOG,
+                    closure(pc->h, pagecache_fill_complete, pn, index, n, buf));
+    return n;
+}
+
+/* Return the page at index, issuing a fill of up to fill_pages pages
+   if it isn't cached. The returned page may still be filling. */
+static pagecache_page pagecache_get_page(pagecache_node pn, u64 index, u64 fill_pages)
+{
+    pagecache_page pp = page_lookup(pn, index);
+    if (pp != INVALID_ADDRESS) {
+        pn->pc->hits++;
+        page_lru_touch(pp);
+        return pp;
+    }
+    if (!pagecache_fill(pn, index, fill_pages))
+        return INVALID_ADDRESS;
+
+    /* the fill may have completed (or failed) synchronously */
+    return page_lookup(pn, index);
+}
+
+/* Map the cached page at offset into vaddr, either by sharing the
+   cached page or, if copy is set, by mapping a private copy of
+   it. Returns false if the page is not resident (or could not be
+   allocated), in which case a fill of up to fill_pages pages is
+   issued and complete is applied once it completes (or with the
+   error). */
+boolean pagecache_map_page(pagecache_node pn, u64 offset, u64 vaddr, u64 flags,
+                           boolean copy, u64 fill_pages, status_handler complete)
+{
+    pagecache pc = pn->pc;
+    pagecache_page pp = pagecache_get_page(pn, page_index(offset), fill_pages);
+    if (pp == INVALID_ADDRESS) {
+        apply(complete, timm("result", "failed to fill cache page"));
+        return false;
+    }
+    if (pp->state != PAGECACHE_PAGESTATE_FILLED) {
+        vector_push(pp->completions, complete);
+        return false;
+    }
+
+    if (copy) {
+        u64 paddr = allocate_u64(pc->physical, PAGESIZE);
+        if (paddr == INVALID_PHYSICAL && pagecache_drain(PAGESIZE))
+            paddr = allocate_u64(pc->physical, PAGESIZE);
+        if (paddr == INVALID_PHYSICAL) {
+            apply(complete, timm("result", "cannot get physical page; OOM"));
+            return false;
+        }
+        map(vaddr, paddr, PAGESIZE, flags, pc->pages);
+        runtime_memcpy(pointer_from_u64(vaddr), pp->kvirt, PAGESIZE);
+        return true;
+    }
+
+    map(vaddr, pp->phys, PAGESIZE, flags, pc->pages);
+    if (pp->refcount++ == 0) {
+        page_lru_remove(pp);
+        table_set(pc->mapped, pointer_from_u64(pp->phys), pp);
+    }
+    return true;
+}
+
+/* Called for each physical page unmapped from a file-backed
+   mapping. Returns true if the page belongs to the cache, in which
+   case the mapping reference is dropped; the caller must otherwise
+   free the page. */
+boolean pagecache_release_mapped_page(u64 phys)
+{
+    pagecache pc = global_pagecache;
+    pagecache_page pp = table_find(pc->mapped, pointer_from_u64(phys));
+    if (!pp)
+        return false;
+    assert(pp->refcount > 0);
+    if (--pp->refcount == 0) {
+        table_set(pc->mapped, pointer_from_u64(phys), 0);
+        page_lru_touch(pp);
+    }
+    return true;
+}
+
+boolean pagecache_is_mapped_page(u64 phys)
+{
+    return table_find(global_pagecache->mapped, pointer_from_u64(phys)) != 0;
+}
+
+/* Take a reference on the cached page containing offset, which keeps
+   it resident and at the same address until released with
+   pagecache_unpin_page. If the page is not yet filled, a fill of up
+   to fill_pages pages is issued, INVALID_ADDRESS is returned and
+   complete is applied once the fill completes (or fails). */
+pagecache_page pagecache_pin_page(pagecache_node pn, u64 offset, u64 fill_pages,
+                                  status_handler complete)
+{
+    pagecache_page pp = pagecache_get_page(pn, page_index(offset), fill_pages);
+    if (pp == INVALID_ADDRESS) {
+        apply(complete, timm("result", "failed to fill cache page"));
+        return INVALID_ADDRESS;
+    }
+    if (pp->state != PAGECACHE_PAGESTATE_FILLED) {
+        vector_push(pp->completions, complete);
+        return INVALID_ADDRESS;
+    }
+    if (pp->pins++ == 0)
+        page_lru_remove(pp);
+    return pp;
+}
+
+void pagecache_unpin_page(pagecache_page pp)
+{
+    assert(pp->pins > 0);
+    if (--pp->pins == 0)
+        page_lru_touch(pp);
+}
+
+void *pagecache_page_data(pagecache_page pp)
+{
+    return pp->kvirt;
+}
+
+closure_function(4, 1, void, pagecache_read_page_complete,
+                 pagecache_page, pp, void *, dest, range, r, status_handler, sh,
+                 status, s)
+{
+    pagecache_page pp = bound(pp);
+    range r = bound(r);
+    if (is_ok(s))
+        runtime_memcpy(bound(dest), pp->kvirt + (r.start - page_offset(pp)), range_span(r));
+    apply(bound(sh), s);
+    closure_finish();
+}
+
+/* Copy file range q into dest by way of the cache. Each page not yet
+   resident holds a reference on merge m until it has been copied. */
+static void pagecache_read_internal(pagecache_node pn, void *dest, range q, merge m)
+{
+    pagecache pc = pn->pc;
+    u64 end_index = page_index(q.end - 1);
+    for (u64 index = page_index(q.start); index <= end_index; index++) {
+        range r = range_intersection(q, irange(index << PAGELOG, (index + 1) << PAGELOG));
+        void *d = dest + (r.start - q.start);
+        pagecache_page pp = pagecache_get_page(pn, index, end_index - index + 1);
+        if (pp == INVALID_ADDRESS) {
+            apply(apply_merge(m), timm("result", "failed to fill cache page"));
+            return;
+        }
+        if (pp->state == PAGECACHE_PAGESTATE_FILLED)
+            runtime_memcpy(d, pp->kvirt + (r.start - page_offset(pp)), range_span(r));
+        else
+            vector_push(pp->completions, closure(pc->h, pagecache_read_page_complete,
+                                                 pp, d, r, apply_merge(m)));
+    }
+}
+
+closure_function(2, 1, void, pagecache_read_complete,
+                 io_status_handler, ish, u64, length,
+                 status, s)
+{
+    apply(bound(ish), s, is_ok(s) ? bound(length) : 0);
+    closure_finish();
+}
+
+/* Read file data by way of the cache. As with filesystem_read, the
+   completion receives the number of bytes read, which is truncated
+   at end of file. */
+void pagecache_read(pagecache_node pn, void *dest, u64 length, u64 offset,
+                    io_status_handler completion)
+{
+    pagecache pc = pn->pc;
+    u64 file_length = pagecache_node_length(pn);
+    if (offset >= file_length || length == 0) {
+        apply(completion, STATUS_OK, 0);
+        return;
+    }
+    range q = irange(offset, offset + MIN(length, file_length - offset));
+    merge m = allocate_merge(pc->h, closure(pc->h, pagecache_read_complete,
+                                            completion, range_span(q)));
+    status_handler k = apply_merge(m);
+    pagecache_read_internal(pn, dest, q, m);
+    apply(k, STATUS_OK);
+}
+
+static void page_set_dirty(pagecache_page pp)
+{
+    pagecache_node pn = pp->pn;
+    pagecache pc = pn->pc;
+    if (pp->dirty)
+        return;
+    pp->dirty = true;
+    page_lru_remove(pp);
+    if (pn->dirty_pages++ == 0)
+        list_push_back(&pc->dirty_nodes, &pn->dirty_l);
+    if (pc->dirty_pages++ == 0 && !pc->writeback_timer_pending) {
+        pc->writeback_timer_pending = true;
+        register_timer(pc->writeback_interval, CLOCK_ID_MONOTONIC, pc->writeback_timer);
+    }
+}
+
+static void page_clear_dirty(pagecache_page pp)
+{
+    pagecache_node pn = pp->pn;
+    if (!pp->dirty)
+        return;
+    pp->dirty = false;
+    pn->pc->dirty_pages--;
+    if (--pn->dirty_pages == 0)
+        list_delete(&pn->dirty_l);
+}
+
+/* Called for each physical page found to have been written through
+   a user mapping. Returns true if the page belongs to the cache, in
+   which case it is marked dirty for writeback. */
+boolean pagecache_dirty_mapped_page(u64 phys)
+{
+    pagecache_page pp = table_find(global_pagecache->mapped, pointer_from_u64(phys));
+    if (!pp)
+        return false;
+    page_set_dirty(pp);
+    return true;
+}
+
+/* Install a write of range q, staged in buf along with the rest of
+   the page-aligned span (save for a partial final page), into the
+   cache, marking the pages dirty if requested. The head and tail of
+   the span were read before the write was queued and may since have
+   been overtaken by another write, so only the bytes of q are merged
+   into resident pages; buf is then refreshed from the page so that a
+   write-through carries the current contents. Returns false if any
+   page could not be updated. */
+static boolean pagecache_write_populate(pagecache_node pn, void *buf, range span, range q,
+                                        boolean dirty)
+{
+    boolean cached = true;
+    for (u64 index = page_index(span.start); (index << PAGELOG) < span.end; index++) {
+        u64 offset = index << PAGELOG;
+        u64 len = MIN(span.end - offset, PAGESIZE);
+        pagecache_page pp = page_lookup(pn, index);
+        if (pp == INVALID_ADDRESS) {
+            pp = allocate_page(pn, index);
+            if (pp == INVALID_ADDRESS) {
+                cached = false;     /* not cached; the write itself goes on */
+                continue;
+            }
+            pp->state = PAGECACHE_PAGESTATE_FILLED;
+            if (len < PAGESIZE)
+                zero(pp->kvirt + len, PAGESIZE - len);
+            runtime_memcpy(pp->kvirt, buf + (offset - span.start), len);
+        } else if (pp->state != PAGECACHE_PAGESTATE_FILLED) {
+            /* the fill in flight predates this write */
+            pp->stale = true;
+            cached = false;
+            continue;
+        } else {
+            range r = range_intersection(q, irange(offset, offset + len));
+            runtime_memcpy(pp->kvirt + (r.start - offset), buf + (r.start - span.start),
+                           range_span(r));
+            runtime_memcpy(buf + (offset - span.start), pp->kvirt, len);
+        }
+        if (dirty)
+            page_set_dirty(pp);
+        page_lru_touch(pp);
+    }
+    return cached;
+}
+
+closure_function(4, 2, void, pagecache_write_complete,
+                 heap, h, buffer, b, u64, length, io_status_handler, ish,
+                 status, s, bytes, written)
+{
+    buffer b = bound(b);
+    deallocate(bound(h), buffer_ref(b, 0), buffer_length(b));
+    unwrap_buffer(bound(h), b);
+    apply(bound(ish), s, is_ok(s) ? bound(length) : 0);
+    closure_finish();
+}
+
+closure_function(5, 1, void, pagecache_write_fill_complete,
+                 pagecache_node, pn, void *, buf, range, span, range, q, io_status_handler, ish,
+                 status, s)
+{
+    pagecache_node pn = bound(pn);
+    pagecache pc = pn->pc;
+    range span = bound(span);
+    range q = bound(q);
+    if (!is_ok(s)) {
+        deallocate(pc->h, bound(buf), range_span(span));
+        apply(bound(ish), s, 0);
+        closure_finish();
+        return;
+    }
+
+    /* In write-back mode, the write is complete once it is cached. */
+    if (pagecache_write_populate(pn, bound(buf), span, q, pc->writeback) && pc->writeback) {
+        if (q.end > pn->pending_length)
+            pn->pending_length = q.end;
+        deallocate(pc->h, bound(buf), range_span(span));
+        apply(bound(ish), STATUS_OK, range_span(q));
+        closure_finish();
+        return;
+    }
+
+    buffer b = wrap_buffer(pc->h, bound(buf), range_span(span));
+    filesystem_write(pn->fs, pn->t, b, span.start,
+                     closure(pc->h, pagecache_write_complete, pc->h, b, range_span(q), bound(ish)));
+    closure_finish();
+}
+
+/* Write file data by way of the cache. The write is widened to page
+   boundaries (or end of file) using cached data for the partial head
+   and tail pages, so the filesystem sees whole-page writes and no
+   block read-modify-write is needed. Data is copied from src before
+   returning. */
+void pagecache_write(pagecache_node pn, void *src, u64 length, u64 offset,
+                     io_status_handler completion)
+{
+    pagecache pc = pn->pc;
+    if (length == 0) {
+        apply(completion, STATUS_OK, 0);
+        return;
+    }
+    u64 file_length = pagecache_node_length(pn);
+    u64 end = offset + length;
+    range span = irange(offset & ~MASK(PAGELOG),
+                        MIN(pad(end, PAGESIZE), MAX(end, file_length)));
+    void *buf = allocate(pc->h, range_span(span));
+    if (buf == INVALID_ADDRESS) {
+        apply(completion, timm("result", "failed to allocate write buffer"), 0);
+        return;
+    }
+    runtime_memcpy(buf + (offset - span.start), src, length);
+
+    merge m = allocate_merge(pc->h, closure(pc->h, pagecache_write_fill_complete,
+                                            pn, buf, span, irange(offset, end), completion));
+    status_handler k = apply_merge(m);
+
+    /* head: existing data, and zeros for any gap past end of file */
+    range head = irange(span.start, offset);
+    if (range_span(head) > 0) {
+        u64 data_end = MIN(head.end, MAX(file_length, head.start));
+        if (data_end > head.start)
+            pagecache_read_internal(pn, buf, irange(head.start, data_end), m);
+        if (head.end > data_end)
+            zero(buf + (data_end - span.start), head.end - data_end);
+    }
+
+    /* tail: existing data up to end of file */
+    range tail = irange(end, span.end);
+    if (range_span(tail) > 0)
+        pagecache_read_internal(pn, buf + (end - span.start), tail, m);
+    apply(k, STATUS_OK);
+}
+
+static void pagecache_sync_waiters(pagecache_node pn)
+{
+    status s = pn->write_error;
+    pn->write_error = 0;
+    status_handler sh;
+    vector_foreach(pn->sync_waiters, sh)
+        apply(sh, s);
+    vector_clear(pn->sync_waiters);
+}
+
+closure_function(3, 2, void, pagecache_writeback_complete,
+                 pagecache_node, pn, range, pages, buffer, b,
+                 status, s, bytes, written)
+{
+    pagecache_node pn = bound(pn);
+    pagecache pc = pn->pc;
+    buffer b = bound(b);
+    range pages = bound(pages);
+    pagecache_debug("%s: pages %R, status %v\n", __func__, pages, s);
+    deallocate(pc->h, buffer_ref(b, 0), range_span(pages) << PAGELOG);
+    unwrap_buffer(pc->h, b);
+    if (!is_ok(s)) {
+        msg_err("writeback of offset 0x%lx failed: %v\n", pages.start << PAGELOG, s);
+        pn->write_error = s;
+    }
+    for (u64 index = pages.start; index < pages.end; index++) {
+        pagecache_page pp = page_lookup(pn, index);
+        if (pp == INVALID_ADDRESS || !pp->writing)
+            continue;
+        pp->writing = false;
+        if (pp->stale) {
+            if (pp->refcount == 0 && pp->pins == 0) {
+                deallocate_page(pp);
+                continue;
+            }
+            /* referenced since it was truncated away; as in
+               pagecache_truncate, keep it but read as zero */
+            zero(pp->kvirt, PAGESIZE);
+            pp->stale = false;
+            continue;
+        }
+        if (!is_ok(s))
+            page_set_dirty(pp);     /* retry on the next writeback */
+        page_lru_touch(pp);
+    }
+    if (--pn->writes_inflight == 0) {
+        if (pn->truncate_length != infinity) {
+            if (fsfile_get_length(pn->fsf) > pn->truncate_length)
+                filesystem_truncate(pn->fs, pn->fsf, pn->truncate_length, ignore_status);
+            pn->truncate_length = infinity;
+        }
+        pagecache_sync_waiters(pn);
+    }
+    closure_finish();
+}
+
+/* Issue a filesystem write for the dirty pages in [start, end). Pages
+   lying wholly past the end of the file, as after a truncate, have
+   nothing to write and are simply cleaned. */
+static void pagecache_writeback_run(pagecache_node pn, u64 start, u64 end)
+{
+    pagecache pc = pn->pc;
+    u64 file_length = pagecache_node_length(pn);
+    u64 eof_index = pad(file_length, PAGESIZE) >> PAGELOG;
+    for (u64 index = MAX(start, eof_index); index < end; index++) {
+        pagecache_page pp = page_lookup(pn, index);
+        page_clear_dirty(pp);
+        page_lru_touch(pp);
+    }
+    if (start >= eof_index)
+        return;
+    end = MIN(end, eof_index);
+    u64 offset = start << PAGELOG;
+    u64 length = MIN((end - start) << PAGELOG, file_length - offset);
+    void *buf = allocate(pc->h, (end - start) << PAGELOG);
+    if (buf == INVALID_ADDRESS) {
+        msg_err("failed to allocate writeback buffer; retrying later\n");
+        return;
+    }
+    for (u64 index = start; index < end; index++) {
+        pagecache_page pp = page_lookup(pn, index);
+        runtime_memcpy(buf + ((index - start) << PAGELOG), pp->kvirt, PAGESIZE);
+        page_clear_dirty(pp);
+        pp->writing = true;
+    }
+    pagecache_debug("%s: offset 0x%lx, length %ld\n", __func__, offset, length);
+    pn->writes_inflight++;
+    pc->writebacks++;
+    buffer b = wrap_buffer(pc->h, buf, length);
+    filesystem_write(pn->fs, pn->t, b, offset,
+                     closure(pc->h, pagecache_writeback_complete, pn, irange(start, end), b));
+}
+
+/* Write back all dirty pages of a file, coalescing contiguous dirty
+   pages into single writes so that appends are recorded as few,
+   large extents. */
+static void pagecache_writeback_node(pagecache_node pn)
+{
+    rmnode n = rangemap_first_node(pn->pages);
+    while (n != INVALID_ADDRESS && pn->dirty_pages > 0) {
+        pagecache_page pp = (pagecache_page)n;
+        if (!pp->dirty) {
+            n = rangemap_next_node(pn->pages, n);
+            continue;
+        }
+        u64 start = pp->node.r.start;
+        u64 end = start;
+        do {
+            end++;
+            n = rangemap_next_node(pn->pages, n);
+        } while (n != INVALID_ADDRESS && n->r.start == end && ((pagecache_page)n)->dirty &&
+                 end - start < PAGECACHE_MAX_WRITEBACK_PAGES);
+        pagecache_writeback_run(pn, start, end);
+    }
+}
+
+static void pagecache_writeback_all(pagecache pc)
+{
+    list_foreach(&pc->dirty_nodes, l) {
+        pagecache_writeback_node(struct_from_list(l, pagecache_node, dirty_l));
+    }
+}
+
+closure_function(1, 0, void, pagecache_writeback_timer_expire,
+                 pagecache, pc)
+{
+    pagecache pc = bound(pc);
+    pc->writeback_timer_pending = false;
+    pagecache_writeback_all(pc);
+
+    /* pages that couldn't be written this round */
+    if (pc->dirty_pages > 0) {
+        pc->writeback_timer_pending = true;
+        register_timer(pc->writeback_interval, CLOCK_ID_MONOTONIC, pc->writeback_timer);
+    }
+}
+
+closure_function(3, 1, void, pagecache_sync_complete,
+                 filesystem, fs, tuple, t, status_handler, sh,
+                 status, s)
+{
+    status_handler sh = bound(sh);
+    if (!is_ok(s))
+        apply(sh, s);
+    else if (filesystem_flush(bound(fs), bound(t), sh))
+        apply(sh, STATUS_OK);
+    closure_finish();
+}
+
+/* Write back any dirty data for a file, then flush filesystem
+   metadata. As with filesystem_flush, returns true if there was
+   nothing to do, in which case completion is not applied. */
+boolean pagecache_sync(filesystem fs, tuple t, status_handler completion)
+{
+    pagecache_node pn = table_find(global_pagecache->nodes, t);
+    if (pn) {
+        if (pn->dirty_pages > 0)
+            pagecache_writeback_node(pn);
+        if (pn->writes_inflight > 0) {
+            vector_push(pn->sync_waiters, closure(pn->pc->h, pagecache_sync_complete,
+                                                  fs, t, completion));
+            return false;
+        }
+        if (pn->write_error) {
+            status s = pn->write_error;
+            pn->write_error = 0;
+            apply(completion, s);
+            return false;
+        }
+    }
+    return filesystem_flush(fs, t, completion);
+}
+
+boolean pagecache_node_sync(pagecache_node pn, status_handler completion)
+{
+    return pagecache_sync(pn->fs, pn->t, completion);
+}
+
+closure_function(2, 1, void, pagecache_sync_all_complete,
+                 filesystem, fs, status_handler, sh,
+                 status, s)
+{
+    filesystem fs = bound(fs);
+    status_handler sh = bound(sh);
+    if (!is_ok(s))
+        apply(sh, s);
+    else if (filesystem_flush(fs, filesystem_getroot(fs), sh))
+        apply(sh, STATUS_OK);
+    closure_finish();
+}
+
+/* Write back the dirty data of every file, then flush the filesystem
+   log, as for sync(2). The completion is always applied, possibly
+   before returning. */
+void pagecache_sync_all(filesystem fs, status_handler completion)
+{
+    pagecache pc = global_pagecache;
+    pagecache_writeback_all(pc);
+    merge m = allocate_merge(pc->h, closure(pc->h, pagecache_sync_all_complete, fs, completion));
+    status_handler k = apply_merge(m);
+    table_foreach(pc->nodes, t, n) {
+        (void)t;
+        pagecache_node pn = n;
+        if (pn->writes_inflight > 0) {
+            vector_push(pn->sync_waiters, apply_merge(m));
+        } else if (pn->write_error) {
+            status s = pn->write_error;
+            pn->write_error = 0;
+            apply(apply_merge(m), s);
+        }
+    }
+    apply(k, STATUS_OK);
+}
+
+/* Drop cached data beyond a new file length. */
+void pagecache_truncate(tuple t, u64 length)
+{
+    pagecache_node pn = table_find(global_pagecache->nodes, t);
+    if (!pn)
+        return;
+    pn->pending_length = 0;
+
+    /* A writeback in flight may extend the file again on completion;
+       reapply the truncation once it's done. */
+    if (pn->writes_inflight > 0)
+        pn->truncate_length = length;
+    rmnode n = rangemap_lookup_at_or_next(pn->pages, page_index(length));
+    while (n != INVALID_ADDRESS) {
+        pagecache_page pp = (pagecache_page)n;
+        n = rangemap_next_node(pn->pages, n);
+        u64 offset = page_offset(pp);
+        if (offset >= length)
+            page_clear_dirty(pp);
+        if (pp->state != PAGECACHE_PAGESTATE_FILLED) {
+            pp->stale = true;
+        } else if (offset < length) {
+            zero(pp->kvirt + (length - offset), PAGESIZE - (length - offset));
+        } else if (pp->refcount > 0 || pp->pins > 0) {
+            /* still referenced; contents past end of file read as zero */
+            zero(pp->kvirt, PAGESIZE);
+        } else if (pp->writing) {
+            pp->stale = true;
+        } else {
+            deallocate_page(pp);
+        }
+    }
+}
+
+u64 pagecache_node_length(pagecache_node pn)
+{
+    return MAX(fsfile_get_length(pn->fsf), pn->pending_length);
+}
+
+/* Length of a regular file as seen by the application, which in
+   write-back mode may exceed the length recorded by the filesystem. */
+u64 pagecache_file_length(tuple t, fsfile fsf)
+{
+    pagecache_node pn = table_find(global_pagecache->nodes, t);
+    return pn ? pagecache_node_length(pn) : fsfile_get_length(fsf);
+}
+
+pagecache_node pagecache_get_node(filesystem fs, tuple t)
+{
+    pagecache pc = global_pagecache;
+    pagecache_node pn = table_find(pc->nodes, t);
+    if (pn)
+        return pn;
+    fsfile fsf = fsfile_from_node(fs, t);
+    if (!fsf)
+        return INVALID_ADDRESS;
+    pn = allocate(pc->h, sizeof(struct pagecache_node));
+    if (pn == INVALID_ADDRESS)
+        return pn;
+    pn->pages = allocate_rangemap(pc->h);
+    if (pn->pages == INVALID_ADDRESS) {
+        deallocate(pc->h, pn, sizeof(struct pagecache_node));
+        return INVALID_ADDRESS;
+    }
+    pn->sync_waiters = allocate_vector(pc->h, 1);
+    if (pn->sync_waiters == INVALID_ADDRESS) {
+        deallocate_rangemap(pn->pages);
+        deallocate(pc->h, pn, sizeof(struct pagecache_node));
+        return INVALID_ADDRESS;
+    }
+    pn->pc = pc;
+    pn->fs = fs;
+    pn->t = t;
+    pn->fsf = fsf;
+    pn->pending_length = 0;
+    pn->dirty_l.prev = pn->dirty_l.next = 0;
+    pn->dirty_pages = 0;
+    pn->writes_inflight = 0;
+    pn->truncate_length = infinity;
+    pn->write_error = 0;
+    table_set(pc->nodes, t, pn);
+    return pn;
+}
+
+void pagecache_format_stats(buffer b)
+{
+    pagecache pc = global_pagecache;
+    bprintf(b, "pages %ld\ndirty %ld\nhits %ld\nmisses %ld\nevictions %ld\nwritebacks %ld\n",
+            pc->total_pages, pc->dirty_pages, pc->hits, pc->misses, pc->evictions,
+            pc->writebacks);
+}
+
+boolean pagecache_init(unix_heaps uh, tuple root)
+{
+    kernel_heaps kh = (kernel_heaps)uh;
+    heap h = heap_general(kh);
+    pagecache pc = allocate(h, sizeof(struct pagecache));
+    if (pc == INVALID_ADDRESS)
+        return false;
+    pc->h = h;
+    pc->backed = heap_backed(kh);
+    pc->physical = heap_physical(kh);
+    pc->pages = heap_pages(kh);
+    pc->nodes = allocate_table(h, identity_key, pointer_equal);
+    pc->mapped = allocate_table(h, identity_key, pointer_equal);
+    if (pc->nodes == INVALID_ADDRESS || pc->mapped == INVALID_ADDRESS)
+        return false;
+    list_init(&pc->lru);
+    list_init(&pc->dirty_nodes);
+    pc->total_pages = pc->dirty_pages = 0;
+    pc->hits = pc->misses = pc->evictions = pc->writebacks = 0;
+
+    /* write-back is opt-in through the manifest */
+    pc->writeback = table_find(root, sym(writeback)) != 0;
+    u64 interval_ms = PAGECACHE_WRITEBACK_INTERVAL_MS;
+    value v = table_find(root, sym(writeback_interval));
+    if (v && !u64_from_value(v, &interval_ms))
+        msg_err("invalid writeback_interval; using default\n");
+    pc->writeback_interval = milliseconds(interval_ms);
+    pc->writeback_timer_pending = false;
+    pc->writeback_timer = closure(h, pagecache_writeback_timer_expire, pc);
+    global_pagecache = pc;
+    return true;
+}
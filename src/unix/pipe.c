@@ -1,5 +1,4 @@
 #include <unix_internal.h>
-#include <buffer.h>
 
 //#define PIPE_DEBUG
 #ifdef PIPE_DEBUG
@@ -8,11 +7,13 @@
 #define pipe_debug(x, ...)
 #endif
 
-#define INITIAL_PIPE_DATA_SIZE  100
 #define DEFAULT_PIPE_MAX_SIZE   (16 * PAGESIZE) /* see pipe(7) */
 #define PIPE_READ               0
 #define PIPE_WRITE              1
 
+/* pages requested per cache fill when splicing from a file */
+#define SPLICE_FILL_PAGES       16
+
 typedef struct pipe *pipe;
 
 typedef struct pipe_file *pipe_file;
@@ -24,32 +25,236 @@ struct pipe_file {
     blockq bq;
 };
 
+/* Pipe data is held in a ring of buffers, each a span of one page.
+   Pages are reference counted so that splice and tee can hand them to
+   other pipes and to sockets without copying. A page is either owned,
+   allocated by the pipe and freed with its last reference, or
+   borrowed - a pinned page cache page or user memory given by
+   vmsplice - and handed back through its release thunk. */
+typedef struct pipe_page {
+    void *data;
+    u64 refcount;
+    boolean owned;
+    thunk release;              /* borrowed pages; may be 0 */
+} *pipe_page;
+
+struct pipe_buf {
+    pipe_page page;
+    u32 offset;
+    u32 length;
+};
+
 struct pipe {
     struct pipe_file files[2];
     process proc;
     heap h;
     u64 ref_cnt;
     u64 max_size;               /* XXX: can change with F_SETPIPE_SZ */
-    buffer data;
+    struct pipe_buf *bufs;      /* ring of max_size / PAGESIZE buffers */
+    u32 nbufs;
+    u32 head;                   /* oldest buffer */
+    u32 count;                  /* buffers in use */
+    u32 reserved;               /* buffers promised to splices in progress */
+    u64 length;                 /* bytes held */
+    pipe_page spare;            /* emptied page kept for the next write */
 };
 
-#define BUFFER_DEBUG(BUF,LENGTH) do { \
-    pipe_debug("%s:%d - requested %d -- contents %p start/end %d/%d  -- len %d %d\n", \
-        __func__, __LINE__, \
-        (LENGTH), \
-        (BUF)->contents, \
-        (BUF)->start, \
-        (BUF)->end, \
-        (BUF)->length, buffer_length((BUF))); \
-} while(0)
-
 boolean pipe_init(unix_heaps uh)
 {
     heap general = heap_general((kernel_heaps)uh);
     heap backed = heap_backed((kernel_heaps)uh);
 
     uh->pipe_cache = allocate_objcache(general, backed, sizeof(struct pipe), PAGESIZE);
-    return (uh->pipe_cache == INVALID_ADDRESS ? false : true);
+    if (uh->pipe_cache == INVALID_ADDRESS)
+        return false;
+    objcache_set_name(uh->pipe_cache, "pipe");
+    uh->pipe_page_cache = allocate_objcache(general, backed, sizeof(struct pipe_page), PAGESIZE);
+    if (uh->pipe_page_cache == INVALID_ADDRESS)
+        return false;
+    objcache_set_name(uh->pipe_page_cache, "pipe_page");
+    return true;
+}
+
+static pipe_page allocate_pipe_page(void *data, boolean owned, thunk release)
+{
+    pipe_page pp = unix_cache_alloc(get_unix_heaps(), pipe_page);
+    if (pp == INVALID_ADDRESS)
+        return pp;
+    pp->data = data;
+    pp->refcount = 1;
+    pp->owned = owned;
+    pp->release = release;
+    return pp;
+}
+
+static pipe_page pipe_page_new(pipe p)
+{
+    pipe_page pp = p->spare;
+    if (pp) {
+        p->spare = 0;
+        return pp;
+    }
+    heap backed = heap_backed(get_kernel_heaps());
+    void *data = allocate(backed, PAGESIZE);
+    if (data == INVALID_ADDRESS)
+        return INVALID_ADDRESS;
+    pp = allocate_pipe_page(data, true, 0);
+    if (pp == INVALID_ADDRESS)
+        deallocate(backed, data, PAGESIZE);
+    return pp;
+}
+
+static void pipe_page_release(pipe_page pp)
+{
+    if (fetch_and_add(&pp->refcount, -1) != 1)
+        return;
+    if (pp->owned)
+        deallocate(heap_backed(get_kernel_heaps()), pp->data, PAGESIZE);
+    else if (pp->release)
+        apply(pp->release);
+    unix_cache_free(get_unix_heaps(), pipe_page, pp);
+}
+
+closure_function(1, 0, void, pipe_page_unref,
+                 pipe_page, pp)
+{
+    pipe_page_release(bound(pp));
+    closure_finish();
+}
+
+/* i-th buffer from the head of the ring */
+static inline struct pipe_buf *pipe_buf_at(pipe p, u32 i)
+{
+    return &p->bufs[(p->head + i) % p->nbufs];
+}
+
+static inline u32 pipe_free_bufs(pipe p)
+{
+    return p->nbufs - p->count - p->reserved;
+}
+
+/* An owned page at the tail that no other pipe or socket refers to
+   may take further writes. */
+static inline struct pipe_buf *pipe_tail_writable(pipe p)
+{
+    if (p->count == 0)
+        return 0;
+    struct pipe_buf *pb = pipe_buf_at(p, p->count - 1);
+    return pb->page->owned && pb->page->refcount == 1 &&
+        pb->offset + pb->length < PAGESIZE ? pb : 0;
+}
+
+/* bytes that a copying write may add */
+static u64 pipe_space(pipe p)
+{
+    u64 space = (u64)pipe_free_bufs(p) * PAGESIZE;
+    struct pipe_buf *pb = pipe_tail_writable(p);
+    if (pb)
+        space += PAGESIZE - (pb->offset + pb->length);
+    return space;
+}
+
+/* takes over the caller's page reference */
+static void pipe_push(pipe p, pipe_page page, u32 offset, u32 length)
+{
+    assert(p->count < p->nbufs);
+    struct pipe_buf *pb = pipe_buf_at(p, p->count++);
+    pb->page = page;
+    pb->offset = offset;
+    pb->length = length;
+    p->length += length;
+}
+
+static void pipe_pop(pipe p)
+{
+    struct pipe_buf *pb = pipe_buf_at(p, 0);
+    pipe_page pp = pb->page;
+    if (!p->spare && pp->owned && pp->refcount == 1)
+        p->spare = pp;
+    else
+        pipe_page_release(pp);
+    p->head = (p->head + 1) % p->nbufs;
+    p->count--;
+}
+
+static void pipe_consume(pipe p, u64 length)
+{
+    while (length > 0 && p->count > 0) {
+        struct pipe_buf *pb = pipe_buf_at(p, 0);
+        u64 n = MIN(length, pb->length);
+        pb->offset += n;
+        pb->length -= n;
+        p->length -= n;
+        length -= n;
+        if (pb->length == 0)
+            pipe_pop(p);
+    }
+}
+
+static u64 pipe_copy_in(pipe p, void *src, u64 length)
+{
+    u64 done = 0;
+    struct pipe_buf *pb = pipe_tail_writable(p);
+    if (pb) {
+        u64 end = pb->offset + pb->length;
+        done = MIN(length, PAGESIZE - end);
+        runtime_memcpy(pb->page->data + end, src, done);
+        pb->length += done;
+        p->length += done;
+    }
+    while (done < length && pipe_free_bufs(p) > 0) {
+        pipe_page pp = pipe_page_new(p);
+        if (pp == INVALID_ADDRESS)
+            break;
+        u64 n = MIN(length - done, PAGESIZE);
+        runtime_memcpy(pp->data, src + done, n);
+        pipe_push(p, pp, 0, n);
+        done += n;
+    }
+    return done;
+}
+
+static u64 pipe_copy_out(pipe p, void *dest, u64 length)
+{
+    u64 done = 0;
+    while (done < length && p->count > 0) {
+        struct pipe_buf *pb = pipe_buf_at(p, 0);
+        u64 n = MIN(length - done, pb->length);
+        runtime_memcpy(dest + done, pb->page->data + pb->offset, n);
+        pipe_consume(p, n);
+        done += n;
+    }
+    return done;
+}
+
+/* Move (or, for tee, share) up to length bytes of buffers from one
+   pipe to the other. */
+static u64 pipe_move(pipe in, pipe out, u64 length, boolean tee)
+{
+    u64 done = 0;
+    u32 i = 0;
+    while (done < length && i < in->count && pipe_free_bufs(out) > 0) {
+        struct pipe_buf *pb = pipe_buf_at(in, i);
+        u64 n = MIN(length - done, pb->length);
+        if (!tee && n == pb->length) {
+            pipe_push(out, pb->page, pb->offset, n);
+            in->length -= n;
+            in->head = (in->head + 1) % in->nbufs;
+            in->count--;
+        } else {
+            fetch_and_add(&pb->page->refcount, 1);
+            pipe_push(out, pb->page, pb->offset, n);
+            if (tee) {
+                i++;
+            } else {
+                pb->offset += n;
+                pb->length -= n;
+                in->length -= n;
+            }
+        }
+        done += n;
+    }
+    return done;
 }
 
 static inline void pipe_notify_reader(pipe_file pf, int events)
@@ -98,8 +303,13 @@ static void pipe_release(pipe p)
 {
     if (!p->ref_cnt || (fetch_and_add(&p->ref_cnt, -1) == 1)) {
         pipe_debug("%s(%p): deallocating pipe\n", __func__, p);
-        if (p->data != INVALID_ADDRESS)
-            deallocate_buffer(p->data);
+        if (p->bufs != INVALID_ADDRESS) {
+            while (p->count > 0)
+                pipe_pop(p);
+            deallocate(p->h, p->bufs, p->nbufs * sizeof(struct pipe_buf));
+        }
+        if (p->spare)
+            pipe_page_release(p->spare);
 
         pipe_file_release(&(p->files[PIPE_READ]));
         pipe_file_release(&(p->files[PIPE_WRITE]));
@@ -142,16 +352,15 @@ closure_function(5, 1, sysreturn, pipe_read_bh,
                  u64, flags)
 {
     pipe_file pf = bound(pf);
-    int rv;
+    pipe p = pf->pipe;
+    int rv = 0;
 
     if (flags & BLOCKQ_ACTION_NULLIFY) {
         rv = -EINTR;
         goto out;
     }
 
-    buffer b = pf->pipe->data;
-    rv = MIN(buffer_length(b), bound(length));
-    if (rv == 0) {
+    if (p->length == 0) {
         if (pf->pipe->files[PIPE_WRITE].fd == -1)
             goto out;
         if (pf->f.flags & O_NONBLOCK) {
@@ -161,15 +370,10 @@ closure_function(5, 1, sysreturn, pipe_read_bh,
         return BLOCKQ_BLOCK_REQUIRED;
     }
 
-    buffer_read(b, bound(dest), rv);
+    rv = pipe_copy_out(p, bound(dest), bound(length));
     pipe_notify_writer(pf, EPOLLOUT);
-
-    // If we have consumed all of the buffer, reset it. This might prevent future writes to allocte new buffer
-    // in buffer_write/buffer_extend. Can improve things until a proper circular buffer is available
-    if (buffer_length(b) == 0) {
-        buffer_clear(b);
+    if (p->length == 0)
         notify_dispatch(pf->f.ns, 0); /* for edge trigger */
-    }
   out:
     blockq_handle_completion(pf->bq, flags, bound(completion), bound(t), rv);
     closure_finish();
@@ -204,8 +408,7 @@ closure_function(5, 1, sysreturn, pipe_write_bh,
 
     u64 length = bound(length);
     pipe p = pf->pipe;
-    buffer b = p->data;
-    u64 avail = p->max_size - buffer_length(b);
+    u64 avail = pipe_space(p);
 
     if (avail == 0) {
         if (pf->pipe->files[PIPE_READ].fd == -1) {
@@ -219,9 +422,12 @@ closure_function(5, 1, sysreturn, pipe_write_bh,
         return BLOCKQ_BLOCK_REQUIRED;
     }
 
-    u64 real_length = MIN(length, avail);
-    buffer_write(b, bound(dest), real_length);
-    if (avail == length)
+    u64 real_length = pipe_copy_in(p, bound(dest), MIN(length, avail));
+    if (real_length == 0) {
+        rv = -ENOMEM;
+        goto out;
+    }
+    if (avail == real_length)
         notify_dispatch(pf->f.ns, 0); /* for edge trigger */
 
     pipe_notify_reader(pf, EPOLLIN);
@@ -251,7 +457,7 @@ closure_function(1, 0, u32, pipe_read_events,
 {
     pipe_file pf = bound(pf);
     assert(pf->f.read);
-    u32 events = buffer_length(pf->pipe->data) ? EPOLLIN : 0;
+    u32 events = pf->pipe->length ? EPOLLIN : 0;
     if (pf->pipe->files[PIPE_WRITE].fd == -1)
         events |= EPOLLIN | EPOLLHUP;
     return events;
@@ -262,7 +468,7 @@ closure_function(1, 0, u32, pipe_write_events,
 {
     pipe_file pf = bound(pf);
     assert(pf->f.write);
-    u32 events = buffer_length(pf->pipe->data) < pf->pipe->max_size ? EPOLLOUT : 0;
+    u32 events = pipe_space(pf->pipe) ? EPOLLOUT : 0;
     if (pf->pipe->files[PIPE_READ].fd == -1)
         events |= EPOLLHUP;
     return events;
@@ -287,7 +493,10 @@ int do_pipe2(int fds[2], int flags)
     }
 
     pipe->h = heap_general((kernel_heaps)uh);
-    pipe->data = INVALID_ADDRESS;
+    pipe->bufs = INVALID_ADDRESS;
+    pipe->head = pipe->count = pipe->reserved = 0;
+    pipe->length = 0;
+    pipe->spare = 0;
     pipe->proc = current->p;
 
     pipe->files[PIPE_READ].fd = -1;
@@ -301,9 +510,10 @@ int do_pipe2(int fds[2], int flags)
     pipe->ref_cnt = 0;
     pipe->max_size = DEFAULT_PIPE_MAX_SIZE;
 
-    pipe->data = allocate_buffer(pipe->h, INITIAL_PIPE_DATA_SIZE);
-    if (pipe->data == INVALID_ADDRESS) {
-        msg_err("failed to allocate pipe's data buffer\n");
+    pipe->nbufs = pipe->max_size / PAGESIZE;
+    pipe->bufs = allocate(pipe->h, pipe->nbufs * sizeof(struct pipe_buf));
+    if (pipe->bufs == INVALID_ADDRESS) {
+        msg_err("failed to allocate pipe's buffer ring\n");
         goto err;
     }
 
@@ -360,3 +570,546 @@ err:
     pipe_release(pipe);
     return -ENOMEM;
 }
+
+/* splice(2), tee(2) and vmsplice(2)
+
+   Data moves between pipes by handing over (or, for tee, sharing)
+   page references. A regular file is spliced into a pipe straight from
+   the page cache, and pipe pages are queued to a socket by reference,
+   so neither direction copies. Other files are read into, or written
+   from, pipe pages through their fdesc ops. */
+
+static inline pipe fdesc_pipe(fdesc f)
+{
+    return f->type == FDESC_TYPE_PIPE ? ((pipe_file)f)->pipe : 0;
+}
+
+/* A read end is ready with data or at end of file, a write end with a
+   free buffer or once the reader has gone. */
+static boolean pipe_end_ready(pipe_file pf)
+{
+    pipe p = pf->pipe;
+    if (pf == &p->files[PIPE_READ])
+        return p->length > 0 || p->files[PIPE_WRITE].fd == -1;
+    return pipe_free_bufs(p) > 0 || p->files[PIPE_READ].fd == -1;
+}
+
+/* Once the end becomes ready, the syscall is reissued to do the transfer. */
+closure_function(2, 1, sysreturn, pipe_splice_wait_bh,
+                 pipe_file, pf, thread, t,
+                 u64, flags)
+{
+    pipe_file pf = bound(pf);
+    thread t = bound(t);
+    sysreturn rv = 0;
+
+    if (flags & BLOCKQ_ACTION_NULLIFY) {
+        rv = -EINTR;
+        blockq_handle_completion(pf->bq, flags, syscall_io_complete, t, rv);
+        goto out;
+    }
+    if (!pipe_end_ready(pf))
+        return BLOCKQ_BLOCK_REQUIRED;
+    if (flags & BLOCKQ_ACTION_BLOCKED) {
+        syscall_restart(t);
+        thread_wakeup(t);
+    }
+  out:
+    closure_finish();
+    return rv;
+}
+
+/* Returns 0 if the end is ready; doesn't return if the thread blocks. */
+static sysreturn pipe_splice_wait(pipe_file pf, boolean nonblock)
+{
+    if (pipe_end_ready(pf))
+        return 0;
+    if (nonblock || (pf->f.flags & O_NONBLOCK))
+        return -EAGAIN;
+    return blockq_check(pf->bq, current, closure(pf->pipe->h, pipe_splice_wait_bh, pf, current),
+                        false);
+}
+
+static sysreturn pipe_splice_pipes(pipe pin, pipe pout, u64 len, boolean tee)
+{
+    if (pout->files[PIPE_READ].fd == -1)
+        return -EPIPE;
+    u64 n = pipe_move(pin, pout, len, tee);
+    if (n > 0) {
+        if (!tee)
+            pipe_notify_writer(&pin->files[PIPE_READ], EPOLLOUT);
+        pipe_notify_reader(&pout->files[PIPE_WRITE], EPOLLIN);
+    }
+    return n;
+}
+
+/* A splice between a pipe and another file runs as a sequence of
+   transfers of up to a page, each of which may complete synchronously
+   or from a completion. */
+typedef struct pipe_splice {
+    heap h;
+    thread t;
+    fdesc in;
+    fdesc out;
+    pipe pin;                   /* exactly one of pin and pout is set */
+    pipe pout;
+    pagecache_node pn;          /* regular file input, read from the cache */
+    u64 *off_in;
+    u64 *off_out;
+    u64 remain;
+    u64 done;
+    boolean nonblock;
+    pipe_page page;             /* held across a file read or write */
+    boolean issuing;            /* transfer in progress on this stack */
+    boolean op_done;            /* ...and it completed synchronously */
+    sysreturn op_rv;
+} *pipe_splice;
+
+static void splice_run(pipe_splice ps);
+
+static void splice_free(pipe_splice ps)
+{
+    pipe_release(ps->pin ? ps->pin : ps->pout);
+    deallocate(ps->h, ps, sizeof(struct pipe_splice));
+}
+
+static void splice_finish(pipe_splice ps, sysreturn rv)
+{
+    thread t = ps->t;
+    thread_log(t, "%s: done %ld, rv %ld", __func__, ps->done, rv);
+    if (ps->done > 0)
+        rv = ps->done;
+    splice_free(ps);
+    set_syscall_return(t, rv);
+    file_op_maybe_wake(t);
+}
+
+/* Nothing moved and the pipe end must be waited on; reissue the
+   syscall so that it blocks on the pipe. */
+static void splice_restart(pipe_splice ps)
+{
+    thread t = ps->t;
+    splice_free(ps);
+    syscall_restart(t);
+    file_op_maybe_wake(t);
+}
+
+static boolean splice_advance(pipe_splice ps, sysreturn rv)
+{
+    if (rv <= 0) {
+        splice_finish(ps, rv);
+        return false;
+    }
+    ps->done += rv;
+    ps->remain -= rv;
+    return true;
+}
+
+static inline u64 splice_in_offset(pipe_splice ps)
+{
+    return ps->off_in ? *ps->off_in : ((file)ps->in)->offset;
+}
+
+static inline void splice_in_consumed(pipe_splice ps, u64 n)
+{
+    if (ps->off_in)
+        *ps->off_in += n;
+    else
+        ((file)ps->in)->offset += n;
+}
+
+/* Returns true if the next transfer may be issued, else false with the
+   result to end on in *rv. */
+static boolean splice_ready(pipe_splice ps, sysreturn *rv)
+{
+    pipe p;
+    fdesc f;
+    u32 want;
+
+    *rv = 0;
+    if ((p = ps->pin)) {
+        if (p->length == 0) {
+            if (p->files[PIPE_WRITE].fd != -1)
+                *rv = ps->nonblock ? -EAGAIN : BLOCKQ_BLOCK_REQUIRED;
+            return false;
+        }
+        f = ps->out;
+        want = EPOLLOUT;
+    } else {
+        p = ps->pout;
+        if (p->files[PIPE_READ].fd == -1) {
+            *rv = -EPIPE;
+            return false;
+        }
+        if (pipe_free_bufs(p) == 0) {
+            *rv = ps->nonblock ? -EAGAIN : BLOCKQ_BLOCK_REQUIRED;
+            return false;
+        }
+        if (ps->pn)
+            return splice_in_offset(ps) < ((file)ps->in)->length;
+        f = ps->in;
+        want = EPOLLIN | EPOLLHUP;
+    }
+
+    /* having made progress, return rather than block on the other file */
+    if (ps->done > 0 && f->events && (apply(f->events) & want) == 0)
+        return false;
+    return true;
+}
+
+/* Account for a completed read or write of a file. */
+static sysreturn splice_op_account(pipe_splice ps, sysreturn rv)
+{
+    pipe_page page = ps->page;
+    ps->page = 0;
+    if (ps->pin) {
+        if (page)
+            pipe_page_release(page);
+        if (rv > 0) {
+            pipe_consume(ps->pin, rv);
+            pipe_notify_writer(&ps->pin->files[PIPE_READ], EPOLLOUT);
+            if (ps->off_out)
+                *ps->off_out += rv;
+        }
+        return rv;
+    }
+    ps->pout->reserved--;
+    if (rv > 0) {
+        pipe_push(ps->pout, page, 0, rv);
+        pipe_notify_reader(&ps->pout->files[PIPE_WRITE], EPOLLIN);
+        if (ps->off_in)
+            *ps->off_in += rv;
+    } else {
+        pipe_page_release(page);
+    }
+    return rv;
+}
+
+closure_function(1, 2, void, splice_op_complete,
+                 pipe_splice, ps,
+                 thread, t, sysreturn, rv)
+{
+    pipe_splice ps = bound(ps);
+    closure_finish();
+    rv = splice_op_account(ps, rv);
+    if (ps->issuing) {
+        ps->op_done = true;
+        ps->op_rv = rv;
+        return;
+    }
+    if (splice_advance(ps, rv))
+        splice_run(ps);
+}
+
+closure_function(1, 0, void, splice_cache_page_release,
+                 pagecache_page, pp)
+{
+    pagecache_unpin_page(bound(pp));
+    closure_finish();
+}
+
+closure_function(1, 1, void, splice_page_filled,
+                 pipe_splice, ps,
+                 status, s)
+{
+    pipe_splice ps = bound(ps);
+    closure_finish();
+    if (!is_ok(s)) {
+        thread_log(ps->t, "%s: fill failed: %v", __func__, s);
+        splice_finish(ps, -EIO);
+        return;
+    }
+    splice_run(ps);
+}
+
+/* Queue a page cache page to the pipe by reference. Returns false if
+   the splice will be resumed, or has been finished, by a cache fill. */
+static boolean splice_issue_cache(pipe_splice ps)
+{
+    u64 pos = splice_in_offset(ps);
+    u64 end = pos + MIN(ps->remain, ((file)ps->in)->length - pos);
+    u64 fill = MIN(SPLICE_FILL_PAGES,
+                   (pad(end, PAGESIZE) - (pos & ~MASK(PAGELOG))) >> PAGELOG);
+    status_handler filled = closure(ps->h, splice_page_filled, ps);
+    pagecache_page pp = pagecache_pin_page(ps->pn, pos, fill, filled);
+    if (pp == INVALID_ADDRESS)
+        return false;
+    deallocate_closure(filled);
+
+    u64 page_off = pos & MASK(PAGELOG);
+    u64 n = MIN(end - pos, PAGESIZE - page_off);
+    thunk release = closure(ps->h, splice_cache_page_release, pp);
+    pipe_page page = allocate_pipe_page(pagecache_page_data(pp), false, release);
+    ps->op_done = true;
+    if (page == INVALID_ADDRESS) {
+        apply(release);
+        ps->op_rv = -ENOMEM;
+        return true;
+    }
+    pipe_push(ps->pout, page, page_off, n);
+    splice_in_consumed(ps, n);
+    pipe_notify_reader(&ps->pout->files[PIPE_WRITE], EPOLLIN);
+    ps->op_rv = n;
+    return true;
+}
+
+closure_function(1, 3, boolean, splice_push_ref,
+                 pipe_splice, ps,
+                 void *, data, u64, length, thunk, release)
+{
+    pipe_page page = allocate_pipe_page(data, false, release);
+    if (page == INVALID_ADDRESS)
+        return false;
+    pipe_push(bound(ps)->pout, page, 0, length);
+    return true;
+}
+
+/* Queue received TCP data to the pipe by reference. Returns false if
+   there is nothing to take this way, leaving a copying read to wait for
+   data or to handle a socket that can't lend its buffers. */
+static boolean splice_issue_socket(pipe_splice ps)
+{
+    socket_ref_handler h = closure(ps->h, splice_push_ref, ps);
+    if (h == INVALID_ADDRESS)
+        return false;
+    sysreturn rv = socket_read_ref(ps->in, ps->remain, pipe_free_bufs(ps->pout), h);
+    deallocate_closure(h);
+    if (rv == -EAGAIN || rv == -EOPNOTSUPP)
+        return false;
+    if (rv > 0)
+        pipe_notify_reader(&ps->pout->files[PIPE_WRITE], EPOLLIN);
+    ps->op_done = true;
+    ps->op_rv = rv;
+    return true;
+}
+
+static boolean splice_issue(pipe_splice ps)
+{
+    io_completion c;
+    if (ps->pin) {
+        struct pipe_buf *pb = pipe_buf_at(ps->pin, 0);
+        pipe_page page = pb->page;
+        void *data = page->data + pb->offset;
+        u64 n = MIN(ps->remain, pb->length);
+        fetch_and_add(&page->refcount, 1);
+        c = closure(ps->h, splice_op_complete, ps);
+        /* only lwIP sockets take the page by reference; socketpair ends
+           (FDESC_TYPE_UNIX_SOCKET) copy through their write op */
+        if (ps->out->type == FDESC_TYPE_SOCKET) {
+            socket_write_ref(ps->out, data, n, closure(ps->h, pipe_page_unref, page),
+                             ps->t, true, c);
+        } else {
+            ps->page = page;
+            apply(ps->out->write, data, n, ps->off_out ? *ps->off_out : infinity,
+                  ps->t, true, c);
+        }
+        return true;
+    }
+    if (ps->pn)
+        return splice_issue_cache(ps);
+    /* socketpair ends (FDESC_TYPE_UNIX_SOCKET) are read by copy */
+    if (ps->in->type == FDESC_TYPE_SOCKET && splice_issue_socket(ps))
+        return true;
+
+    pipe_page page = pipe_page_new(ps->pout);
+    if (page == INVALID_ADDRESS) {
+        ps->op_done = true;
+        ps->op_rv = -ENOMEM;
+        return true;
+    }
+    ps->page = page;
+    ps->pout->reserved++;
+    c = closure(ps->h, splice_op_complete, ps);
+    apply(ps->in->read, page->data, MIN(ps->remain, PAGESIZE),
+          ps->off_in ? *ps->off_in : infinity, ps->t, true, c);
+    return true;
+}
+
+/* Issue transfers until the splice completes or must wait. Transfers
+   that complete synchronously are handled in this loop rather than by
+   recursion. */
+static void splice_run(pipe_splice ps)
+{
+    while (ps->remain > 0) {
+        sysreturn rv;
+        if (!splice_ready(ps, &rv)) {
+            if (rv == BLOCKQ_BLOCK_REQUIRED) {
+                if (ps->done == 0) {
+                    splice_restart(ps);
+                    return;
+                }
+                rv = 0;
+            }
+            splice_finish(ps, rv);
+            return;
+        }
+        ps->issuing = true;
+        ps->op_done = false;
+        if (!splice_issue(ps))
+            return;             /* resumed or finished by splice_page_filled */
+        ps->issuing = false;
+        if (!ps->op_done)
+            return;             /* resumed by splice_op_complete */
+        if (!splice_advance(ps, ps->op_rv))
+            return;
+    }
+    splice_finish(ps, 0);
+}
+
+sysreturn splice(int fd_in, u64 *off_in, int fd_out, u64 *off_out, u64 len, unsigned int flags)
+{
+    thread_log(current, "%s: in %d, off_in %p, out %d, off_out %p, len %ld, flags 0x%x",
+               __func__, fd_in, off_in, fd_out, off_out, len, flags);
+    fdesc in = resolve_fd(current->p, fd_in);
+    fdesc out = resolve_fd(current->p, fd_out);
+    if (flags & ~SPLICE_F_ALL)
+        return set_syscall_error(current, EINVAL);
+    if (!in->read || !out->write)
+        return set_syscall_error(current, EBADF);
+
+    pipe pin = fdesc_pipe(in);
+    pipe pout = fdesc_pipe(out);
+    if ((!pin && !pout) || pin == pout)
+        return set_syscall_error(current, EINVAL);
+    if ((pin && off_in) || (pout && off_out))
+        return set_syscall_error(current, ESPIPE);
+    if (len == 0)
+        return 0;
+
+    boolean nonblock = (flags & SPLICE_F_NONBLOCK) != 0;
+    sysreturn rv;
+    if (pin && (rv = pipe_splice_wait((pipe_file)in, nonblock)))
+        return rv;
+    if (pout && (rv = pipe_splice_wait((pipe_file)out, nonblock)))
+        return rv;
+    if (pin && pout)
+        return pipe_splice_pipes(pin, pout, len, false);
+
+    pagecache_node pn = 0;
+    if (in->type == FDESC_TYPE_REGULAR && !is_special(((file)in)->n)) {
+        pn = pagecache_get_node(current->p->fs, ((file)in)->n);
+        if (pn == INVALID_ADDRESS)
+            return set_syscall_error(current, ENOMEM);
+    }
+    heap h = heap_general(get_kernel_heaps());
+    pipe_splice ps = allocate(h, sizeof(struct pipe_splice));
+    if (ps == INVALID_ADDRESS)
+        return set_syscall_error(current, ENOMEM);
+    ps->h = h;
+    ps->t = current;
+    ps->in = in;
+    ps->out = out;
+    ps->pin = pin;
+    ps->pout = pout;
+    ps->pn = pn;
+    ps->off_in = off_in;
+    ps->off_out = off_out;
+    ps->remain = len;
+    ps->done = 0;
+    ps->nonblock = nonblock;
+    ps->page = 0;
+    ps->issuing = false;
+    fetch_and_add(&(pin ? pin : pout)->ref_cnt, 1);
+    file_op_begin(current);
+    splice_run(ps);
+    return file_op_maybe_sleep(current);
+}
+
+sysreturn tee(int fd_in, int fd_out, u64 len, unsigned int flags)
+{
+    thread_log(current, "%s: in %d, out %d, len %ld, flags 0x%x",
+               __func__, fd_in, fd_out, len, flags);
+    fdesc in = resolve_fd(current->p, fd_in);
+    fdesc out = resolve_fd(current->p, fd_out);
+    if (flags & ~SPLICE_F_ALL)
+        return set_syscall_error(current, EINVAL);
+    pipe pin = fdesc_pipe(in);
+    pipe pout = fdesc_pipe(out);
+    if (!pin || !pout || !in->read || !out->write || pin == pout)
+        return set_syscall_error(current, EINVAL);
+    if (len == 0)
+        return 0;
+
+    boolean nonblock = (flags & SPLICE_F_NONBLOCK) != 0;
+    sysreturn rv;
+    if ((rv = pipe_splice_wait((pipe_file)in, nonblock)) ||
+        (rv = pipe_splice_wait((pipe_file)out, nonblock)))
+        return rv;
+    return pipe_splice_pipes(pin, pout, len, true);
+}
+
+/* User memory can't be pinned here, so vmsplice copies it to or from
+   the pipe's pages once, as writev and readv would; it may then be
+   spliced onward by reference. */
+closure_function(5, 1, sysreturn, pipe_vmsplice_bh,
+                 pipe_file, pf, thread, t, struct iovec *, iov, int, iovcnt, boolean, nonblock,
+                 u64, flags)
+{
+    pipe_file pf = bound(pf);
+    pipe p = pf->pipe;
+    boolean write = pf == &p->files[PIPE_WRITE];
+    struct iovec *iov = bound(iov);
+    sysreturn rv = 0;
+
+    if (flags & BLOCKQ_ACTION_NULLIFY) {
+        rv = -EINTR;
+        goto out;
+    }
+
+    if (write) {
+        if (p->files[PIPE_READ].fd == -1) {
+            rv = -EPIPE;
+            goto out;
+        }
+        if (pipe_space(p) == 0)
+            goto block;
+    } else if (p->length == 0) {
+        if (p->files[PIPE_WRITE].fd == -1)
+            goto out;
+        goto block;
+    }
+
+    int i;
+    for (i = 0; i < bound(iovcnt); i++) {
+        u64 len = iov[i].iov_len;
+        u64 n = write ? pipe_copy_in(p, iov[i].iov_base, len) :
+            pipe_copy_out(p, iov[i].iov_base, len);
+        rv += n;
+        if (n < len)
+            break;
+    }
+    if (!write)
+        pipe_notify_writer(pf, EPOLLOUT);
+    else if (rv > 0)
+        pipe_notify_reader(pf, EPOLLIN);
+    else if (i < bound(iovcnt))
+        rv = -ENOMEM;           /* no page for the data */
+  out:
+    blockq_handle_completion(pf->bq, flags, syscall_io_complete, bound(t), rv);
+    closure_finish();
+    return rv;
+  block:
+    if (bound(nonblock) || (pf->f.flags & O_NONBLOCK)) {
+        rv = -EAGAIN;
+        goto out;
+    }
+    return BLOCKQ_BLOCK_REQUIRED;
+}
+
+sysreturn vmsplice(int fd, struct iovec *iov, u64 nr_segs, unsigned int flags)
+{
+    thread_log(current, "%s: fd %d, iov %p, nr_segs %ld, flags 0x%x",
+               __func__, fd, iov, nr_segs, flags);
+    fdesc f = resolve_fd(current->p, fd);
+    if (f->type != FDESC_TYPE_PIPE)
+        return set_syscall_error(current, EBADF);
+    if (nr_segs > IOV_MAX || (flags & ~SPLICE_F_ALL))
+        return set_syscall_error(current, EINVAL);
+    if (nr_segs == 0)
+        return 0;
+
+    pipe_file pf = (pipe_file)f;
+    blockq_action ba = closure(pf->pipe->h, pipe_vmsplice_bh, pf, current, iov, nr_segs,
+                               (flags & SPLICE_F_NONBLOCK) != 0);
+    return blockq_check(pf->bq, current, ba, false);
+}
@@ -20,8 +20,14 @@ typedef struct epollfd {
     struct refcount refcount;
     closure_struct(epollfd_free, free);
     epoll e;
+    fdesc f;                    /* valid while registered */
     boolean registered;
     boolean zombie;		/* freed or masked by oneshot */
+    boolean ready;              /* on e->ready or e->rearm */
+    u32 pending;                /* events reported by notify, not yet delivered */
+    boolean level_check;        /* on e->level */
+    struct list ready_l;
+    struct list level_l;
     notify_entry notify_handle;
 } *epollfd;
 
@@ -72,6 +78,13 @@ struct epoll {
     vector events;		/* epollfds indexed by fd */
     int nfds;
     bitmap fds;			/* fds being watched / epollfd registered */
+    struct list ready;          /* epollfds with events to deliver (epoll only) */
+    struct list rearm;          /* level-triggered epollfds reported to a waiter
+                                   that has yet to return */
+    struct list level;          /* epollfds polled on every wait; see
+                                   fdesc_notifies */
+    boolean delivering;         /* within epoll_deliver */
+    boolean redeliver;          /* delivery requested during the above */
 };
     
 define_closure_function(1, 0, void, epoll_free,
@@ -93,6 +106,10 @@ static epoll epoll_alloc_internal(void)
 	return e;
 
     list_init(&e->blocked_head);
+    list_init(&e->ready);
+    list_init(&e->rearm);
+    list_init(&e->level);
+    e->delivering = e->redeliver = false;
     init_refcount(&e->refcount, init_closure(&e->free, epoll_free, e));
     e->h = heap_general(get_kernel_heaps());
     e->events = allocate_vector(e->h, 8);
@@ -133,8 +150,12 @@ static epollfd alloc_epollfd(epoll e, int fd, u32 eventmask, u64 data)
     efd->e = e;
     efd->data = data;
     init_refcount(&efd->refcount, init_closure(&efd->free, epollfd_free, efd));
+    efd->f = 0;
     efd->registered = false;
     efd->zombie = false;
+    efd->ready = false;
+    efd->pending = 0;
+    efd->level_check = false;
     vector_set(e->events, fd, efd);
     bitmap_set(e->fds, fd, 1);
     if (fd >= e->nfds)
@@ -143,6 +164,38 @@ static epollfd alloc_epollfd(epoll e, int fd, u32 eventmask, u64 data)
     return efd;
 }
 
+static void epollfd_dequeue(epollfd efd)
+{
+    if (efd->ready) {
+        list_delete(&efd->ready_l);
+        efd->ready = false;
+    }
+    efd->pending = 0;
+    if (efd->level_check) {
+        list_delete(&efd->level_l);
+        efd->level_check = false;
+    }
+}
+
+/* Pipes, socketpair ends and eventfds dispatch a notify on every change
+   in readiness, and regular files and directories are always ready, so
+   the ready list alone sees all of their events. lwIP sockets do not
+   notify on every pcb state transition (nor do special files, stdio or
+   nested epolls notify at all), so these are polled on each epoll_wait. */
+static boolean fdesc_notifies(fdesc f)
+{
+    switch (f->type) {
+    case FDESC_TYPE_REGULAR:
+    case FDESC_TYPE_DIRECTORY:
+    case FDESC_TYPE_PIPE:
+    case FDESC_TYPE_UNIX_SOCKET:
+    case FDESC_TYPE_EVENTFD:
+        return true;
+    default:
+        return false;
+    }
+}
+
 static void unregister_epollfd(epollfd efd)
 {
     fdesc f = resolve_fd_noret(current->p, efd->fd);
@@ -163,6 +216,7 @@ static void release_epollfd(epollfd efd)
     vector_set(e->events, fd, 0);
     bitmap_set(e->fds, fd, 0);
     efd->zombie = true;
+    epollfd_dequeue(efd);
     if (efd->registered)
         unregister_epollfd(efd);
     refcount_release(&efd->refcount); /* alloc */
@@ -179,6 +233,7 @@ static boolean register_epollfd(epollfd efd, event_handler eh)
     if (efd->zombie)
         return false; // XXX
     fdesc f = resolve_fd(current->p, efd->fd);
+    efd->f = f;
     efd->registered = true;
     refcount_reserve(&efd->refcount); /* registration */
     epoll_debug("fd %d, eventmask 0x%x, handler %p\n", efd->fd, efd->eventmask, eh);
@@ -274,49 +329,149 @@ static inline u32 report_from_notify_events(epollfd efd, u32 events)
     return edge_detect ? ~efd->lastevents & events : events;
 }
 
-closure_function(1, 1, void, epoll_wait_notify,
+/* Level-triggered epollfds reported to a waiter are held on the rearm
+   list until that waiter returns, so that it doesn't collect duplicates,
+   then put back on the ready list to be polled again on the next wait. */
+static void epoll_rearm(epoll e)
+{
+    list_foreach(&e->rearm, l) {
+        list_delete(l);
+        list_push_back(&e->ready, l);
+    }
+}
+
+/* Deliver events from the ready list to a waiter until its buffer is
+   full. Only epollfds that have seen a notify since last being reported
+   (or that are level-triggered and were still ready) are visited, so
+   cost is independent of the number of registered fds. */
+static int epoll_harvest(epoll e, epoll_blocked w, u64 max)
+{
+    buffer b = w->user_events;
+    int n = 0;
+    list l;
+
+    if (!b)
+        return 0;
+    while (n < max && (b->length - b->end) && (l = list_get_next(&e->ready))) {
+        epollfd efd = struct_from_list(l, epollfd, ready_l);
+        list_delete(l);
+        u32 events = efd->pending;
+        efd->pending = 0;
+        if (efd->zombie || !efd->registered) {
+            efd->ready = false;
+            continue;
+        }
+
+        /* level-triggered events are reported as of now, not as of the notify */
+        boolean level = (efd->eventmask & (EPOLLET | EPOLLONESHOT)) == 0;
+        if (level && efd->f->events)
+            events = apply(efd->f->events) & efd->eventmask;
+        if (!events) {
+            efd->ready = false;
+            continue;
+        }
+
+        struct epoll_event *ev = buffer_ref(b, b->end);
+        ev->data = efd->data;
+        ev->events = events;
+        b->end += sizeof(struct epoll_event);
+        n++;
+        epoll_debug("   epoll_event %p, fd %d, data 0x%lx, events 0x%x\n",
+                    ev, efd->fd, ev->data, ev->events);
+
+        if (efd->eventmask & EPOLLONESHOT)
+            efd->zombie = true;
+
+        /* now that we've reported these events, update last */
+        efd->lastevents |= events;
+
+        if (level)
+            list_push_back(&e->rearm, l);
+        else
+            efd->ready = false;
+    }
+    return n;
+}
+
+/* Give events to the first eligible waiter and wake it. Waking may run
+   the waiter's bottom half synchronously, which releases it (and may
+   otherwise alter the blocked list), so we return rather than continue
+   the walk from a node that might no longer be valid. */
+static boolean epoll_deliver_one(epoll e, int pass)
+{
+    list_foreach(&e->blocked_head, l) {
+        epoll_blocked w = struct_from_list(l, epoll_blocked, blocked_list);
+        if (!w->user_events || (pass == 0 && w->user_events->end))
+            continue;
+        if (epoll_harvest(e, w, pass == 0 ? 1 : infinity)) {
+            blockq_wake_one(w->t->thread_bq);
+            return true;
+        }
+        if (!list_get_next(&e->ready))
+            break;
+    }
+    return false;
+}
+
+/* Hand ready events to blocked waiters, oldest first. A first pass gives
+   one event to each waiter that has none yet, so that readiness spreads
+   across threads rather than piling onto one; a second pass fills
+   waiters in order, passing over any whose buffer is full.
+
+   A waiter returning from epoll_wait_bh puts its level-triggered fds back
+   on the ready list and asks for another delivery; if that happens while
+   a delivery is under way, it is recorded and carried out here once the
+   current walk is done rather than nesting inside it. */
+static boolean epoll_deliver(epoll e)
+{
+    if (e->delivering) {
+        e->redeliver = true;
+        return false;
+    }
+    boolean woken = false;
+    e->delivering = true;
+    do {
+        e->redeliver = false;
+        for (int pass = 0; pass < 2; pass++) {
+            while (list_get_next(&e->ready) && epoll_deliver_one(e, pass))
+                woken = true;
+        }
+    } while (e->redeliver);
+    e->delivering = false;
+    return woken;
+}
+
+closure_function(1, 1, boolean, epoll_wait_notify,
                  epollfd, efd,
                  u32, events)
 {
     epollfd efd = bound(efd);
-    list l = list_get_next(&efd->e->blocked_head);
+    epoll e = efd->e;
 
     /* only path to freedom - even fd removals trigger release */
     if (events == NOTIFY_EVENTS_RELEASE) {
         epoll_debug("efd->fd %d unregistered\n", efd->fd);
         efd->registered = false;
+        epollfd_dequeue(efd);
         closure_finish();
-        return;
+        return false;
     }
 
-    epoll_blocked w = l ? struct_from_list(l, epoll_blocked, blocked_list) : 0;
     u32 report = report_from_notify_events(efd, events);
     assert(efd->registered);
-    epoll_debug("efd->fd %d, events 0x%x, report 0x%x, blocked %p, zombie %d\n",
-                efd->fd, events, report, w, efd->zombie);
-
-    /* XXX need to do some work to properly dole out to multiple epoll_waits (threads)... */
-    if (report && w && !efd->zombie) {
-	if (w->user_events && (w->user_events->length - w->user_events->end)) {
-	    struct epoll_event *e = buffer_ref(w->user_events, w->user_events->end);
-	    e->data = efd->data;
-	    e->events = report;
-	    w->user_events->end += sizeof(struct epoll_event);
-	    epoll_debug("   epoll_event %p, data 0x%lx, events 0x%x\n", e, e->data, e->events);
-
-            /* XXX check this */
-	    if (efd->eventmask & EPOLLONESHOT)
-		efd->zombie = true;
-
-            /* now that we've reported these events, update last */
-            efd->lastevents |= report;
-	} else {
-            /* XXX here we should advance to the next blocked head, probably */
-	    epoll_debug("   user_events null or full\n");
-	    return;
-	}
-	blockq_wake_one(w->t->thread_bq);
+    epoll_debug("efd->fd %d, events 0x%x, report 0x%x, zombie %d\n",
+                efd->fd, events, report, efd->zombie);
+
+    if (!report || efd->zombie)
+        return false;
+
+    efd->pending |= report;
+    if (!efd->ready) {
+        efd->ready = true;
+        list_push_back(&e->ready, &efd->ready_l);
     }
+
+    return epoll_deliver(e);
 }
 
 static epoll_blocked alloc_epoll_blocked(epoll e)
@@ -332,7 +487,7 @@ static epoll_blocked alloc_epoll_blocked(epoll e)
     refcount_reserve(&w->t->refcount);
     w->e = e;
     refcount_reserve(&e->refcount);
-    list_insert_after(&e->blocked_head, &w->blocked_list); /* push */
+    list_push_back(&e->blocked_head, &w->blocked_list);
     return w;
 }
 
@@ -374,6 +529,10 @@ closure_function(3, 1, sysreturn, epoll_wait_bh,
         thread_wakeup(t);
     unwrap_buffer(w->e->h, w->user_events);
     w->user_events = 0;
+
+    /* level-triggered fds still ready may go to another waiter */
+    epoll_rearm(w->e);
+    epoll_deliver(w->e);
     epoll_debug("   pre refcnt %ld, returning %ld\n", w->refcount.c, rv);
     epoll_blocked_release(w);
     closure_finish();
@@ -385,8 +544,10 @@ closure_function(3, 1, sysreturn, epoll_wait_bh,
    - notify on a match only once until condition is reset (EPOLLET)
    - notify once before removing the registration, handled upstream (EPOLLONESHOT)
    - notify only one matching waiter, even across multiple epoll instances (EPOLLEXCLUSIVE)
-     - XXX Not implemented; will require tracking reported events on a per fd - not per
-           registration - basis.
+     - an exclusive registration only sees an event if no exclusive registration
+       ahead of it on the fd woke a waiter; see notify_dispatch
+
+   Within one epoll instance, each event goes to a single waiter; see epoll_deliver.
 */
 sysreturn epoll_wait(int epfd,
                      struct epoll_event *events,
@@ -394,6 +555,17 @@ sysreturn epoll_wait(int epfd,
                      int timeout)
 {
     epoll e = resolve_fd(current->p, epfd);
+
+    /* queue any fds that became ready without a notify; this is done
+       before the waiter is on the blocked list, so any events found are
+       left on the ready list for the harvest below (or given to another
+       waiter already blocked) */
+    list_foreach(&e->level, l) {
+        epollfd efd = struct_from_list(l, epollfd, level_l);
+        if (efd->registered && !efd->zombie && !efd->ready)
+            check_fdesc(efd->f);
+    }
+
     epoll_blocked w = alloc_epoll_blocked(e);
     if (w == INVALID_ADDRESS)
 	return -ENOMEM;
@@ -403,26 +575,9 @@ sysreturn epoll_wait(int epfd,
     w->user_events = wrap_buffer(e->h, events, maxevents * sizeof(struct epoll_event));
     w->user_events->end = 0;
 
-    bitmap_foreach_set(e->fds, fd) {
-	epollfd efd = vector_get(e->events, fd);
-	assert(efd);
-        assert(efd->fd == fd);
-
-        if (efd->zombie)
-            continue;
-
-        fdesc f = resolve_fd_noret(current->p, efd->fd);
-        if (!f) {
-            epoll_debug("   x fd %d\n", efd->fd);
-            release_epollfd(efd);
-            continue;
-        }
-
-        /* event transitions may in some cases need to be polled for
-           (e.g. due to change in lwIP internal state), so request a check */
-        if (efd->registered)
-            check_fdesc(f);
-    }
+    /* readiness transitions queue epollfds as they happen, so only the
+       ready list (and the level checks above) need be visited here */
+    epoll_harvest(e, w, infinity);
 
     return blockq_check_timeout(w->t->thread_bq, current,
                                 closure(e->h, epoll_wait_bh, w, current, timeout != 0),
@@ -441,7 +596,12 @@ static epollfd epollfd_from_fd(epoll e, int fd)
 
 static sysreturn epoll_add_fd(epoll e, int fd, u32 events, u64 data)
 {
-    if (epollfd_from_fd(e, fd) != INVALID_ADDRESS) {
+    epollfd efd = epollfd_from_fd(e, fd);
+    if (efd != INVALID_ADDRESS && !efd->registered && !efd->zombie) {
+        /* left over from a closed fd that has since been reused */
+        epoll_debug("   x fd %d\n", fd);
+        release_epollfd(efd);
+    } else if (efd != INVALID_ADDRESS) {
         epoll_debug("   can't add fd %d to epoll %p; already exists\n", fd, e);
         return -EEXIST;
     }
@@ -450,18 +610,20 @@ static sysreturn epoll_add_fd(epoll e, int fd, u32 events, u64 data)
     if (alloc_epollfd(e, fd, events | EPOLLERR | EPOLLHUP, data) == INVALID_ADDRESS)
         return -ENOMEM;
 
-    epollfd efd = epollfd_from_fd(e, fd);
+    efd = epollfd_from_fd(e, fd);
     assert(efd != INVALID_ADDRESS);
     fdesc f = resolve_fd_noret(current->p, efd->fd);
     assert(f);
     register_epollfd(efd, closure(e->h, epoll_wait_notify, efd));
-
-    /* apply check if we have a waiter */
-    if (!list_empty(&efd->e->blocked_head)) {
-        epoll_debug("   posting check for blocked waiter\n");
-        check_fdesc(f);
+    if (!fdesc_notifies(f)) {
+        efd->level_check = true;
+        list_push_back(&e->level, &efd->level_l);
     }
 
+    /* queue the fd if it is already ready */
+    epoll_debug("   posting initial check\n");
+    check_fdesc(f);
+
     return 0;
 }
 
@@ -487,10 +649,12 @@ sysreturn epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
         return set_syscall_error(current, EFAULT);
     }
 
-    /* EPOLLEXCLUSIVE not yet implemented */
+    /* EPOLLEXCLUSIVE may only be given on add, along with a limited set of events */
     if (event && (event->events & EPOLLEXCLUSIVE)) {
-        msg_err("add: EPOLLEXCLUSIVE not supported\n");
-        return set_syscall_error(current, EINVAL);
+        if (op != EPOLL_CTL_ADD ||
+            (event->events & ~(EPOLLEXCLUSIVE | EPOLLIN | EPOLLOUT | EPOLLET |
+                               EPOLLERR | EPOLLHUP | EPOLLRDNORM | EPOLLWRNORM)))
+            return set_syscall_error(current, EINVAL);
     }
 
     if ((f->type == FDESC_TYPE_REGULAR) || (f->type == FDESC_TYPE_DIRECTORY)) {
@@ -505,6 +669,9 @@ sysreturn epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
         return set_syscall_return(current, remove_fd(e, fd));
     case EPOLL_CTL_MOD:
 	epoll_debug("   modifying %d, events 0x%x, data 0x%lx\n", fd, event->events, event->data);
+        epollfd efd = epollfd_from_fd(e, fd);
+        if (efd != INVALID_ADDRESS && (efd->eventmask & EPOLLEXCLUSIVE))
+            return set_syscall_error(current, EINVAL);
         sysreturn rv = remove_fd(e, fd);
         if (rv != 0)
             return set_syscall_return(current, rv);
@@ -523,7 +690,7 @@ sysreturn epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 #define POLLFDMASK_WRITE	(EPOLLOUT | EPOLLHUP | EPOLLERR)
 #define POLLFDMASK_EXCEPT	(EPOLLPRI)
 
-closure_function(1, 1, void, select_notify,
+closure_function(1, 1, boolean, select_notify,
                  epollfd, efd,
                  u32, events)
 {
@@ -534,7 +701,7 @@ closure_function(1, 1, void, select_notify,
         epoll_debug("efd->fd %d unregistered\n", efd->fd);
         efd->registered = false;
         closure_finish();
-        return;
+        return false;
     }
 
     epoll_blocked w = l ? struct_from_list(l, epoll_blocked, blocked_list) : 0;
@@ -562,8 +729,10 @@ closure_function(1, 1, void, select_notify,
 	    fetch_and_add(&w->retcount, count);
 	    epoll_debug("   event on %d, events 0x%x\n", efd->fd, events);
 	    blockq_wake_one(w->t->thread_bq);
+	    return true;
 	}
     }
+    return false;
 }
 
 closure_function(3, 1, sysreturn, select_bh,
@@ -755,7 +924,7 @@ sysreturn select(int nfds,
     return select_internal(nfds, readfds, writefds, exceptfds, timeout ? time_from_timeval(timeout) : infinity, 0);
 }
 
-closure_function(1, 1, void, poll_notify,
+closure_function(1, 1, boolean, poll_notify,
                  epollfd, efd,
                  u32, events)
 {
@@ -766,7 +935,7 @@ closure_function(1, 1, void, poll_notify,
         epoll_debug("efd->fd %d unregistered\n", efd->fd);
         efd->registered = false;
         closure_finish();
-        return;
+        return false;
     }
 
     epoll_blocked w = l ? struct_from_list(l, epoll_blocked, blocked_list) : 0;
@@ -780,7 +949,9 @@ closure_function(1, 1, void, poll_notify,
         pfd->revents = events;
         epoll_debug("   event on %d (%d), events 0x%x\n", efd->fd, pfd->fd, pfd->revents);
         blockq_wake_one(w->t->thread_bq);
+        return true;
     }
+    return false;
 }
 
 closure_function(3, 1, sysreturn, poll_bh,
@@ -940,6 +1111,9 @@ boolean poll_init(unix_heaps uh)
     if ((uh->epoll_blocked_cache = allocate_objcache(general, backed, sizeof(struct epoll_blocked), PAGESIZE))
 	== INVALID_ADDRESS)
 	return false;
+    objcache_set_name(uh->epoll_cache, "epoll");
+    objcache_set_name(uh->epollfd_cache, "epollfd");
+    objcache_set_name(uh->epoll_blocked_cache, "epoll_blocked");
 
     return true;
 }
@@ -346,7 +346,7 @@ sysreturn socketpair(int domain, int type, int protocol, int sv[2]) {
             msg_err("failed to allocate socketpair write block queue\n");
             break;
         }
-        init_fdesc(h, &s->f, FDESC_TYPE_SOCKET);
+        init_fdesc(h, &s->f, FDESC_TYPE_UNIX_SOCKET);
         s->f.flags = type & ~SOCK_TYPE_MASK;
         s->f.read = closure(sockpair->h, sockpair_read, s);
         s->f.write = closure(sockpair->h, sockpair_write, s);
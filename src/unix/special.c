@@ -1,5 +1,6 @@
 #include <unix_internal.h>
 #include <ftrace.h>
+#include <virtio/virtio.h>
 
 typedef struct special_file {
     const char *path;
@@ -55,22 +56,128 @@ static u32 text_events(const char *text, bytes text_len, file f)
     return events;
 }
 
-static const char cpu_online[] = "0-0\n";
+static void cpu_range(buffer b, int ncpus)
+{
+    bprintf(b, "0-%d\n", ncpus - 1);
+}
 
 static sysreturn cpu_online_read(file f, void *dest, u64 length, u64 offset)
 {
-    return text_read(cpu_online, sizeof(cpu_online) - 1, f, dest, length, offset);
+    buffer b = little_stack_buffer(16);
+    cpu_range(b, online_cpus);
+    return text_read(buffer_ref(b, 0), buffer_length(b), f, dest, length, offset);
 }
 
 static u32 cpu_online_events(file f)
 {
-    return text_events(cpu_online, sizeof(cpu_online) - 1, f);
+    buffer b = little_stack_buffer(16);
+    cpu_range(b, online_cpus);
+    return text_events(buffer_ref(b, 0), buffer_length(b), f);
+}
+
+static sysreturn cpu_present_read(file f, void *dest, u64 length, u64 offset)
+{
+    buffer b = little_stack_buffer(16);
+    cpu_range(b, present_cpus);
+    return text_read(buffer_ref(b, 0), buffer_length(b), f, dest, length, offset);
+}
+
+static u32 cpu_present_events(file f)
+{
+    buffer b = little_stack_buffer(16);
+    cpu_range(b, present_cpus);
+    return text_events(buffer_ref(b, 0), buffer_length(b), f);
+}
+
+static sysreturn pagecache_stats_read(file f, void *dest, u64 length, u64 offset)
+{
+    buffer b = little_stack_buffer(256);
+    pagecache_format_stats(b);
+    return text_read(buffer_ref(b, 0), buffer_length(b), f, dest, length, offset);
+}
+
+static u32 pagecache_stats_events(file f)
+{
+    return EPOLLIN;
+}
+
+static sysreturn virtqueue_stats_read(file f, void *dest, u64 length, u64 offset)
+{
+    buffer b = little_stack_buffer(1024);
+    virtqueue_format_stats(b);
+    return text_read(buffer_ref(b, 0), buffer_length(b), f, dest, length, offset);
+}
+
+static u32 virtqueue_stats_events(file f)
+{
+    return EPOLLIN;
+}
+
+/* one line per named cache; the buffer grows to fit however many exist */
+static sysreturn objcache_stats_read(file f, void *dest, u64 length, u64 offset)
+{
+    buffer b = allocate_buffer(heap_general(get_kernel_heaps()), 4096);
+    if (b == INVALID_ADDRESS)
+        return -ENOMEM;
+    objcache_format_stats(b);
+    sysreturn rv = text_read(buffer_ref(b, 0), buffer_length(b), f, dest, length, offset);
+    deallocate_buffer(b);
+    return rv;
+}
+
+static u32 objcache_stats_events(file f)
+{
+    return EPOLLIN;
+}
+
+static sysreturn boot_trace_read(file f, void *dest, u64 length, u64 offset)
+{
+    buffer b = little_stack_buffer(512);
+    boot_trace_format(b);
+    return text_read(buffer_ref(b, 0), buffer_length(b), f, dest, length, offset);
+}
+
+static u32 boot_trace_events(file f)
+{
+    return EPOLLIN;
+}
+
+/* one line per syscall or subsystem histogram may not fit a small
+   stack buffer */
+static sysreturn latency_read(file f, void *dest, u64 length, u64 offset)
+{
+    buffer b = allocate_buffer(heap_general(get_kernel_heaps()), 4096);
+    if (b == INVALID_ADDRESS)
+        return -ENOMEM;
+    histogram_format_all(b);
+    sysreturn rv = text_read(buffer_ref(b, 0), buffer_length(b), f, dest, length, offset);
+    deallocate_buffer(b);
+    return rv;
+}
+
+/* any write resets the histograms */
+static sysreturn latency_write(file f, void *dest, u64 length, u64 offset)
+{
+    histogram_clear_all();
+    return length;
+}
+
+static u32 latency_events(file f)
+{
+    return EPOLLIN | EPOLLOUT;
 }
 
 static special_file special_files[] = {
     { "/dev/urandom", .read = urandom_read, .write = 0, .events = urandom_events },
     { "/dev/null", .read = null_read, .write = null_write, .events = null_events },
     { "/sys/devices/system/cpu/online", .read = cpu_online_read, .write = null_write, .events = cpu_online_events },
+    { "/sys/devices/system/cpu/present", .read = cpu_present_read, .write = null_write, .events = cpu_present_events },
+    { "/sys/devices/system/cpu/possible", .read = cpu_present_read, .write = null_write, .events = cpu_present_events },
+    { "/sys/kernel/mm/pagecache/stats", .read = pagecache_stats_read, .write = 0, .events = pagecache_stats_events },
+    { "/sys/kernel/mm/objcache/stats", .read = objcache_stats_read, .write = 0, .events = objcache_stats_events },
+    { "/sys/kernel/latency", .read = latency_read, .write = latency_write, .events = latency_events },
+    { "/sys/kernel/boot/phases", .read = boot_trace_read, .write = 0, .events = boot_trace_events },
+    { "/sys/kernel/virtio/virtqueue/stats", .read = virtqueue_stats_read, .write = 0, .events = virtqueue_stats_events },
     FTRACE_SPECIAL_FILES
 };
 
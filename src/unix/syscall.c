@@ -31,7 +31,6 @@ io_completion syscall_io_complete;
 
 void register_other_syscalls(struct syscall *map)
 {
-    register_syscall(map, msync, 0);
     register_syscall(map, shmget, 0);
     register_syscall(map, shmat, 0);
     register_syscall(map, shmctl, 0);
@@ -104,7 +103,6 @@ void register_other_syscalls(struct syscall *map)
     register_syscall(map, _sysctl, 0);
     register_syscall(map, adjtimex, 0);
     register_syscall(map, chroot, 0);
-    register_syscall(map, sync, 0);
     register_syscall(map, acct, 0);
     register_syscall(map, settimeofday, 0);
     register_syscall(map, mount, 0);
@@ -193,10 +191,7 @@ void register_other_syscalls(struct syscall *map)
     register_syscall(map, unshare, 0);
     register_syscall(map, set_robust_list, 0);
     register_syscall(map, get_robust_list, 0);
-    register_syscall(map, splice, 0);
-    register_syscall(map, tee, 0);
     register_syscall(map, sync_file_range, 0);
-    register_syscall(map, vmsplice, 0);
     register_syscall(map, move_pages, 0);
     register_syscall(map, utimensat, 0);
     register_syscall(map, signalfd, 0);
@@ -209,13 +204,11 @@ void register_other_syscalls(struct syscall *map)
     register_syscall(map, preadv, 0);
     register_syscall(map, pwritev, 0);
     register_syscall(map, perf_event_open, 0);
-    register_syscall(map, recvmmsg, 0);
     register_syscall(map, fanotify_init, 0);
     register_syscall(map, fanotify_mark, 0);
     register_syscall(map, name_to_handle_at, 0);
     register_syscall(map, open_by_handle_at, 0);
     register_syscall(map, clock_adjtime, 0);
-    register_syscall(map, syncfs, 0);
     register_syscall(map, setns, 0);
     register_syscall(map, getcpu, 0);
     register_syscall(map, process_vm_readv, 0);
@@ -493,6 +486,8 @@ sysreturn read(int fd, u8 *dest, bytes length)
     fdesc f = resolve_fd(current->p, fd);
     if (!f->read)
         return set_syscall_error(current, EINVAL);
+    if (!fault_in_user_range(dest, length, true))
+        return get_syscall_return(current);
 
     /* use (and update) file offset */
     return apply(f->read, dest, length, infinity, current, false, syscall_io_complete);
@@ -503,6 +498,8 @@ sysreturn pread(int fd, u8 *dest, bytes length, s64 offset)
     fdesc f = resolve_fd(current->p, fd);
     if (!f->read || offset < 0)
         return set_syscall_error(current, EINVAL);
+    if (!fault_in_user_range(dest, length, true))
+        return get_syscall_return(current);
 
     /* use given offset with no file offset update */
     return apply(f->read, dest, length, offset, current, false, syscall_io_complete);
@@ -511,6 +508,8 @@ sysreturn pread(int fd, u8 *dest, bytes length, s64 offset)
 sysreturn readv(int fd, struct iovec *iov, int iovcnt)
 {
     fdesc f = resolve_fd(current->p, fd);
+    if (!fault_in_user_iov(iov, iovcnt, true))
+        return get_syscall_return(current);
     return iov_op(f, f->read, iov, iovcnt, syscall_io_complete);
 }
 
@@ -519,6 +518,8 @@ sysreturn write(int fd, u8 *body, bytes length)
     fdesc f = resolve_fd(current->p, fd);
     if (!f->write)
         return set_syscall_error(current, EINVAL);
+    if (!fault_in_user_range(body, length, false))
+        return get_syscall_return(current);
 
     /* use (and update) file offset */
     return apply(f->write, body, length, infinity, current, false, syscall_io_complete);
@@ -529,6 +530,8 @@ sysreturn pwrite(int fd, u8 *body, bytes length, s64 offset)
     fdesc f = resolve_fd(current->p, fd);
     if (!f->write || offset < 0)
         return set_syscall_error(current, EINVAL);
+    if (!fault_in_user_range(body, length, false))
+        return get_syscall_return(current);
 
     return apply(f->write, body, length, offset, current, false, syscall_io_complete);
 }
@@ -536,6 +539,8 @@ sysreturn pwrite(int fd, u8 *body, bytes length, s64 offset)
 sysreturn writev(int fd, struct iovec *iov, int iovcnt)
 {
     fdesc f = resolve_fd(current->p, fd);
+    if (!fault_in_user_iov(iov, iovcnt, false))
+        return get_syscall_return(current);
     return iov_op(f, f->write, iov, iovcnt, syscall_io_complete);
 }
 
@@ -561,11 +566,6 @@ static boolean is_dir(tuple n)
     return children(n) ? true : false;
 }
 
-static boolean is_special(tuple n)
-{
-    return table_find(n, sym(special)) ? true : false;
-}
-
 closure_function(5, 2, void, file_op_complete,
                  thread, t, file, f, fsfile, fsf, boolean, is_file_offset, io_completion, completion,
                  status, s, bytes, length)
@@ -579,7 +579,7 @@ closure_function(5, 2, void, file_op_complete,
     if (is_ok(s)) {
         /* if regular file, update length */
         if (bound(fsf))
-            f->length = fsfile_get_length(bound(fsf));
+            f->length = pagecache_file_length(f->n, bound(fsf));
         if (bound(is_file_offset)) /* vs specified offset (pread) */
             f->offset += length;
         rv = length;
@@ -633,6 +633,154 @@ out_complete:
     closure_finish();
 }
 
+/* Sending a regular file to a socket transmits straight from the page
+   cache. Each page is pinned and queued to the socket by reference, a
+   page at a time, so there is no staging buffer and no copy; the pin
+   is dropped once the socket no longer needs the data. */
+
+/* pages requested per cache fill when a page isn't resident */
+#define SENDFILE_FILL_PAGES 16
+
+typedef struct sendfile_pages {
+    heap h;
+    thread t;
+    file in;
+    pagecache_node pn;
+    fdesc out;
+    int *offset;
+    u64 pos;
+    u64 end;
+    u64 sent;
+    boolean issuing;            /* socket write in progress on this stack */
+    boolean write_done;         /* ...and it completed synchronously */
+    sysreturn write_rv;
+} *sendfile_pages;
+
+static void sendfile_pages_run(sendfile_pages sp);
+
+static void sendfile_pages_finish(sendfile_pages sp, sysreturn rv)
+{
+    thread t = sp->t;
+    thread_log(t, "%s: sent %ld, rv %ld", __func__, sp->sent, rv);
+    if (sp->sent > 0) {
+        rv = sp->sent;
+        if (sp->offset)
+            *sp->offset += rv;
+        else
+            sp->in->offset += rv;
+    }
+    deallocate(sp->h, sp, sizeof(struct sendfile_pages));
+    set_syscall_return(t, rv);
+    file_op_maybe_wake(t);
+}
+
+/* Account for a completed socket write. Returns false if the transfer
+   has ended. */
+static boolean sendfile_pages_advance(sendfile_pages sp, sysreturn rv)
+{
+    if (rv <= 0) {
+        sendfile_pages_finish(sp, rv);
+        return false;
+    }
+    sp->pos += rv;
+    sp->sent += rv;
+    return true;
+}
+
+closure_function(1, 0, void, sendfile_page_release,
+                 pagecache_page, pp)
+{
+    pagecache_unpin_page(bound(pp));
+    closure_finish();
+}
+
+closure_function(1, 2, void, sendfile_page_sent,
+                 sendfile_pages, sp,
+                 thread, t, sysreturn, rv)
+{
+    sendfile_pages sp = bound(sp);
+    closure_finish();
+    if (sp->issuing) {
+        sp->write_done = true;
+        sp->write_rv = rv;
+        return;
+    }
+    if (sendfile_pages_advance(sp, rv))
+        sendfile_pages_run(sp);
+}
+
+closure_function(1, 1, void, sendfile_page_filled,
+                 sendfile_pages, sp,
+                 status, s)
+{
+    sendfile_pages sp = bound(sp);
+    closure_finish();
+    if (!is_ok(s)) {
+        thread_log(sp->t, "%s: fill failed: %v", __func__, s);
+        sendfile_pages_finish(sp, -EIO);
+        return;
+    }
+    sendfile_pages_run(sp);
+}
+
+/* Issue writes until the transfer completes or must wait on a cache
+   fill or on the socket. Writes that complete synchronously are
+   handled in this loop rather than by recursion. */
+static void sendfile_pages_run(sendfile_pages sp)
+{
+    heap h = sp->h;
+    while (sp->pos < sp->end) {
+        u64 fill = MIN(SENDFILE_FILL_PAGES,
+                       (pad(sp->end, PAGESIZE) - (sp->pos & ~MASK(PAGELOG))) >> PAGELOG);
+        status_handler filled = closure(h, sendfile_page_filled, sp);
+        pagecache_page pp = pagecache_pin_page(sp->pn, sp->pos, fill, filled);
+        if (pp == INVALID_ADDRESS)
+            return;             /* resumed or finished by sendfile_page_filled */
+        deallocate_closure(filled);
+
+        u64 page_off = sp->pos & MASK(PAGELOG);
+        u64 len = MIN(sp->end - sp->pos, PAGESIZE - page_off);
+        sp->issuing = true;
+        sp->write_done = false;
+        socket_write_ref(sp->out, pagecache_page_data(pp) + page_off, len,
+                         closure(h, sendfile_page_release, pp), sp->t, true,
+                         closure(h, sendfile_page_sent, sp));
+        sp->issuing = false;
+        if (!sp->write_done)
+            return;             /* resumed by sendfile_page_sent */
+        if (!sendfile_pages_advance(sp, sp->write_rv))
+            return;
+    }
+    sendfile_pages_finish(sp, 0);
+}
+
+static sysreturn sendfile_from_cache(file in, fdesc out, int *offset, bytes count)
+{
+    u64 start = offset ? *offset : in->offset;
+    if (start >= in->length || count == 0)
+        return 0;
+    pagecache_node pn = pagecache_get_node(current->p->fs, in->n);
+    if (pn == INVALID_ADDRESS)
+        return set_syscall_error(current, ENOMEM);
+    heap h = heap_general(get_kernel_heaps());
+    sendfile_pages sp = allocate(h, sizeof(struct sendfile_pages));
+    if (sp == INVALID_ADDRESS)
+        return set_syscall_error(current, ENOMEM);
+    sp->h = h;
+    sp->t = current;
+    sp->in = in;
+    sp->pn = pn;
+    sp->out = out;
+    sp->offset = offset;
+    sp->pos = start;
+    sp->end = start + MIN(count, in->length - start);
+    sp->sent = 0;
+    sp->issuing = false;
+    file_op_begin(current);
+    sendfile_pages_run(sp);
+    return file_op_maybe_sleep(current);
+}
+
 static sysreturn sendfile(int out_fd, int in_fd, int *offset, bytes count)
 {
     thread_log(current, "%s: out %d, in %d, offset %p, *offset %d, count %ld",
@@ -643,7 +791,13 @@ static sysreturn sendfile(int out_fd, int in_fd, int *offset, bytes count)
 
     if (!infile->read || !outfile->write)
         return set_syscall_error(current, EINVAL);
-    
+
+    /* only lwIP sockets take data by reference; others use the copy below */
+    if (infile->type == FDESC_TYPE_REGULAR && !is_special(((file)infile)->n) &&
+        outfile->type == FDESC_TYPE_SOCKET)
+        return sendfile_from_cache((file)infile, outfile, offset, count);
+
+
     void *buf = allocate(h, count);
     io_completion read_complete = closure(h, sendfile_bh, h, outfile, offset, buf, count, 0, 0, false);
     apply(infile->read, buf, count, offset ? *offset : infinity, current, false, read_complete);
@@ -668,11 +822,14 @@ closure_function(2, 6, sysreturn, file_read,
     }
 
     if (offset < f->length) {
+        pagecache_node pn = pagecache_get_node(t->p->fs, f->n);
+        if (pn == INVALID_ADDRESS)
+            return set_syscall_error(t, ENOMEM);
         file_op_begin(t);
-        filesystem_read(t->p->fs, f->n, dest, length, offset,
-                        closure(heap_general(get_kernel_heaps()),
-                                file_op_complete, t, f, fsf, is_file_offset,
-                                completion));
+        pagecache_read(pn, dest, length, offset,
+                       closure(heap_general(get_kernel_heaps()),
+                               file_op_complete, t, f, fsf, is_file_offset,
+                               completion));
 
         /* possible direct return in top half */
         return bh ? SYSRETURN_CONTINUE_BLOCKING : file_op_maybe_sleep(t);
@@ -697,31 +854,25 @@ closure_function(2, 6, sysreturn, file_write,
                length, f->length);
     heap h = heap_general(get_kernel_heaps());
 
-    u64 final_length = PAD_WRITES ? pad(length, SECTOR_SIZE) : length;
-    void *buf = allocate(h, final_length);
-
-    /* XXX we shouldn't need to copy here, however if we at some point
-       want to support non-blocking, we'll need to fix the unaligned
-       block rmw in the extent write (prob just break it up into
-       aligned and unaligned portions, copying aligned data straight
-       to dma buffer and stashing unaligned portions to be copied post
-       block read) */
-
-    /* copy from userspace, XXX: check pointer safety */
-    runtime_memset(buf, 0, final_length);
-    runtime_memcpy(buf, dest, length);
-
     if (is_special(f->n)) {
+        /* copy from userspace, XXX: check pointer safety */
+        u64 final_length = PAD_WRITES ? pad(length, SECTOR_SIZE) : length;
+        void *buf = allocate(h, final_length);
+        runtime_memset(buf, 0, final_length);
+        runtime_memcpy(buf, dest, length);
         return spec_write(f, buf, length, offset, t, bh, completion);
     }
 
-    buffer b = wrap_buffer(h, buf, final_length);
-    thread_log(t, "%s: b_ref: %p", __func__, buffer_ref(b, 0));
+    pagecache_node pn = pagecache_get_node(t->p->fs, f->n);
+    if (pn == INVALID_ADDRESS)
+        return set_syscall_error(t, ENOMEM);
 
+    /* data is copied (from userspace, XXX: check pointer safety) into
+       the page cache, which issues the filesystem write */
     file_op_begin(t);
-    filesystem_write(t->p->fs, f->n, b, offset,
-                     closure(h, file_op_complete, t, f, fsf, is_file_offset,
-                     completion));
+    pagecache_write(pn, dest, length, offset,
+                    closure(h, file_op_complete, t, f, fsf, is_file_offset,
+                            completion));
 
     /* possible direct return in top half */
     return bh ? SYSRETURN_CONTINUE_BLOCKING : file_op_maybe_sleep(t);
@@ -802,7 +953,7 @@ sysreturn open_internal(tuple cwd, const char *name, int flags, int mode)
         if (!fsf) {
             length = 0;
         } else {
-            length = fsfile_get_length(fsf);
+            length = pagecache_file_length(n, fsf);
         }
     }
 
@@ -1135,6 +1286,7 @@ static sysreturn truncate_internal(tuple t, long length)
     if (!fsf) {
         return set_syscall_error(current, ENOENT);
     }
+    pagecache_truncate(t, length);
     file_op_begin(current);
     if (filesystem_truncate(current->p->fs, fsf, length,
             closure(heap_general(get_kernel_heaps()), truncate_complete,
@@ -1183,7 +1335,7 @@ sysreturn fsync(int fd)
     file f = resolve_fd(current->p, fd);
 
     file_op_begin(current);
-    if (filesystem_flush(current->p->fs, f->n,
+    if (pagecache_sync(current->p->fs, f->n,
             closure(heap_general(get_kernel_heaps()), fsync_complete, current,
             f))) {
         /* Nothing to sync. */
@@ -1197,6 +1349,32 @@ sysreturn fdatasync(int fd)
     return fsync(fd);
 }
 
+closure_function(1, 1, void, sync_complete,
+                 thread, t,
+                 status, s)
+{
+    thread t = bound(t);
+    thread_log(t, "%s: status %v", __func__, s);
+    set_syscall_return(t, is_ok(s) ? 0 : -EIO);
+    file_op_maybe_wake(t);
+    closure_finish();
+}
+
+sysreturn sync(void)
+{
+    file_op_begin(current);
+    mmap_collect_dirty(current->p);
+    pagecache_sync_all(current->p->fs,
+                       closure(heap_general(get_kernel_heaps()), sync_complete, current));
+    return file_op_maybe_sleep(current);
+}
+
+sysreturn syncfs(int fd)
+{
+    resolve_fd(current->p, fd);
+    return sync();
+}
+
 sysreturn access(const char *name, int mode)
 {
     thread_log(current, "access: \"%s\", mode %d", name, mode);
@@ -1242,6 +1420,7 @@ static void fill_stat(int type, tuple n, struct stat *s)
         s->st_mode = S_IFCHR;   /* assuming only character devs now */
         break;
     case FDESC_TYPE_SOCKET:
+    case FDESC_TYPE_UNIX_SOCKET:
         s->st_mode = S_IFSOCK;
         break;
     case FDESC_TYPE_PIPE:
@@ -1258,7 +1437,7 @@ static void fill_stat(int type, tuple n, struct stat *s)
     if (type == FDESC_TYPE_REGULAR) {
         fsfile f = fsfile_from_node(current->p->fs, n);
         if (f)
-            s->st_size = fsfile_get_length(f);
+            s->st_size = pagecache_file_length(n, f);
     }
     thread_log(current, "st_ino %lx, st_mode 0x%x, st_size %lx",
             s->st_ino, s->st_mode, s->st_size);
@@ -1766,9 +1945,29 @@ void exit(int code)
     runloop();
 }
 
+closure_function(1, 1, void, exit_sync_complete,
+                 int, status,
+                 status, s)
+{
+    if (!is_ok(s))
+        msg_err("failed to sync filesystem on exit: %v\n", s);
+    vm_exit(bound(status));
+}
+
+/* Data that write() has reported as written may still be in the page
+   cache or in a pending log batch, as may stores made through shared
+   file mappings; sync before exiting. */
 sysreturn exit_group(int status)
 {
-    vm_exit(status);
+    status_handler sh = closure(heap_general(get_kernel_heaps()), exit_sync_complete, status);
+    if (sh == INVALID_ADDRESS) {
+        msg_err("failed to allocate exit completion; exiting without sync\n");
+        vm_exit(status);
+    }
+    current->syscall = -1;
+    mmap_collect_dirty(current->p);
+    pagecache_sync_all(current->p->fs, sh);
+    thread_sleep_uninterruptible();
 }
 
 sysreturn pipe2(int fds[2], int flags)
@@ -1798,7 +1997,9 @@ sysreturn sched_getaffinity(int pid, u64 cpusetsize, cpu_set_t *mask)
 {
     if (!mask || cpusetsize < sizeof(mask->mask[0]))
         return set_syscall_error(current, EINVAL);
-    mask->mask[0] = 1;      /* always cpu 0 */
+    /* online cpus are numbered from zero, and MAX_CPUS fits one word */
+    build_assert(MAX_CPUS <= 64);
+    mask->mask[0] = online_cpus == 64 ? -1ull : MASK(online_cpus);
     return sizeof(mask->mask[0]);
 }
 
@@ -1869,6 +2070,8 @@ void register_file_syscalls(struct syscall *map)
     register_syscall(map, ftruncate, ftruncate);
     register_syscall(map, fdatasync, fdatasync);
     register_syscall(map, fsync, fsync);
+    register_syscall(map, sync, sync);
+    register_syscall(map, syncfs, syncfs);
     register_syscall(map, access, access);
     register_syscall(map, lseek, lseek);
     register_syscall(map, fcntl, fcntl);
@@ -1899,6 +2102,9 @@ void register_file_syscalls(struct syscall *map)
     register_syscall(map, getrandom, getrandom);
     register_syscall(map, pipe, pipe);
     register_syscall(map, pipe2, pipe2);
+    register_syscall(map, splice, splice);
+    register_syscall(map, tee, tee);
+    register_syscall(map, vmsplice, vmsplice);
     register_syscall(map, socketpair, socketpair);
     register_syscall(map, eventfd, eventfd);
     register_syscall(map, eventfd2, eventfd2);
@@ -1927,6 +2133,7 @@ struct syscall {
     void *handler;
     const char *name;
     int flags;
+    histogram latency;          /* allocated on first use */
 };
 
 static struct syscall _linux_syscalls[SYS_MAX];
@@ -1934,6 +2141,19 @@ struct syscall *linux_syscalls = _linux_syscalls;
 
 static context syscall_frame;
 
+boolean is_syscall_context(context frame)
+{
+    return frame == syscall_frame;
+}
+
+/* Arrange for the thread's current syscall to be reissued when it
+   next runs, e.g. after sleeping on a fault taken within the syscall. */
+void syscall_restart(thread t)
+{
+    t->frame[FRAME_RIP] -= 2;   /* length of syscall instruction */
+    t->frame[FRAME_RAX] = t->frame[FRAME_VECTOR];
+}
+
 static void syscall_debug()
 {
     sysreturn rv = -ENOSYS;
@@ -1954,6 +2174,10 @@ static void syscall_debug()
     }
     sysreturn (*h)(u64, u64, u64, u64, u64, u64) = s->handler;
     if (h) {
+        /* timed until the thread returns to user, whether directly or
+           after blocking */
+        current->syscall_timed = s;
+        current->syscall_start = now(CLOCK_ID_MONOTONIC);
         proc_enter_system(current->p);
 
         /* exchange frames so that a fault won't clobber the syscall
@@ -1967,6 +2191,7 @@ static void syscall_debug()
             thread_log(current, "direct return: %ld, rsp 0x%lx", rv, f[FRAME_RSP]);
         proc_enter_user(current->p);
         running_frame = saveframe;
+        syscall_timing_end(current);
     } else if (debugsyscalls) {
         if (s->name)
             thread_log(current, "nosyscall %s", s->name);
@@ -1981,6 +2206,22 @@ static void syscall_debug()
     dispatch_signals(current);
 }
 
+void syscall_timing_end(thread t)
+{
+    struct syscall *s = t->syscall_timed;
+    if (!s)
+        return;
+    t->syscall_timed = 0;
+    if (!s->latency) {
+        s->latency = allocate_histogram(heap_general(get_kernel_heaps()), "syscall", s->name);
+        if (s->latency == INVALID_ADDRESS) {
+            s->latency = 0;
+            return;
+        }
+    }
+    histogram_record_since(s->latency, t->syscall_start);
+}
+
 boolean syscall_notrace(int syscall)
 {
     if (syscall < 0 || syscall >= sizeof(_linux_syscalls) / sizeof(_linux_syscalls[0]))
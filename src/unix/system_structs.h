@@ -117,6 +117,13 @@ typedef struct iovec {
 #define O_DIRECT        00040000
 #define O_CLOEXEC       02000000
 
+/* splice(2), tee(2) and vmsplice(2) flags */
+#define SPLICE_F_MOVE           1
+#define SPLICE_F_NONBLOCK       2
+#define SPLICE_F_MORE           4
+#define SPLICE_F_GIFT           8
+#define SPLICE_F_ALL            (SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE | SPLICE_F_GIFT)
+
 #define F_LINUX_SPECIFIC_BASE   0x400
 
 /* Values for the second argument to `fcntl'.  */
@@ -173,12 +180,17 @@ struct flock {
 
 #define MAP_FIXED 0x10
 #define MAP_ANONYMOUS 0x20
+#define MAP_SHARED	0x01
 #define MAP_PRIVATE	0x02
 #define MREMAP_MAYMOVE	1
 #define MREMAP_FIXED	2
 #define MAP_STACK	0x20000
 #define MAP_32BIT	0x40
 
+#define MS_ASYNC	1
+#define MS_INVALIDATE	2
+#define MS_SYNC		4
+
 #define PROT_READ       0x1
 #define PROT_WRITE      0x2
 #define PROT_EXEC       0x4
@@ -309,6 +321,13 @@ struct rlimit {
 # define SEGV_PKUERR    4   /* failed protection key checks */
 #define NSIGSEGV    4
 
+/*
+ * SIGBUS si_codes
+ */
+#define BUS_ADRALN  1   /* invalid address alignment */
+#define BUS_ADRERR  2   /* non-existent physical address */
+#define BUS_OBJERR  3   /* object specific hardware error */
+
 typedef struct siginfo {
     u32 si_signo;
     s32 si_errno;
@@ -678,7 +697,7 @@ struct epoll_event {
 #define EPOLLWRBAND	0x00000200
 #define EPOLLMSG	0x00000400
 #define EPOLLRDHUP	0x00002000
-#define EPOLLEXCLUSIVE	(1u << 29)
+#define EPOLLEXCLUSIVE	(1u << 28)
 #define EPOLLWAKEUP	(1u << 29)
 #define EPOLLONESHOT	(1u << 30)
 #define EPOLLET		(1u << 31)
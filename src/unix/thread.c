@@ -122,6 +122,9 @@ closure_function(1, 0, void, run_thread,
     /* cover wake-before-sleep situations (e.g. sched yield, fs ops that don't go to disk, etc.) */
     current->blocked_on = 0;
 
+    /* a syscall that blocked returns to user here */
+    syscall_timing_end(t);
+
     /* check if we have a pending signal */
     dispatch_signals(t);
 
@@ -208,6 +211,7 @@ thread create_thread(process p)
 
     t->p = p;
     t->syscall = -1;
+    t->syscall_timed = 0;
     t->uh = *p->uh;
     init_refcount(&t->refcount, init_closure(&t->free, free_thread, t));
     t->select_epoll = 0;
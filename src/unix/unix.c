@@ -270,10 +270,18 @@ process init_unix(kernel_heaps kh, tuple root, filesystem fs)
     uh->file_cache = allocate_objcache(h, heap_backed(kh), sizeof(struct file), PAGESIZE);
     if (uh->file_cache == INVALID_ADDRESS)
 	goto alloc_fail;
+    objcache_set_name(uh->file_cache, "file");
+    if (!notify_init(uh))
+	goto alloc_fail;
+    if (!blockq_init(uh))
+	goto alloc_fail;
+    mmap_init();
     if (!poll_init(uh))
 	goto alloc_fail;
     if (!pipe_init(uh))
 	goto alloc_fail;
+    if (!pagecache_init(uh, root))
+	goto alloc_fail;
 
     if (ftrace_init(uh, fs))
 	goto alloc_fail;
@@ -8,7 +8,7 @@ typedef struct thread *thread;
 process init_unix(kernel_heaps kh, tuple root, filesystem fs);
 process create_process(unix_heaps uh, tuple root, filesystem fs);
 thread create_thread(process p);
-process exec_elf(buffer ex, process kernel_process);
+process exec_elf(tuple program, process kernel_process);
 
 void proc_enter_user(process p);
 void proc_enter_system(process p);
@@ -107,6 +107,9 @@ typedef struct unix_heaps {
     heap epollfd_cache;
     heap epoll_blocked_cache;
     heap pipe_cache;
+    heap pipe_page_cache;
+    heap notify_entry_cache;
+    heap blockq_item_cache;
 #ifdef NET
     heap socket_cache;
 #endif
@@ -183,6 +186,10 @@ typedef struct thread {
     int syscall;
     process p;
 
+    /* syscall being timed, and when it was entered */
+    struct syscall *syscall_timed;
+    timestamp syscall_start;
+
     /* Heaps in the unix world are typically found through
        current. Copying them here means any heap is accessed through
        one level of indirection. It also allows heaps to be
@@ -234,10 +241,12 @@ typedef closure_type(io, sysreturn, void *buf, u64 length, u64 offset, thread t,
 #define FDESC_TYPE_REGULAR      1
 #define FDESC_TYPE_DIRECTORY    2
 #define FDESC_TYPE_SPECIAL      3
-#define FDESC_TYPE_SOCKET       4
+#define FDESC_TYPE_SOCKET       4       /* lwIP socket (struct sock) */
 #define FDESC_TYPE_PIPE         5
 #define FDESC_TYPE_STDIO        6
 #define FDESC_TYPE_EPOLL        7
+#define FDESC_TYPE_UNIX_SOCKET  8       /* socketpair end */
+#define FDESC_TYPE_EVENTFD      9
 
 typedef struct fdesc {
     io read, write;
@@ -270,10 +279,16 @@ void epoll_finish(epoll e);
 #define VMAP_FLAG_ANONYMOUS     2
 #define VMAP_FLAG_WRITABLE      4
 #define VMAP_FLAG_EXEC          8
+#define VMAP_FLAG_SHARED        16
+
+typedef struct pagecache_node *pagecache_node;
+typedef struct pagecache_page *pagecache_page;
 
 typedef struct vmap {
     struct rmnode node;
     u64 flags;
+    pagecache_node cache_node;  /* file backing, if any */
+    u64 file_base;              /* address of file offset 0; unchanged by splits */
 } *vmap;
 
 vmap allocate_vmap(rangemap rm, range r, u64 flags);
@@ -349,6 +364,7 @@ void deallocate_fd(process p, int fd);
 
 void init_vdso(heap, heap);
 
+void mmap_init(void);
 void mmap_process_init(process p);
 
 static inline u64 get_aslr_offset(u64 range)
@@ -409,6 +425,7 @@ void _register_syscall(struct syscall *m, int n, sysreturn (*f)(), const char *n
 
 void configure_syscalls(process p);
 boolean syscall_notrace(int syscall);
+void syscall_timing_end(thread t);
 
 void register_file_syscalls(struct syscall *);
 void register_net_syscalls(struct syscall *);
@@ -421,10 +438,42 @@ void register_other_syscalls(struct syscall *);
 
 boolean poll_init(unix_heaps uh);
 boolean pipe_init(unix_heaps uh);
+boolean notify_init(unix_heaps uh);
+boolean blockq_init(unix_heaps uh);
+boolean pagecache_init(unix_heaps uh, tuple root);
+
+pagecache_node pagecache_get_node(filesystem fs, tuple t);
+u64 pagecache_node_length(pagecache_node pn);
+u64 pagecache_file_length(tuple t, fsfile fsf);
+boolean pagecache_map_page(pagecache_node pn, u64 offset, u64 vaddr, u64 flags,
+                           boolean copy, u64 fill_pages, status_handler complete);
+boolean pagecache_release_mapped_page(u64 phys);
+boolean pagecache_is_mapped_page(u64 phys);
+boolean pagecache_dirty_mapped_page(u64 phys);
+pagecache_page pagecache_pin_page(pagecache_node pn, u64 offset, u64 fill_pages,
+                                  status_handler complete);
+void pagecache_unpin_page(pagecache_page pp);
+void *pagecache_page_data(pagecache_page pp);
+void pagecache_read(pagecache_node pn, void *dest, u64 length, u64 offset,
+                    io_status_handler completion);
+void pagecache_write(pagecache_node pn, void *src, u64 length, u64 offset,
+                     io_status_handler completion);
+void pagecache_truncate(tuple t, u64 length);
+boolean pagecache_sync(filesystem fs, tuple t, status_handler completion);
+boolean pagecache_node_sync(pagecache_node pn, status_handler completion);
+void pagecache_sync_all(filesystem fs, status_handler completion);
+u64 pagecache_drain(u64 length);
+void pagecache_format_stats(buffer b);
+
 #define sysreturn_from_pointer(__x) ((s64)u64_from_pointer(__x));
 
 extern sysreturn syscall_ignore();
 boolean unix_fault_page(u64 vaddr, context frame);
+boolean fault_in_user_range(void *addr, u64 length, boolean write);
+boolean fault_in_user_iov(struct iovec *iov, int iovcnt, boolean write);
+void mmap_collect_dirty(process p);
+boolean is_syscall_context(context frame);
+void syscall_restart(thread t);
 
 void thread_log_internal(thread t, const char *desc, ...);
 #define thread_log(__t, __desc, ...) thread_log_internal(__t, __desc, ##__VA_ARGS__)
@@ -513,12 +562,26 @@ static inline boolean futex_wake_one_by_uaddr(process p, int *uaddr)
 }
 
 int do_pipe2(int fds[2], int flags);
+sysreturn splice(int fd_in, u64 *off_in, int fd_out, u64 *off_out, u64 len, unsigned int flags);
+sysreturn tee(int fd_in, int fd_out, u64 len, unsigned int flags);
+sysreturn vmsplice(int fd, struct iovec *iov, u64 nr_segs, unsigned int flags);
 
 sysreturn socketpair(int domain, int type, int protocol, int sv[2]);
+sysreturn socket_write_ref(fdesc f, void *buf, u64 length, thunk release,
+                           thread t, boolean bh, io_completion completion);
+typedef closure_type(socket_ref_handler, boolean, void *data, u64 length, thunk release);
+sysreturn socket_read_ref(fdesc f, u64 length, int maxsegs, socket_ref_handler h);
 
 int do_eventfd2(unsigned int count, int flags);
 
 void register_special_files(process p);
+
+/* special files have no file data, so they bypass the page cache */
+static inline boolean is_special(tuple n)
+{
+    return table_find(n, sym(special)) ? true : false;
+}
+
 sysreturn spec_open(file f);
 sysreturn spec_close(file f);
 sysreturn spec_read(file f, void *dest, u64 length, u64 offset_arg, thread t,
@@ -2,8 +2,11 @@
 
 #include <drivers/storage.h>
 
+void start_network_iface(void);
 void init_network_iface(tuple root);
 void init_virtio_network(kernel_heaps kh);
 
 void virtio_register_scsi(kernel_heaps kh, storage_attach a);
 void virtio_register_blk(kernel_heaps kh, storage_attach a);
+
+void virtqueue_format_stats(buffer b);
@@ -67,4 +67,6 @@ typedef struct vqmsg *vqmsg;
 vqmsg allocate_vqmsg(virtqueue vq);
 void deallocate_vqmsg(virtqueue vq, vqmsg m);
 void vqmsg_push(virtqueue vq, vqmsg m, void * addr, u32 len, boolean write);
+void vqmsg_queue(virtqueue vq, vqmsg m, vqfinish completion);
 void vqmsg_commit(virtqueue vq, vqmsg m, vqfinish completion);
+void virtqueue_kick(virtqueue vq);
@@ -45,14 +45,26 @@
 #include "netif/ethernet.h"
 #include "virtio_internal.h"
 #include "virtio_net.h"
+#include <lwip.h>
 
 #include <io.h>
+#include <x86_64.h>
+
+/* receive buffers posted at initialization; each completion posts a
+   replacement */
+#define VIRTIO_NET_RX_BUFFERS   64
 
 typedef struct vnet {
     vtpci dev;
     u16 port;
     heap rxbuffers;
     int rxbuflen;
+    u16 net_header_len;
+    boolean mrg_rxbuf;          /* frames may span several receive buffers */
+    struct list rx_free;        /* released receive buffers, for reuse */
+    u32 rx_free_count;
+    struct pbuf *rx_head;       /* merged frame being assembled */
+    u16 rx_remain;              /* ...and buffers still to come */
     struct netif *n;
     struct virtqueue *txq;
     struct virtqueue *rxq;
@@ -64,6 +76,7 @@ typedef struct xpbuf
 {
     struct pbuf_custom p;
     vnet vn;
+    struct list l;              /* on rx_free while unused */
 } *xpbuf;
 
 
@@ -79,20 +92,30 @@ closure_function(1, 1, void, tx_complete,
 }
 
 
+closure_function(1, 0, void, virtio_net_tx_flush,
+                 vnet, vn)
+{
+    virtqueue_kick(bound(vn)->txq);
+}
+
 static err_t low_level_output(struct netif *netif, struct pbuf *p)
 {
     vnet vn = netif->state;
 
     vqmsg m = allocate_vqmsg(vn->txq);
     assert(m != INVALID_ADDRESS);
-    vqmsg_push(vn->txq, m, vn->empty, NET_HEADER_LENGTH, false);
+    vqmsg_push(vn->txq, m, vn->empty, vn->net_header_len, false);
 
     pbuf_ref(p);
 
     for (struct pbuf * q = p; q != NULL; q = q->next)
         vqmsg_push(vn->txq, m, q->payload, q->len, false);
 
-    vqmsg_commit(vn->txq, m, closure(vn->dev->general, tx_complete, p));
+    vqfinish c = closure(vn->dev->general, tx_complete, p);
+    if (net_tx_batching())
+        vqmsg_queue(vn->txq, m, c);     /* posted by virtio_net_tx_flush */
+    else
+        vqmsg_commit(vn->txq, m, c);
     
     MIB2_STATS_NETIF_ADD(netif, ifoutoctets, p->tot_len);
     if (((u8_t *)p->payload)[0] & 1) {
@@ -109,32 +132,75 @@ static err_t low_level_output(struct netif *netif, struct pbuf *p)
     return ERR_OK;
 }
 
+/* Receive buffers are recycled through a free list rather than
+   returned to the heap; only those beyond the number posted at
+   initialization are freed. May be called from any context. */
 static void receive_buffer_release(struct pbuf *p)
 {
     xpbuf x  = (void *)p;
-    deallocate(x->vn->rxbuffers, x, x->vn->rxbuflen + sizeof(struct xpbuf));
+    vnet vn = x->vn;
+    u64 flags = irq_disable_save();
+    if (vn->rx_free_count < VIRTIO_NET_RX_BUFFERS) {
+        list_push_back(&vn->rx_free, &x->l);
+        vn->rx_free_count++;
+        x = 0;
+    }
+    irq_restore(flags);
+    if (x)
+        deallocate(vn->rxbuffers, x, vn->rxbuflen + sizeof(struct xpbuf));
+}
+
+static xpbuf receive_buffer_alloc(vnet vn)
+{
+    u64 flags = irq_disable_save();
+    list l = list_get_next(&vn->rx_free);
+    if (l) {
+        list_delete(l);
+        vn->rx_free_count--;
+    }
+    irq_restore(flags);
+    if (l)
+        return struct_from_list(l, xpbuf, l);
+    return allocate(vn->rxbuffers, sizeof(struct xpbuf) + vn->rxbuflen);
 }
 
 static void post_receive(vnet vn);
 
+/* With VIRTIO_NET_F_MRG_RXBUF, the header of a frame's first buffer
+   gives the number of buffers it spans; the rest follow in order on
+   the used ring and are chained onto the first. */
 closure_function(1, 1, void, input,
                  xpbuf, x,
                  u64, len)
 {
     xpbuf x = bound(x);
     vnet vn= x->vn;
-    // under what conditions does a virtio queue give us zero?
-    if (x != NULL) {
-        len -= NET_HEADER_LENGTH;
-        assert(len <= x->p.pbuf.len);
-        x->p.pbuf.tot_len = x->p.pbuf.len = len;
-        x->p.pbuf.payload += NET_HEADER_LENGTH;
-        if (vn->n->input(&x->p.pbuf, vn->n) != ERR_OK) {
-            receive_buffer_release(&x->p.pbuf);
-        }
+    struct pbuf *p = &x->p.pbuf;
+    if (vn->rx_head) {
+        assert(len <= p->len);
+        p->tot_len = p->len = len;
+        pbuf_cat(vn->rx_head, p);
+        if (--vn->rx_remain > 0)
+            goto out;
+        p = vn->rx_head;
+        vn->rx_head = 0;
     } else {
-        rprintf ("virtio null\n");
+        u16 num_buffers = vn->mrg_rxbuf ?
+            ((struct virtio_net_hdr_mrg_rxbuf *)p->payload)->num_buffers : 1;
+        len -= vn->net_header_len;
+        assert(len <= p->len);
+        p->tot_len = p->len = len;
+        p->payload += vn->net_header_len;
+        if (num_buffers > 1) {
+            vn->rx_head = p;
+            vn->rx_remain = num_buffers - 1;
+            goto out;
+        }
     }
+    if (vn->n->input(p, vn->n) != ERR_OK) {
+        pbuf_free(p);
+    }
+  out:
     // we need to get a signal from the device side that there was
     // an underrun here to open up the window
     post_receive(vn);
@@ -144,7 +210,11 @@ closure_function(1, 1, void, input,
 
 static void post_receive(vnet vn)
 {
-    xpbuf x = allocate(vn->rxbuffers, sizeof(struct xpbuf) + vn->rxbuflen);
+    xpbuf x = receive_buffer_alloc(vn);
+    if (x == INVALID_ADDRESS) {
+        msg_err("failed to allocate receive buffer\n");
+        return;
+    }
     x->vn = vn;
     x->p.custom_free_function = receive_buffer_release;
     pbuf_alloced_custom(PBUF_RAW,
@@ -181,11 +251,9 @@ static err_t virtioif_init(struct netif *netif)
     /* don't set NETIF_FLAG_ETHARP if this device is not an ethernet one */
     netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP | NETIF_FLAG_UP;
 
-    // fix
-    post_receive(vn);
-    post_receive(vn);
-    post_receive(vn);
-    
+    for (int i = 0; i < VIRTIO_NET_RX_BUFFERS; i++)
+        post_receive(vn);
+    net_tx_register_flush(closure(vn->dev->general, virtio_net_tx_flush, vn));
     return ERR_OK;
 }
 
@@ -195,12 +263,26 @@ static void virtio_net_attach(heap general, heap page_allocator, pci_dev d)
     //    VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6 |  VIRTIO_NET_F_GUEST_ECN|
     //    VIRTIO_NET_F_GUEST_UFO | VIRTIO_NET_F_CTRL_VLAN | VIRTIO_NET_F_MQ;
 
-    vtpci dev = attach_vtpci(general, page_allocator, d, VIRTIO_NET_F_MAC);
+    vtpci dev = attach_vtpci(general, page_allocator, d,
+                             VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF);
     vnet vn = allocate(dev->general, sizeof(struct vnet));
     vn->n = allocate(dev->general, sizeof(struct netif));
-    vn->rxbuflen = NET_HEADER_LENGTH + sizeof(struct eth_hdr) + sizeof(struct eth_vlan_hdr) + 1500;
-    vn->rxbuffers = allocate_objcache(dev->general, page_allocator,
-				      vn->rxbuflen + sizeof(struct xpbuf), PAGESIZE_2M);
+    vn->mrg_rxbuf = (dev->features & VIRTIO_NET_F_MRG_RXBUF) != 0;
+    if (vn->mrg_rxbuf) {
+        /* page-sized buffers, straight from the page allocator */
+        vn->net_header_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+        vn->rxbuflen = PAGESIZE - sizeof(struct xpbuf);
+        vn->rxbuffers = page_allocator;
+    } else {
+        vn->net_header_len = NET_HEADER_LENGTH;
+        vn->rxbuflen = NET_HEADER_LENGTH + sizeof(struct eth_hdr) + sizeof(struct eth_vlan_hdr) + 1500;
+        vn->rxbuffers = allocate_objcache(dev->general, page_allocator,
+                                          vn->rxbuflen + sizeof(struct xpbuf), PAGESIZE_2M);
+    }
+    list_init(&vn->rx_free);
+    vn->rx_free_count = 0;
+    vn->rx_head = 0;
+    vn->rx_remain = 0;
     /* rx = 0, tx = 1, ctl = 2 by 
        page 53 of http://docs.oasis-open.org/virtio/virtio/v1.0/cs01/virtio-v1.0-cs01.pdf */
     vn->dev = dev;
@@ -208,7 +290,7 @@ static void virtio_net_attach(heap general, heap page_allocator, pci_dev d)
     vtpci_alloc_virtqueue(dev, 0, &vn->rxq);
     // just need 10 contig bytes really
     vn->empty = allocate(dev->contiguous, dev->contiguous->pagesize);
-    for (int i = 0; i < NET_HEADER_LENGTH ; i++)  ((u8 *)vn->empty)[i] = 0;
+    for (int i = 0; i < vn->net_header_len; i++)  ((u8 *)vn->empty)[i] = 0;
     vn->n->state = vn;
     // initialization complete
     vtpci_set_status(dev, VIRTIO_CONFIG_STATUS_DRIVER_OK);
@@ -258,14 +340,44 @@ err_t init_static_config(tuple root, struct netif *n) {
     return ERR_OK;       
 }
 
+static boolean dhcp_started;
+
+/* Called once devices are attached, before the root tuple is read, so
+   that DHCP runs alongside filesystem log replay. */
+void start_network_iface(void)
+{
+    struct netif *n = netif_find("en0");
+    if (!n)
+        return;
+    netif_set_default(n);
+    boot_phase_begin(BOOT_PHASE_NETWORK);
+    dhcp_start(n);
+    dhcp_started = true;
+}
+
+/* Called as soon as the root tuple has been read, ahead of unix and
+   program startup. A static configuration in the manifest replaces
+   the DHCP started beforehand. */
 void init_network_iface(tuple root) {
     struct netif *n = netif_find("en0");
     if (!n) {
         rprintf("no network interface found\n");
         return;
     }
-    netif_set_default(n);
+    if (!table_find(root, sym(ipaddr))) {
+        if (!dhcp_started)
+            start_network_iface();
+        return;
+    }
+    if (dhcp_started) {
+        dhcp_stop(n);
+        dhcp_started = false;
+    } else {
+        netif_set_default(n);
+        boot_phase_begin(BOOT_PHASE_NETWORK);
+    }
     if (ERR_OK != init_static_config(root, n)) {
-         dhcp_start(n);
-    } 
+        dhcp_start(n);
+        dhcp_started = true;
+    }
 }
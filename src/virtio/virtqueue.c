@@ -75,11 +75,19 @@ struct vring_used {
     struct vring_used_elem ring[0];
 } __attribute__((packed));
 
+/* Most uses here are a chain of 3 or less descriptors; chains up to
+   this length are described within the vqmsg itself. */
+#define VQMSG_INLINE_DESCS     4
+
 typedef struct vqmsg {
     struct list l;
-    u64 count;
-    buffer descv;               /* XXX should be a variable stride vector */
+    u16 count;
+    u16 size;                   /* capacity of descs */
+    boolean pooled;             /* from the virtqueue's pool rather than the heap */
+    struct vring_desc *descs;   /* inline_descs, or a heap array for long chains */
     vqfinish completion;
+    timestamp committed;
+    struct vring_desc inline_descs[VQMSG_INLINE_DESCS];
 } *vqmsg;
     
 typedef struct virtqueue {
@@ -95,37 +103,84 @@ typedef struct virtqueue {
     u16 last_used_idx;          /* irq only */
     struct list msgqueue;
     int max_queued;
+    struct vqmsg *msg_pool;     /* one vqmsg per ring entry */
+    struct list free_msgs;      /* unused pool vqmsgs */
+    boolean service_queued;     /* service thunk pending on bhqueue or deferqueue */
+    thunk service;
+    struct list l;              /* on virtqueues, for stats */
+    u64 msg_count;              /* vqmsgs allocated */
+    u64 heap_msgs;              /* ...which came from the heap */
+    u64 heap_descs;             /* descriptor arrays allocated for long chains */
     vqmsg msgs[0];
 } *virtqueue;
 
-/* Most uses here are a chain of 3 or less descriptors. */
-#define VQMSG_DEFAULT_SIZE     3
-vqmsg allocate_vqmsg(virtqueue vq)
+/* maximum number of used descriptor chains completed per service pass */
+#define VIRTQUEUE_SERVICE_BUDGET    64
+
+static struct list virtqueues = { &virtqueues, &virtqueues };
+
+/* commit to completion, across all virtqueues */
+static struct histogram virtqueue_latency;
+
+static void vqmsg_init(vqmsg m, boolean pooled)
 {
-    heap h = vq->dev->general;
-    vqmsg m = allocate(h, sizeof(struct vqmsg));
     list_init(&m->l);
     m->count = 0;
-    m->descv = allocate_buffer(h, sizeof(struct vring_desc) * VQMSG_DEFAULT_SIZE);
-    if (m->descv == INVALID_ADDRESS) {
-        deallocate(h, m, sizeof(struct vqmsg));
-        return INVALID_ADDRESS;
-    }
+    m->size = VQMSG_INLINE_DESCS;
+    m->pooled = pooled;
+    m->descs = m->inline_descs;
     m->completion = 0;          /* fill on queue */
+}
+
+/* vqmsgs come from a pool sized to the ring, so the heap is only
+   touched when more messages are queued than the ring can hold. */
+vqmsg allocate_vqmsg(virtqueue vq)
+{
+    vqmsg m;
+    u64 flags = irq_disable_save();
+    list l = list_get_next(&vq->free_msgs);
+    if (l)
+        list_delete(l);
+    vq->msg_count++;
+    if (!l)
+        vq->heap_msgs++;
+    irq_restore(flags);
+    if (l) {
+        m = struct_from_list(l, vqmsg, l);
+    } else {
+        m = allocate(vq->dev->general, sizeof(struct vqmsg));
+        if (m == INVALID_ADDRESS)
+            return m;
+    }
+    vqmsg_init(m, l != 0);
     return m;
 }
 
-/* must be safe at interrupt level */
-void deallocate_vqmsg_irq(virtqueue vq, vqmsg m)
+/* Called with interrupts disabled. */
+static void deallocate_vqmsg_irq(virtqueue vq, vqmsg m)
 {
-    deallocate_buffer(m->descv);
-    deallocate(vq->dev->general, m, sizeof(struct vqmsg));
+    if (m->descs != m->inline_descs)
+        deallocate(vq->dev->general, m->descs, m->size * sizeof(struct vring_desc));
+    if (m->pooled)
+        list_push_back(&vq->free_msgs, &m->l);
+    else
+        deallocate(vq->dev->general, m, sizeof(struct vqmsg));
 }
 
 void vqmsg_push(virtqueue vq, vqmsg m, void * addr, u32 len, boolean write)
 {
-    buffer_extend(m->descv, (m->count + 1) * sizeof(struct vring_desc));
-    struct vring_desc * d = buffer_ref(m->descv, m->count * sizeof(struct vring_desc));
+    if (m->count == m->size) {
+        u16 size = m->size * 2;
+        struct vring_desc *descs = allocate(vq->dev->general, size * sizeof(struct vring_desc));
+        assert(descs != INVALID_ADDRESS);
+        runtime_memcpy(descs, m->descs, m->count * sizeof(struct vring_desc));
+        if (m->descs != m->inline_descs)
+            deallocate(vq->dev->general, m->descs, m->size * sizeof(struct vring_desc));
+        m->descs = descs;
+        m->size = size;
+        fetch_and_add(&vq->heap_descs, 1);
+    }
+    struct vring_desc * d = m->descs + m->count;
     d->busaddr = physical_from_virtual(addr);
     d->len = len;
     d->flags = write ? VRING_DESC_F_WRITE : 0;
@@ -133,35 +188,60 @@ void vqmsg_push(virtqueue vq, vqmsg m, void * addr, u32 len, boolean write)
     m->count++;
 }
 
+void virtqueue_format_stats(buffer b)
+{
+    int n = 0;
+    u64 flags = irq_disable_save();
+    list_foreach(&virtqueues, l) {
+        virtqueue vq = struct_from_list(l, virtqueue, l);
+        bprintf(b, "vq%d: index %d entries %d msgs %ld heap_msgs %ld heap_descs %ld\n",
+                n++, vq->queue_index, vq->entries, vq->msg_count, vq->heap_msgs, vq->heap_descs);
+    }
+    irq_restore(flags);
+}
+
 static void virtqueue_fill(virtqueue vq);
 static void virtqueue_fill_irq(virtqueue vq);
 
-void vqmsg_commit(virtqueue vq, vqmsg m, vqfinish completion)
+/* Queue a message without posting it to the device; it goes out with
+   the next commit or virtqueue_kick(), so that a burst of messages costs
+   one ring update and one notification. */
+void vqmsg_queue(virtqueue vq, vqmsg m, vqfinish completion)
 {
     m->completion = completion;
+    m->committed = now(CLOCK_ID_MONOTONIC);
     /* XXX noirq */
     list_push_back(&vq->msgqueue, &m->l);
+}
+
+void vqmsg_commit(virtqueue vq, vqmsg m, vqfinish completion)
+{
+    vqmsg_queue(vq, m, completion);
     virtqueue_fill(vq);
 }
 
-closure_function(2, 0, void, vq_complete,
-                 vqfinish, f, u16, len)
+void virtqueue_kick(virtqueue vq)
 {
-    apply(bound(f), bound(len));
-    closure_finish();
+    virtqueue_fill(vq);
 }
 
-closure_function(1, 0, void, vq_interrupt,
+/* Bottom half for a virtqueue: walk the used ring, retire descriptor
+   chains and apply message completions, up to a budget per pass so
+   that one busy queue can't hold off other bottom-half work. Any
+   remainder is picked up from the deferqueue on the next pass. */
+closure_function(1, 0, void, vq_service,
                  virtqueue, vq)
 {
+    virtqueue vq = bound(vq);
+    u64 flags = irq_disable_save();
+
     // ensure we see up-to-date used->idx (updated by host)
     memory_barrier();
-    virtqueue vq = bound(vq);
     virtqueue_debug_verbose("%s: ENTRY: vq %p: entries %d, last_used_idx %d, used->idx %d, desc_idx %d\n",
         __func__, vq, vq->entries, vq->last_used_idx, vq->used->idx, vq->desc_idx);
-    
+
     int processed = 0;
-    while (vq->last_used_idx != vq->used->idx) {
+    while (vq->last_used_idx != vq->used->idx && processed < VIRTQUEUE_SERVICE_BUDGET) {
         volatile struct vring_used_elem *uep = vq->used->ring + (vq->last_used_idx & (vq->entries - 1));
         virtqueue_debug_verbose("%s: vq %p: last_used_idx %d, id %d, len %d\n",
             __func__, vq, vq->last_used_idx, uep->id, uep->len);
@@ -185,17 +265,37 @@ closure_function(1, 0, void, vq_interrupt,
         processed++;
         fetch_and_add(&vq->free_cnt, m->count);
         vq->msgs[head] = 0;
+        histogram_record_since(&virtqueue_latency, m->committed);
         deallocate_vqmsg_irq(vq, m);
 
-        /* XXX seems like we could devise a way to avoid another enqueue */
-        enqueue(bhqueue, closure(vq->dev->general, vq_complete, completion, len));
+        irq_restore(flags);
+        apply(completion, len);
+        flags = irq_disable_save();
+        memory_barrier();
     }
 
     virtqueue_fill_irq(vq);
+    if (vq->last_used_idx != vq->used->idx)
+        assert(enqueue(deferqueue, vq->service));
+    else
+        vq->service_queued = false;
+    irq_restore(flags);
     virtqueue_debug("%s: EXIT: vq %p: processed %d, last_used_idx %d, desc_idx %d\n",
         __func__, vq, processed, vq->last_used_idx, vq->desc_idx);
 }
 
+/* The interrupt only schedules the service thunk; it is queued at
+   most once regardless of how many chains have completed. */
+closure_function(1, 0, void, vq_interrupt,
+                 virtqueue, vq)
+{
+    virtqueue vq = bound(vq);
+    if (vq->service_queued)
+        return;
+    vq->service_queued = true;
+    assert(enqueue(bhqueue, vq->service));
+}
+
 status virtqueue_alloc(vtpci dev,
                        u16 queue,
                        u16 size,
@@ -220,6 +320,22 @@ status virtqueue_alloc(vtpci dev,
     vq->free_cnt = size;
     list_init(&vq->msgqueue);
     vq->max_queued = 0;
+    vq->service_queued = false;
+    vq->msg_count = vq->heap_msgs = vq->heap_descs = 0;
+    list_init(&vq->free_msgs);
+    vq->msg_pool = allocate(dev->general, size * sizeof(struct vqmsg));
+    if (vq->msg_pool == INVALID_ADDRESS) {
+        deallocate(dev->general, vq, sizeof(struct virtqueue) + size * sizeof(vqmsg));
+        return timm("status", "cannot allocate virtqueue message pool");
+    }
+    for (int i = 0; i < size; i++)
+        list_push_back(&vq->free_msgs, &vq->msg_pool[i].l);
+    vq->service = closure(dev->general, vq_service, vq);
+    if (vq->service == INVALID_ADDRESS) {
+        deallocate(dev->general, vq->msg_pool, size * sizeof(struct vqmsg));
+        deallocate(dev->general, vq, sizeof(struct virtqueue) + size * sizeof(vqmsg));
+        return timm("status", "cannot allocate virtqueue service");
+    }
 
     if ((vq->ring_mem = allocate_zero(dev->contiguous, alloc)) != INVALID_ADDRESS) {
         vq->desc = (struct vring_desc *) vq->ring_mem;
@@ -234,6 +350,9 @@ status virtqueue_alloc(vtpci dev,
         vq->desc[vq->entries - 1].next = VQ_RING_DESC_CHAIN_END;
 
         *t = closure(dev->general, vq_interrupt, vq);
+        if (list_empty(&virtqueues))
+            histogram_init(&virtqueue_latency, "virtqueue", "completion");
+        list_push_back(&virtqueues, &vq->l);
         *vqp = vq;
         return 0;
     }
@@ -290,7 +409,7 @@ static void virtqueue_fill_irq(virtqueue vq)
         vq->msgs[head] = m;
 
         for (int i = 0; i < m->count; i++) {
-            struct vring_desc *src = buffer_ref(m->descv, i * sizeof(*src));
+            struct vring_desc *src = m->descs + i;
             volatile struct vring_desc *d = vq->desc + vq->desc_idx;
             d->busaddr = src->busaddr;
             d->len = src->len;
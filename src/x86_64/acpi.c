@@ -0,0 +1,217 @@
+#include <runtime.h>
+#include <x86_64.h>
+#include <page.h>
+
+/* Just enough ACPI to enumerate processors from the MADT. */
+
+//#define ACPI_DEBUG
+#ifdef ACPI_DEBUG
+#define acpi_debug(x, ...) do {rprintf("ACPI: " x, ##__VA_ARGS__);} while(0)
+#else
+#define acpi_debug(x, ...)
+#endif
+
+#define ACPI_EBDA_PTR           0x40e
+#define ACPI_BIOS_ROM_START     0xe0000
+#define ACPI_BIOS_ROM_END       0x100000
+
+#define ACPI_MADT_LAPIC         0
+#define ACPI_MADT_X2APIC        9
+#define ACPI_MADT_ENABLED       0x1
+
+struct acpi_rsdp {
+    char sig[8];
+    u8 checksum;
+    char oem_id[6];
+    u8 revision;
+    u32 rsdt_addr;
+    /* revision >= 2 */
+    u32 length;
+    u64 xsdt_addr;
+    u8 ext_checksum;
+    u8 reserved[3];
+} __attribute__((packed));
+
+struct acpi_header {
+    char sig[4];
+    u32 length;
+    u8 revision;
+    u8 checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    u32 oem_revision;
+    u32 creator_id;
+    u32 creator_revision;
+} __attribute__((packed));
+
+struct acpi_madt {
+    struct acpi_header h;
+    u32 lapic_addr;
+    u32 flags;
+    u8 entries[0];
+} __attribute__((packed));
+
+struct acpi_madt_lapic {
+    u8 type;
+    u8 length;
+    u8 acpi_id;
+    u8 apic_id;
+    u32 flags;
+} __attribute__((packed));
+
+struct acpi_madt_x2apic {
+    u8 type;
+    u8 length;
+    u16 reserved;
+    u32 apic_id;
+    u32 flags;
+    u32 acpi_id;
+} __attribute__((packed));
+
+static u8 acpi_checksum(void *p, u64 length)
+{
+    u8 sum = 0;
+    for (u64 i = 0; i < length; i++)
+        sum += ((u8 *)p)[i];
+    return sum;
+}
+
+/* Tables live in firmware memory outside of any kernel mapping; map them
+   for the duration of the scan. */
+static void *acpi_map(kernel_heaps kh, u64 phys, u64 length, u64 *vlen)
+{
+    u64 base = phys & ~MASK(PAGELOG);
+    u64 len = pad(phys + length, PAGESIZE) - base;
+    u64 v = allocate_u64(heap_virtual_page(kh), len);
+    if (v == INVALID_PHYSICAL)
+        return 0;
+    map(v, base, len, PAGE_NO_EXEC, heap_pages(kh));
+    *vlen = len;
+    return pointer_from_u64(v + (phys - base));
+}
+
+static void acpi_unmap(kernel_heaps kh, void *p, u64 vlen)
+{
+    u64 v = u64_from_pointer(p) & ~MASK(PAGELOG);
+    unmap(v, vlen, heap_pages(kh));
+    deallocate_u64(heap_virtual_page(kh), v, vlen);
+}
+
+static u64 acpi_scan_rsdp(void *p, u64 length)
+{
+    for (u64 off = 0; off + sizeof(struct acpi_rsdp) <= length; off += 16) {
+        struct acpi_rsdp *r = p + off;
+        if (runtime_memcmp(r->sig, "RSD PTR ", 8) == 0 && acpi_checksum(r, 20) == 0)
+            return off;
+    }
+    return INVALID_PHYSICAL;
+}
+
+/* Returns the physical address of the RSDT (or XSDT, if xsdt is set). */
+static u64 acpi_find_root(kernel_heaps kh, boolean *xsdt)
+{
+    u64 vlen, off, root = INVALID_PHYSICAL;
+    struct acpi_rsdp *r = 0;
+    void *p;
+
+    /* first KB of the EBDA, then the BIOS ROM area */
+    p = acpi_map(kh, 0, PAGESIZE, &vlen);
+    if (!p)
+        return INVALID_PHYSICAL;
+    u64 ebda = ((u64)*(u16 *)(p + ACPI_EBDA_PTR)) << 4;
+    acpi_unmap(kh, p, vlen);
+    if (ebda) {
+        p = acpi_map(kh, ebda, KB, &vlen);
+        if (p) {
+            if ((off = acpi_scan_rsdp(p, KB)) != INVALID_PHYSICAL)
+                r = p + off;
+            else
+                acpi_unmap(kh, p, vlen);
+        }
+    }
+    if (!r) {
+        p = acpi_map(kh, ACPI_BIOS_ROM_START, ACPI_BIOS_ROM_END - ACPI_BIOS_ROM_START, &vlen);
+        if (!p)
+            return INVALID_PHYSICAL;
+        if ((off = acpi_scan_rsdp(p, ACPI_BIOS_ROM_END - ACPI_BIOS_ROM_START)) == INVALID_PHYSICAL) {
+            acpi_unmap(kh, p, vlen);
+            return INVALID_PHYSICAL;
+        }
+        r = p + off;
+    }
+    if (r->revision >= 2 && r->xsdt_addr) {
+        root = r->xsdt_addr;
+        *xsdt = true;
+    } else {
+        root = r->rsdt_addr;
+        *xsdt = false;
+    }
+    acpi_unmap(kh, r, vlen);
+    return root;
+}
+
+static struct acpi_header *acpi_map_table(kernel_heaps kh, u64 phys, u64 *vlen)
+{
+    struct acpi_header *h = acpi_map(kh, phys, sizeof(struct acpi_header), vlen);
+    if (!h)
+        return 0;
+    u64 length = h->length;
+    acpi_unmap(kh, h, *vlen);
+    if (length < sizeof(struct acpi_header))
+        return 0;
+    h = acpi_map(kh, phys, length, vlen);
+    if (h && acpi_checksum(h, length) != 0) {
+        acpi_debug("bad checksum for table at 0x%lx\n", phys);
+        acpi_unmap(kh, h, *vlen);
+        return 0;
+    }
+    return h;
+}
+
+/* Apply mh to the APIC ID of each enabled processor listed in the MADT.
+   Returns false if no MADT could be found. */
+boolean acpi_walk_madt(kernel_heaps kh, madt_handler mh)
+{
+    boolean xsdt;
+    u64 vlen, mlen;
+    u64 root_phys = acpi_find_root(kh, &xsdt);
+    if (root_phys == INVALID_PHYSICAL) {
+        acpi_debug("no RSDP found\n");
+        return false;
+    }
+    struct acpi_header *root = acpi_map_table(kh, root_phys, &vlen);
+    if (!root)
+        return false;
+
+    boolean found = false;
+    int esize = xsdt ? sizeof(u64) : sizeof(u32);
+    int n = (root->length - sizeof(struct acpi_header)) / esize;
+    void *entries = (void *)(root + 1);
+    for (int i = 0; i < n && !found; i++) {
+        u64 phys = xsdt ? ((u64 *)entries)[i] : ((u32 *)entries)[i];
+        struct acpi_header *h = acpi_map_table(kh, phys, &mlen);
+        if (!h)
+            continue;
+        if (runtime_memcmp(h->sig, "APIC", 4) == 0) {
+            struct acpi_madt *madt = (struct acpi_madt *)h;
+            u8 *e = madt->entries;
+            u8 *end = (u8 *)h + h->length;
+            found = true;
+            while (e + 2 <= end && e[1] >= 2 && e + e[1] <= end) {
+                if (e[0] == ACPI_MADT_LAPIC && e[1] >= sizeof(struct acpi_madt_lapic)) {
+                    struct acpi_madt_lapic *l = (struct acpi_madt_lapic *)e;
+                    if (l->flags & ACPI_MADT_ENABLED)
+                        apply(mh, l->apic_id);
+                } else if (e[0] == ACPI_MADT_X2APIC && e[1] >= sizeof(struct acpi_madt_x2apic)) {
+                    struct acpi_madt_x2apic *x = (struct acpi_madt_x2apic *)e;
+                    if (x->flags & ACPI_MADT_ENABLED)
+                        apply(mh, x->apic_id);
+                }
+                e += e[1];
+            }
+        }
+        acpi_unmap(kh, h, mlen);
+    }
+    acpi_unmap(kh, root, vlen);
+    return found;
+}
@@ -70,14 +70,31 @@ static void calibrate_lapic_timer()
 closure_function(0, 1, void, lapic_timer,
                  timestamp, interval)
 {
-    /* interval * apic_timer_cal_sec / second */
-    u32 cnt = (((u128)interval) * apic_timer_cal_sec) >> 32;
+    /* interval * apic_timer_cal_sec / second; a count of zero would stop
+       the timer, and long intervals are cut short to the counter width */
+    u64 cnt = (((u128)interval) * apic_timer_cal_sec) >> 32;
     apic_clear(APIC_LVT_TMR, APIC_LVT_INTMASK);
-    apic_write(APIC_TMRINITCNT, cnt);
+    apic_write(APIC_TMRINITCNT, MAX(1, MIN(cnt, MASK(32))));
 }
 
 closure_function(0, 0, void, int_ignore) {}
 
+/* Taken from cpuid rather than the APIC ID register, which is only
+   mapped in xAPIC mode and holds just 8 bits; leaf 0xb gives the full
+   x2APIC ID where supported. */
+u32 lapic_id(void)
+{
+    u32 v[4];
+    cpuid(0, 0, v);
+    if (v[0] >= 0xb) {
+        cpuid(0xb, 0, v);
+        if (v[1] != 0)          /* EBX: leaf valid */
+            return v[3];        /* EDX: x2APIC ID */
+    }
+    cpuid(0x1, 0, v);
+    return v[1] >> 24;          /* EBX[31:24]: initial APIC ID */
+}
+
 void lapic_eoi(void)
 {
     write_barrier();
@@ -63,6 +63,32 @@ void elf_symbols(buffer elf, elf_sym_handler each)
     msg_err("failed to parse elf file, len %d; check file image consistency\n", buffer_length(elf));
 }
 
+/* As elf_symbols, but for a symbol table and its string table that have
+   been read out of the file separately. */
+boolean elf_symbols_from_tables(buffer symtab, u64 entsize, buffer strtab, elf_sym_handler each)
+{
+    if (entsize < sizeof(Elf64_Sym))
+        goto out_fail;
+    char *strings = buffer_ref(strtab, 0);
+    u64 strings_len = buffer_length(strtab);
+    for (u64 off = 0; off + sizeof(Elf64_Sym) <= buffer_length(symtab); off += entsize) {
+        Elf64_Sym *sym = buffer_ref(symtab, off);
+        if (sym->st_name >= strings_len)
+            goto out_fail;
+        char *name = strings + sym->st_name;
+        char *c = name;
+        while (c < strings + strings_len && *c != '\0')
+            c++;
+        if (c == strings + strings_len)
+            goto out_fail;      /* no null terminator found */
+        apply(each, name, sym->st_value, sym->st_size, sym->st_info);
+    }
+    return true;
+  out_fail:
+    msg_err("failed to parse elf symbol table, len %d\n", buffer_length(symtab));
+    return false;
+}
+
 void *load_elf(buffer elf, u64 load_offset, elf_map_handler mapper)
 {
     void * elf_end = buffer_ref(elf, buffer_length(elf));
@@ -175,6 +175,7 @@ typedef struct {
 typedef closure_type(elf_map_handler, void, u64 /* vaddr */, u64 /* paddr, -1ull if bss */, u64 /* size */, u64 /* flags */);
 typedef closure_type(elf_sym_handler, void, char *, u64, u64, u8);
 void elf_symbols(buffer elf, elf_sym_handler each);
+boolean elf_symbols_from_tables(buffer symtab, u64 entsize, buffer strtab, elf_sym_handler each);
 void *load_elf(buffer elf, u64 load_offset, elf_map_handler mapper);
 
 #endif /* !_SYS_ELF64_H_ */
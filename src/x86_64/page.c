@@ -308,6 +308,28 @@ void update_map_flags(u64 vaddr, u64 length, u64 flags)
     traverse_ptes(vaddr, length, stack_closure(update_pte_flags, flags));
 }
 
+closure_function(1, 3, boolean, collect_dirty_entry,
+                 range_handler, rh,
+                 int, level, u64, addr, u64 *, entry)
+{
+    u64 old = *entry;
+    if (!pt_entry_is_present(old) || !pt_entry_is_pte(level, old) || (old & PAGE_DIRTY) == 0)
+        return true;
+
+    *entry = old & ~PAGE_DIRTY;
+    page_invalidate(addr);
+    u64 phys = phys_from_pte(old);
+    apply(bound(rh), irange(phys, phys + (pt_entry_is_fat(level, old) ? PAGESIZE_2M : PAGESIZE)));
+    return true;
+}
+
+/* Clear the dirty bit of any pages written within a given area,
+   passing the physical range of each to rh */
+void collect_dirty_pages(u64 vaddr, u64 length, range_handler rh)
+{
+    traverse_ptes(vaddr, length, stack_closure(collect_dirty_entry, rh));
+}
+
 closure_function(3, 3, boolean, remap_entry,
                  u64, new, u64, old, heap, h,
                  int, level, u64, curr, u64 *, entry)
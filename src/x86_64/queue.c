@@ -4,109 +4,156 @@
 void queue_dump(queue q)
 {
     rprintf("queue @ %p being dumped\n", q);
-    rprintf("queue size: %p\n", q->size);
-    rprintf("queue count: %p\n", q->count);
+    rprintf("queue size: %p, capacity: %p\n", q->size, q->capacity);
+    rprintf("enqueue pos: %p, dequeue pos: %p\n", q->enqueue_pos, q->dequeue_pos);
     for (int i = 0; i < q->size; i ++) {
-        if (i >= q->read % q->size && i < q->write % q->size) {
-            rprintf("+ ");
-        } else {
-            rprintf("- ");
-        }
-
-        rprintf("%p: ", i);
-        rprintf("%p\n", q->buf[i]);
+        rprintf("%p: seq %p, %p\n", i, q->slots[i].seq, q->slots[i].data);
     }
 }
 
-boolean enqueue(queue q, void *n)
+/* Spin briefly after losing a race; the loser's next attempt sees an
+   updated position, so a short, bounded pause is all that's needed. */
+#define QUEUE_MAX_BACKOFF 64
+static inline void queue_backoff(int *backoff)
 {
-    u64 count = fetch_and_add(&q->count, 1);
-    u64 write;
-    boolean r;
-
-    if (count >= q->size) {
-        // can't enqueue more elements than the bounds
-        fetch_and_add(&q->count, -1);
-        return false;
-    }
-
-    // rusty 'acquire the ownership' of the next element in the queue
-    write = fetch_and_add(&q->write, 1);
-
-    // put the data in the buf
-    r = __sync_bool_compare_and_swap(&q->buf[write % q->size], 0, n);
-    if (!r) {
-        // should never happen
-        // if it does, then something went horribly wrong.
-        queue_dump(q);
-        halt("queue is in inconsistent state");
-    }
+    for (int i = 0; i < *backoff; i++)
+        kern_pause();
+    if (*backoff < QUEUE_MAX_BACKOFF)
+        *backoff <<= 1;
+}
 
-    // otherwise we are done
-    return true;
+static inline u64 load_acquire(u64 *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
 }
 
-int queue_length(queue q)
+static inline void store_release(u64 *p, u64 v)
 {
-    return __atomic_load_n(&q->count, __ATOMIC_ACQUIRE);
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
 }
 
-void *queue_peek(queue q)
+static inline boolean advance(u64 *pos, u64 *expected, u64 n)
 {
-    if (__atomic_load_n(&q->count, __ATOMIC_ACQUIRE) == 0)
-        return 0;
+    return __atomic_compare_exchange_n(pos, expected, *expected + n, false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
 
-    return __atomic_load_n(&q->buf[q->read % q->size], __ATOMIC_ACQUIRE);
+/* Returns false if the queue is full. */
+boolean enqueue(queue q, void *n)
+{
+    u64 mask = q->size - 1;
+    u64 pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    int backoff = 1;
+    struct qslot *s;
+
+    while (1) {
+        s = &q->slots[pos & mask];
+        s64 dif = (s64)(load_acquire(&s->seq) - pos);
+        if (dif == 0) {
+            /* the ring may hold more slots than were asked for */
+            if (q->capacity < q->size &&
+                pos - __atomic_load_n(&q->dequeue_pos, __ATOMIC_ACQUIRE) >= q->capacity)
+                return false;
+            /* on failure, pos is updated to the current enqueue position */
+            if (advance(&q->enqueue_pos, &pos, 1))
+                break;
+            queue_backoff(&backoff);
+        } else if (dif < 0) {
+            /* slot still holds an item from the previous lap */
+            return false;
+        } else {
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    s->data = n;
+    store_release(&s->seq, pos + 1);
+    return true;
 }
 
-#define DEQUEUE_MAX_BACKOFF 10000
-void *dequeue(queue q)
+/* Dequeue up to n items into buf, claiming a run of consecutive ready
+   slots with one CAS. Returns the number dequeued; zero means the queue
+   was empty (or the next item is still being written). */
+u64 dequeue_n(queue q, void **buf, u64 n)
 {
+    u64 mask = q->size - 1;
+    u64 pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
     int backoff = 1;
-    int i;
-    void *r;
+    u64 count;
 
-    if (__atomic_load_n(&q->count, __ATOMIC_ACQUIRE) == 0)
+    if (n == 0)
         return 0;
-
-retry:
-    r = __atomic_exchange_n(&q->buf[q->read ++ % q->size], 0, __ATOMIC_ACQUIRE);
-    if (!r) {
-        // if we had already backed off that maximum, let the dequeueing fail
-        if (backoff >= DEQUEUE_MAX_BACKOFF)
-            return false;
-
-        // issue @backoff PAUSE instructions
-        for (i = 0; i < backoff; i ++) {
-            // make sure the compiler does not optimize away the
-            asm volatile("pause");
+    while (1) {
+        s64 dif = 0;
+        for (count = 0; count < n && count <= mask; count++) {
+            dif = (s64)(load_acquire(&q->slots[(pos + count) & mask].seq) - (pos + count + 1));
+            if (dif != 0)
+                break;
         }
-
-        // exponentially increase the amount of PAUSE instructions executed
-        backoff *= 10;
-        goto retry;
+        if (count > 0) {
+            if (advance(&q->dequeue_pos, &pos, count))
+                break;
+            queue_backoff(&backoff);
+        } else if (dif < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    for (u64 i = 0; i < count; i++) {
+        struct qslot *s = &q->slots[(pos + i) & mask];
+        buf[i] = s->data;
+        /* free the slot for the producer one lap ahead */
+        store_release(&s->seq, pos + i + mask + 1);
     }
+    return count;
+}
+
+void *dequeue(queue q)
+{
+    void *n;
+    return dequeue_n(q, &n, 1) ? n : 0;
+}
 
-    // formally tell tell the queue that the element is gone
-    fetch_and_add(&q->count, -1);
-    return r;
+int queue_length(queue q)
+{
+    s64 len = (s64)(__atomic_load_n(&q->enqueue_pos, __ATOMIC_ACQUIRE) -
+                    __atomic_load_n(&q->dequeue_pos, __ATOMIC_ACQUIRE));
+    return len < 0 ? 0 : len;
 }
 
+/* Only meaningful for a single consumer. */
+void *queue_peek(queue q)
+{
+    u64 pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_ACQUIRE);
+    struct qslot *s = &q->slots[pos & (q->size - 1)];
+    if (load_acquire(&s->seq) != pos + 1)
+        return 0;
+    return s->data;
+}
+
+/* The ring is rounded up to a power of two slots, but enqueue still
+   refuses items beyond the size requested, so that queues sized from a
+   limit (e.g. a listen backlog) keep it. */
 queue allocate_queue(heap h, u64 size)
 {
-    queue q = allocate(h, sizeof(struct queue) + size * sizeof(void *));
+    u64 capacity = size;
+    size = U64_FROM_BIT(find_order(size));
+    queue q = allocate(h, sizeof(struct queue) + size * sizeof(struct qslot));
+    if (q == INVALID_ADDRESS)
+        return q;
     q->size = size;
-    q->count = 0;
-    q->write = q->read = 0;
+    q->capacity = capacity;
+    q->enqueue_pos = q->dequeue_pos = 0;
     q->h = h;
-    zero(q->buf, size * sizeof(void *));
-    // XXX: we could do a release ordering here, however let's just use a full
-    // barrier for now.
+    for (u64 i = 0; i < size; i++) {
+        q->slots[i].seq = i;
+        q->slots[i].data = 0;
+    }
     memory_barrier();
     return q;
 }
 
 void deallocate_queue(queue q)
 {
-    deallocate(q->h, q, sizeof(struct queue) + q->size * sizeof(void *));
+    deallocate(q->h, q, sizeof(struct queue) + q->size * sizeof(struct qslot));
 }
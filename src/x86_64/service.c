@@ -4,6 +4,7 @@
 #include <x86_64.h>
 #include <region.h>
 #include <page.h>
+#include <apic.h>
 #include <symtab.h>
 #include <virtio/virtio.h>
 #include <drivers/storage.h>
@@ -59,34 +60,50 @@ static u64 bootstrap_alloc(heap h, bytes length)
 }
 
 queue runqueue;                 /* dispatched in runloop */
+int present_cpus = 1;
+int online_cpus = 1;
+
 queue bhqueue;                  /* dispatched to exhaustion in process_bhqueue */
 queue deferqueue;               /* same as bhqueue, but only for previously queued items */
 
+/* deferqueue items only run on the next pass through the bhqueue */
+#define DEFERQUEUE_WAKEUP microseconds(100)
+
 static void timer_update(void)
 {
-    /* minimum runloop period - XXX move to a config header */
-    timestamp timeout = MIN(timer_check(), milliseconds(100) /* XXX config */);
-    runloop_timer(timeout);
+    /* tickless: with nothing pending, leave the runloop timer disarmed
+       and sleep until the next interrupt */
+    timestamp timeout = timer_check();
+    if (queue_length(deferqueue) > 0)
+        timeout = MIN(timeout, DEFERQUEUE_WAKEUP);
+    if (timeout != infinity)
+        runloop_timer(timeout);
 }
 
 extern void interrupt_exit(void);
 
+#define BHQUEUE_BATCH 16
+
 __attribute__((no_instrument_function))
 void process_bhqueue()
 {
     /* XXX - we're on bh frame & stack; re-enable ints here */
-    thunk t;
+    thunk batch[BHQUEUE_BATCH];
+    u64 n;
     int defer_waiters = queue_length(deferqueue);
-    while ((t = dequeue(bhqueue))) {
-        apply(t);
+    while ((n = dequeue_n(bhqueue, (void **)batch, BHQUEUE_BATCH))) {
+        for (int i = 0; i < n; i++)
+            apply(batch[i]);
     }
 
     /* only process deferred items that were queued prior to call -
        this allows bhqueue and deferqueue waiters to re-schedule for
        subsequent bh processing */
-    while (defer_waiters > 0 && (t = dequeue(deferqueue))) {
-        apply(t);
-        defer_waiters--;
+    while (defer_waiters > 0 &&
+           (n = dequeue_n(deferqueue, (void **)batch, MIN(defer_waiters, BHQUEUE_BATCH)))) {
+        for (int i = 0; i < n; i++)
+            apply(batch[i]);
+        defer_waiters -= n;
     }
 
     timer_update();
@@ -96,12 +113,31 @@ void process_bhqueue()
     interrupt_exit();
 }
 
+#define RUNQUEUE_BATCH 8
+
+/* thunks taken from runqueue in one dequeue_n but not yet run; kept
+   here rather than on the stack since a thread thunk doesn't return */
+static thunk runqueue_batch[RUNQUEUE_BATCH];
+static int runqueue_batch_next;
+static int runqueue_batch_count;
+
+static thunk next_work(void)
+{
+    if (runqueue_batch_next == runqueue_batch_count) {
+        runqueue_batch_next = 0;
+        runqueue_batch_count = dequeue_n(runqueue, (void **)runqueue_batch, RUNQUEUE_BATCH);
+        if (runqueue_batch_count == 0)
+            return 0;
+    }
+    return runqueue_batch[runqueue_batch_next++];
+}
+
 void runloop()
 {
     thunk t;
 
     while(1) {
-        while((t = dequeue(runqueue))) {
+        while((t = next_work())) {
             apply(t);
             disable_interrupts();
         }
@@ -143,6 +179,89 @@ closure_function(2, 3, void, offset_block_io,
     apply(k, STATUS_OK);
 }
 
+/* Boot phase trace. Times are relative to clock initialization, before
+   which nothing can be timed. */
+static const char *boot_phase_names[BOOT_PHASES] = {
+    [BOOT_PHASE_DEVICES] = "devices",
+    [BOOT_PHASE_FILESYSTEM] = "filesystem",
+    [BOOT_PHASE_NETWORK] = "network",
+    [BOOT_PHASE_UNIX] = "unix",
+    [BOOT_PHASE_EXEC] = "exec",
+};
+
+static struct {
+    timestamp begin, end;
+} boot_phases[BOOT_PHASES];
+static timestamp boot_clock_start;
+static boolean boot_trace_pending;
+
+static boolean boot_trace_done(void)
+{
+    if (!boot_phases[BOOT_PHASE_EXEC].end)
+        return false;
+    for (int i = 0; i < BOOT_PHASES; i++) {
+        if (boot_phases[i].begin && !boot_phases[i].end)
+            return false;
+    }
+    return true;
+}
+
+void boot_phase_begin(enum boot_phase phase)
+{
+    boot_phases[phase].begin = now(CLOCK_ID_MONOTONIC);
+    boot_phases[phase].end = 0;
+}
+
+void boot_phase_end(enum boot_phase phase)
+{
+    if (!boot_phases[phase].begin || boot_phases[phase].end)
+        return;
+    boot_phases[phase].end = now(CLOCK_ID_MONOTONIC);
+    if (boot_trace_pending && boot_trace_done()) {
+        boot_trace_pending = false;
+        boot_trace_print();
+    }
+}
+
+void boot_trace_format(buffer b)
+{
+    timestamp last = 0;
+    for (int i = 0; i < BOOT_PHASES; i++) {
+        timestamp begin = boot_phases[i].begin, end = boot_phases[i].end;
+        if (!begin) {
+            bprintf(b, "%s: not run\n", boot_phase_names[i]);
+            continue;
+        }
+        bprintf(b, "%s: start %ld us", boot_phase_names[i],
+                usec_from_timestamp(begin - boot_clock_start));
+        if (end) {
+            bprintf(b, " end %ld us duration %ld us\n",
+                    usec_from_timestamp(end - boot_clock_start),
+                    usec_from_timestamp(end - begin));
+            last = MAX(last, end);
+        } else {
+            bprintf(b, " in progress\n");
+        }
+    }
+    if (boot_phases[BOOT_PHASE_EXEC].end)
+        bprintf(b, "first instruction: %ld us\n",
+                usec_from_timestamp(boot_phases[BOOT_PHASE_EXEC].end - boot_clock_start));
+    if (last)
+        bprintf(b, "total: %ld us\n", usec_from_timestamp(last - boot_clock_start));
+}
+
+/* Print the trace once every phase that was started has finished. */
+void boot_trace_print(void)
+{
+    if (!boot_trace_done()) {
+        boot_trace_pending = true;
+        return;
+    }
+    buffer b = little_stack_buffer(512);
+    boot_trace_format(b);
+    rprintf("boot trace:\n%b", b);
+}
+
 /* XXX some header reorg in order */
 void init_extra_prints(); 
 thunk create_init(kernel_heaps kh, tuple root, filesystem fs);
@@ -152,6 +271,10 @@ closure_function(1, 2, void, fsstarted,
                  filesystem, fs, status, s)
 {
     assert(s == STATUS_OK);
+    boot_phase_end(BOOT_PHASE_FILESYSTEM);
+    /* apply any static network configuration in place of DHCP before
+       unix and program startup */
+    init_network_iface(bound(root));
     enqueue(runqueue, create_init(&heaps, bound(root), fs));
     closure_finish();
 }
@@ -162,6 +285,7 @@ closure_function(2, 3, void, attach_storage,
 {
     // with filesystem...should be hidden as functional handlers on the tuplespace
     heap h = heap_general(&heaps);
+    boot_phase_begin(BOOT_PHASE_FILESYSTEM);
     create_filesystem(h,
                       SECTOR_SIZE,
                       length,
@@ -243,6 +367,21 @@ static void init_hwrand(void)
         have_rdrand = true;
 }
 
+closure_function(1, 1, void, add_cpu,
+                 u32, bsp_id,
+                 u32, id)
+{
+    /* the boot processor is already counted */
+    if (id != bound(bsp_id) && present_cpus < MAX_CPUS)
+        present_cpus++;
+}
+
+static void init_cpus(kernel_heaps kh)
+{
+    if (!acpi_walk_madt(kh, stack_closure(add_cpu, lapic_id())))
+        init_debug("no MADT found; assuming one cpu");
+}
+
 static void reclaim_regions(void)
 {
     for_regions(e) {
@@ -277,13 +416,16 @@ static void __attribute__((noinline)) init_service_new_stack()
 
     /* scheduling queues init */
     runqueue = allocate_queue(misc, 64);
-    /* XXX bhqueue is large to accomodate vq completions; explore batch processing on vq side */
+    /* XXX bhqueue is large to accomodate per-buffer xennet completions; virtqueues
+       queue a single service thunk each */
     bhqueue = allocate_queue(misc, 2048);
     deferqueue = allocate_queue(misc, 64);
 
     /* interrupts */
     init_debug("start_interrupts");
     start_interrupts(kh);
+    init_debug("enumerate cpus");
+    init_cpus(kh);
 
     /* platform detection and early init */
     init_debug("probing for KVM");
@@ -307,6 +449,7 @@ static void __attribute__((noinline)) init_service_new_stack()
 
     /* clock, RNG, stack canaries */
     init_clock();
+    boot_clock_start = now(CLOCK_ID_MONOTONIC);
     init_debug("RNG");
     init_hwrand();
     init_random();
@@ -316,6 +459,7 @@ static void __attribute__((noinline)) init_service_new_stack()
     init_debug("LWIP init");
     init_net(kh);
 
+    boot_phase_begin(BOOT_PHASE_DEVICES);
     init_debug("probe fs, register storage drivers");
     tuple root = allocate_tuple();
     u64 fs_offset = 0;
@@ -342,12 +486,18 @@ static void __attribute__((noinline)) init_service_new_stack()
 
     init_debug("pci_discover (for virtio & ata)");
     pci_discover(); // do PCI discover again for other devices
+    boot_phase_end(BOOT_PHASE_DEVICES);
 
     /* Switch to stage3 GDT64, enable TSS and free up initial map */
     init_debug("install GDT64 and TSS");
     install_gdt64_and_tss();
     unmap(PAGESIZE, INITIAL_MAP_SIZE - PAGESIZE, pages);
 
+    /* Storage attach has already issued the filesystem log read; get
+       DHCP going alongside it rather than waiting for the root tuple. */
+    init_debug("start network interface");
+    start_network_iface();
+
     init_debug("starting runloop");
     runloop();
 }
@@ -447,6 +597,7 @@ static void init_kernel_heaps()
 
     heaps.general = allocate_mcache(&bootstrap, heaps.backed, 5, 20, PAGESIZE_2M);
     assert(heaps.general != INVALID_ADDRESS);
+    mcache_set_name(heaps.general, "general");
 }
 
 // init linker set
@@ -78,6 +78,14 @@ void add_elf_syms(buffer b)
 	console("can't add ELF symbols; symtab not initialized\n");
 }
 
+boolean add_elf_syms_from_tables(buffer symtab, u64 entsize, buffer strtab)
+{
+    if (elf_symtable)
+        return elf_symbols_from_tables(symtab, entsize, strtab, stack_closure(elf_symtable_add));
+    console("can't add ELF symbols; symtab not initialized\n");
+    return false;
+}
+
 void init_symtab(kernel_heaps kh)
 {
     general = heap_general(kh);
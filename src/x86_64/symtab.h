@@ -1,5 +1,6 @@
 #pragma once
 void init_symtab(kernel_heaps kh);
 void add_elf_syms(buffer b);
+boolean add_elf_syms_from_tables(buffer symtab, u64 entsize, buffer strtab);
 char * find_elf_sym(u64 a, u64 *offset, u64 *len);
 
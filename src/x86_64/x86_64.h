@@ -67,6 +67,12 @@ static inline void disable_interrupts()
 typedef u64 *context;
 
 extern context running_frame;
+extern context bhframe;
+
+static inline boolean in_bottom_half(void)
+{
+    return running_frame == bhframe;
+}
 
 extern void * syscall_stack_top;
 
@@ -180,6 +186,16 @@ extern queue runqueue;
 extern queue bhqueue;
 extern queue deferqueue;
 
+/* Processors enumerated from the ACPI MADT. Only the boot processor is
+   started; the kernel entry paths (running_frame, syscall stack) and
+   kernel heaps are not per-cpu or locked. */
+#define MAX_CPUS 64
+extern int present_cpus;
+extern int online_cpus;
+
+typedef closure_type(madt_handler, void, u32);
+boolean acpi_walk_madt(kernel_heaps kh, madt_handler mh);
+
 heap physically_backed(heap meta, heap virtual, heap physical, heap pages, u64 pagesize);
 void physically_backed_dealloc_virtual(heap h, u64 x, bytes length);
 void print_stack(context c);
@@ -191,6 +207,7 @@ void configure_timer(timestamp rate, thunk t);
 
 boolean enqueue(queue q, void *n);
 void *dequeue(queue q);
+u64 dequeue_n(queue q, void **buf, u64 n);
 void *queue_peek(queue q);
 int queue_length(queue q);
 queue allocate_queue(heap h, u64 size);
@@ -223,16 +240,41 @@ void init_clock(void);
 boolean init_hpet(kernel_heaps kh);
 
 void process_bhqueue();
+
+/* Boot phases overlap; each records its own start and end. */
+enum boot_phase {
+    BOOT_PHASE_DEVICES,
+    BOOT_PHASE_FILESYSTEM,
+    BOOT_PHASE_NETWORK,
+    BOOT_PHASE_UNIX,
+    BOOT_PHASE_EXEC,
+    BOOT_PHASES
+};
+
+void boot_phase_begin(enum boot_phase phase);
+void boot_phase_end(enum boot_phase phase);
+void boot_trace_format(buffer b);
+void boot_trace_print(void);
 void install_fallback_fault_handler(fault_handler h);
 
 // xxx - hide
+/* Bounded MPMC ring (after Dmitry Vyukov): each slot carries a sequence
+   number that tells producers and consumers whether it is free for the
+   lap they are on, so claiming a slot is a single CAS on the position. */
+struct qslot {
+    u64 seq;
+    void *data;
+};
+
 struct queue {
-    u64 count;
-    u64 write;
-    u64 read;
-    u64 size;
+    u64 enqueue_pos;
+    u64 pad0[7];                /* keep producers and consumers on separate lines */
+    u64 dequeue_pos;
+    u64 pad1[7];
+    u64 size;                   /* slots; power of two */
+    u64 capacity;               /* as requested; at most size */
     heap h;
-    void *buf[];
+    struct qslot slots[];
 };
 
 void msi_format(u32 *address, u32 *data, int vector);
@@ -5,14 +5,12 @@
 #include <http.h>
 #include <gdb.h>
 #include <virtio/virtio.h>
+#include <x86_64.h>
 
-closure_function(2, 1, status, read_program_complete,
-                 process, kp, tuple, root,
-                 buffer, b)
+static void start_program(process kp, tuple root, tuple program)
 {
-    tuple root = bound(root);
     if (table_find(root, sym(trace))) {
-        rprintf("read program complete: %p ", root);
+        rprintf("starting program: %p ", root);
         rprintf("gitversion: %s ", gitversion);
 
         /* XXX - disable this until we can be assured that print_root
@@ -25,17 +23,9 @@ closure_function(2, 1, status, read_program_complete,
         rprintf("\n");
 #endif
        
+        boot_trace_print();
     }
-    exec_elf(b, bound(kp));
-    closure_finish();
-    return STATUS_OK;
-}
-
-closure_function(0, 1, void, read_program_fail,
-                 status, s)
-{
-    closure_finish();
-    halt("read program failed %v\n", s);
+    exec_elf(program, kp);
 }
 
 /* XXX Note: temporarily putting these connection tests here until we
@@ -92,6 +82,23 @@ closure_function(1, 1, buffer_handler, each_telnet_connection,
     return closure(h, test_recv, h, out);
 }
 
+/* http debug statistics */
+closure_function(2, 3, void, each_stats_request,
+                 heap, h, void *, format,
+                 http_method, m, buffer_handler, out, value, v)
+{
+    void (*format)(buffer) = bound(format);
+    buffer b = allocate_buffer(bound(h), 4096);
+    if (b == INVALID_ADDRESS) {
+        msg_err("failed to allocate response buffer\n");
+        return;
+    }
+    format(b);
+    status s = send_http_response(out, timm("Content-Type", "text/plain"), b);
+    if (!is_ok(s))
+        msg_err("output buffer handler failed: %v\n", s);
+}
+
 /* http debug test */
 #if 0
 closure_function(1, 3, void, each_test_request,
@@ -144,35 +151,42 @@ closure_function(3, 0, void, startup,
     filesystem fs = bound(fs);
 
     /* kernel process is used as a handle for unix */
+    boot_phase_begin(BOOT_PHASE_UNIX);
     process kp = init_unix(kh, root, fs);
     if (kp == INVALID_ADDRESS) {
 	halt("unable to initialize unix instance; halt\n");
     }
+    boot_phase_end(BOOT_PHASE_UNIX);
     heap general = heap_general(kh);
-    buffer_handler pg = closure(general, read_program_complete, kp, root);
+
+    /* issue the program header reads before anything else */
+    value p = table_find(root, sym(program));
+    assert(p);
+    tuple pro = resolve_path(root, split(general, p, '/'));
+    if (!pro)
+        halt("unable to resolve program path \"%b\"\n", p);
+    start_program(kp, root, pro);
 
     if (table_find(root, sym(telnet))) {
         listen_port(general, 9090, closure(general, each_telnet_connection, general));
         rprintf("Debug telnet server started on port 9090\n");
     }
 
-#if 0
-    http_listener hl = allocate_http_listener(general, 9090);
-    assert(hl != INVALID_ADDRESS);
-    http_register_uri_handler(hl, "test", closure(general, each_test_request, general));
-
     if (table_find(root, sym(http))) {
+        http_listener hl = allocate_http_listener(general, 9090);
+        assert(hl != INVALID_ADDRESS);
+        http_register_uri_handler(hl, "latency", closure(general, each_stats_request, general,
+                                                         histogram_format_all));
+        http_register_uri_handler(hl, "boot", closure(general, each_stats_request, general,
+                                                      boot_trace_format));
+#if 0
+        http_register_uri_handler(hl, "test", closure(general, each_test_request, general));
+#endif
         status s = listen_port(general, 9090, connection_handler_from_http_listener(hl));
         if (!is_ok(s))
             halt("listen_port failed for http listener: %v\n", s);
         rprintf("Debug http server started on port 9090\n");
     }
-#endif
-    value p = table_find(root, sym(program));
-    assert(p);
-    tuple pro = resolve_path(root, split(general, p, '/'));
-    init_network_iface(root);
-    filesystem_read_entire(fs, pro, heap_backed(kh), pg, closure(general, read_program_fail));
     closure_finish();
 }
 
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* Report kernel object cache allocations per syscall for simple read,
+   write and epoll_wait loops, using the totals line of the objcache
+   statistics. Each figure includes the stats read itself, which is
+   amortized over the loop count. */
+
+#define DEFAULT_COUNT 100000
+#define STATS_PATH "/sys/kernel/mm/objcache/stats"
+
+static void fail(const char *s)
+{
+    printf("%s failed: %s (errno %d)\n", s, strerror(errno), errno);
+    exit(EXIT_FAILURE);
+}
+
+static unsigned long long read_allocs(void)
+{
+    char buf[4096];
+    int fd = open(STATS_PATH, O_RDONLY);
+    if (fd < 0)
+        fail("open " STATS_PATH);
+    int n = read(fd, buf, sizeof(buf) - 1);
+    if (n < 0)
+        fail("read " STATS_PATH);
+    close(fd);
+    buf[n] = '\0';
+
+    char *total = strstr(buf, "total: ");
+    unsigned long long allocs;
+    if (!total || sscanf(total, "total: allocs %llu", &allocs) != 1) {
+        printf("no totals in " STATS_PATH "\n");
+        exit(EXIT_FAILURE);
+    }
+    return allocs;
+}
+
+static void report(const char *what, unsigned long long before, long count)
+{
+    unsigned long long allocs = read_allocs() - before;
+    printf("%s: %llu allocations in %ld syscalls (%llu.%03llu per syscall)\n",
+           what, allocs, count, allocs / count, (allocs * 1000 / count) % 1000);
+}
+
+int main(int argc, char **argv)
+{
+    long count = argc > 1 ? atol(argv[1]) : DEFAULT_COUNT;
+    unsigned long long before;
+    char c = 'x';
+    int pfd[2];
+
+    if (count <= 0) {
+        printf("invalid count %ld\n", count);
+        exit(EXIT_FAILURE);
+    }
+
+    if (pipe(pfd) < 0)
+        fail("pipe");
+    before = read_allocs();
+    for (long i = 0; i < count; i++) {
+        if (write(pfd[1], &c, 1) != 1)
+            fail("pipe write");
+        if (read(pfd[0], &c, 1) != 1)
+            fail("pipe read");
+    }
+    report("pipe write+read", before, count * 2);
+    close(pfd[0]);
+    close(pfd[1]);
+
+    int fd = open("/allocbench.dat", O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0)
+        fail("open");
+    if (pwrite(fd, &c, 1, 0) != 1)
+        fail("pwrite");
+    before = read_allocs();
+    for (long i = 0; i < count; i++) {
+        if (pwrite(fd, &c, 1, 0) != 1)
+            fail("pwrite");
+        if (pread(fd, &c, 1, 0) != 1)
+            fail("pread");
+    }
+    report("file pwrite+pread", before, count * 2);
+    close(fd);
+
+    int efd = eventfd(1, 0);
+    if (efd < 0)
+        fail("eventfd");
+    int epfd = epoll_create1(0);
+    if (epfd < 0)
+        fail("epoll_create1");
+    struct epoll_event ev = { .events = EPOLLIN };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &ev) < 0)
+        fail("epoll_ctl");
+    before = read_allocs();
+    for (long i = 0; i < count; i++) {
+        if (epoll_wait(epfd, &ev, 1, 0) != 1)
+            fail("epoll_wait");
+    }
+    report("epoll_wait (ready)", before, count);
+    before = read_allocs();
+    for (long i = 0; i < count; i++) {
+        if (epoll_wait(epfd, &ev, 1, 1) != 1)
+            fail("epoll_wait");
+    }
+    report("epoll_wait (ready, timeout)", before, count);
+    close(epfd);
+    close(efd);
+
+    printf("allocbench test passed\n");
+    exit(EXIT_SUCCESS);
+}
@@ -2,10 +2,15 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <errno.h>
 
+#define BILLION 1000000000ull
+
 /* Covers EPOLL_CTL_ADD and EPOLL_CTL_DEL epoll_ctl operations */
 void test_ctl()
 {
@@ -60,9 +65,212 @@ void test_ctl()
     exit(EXIT_FAILURE);
 }
 
+static void fail(const char *s)
+{
+    printf("%s failed: %s (errno %d)\n", s, strerror(errno), errno);
+    printf("test failed\n");
+    exit(EXIT_FAILURE);
+}
+
+static int wait_one(int efd, int timeout)
+{
+    struct epoll_event ev[4];
+    int n = epoll_wait(efd, ev, 4, timeout);
+    if (n < 0)
+        fail("epoll_wait");
+    return n;
+}
+
+/* A level-triggered fd is reported until drained; an edge-triggered fd
+   only once per transition. */
+void test_triggers()
+{
+    int efd = epoll_create1(0);
+    if (efd < 0)
+        fail("epoll_create1");
+    int lt = eventfd(0, EFD_NONBLOCK);
+    int et = eventfd(0, EFD_NONBLOCK);
+    if (lt < 0 || et < 0)
+        fail("eventfd");
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = lt;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, lt, &event))
+        fail("epoll_ctl");
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = et;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, et, &event))
+        fail("epoll_ctl");
+
+    uint64_t v = 1;
+    if (write(lt, &v, sizeof(v)) != sizeof(v) || write(et, &v, sizeof(v)) != sizeof(v))
+        fail("write");
+    if (wait_one(efd, 0) != 2) {
+        printf("expected both fds ready\n");
+        goto fail;
+    }
+    if (wait_one(efd, 0) != 1) {
+        printf("expected level-triggered fd to be reported again\n");
+        goto fail;
+    }
+    if (read(lt, &v, sizeof(v)) != sizeof(v))
+        fail("read");
+    if (wait_one(efd, 0) != 0) {
+        printf("expected no fds ready after drain\n");
+        goto fail;
+    }
+    close(lt);
+    close(et);
+    close(efd);
+    return;
+  fail:
+    printf("test failed\n");
+    exit(EXIT_FAILURE);
+}
+
+/* EPOLLEXCLUSIVE is accepted on add, but not with EPOLL_CTL_MOD */
+void test_exclusive()
+{
+    int efd = epoll_create1(0);
+    if (efd < 0)
+        fail("epoll_create1");
+    int fd = eventfd(0, EFD_NONBLOCK);
+    if (fd < 0)
+        fail("eventfd");
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.fd = fd;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &event))
+        fail("epoll_ctl add exclusive");
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, fd, &event) != -1 || errno != EINVAL) {
+        printf("EPOLLEXCLUSIVE should not be allowed with EPOLL_CTL_MOD\n");
+        printf("test failed\n");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t v = 1;
+    if (write(fd, &v, sizeof(v)) != sizeof(v))
+        fail("write");
+    if (wait_one(efd, 0) != 1) {
+        printf("expected exclusive fd to be ready\n");
+        printf("test failed\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    close(efd);
+}
+
+/* Two threads wait on one level-triggered fd. The first waiter to
+   return passes the still-ready fd on to the second from within the same
+   delivery, so both must come back with the event. */
+static void *shared_waiter(void *arg)
+{
+    struct epoll_event ev;
+    int n = epoll_wait(*(int *)arg, &ev, 1, 5000);
+    return (void *)(long)n;
+}
+
+void test_shared_wake()
+{
+    int efd = epoll_create1(0);
+    if (efd < 0)
+        fail("epoll_create1");
+    int fd = eventfd(0, EFD_NONBLOCK);
+    if (fd < 0)
+        fail("eventfd");
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &event))
+        fail("epoll_ctl");
+
+    pthread_t pt[2];
+    for (int i = 0; i < 2; i++) {
+        if (pthread_create(&pt[i], NULL, shared_waiter, &efd))
+            fail("pthread_create");
+    }
+    /* give both threads time to block */
+    usleep(100000);
+    uint64_t v = 1;
+    if (write(fd, &v, sizeof(v)) != sizeof(v))
+        fail("write");
+    for (int i = 0; i < 2; i++) {
+        void *retval;
+        if (pthread_join(pt[i], &retval))
+            fail("pthread_join");
+        if ((long)retval != 1) {
+            printf("waiter %d returned %ld, expected 1\n", i, (long)retval);
+            printf("test failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
+    close(efd);
+}
+
+/* Time epoll_wait with one active fd among a growing number of idle
+   ones; with a ready list the cost per wait should stay flat. */
+#define BENCH_ITERATIONS 10000
+
+void bench_idle(int nidle)
+{
+    int efd = epoll_create1(0);
+    if (efd < 0)
+        fail("epoll_create1");
+    int *idle = malloc(nidle * sizeof(int));
+    if (!idle)
+        fail("malloc");
+    struct epoll_event event;
+    for (int i = 0; i < nidle; i++) {
+        idle[i] = eventfd(0, EFD_NONBLOCK);
+        if (idle[i] < 0)
+            fail("eventfd");
+        event.events = EPOLLIN;
+        event.data.fd = idle[i];
+        if (epoll_ctl(efd, EPOLL_CTL_ADD, idle[i], &event))
+            fail("epoll_ctl");
+    }
+    int active = eventfd(0, EFD_NONBLOCK);
+    if (active < 0)
+        fail("eventfd");
+    event.events = EPOLLIN;
+    event.data.fd = active;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, active, &event))
+        fail("epoll_ctl");
+
+    struct timespec start, end;
+    uint64_t v = 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        if (write(active, &v, sizeof(v)) != sizeof(v))
+            fail("write");
+        if (wait_one(efd, -1) != 1) {
+            printf("expected one ready fd\n");
+            printf("test failed\n");
+            exit(EXIT_FAILURE);
+        }
+        if (read(active, &v, sizeof(v)) != sizeof(v))
+            fail("read");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    unsigned long long ns = (end.tv_sec - start.tv_sec) * BILLION +
+        (end.tv_nsec - start.tv_nsec);
+    printf("%d idle fds: %llu ns per wait\n", nidle, ns / BENCH_ITERATIONS);
+
+    close(active);
+    for (int i = 0; i < nidle; i++)
+        close(idle[i]);
+    free(idle);
+    close(efd);
+}
+
 int main(int argc, char **argv)
 {
     test_ctl();
+    test_triggers();
+    test_exclusive();
+    test_shared_wake();
+    for (int nidle = 1; nidle <= 10000; nidle *= 10)
+        bench_idle(nidle);
 
     printf("test passed\n");
     return EXIT_SUCCESS;
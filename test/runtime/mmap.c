@@ -285,6 +285,118 @@ static void mmap_flags_test(const char  * filename, void * target_addr,
         close(fd);
 }
 
+/* Pass a file mapping that hasn't been touched yet straight to
+ * syscalls, first as the source of a write() and then as the
+ * destination of a read(), so that the kernel is the first to access
+ * its pages.
+ */
+static void syscall_buffer_test(const char * filename)
+{
+    char contents[PAGESIZE];
+    char piped[PAGESIZE];
+    int fds[2];
+    ssize_t bytes;
+    void * addr;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("open failed");
+        exit(EXIT_FAILURE);
+    }
+    bytes = read(fd, contents, PAGESIZE);
+    if (bytes <= 0) {
+        perror("read failed");
+        exit(EXIT_FAILURE);
+    }
+    if (pipe(fds)) {
+        perror("pipe failed");
+        exit(EXIT_FAILURE);
+    }
+
+    addr = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+    if (write(fds[1], addr, bytes) != bytes) {
+        perror("write from mapping failed");
+        exit(EXIT_FAILURE);
+    }
+    if (read(fds[0], piped, bytes) != bytes || memcmp(piped, contents, bytes)) {
+        fprintf(stderr, "write from mapping: contents differ\n");
+        exit(EXIT_FAILURE);
+    }
+    do_munmap(addr, bytes);
+
+    addr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+    if (write(fds[1], contents, bytes) != bytes) {
+        perror("write failed");
+        exit(EXIT_FAILURE);
+    }
+    if (read(fds[0], addr, bytes) != bytes || memcmp(addr, contents, bytes)) {
+        fprintf(stderr, "read into mapping: contents differ\n");
+        exit(EXIT_FAILURE);
+    }
+    do_munmap(addr, bytes);
+
+    close(fds[0]);
+    close(fds[1]);
+    close(fd);
+}
+
+/* Stores through a shared file mapping must reach the file by way of
+ * msync and survive the mapping being torn down.
+ */
+static void shared_write_test(void)
+{
+    const char * filename = "shared_write";
+    char contents[PAGESIZE];
+    void * addr;
+    int fd;
+
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(contents, 'a', PAGESIZE);
+    if (write(fd, contents, PAGESIZE) != PAGESIZE) {
+        perror("write failed");
+        exit(EXIT_FAILURE);
+    }
+
+    addr = mmap(NULL, PAGESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(addr, 'b', PAGESIZE / 2);
+    if (msync(addr, PAGESIZE, MS_SYNC)) {
+        perror("msync failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(addr + PAGESIZE / 2, 'c', PAGESIZE / 2);
+    do_munmap(addr, PAGESIZE);
+
+    if (pread(fd, contents, PAGESIZE, 0) != PAGESIZE) {
+        perror("pread failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < PAGESIZE; i++) {
+        if (contents[i] != (i < PAGESIZE / 2 ? 'b' : 'c')) {
+            fprintf(stderr, "shared mapping store lost at offset %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
+    unlink(filename);
+}
+
 typedef struct {
     char * filename;
     unsigned long flags;
@@ -366,6 +478,12 @@ static void mmap_test(void)
         mmap_flags_test(tests[i].filename, mmap_addr, size, tests[i].flags);
     }
 
+    printf("  performing syscall_buffer_test...\n");
+    syscall_buffer_test("infile");
+
+    printf("  performing shared_write_test...\n");
+    shared_write_test();
+
     printf("  performing munmap test...\n");
     {
         void * mmap_addr;
@@ -6,6 +6,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 
 #include <runtime.h>
 
@@ -119,6 +122,121 @@ void blocking_test(heap h, int * fds)
     printf("blocking test passed\n");
 }
 
+#define SPLICE_TEST_LEN (3 * PAGESIZE + 100)
+
+static char splice_srcbuf[SPLICE_TEST_LEN];
+
+static void splice_read_check(int fd, const char *src, int len, const char *what)
+{
+    char dstbuf[SPLICE_TEST_LEN];
+    int nread = 0;
+    while (nread < len) {
+        int nbytes = read(fd, dstbuf + nread, len - nread);
+        if (nbytes <= 0)
+            handle_error(what);
+        nread += nbytes;
+    }
+    if (memcmp(dstbuf, src, len)) {
+        printf("splice test: %s: data mismatch\n", what);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* vmsplice into one pipe, tee and splice it to another, splice a file
+   through the pipe to a second file, and splice between the pipes and a
+   socketpair */
+void splice_test(heap h)
+{
+    int a[2], b[2];
+    ssize_t n;
+
+    for (int i = 0; i < SPLICE_TEST_LEN; i++)
+        splice_srcbuf[i] = (char)random_u64();
+    if (__pipe(a) < 0 || __pipe(b) < 0)
+        handle_error("splice test pipe");
+
+    struct iovec iov[2] = {
+        { .iov_base = splice_srcbuf, .iov_len = 100 },
+        { .iov_base = splice_srcbuf + 100, .iov_len = SPLICE_TEST_LEN - 100 },
+    };
+    n = vmsplice(a[1], iov, 2, 0);
+    if (n != SPLICE_TEST_LEN) {
+        printf("splice test: vmsplice returned %ld\n", n);
+        exit(EXIT_FAILURE);
+    }
+    n = tee(a[0], b[1], SPLICE_TEST_LEN, 0);
+    if (n != SPLICE_TEST_LEN) {
+        printf("splice test: tee returned %ld\n", n);
+        exit(EXIT_FAILURE);
+    }
+    splice_read_check(b[0], splice_srcbuf, SPLICE_TEST_LEN, "tee read");
+    n = splice(a[0], 0, b[1], 0, SPLICE_TEST_LEN, 0);
+    if (n != SPLICE_TEST_LEN) {
+        printf("splice test: pipe to pipe splice returned %ld\n", n);
+        exit(EXIT_FAILURE);
+    }
+    splice_read_check(b[0], splice_srcbuf, SPLICE_TEST_LEN, "splice read");
+    n = splice(a[0], 0, b[1], 0, SPLICE_TEST_LEN, SPLICE_F_NONBLOCK);
+    if (n != -1 || errno != EAGAIN) {
+        printf("splice test: splice from empty pipe returned %ld, errno %d\n", n, errno);
+        exit(EXIT_FAILURE);
+    }
+
+    int in = open("/splice_in", O_CREAT | O_RDWR | O_TRUNC, 0644);
+    int out = open("/splice_out", O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (in < 0 || out < 0)
+        handle_error("splice test open");
+    if (write(in, splice_srcbuf, SPLICE_TEST_LEN) != SPLICE_TEST_LEN)
+        handle_error("splice test write");
+    loff_t off_in = 0, off_out = 0;
+    while (off_in < SPLICE_TEST_LEN) {
+        n = splice(in, &off_in, a[1], 0, SPLICE_TEST_LEN - off_in, 0);
+        if (n <= 0)
+            handle_error("splice from file");
+        while (n > 0) {
+            ssize_t m = splice(a[0], 0, out, &off_out, n, 0);
+            if (m <= 0)
+                handle_error("splice to file");
+            n -= m;
+        }
+    }
+    if (off_out != SPLICE_TEST_LEN) {
+        printf("splice test: spliced %ld bytes to file\n", (long)off_out);
+        exit(EXIT_FAILURE);
+    }
+    splice_read_check(out, splice_srcbuf, SPLICE_TEST_LEN, "file read");
+
+    /* a unix socket is written by copy rather than by page reference */
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        handle_error("splice test socketpair");
+    if (vmsplice(a[1], iov, 2, 0) != SPLICE_TEST_LEN)
+        handle_error("splice test vmsplice");
+    for (int done = 0; done < SPLICE_TEST_LEN; done += n) {
+        n = splice(a[0], 0, sv[0], 0, SPLICE_TEST_LEN - done, 0);
+        if (n <= 0)
+            handle_error("splice to socketpair");
+    }
+    splice_read_check(sv[1], splice_srcbuf, SPLICE_TEST_LEN, "socketpair read");
+    if (write(sv[1], splice_srcbuf, SPLICE_TEST_LEN) != SPLICE_TEST_LEN)
+        handle_error("splice test socketpair write");
+    for (int done = 0; done < SPLICE_TEST_LEN; done += n) {
+        n = splice(sv[0], 0, b[1], 0, SPLICE_TEST_LEN - done, 0);
+        if (n <= 0)
+            handle_error("splice from socketpair");
+        splice_read_check(b[0], splice_srcbuf + done, n, "splice from socketpair read");
+    }
+    close(sv[0]);
+    close(sv[1]);
+    close(in);
+    close(out);
+    close(a[0]);
+    close(a[1]);
+    close(b[0]);
+    close(b[1]);
+    printf("splice test passed\n");
+}
+
 int main(int argc, char **argv)
 {
     int fds[2] = {0,0};
@@ -139,5 +257,7 @@ int main(int argc, char **argv)
 
     close(fds[0]);
     close(fds[1]);
+
+    splice_test(h);
     return(EXIT_SUCCESS);
 }
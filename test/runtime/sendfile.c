@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <sys/syscall.h>
 #include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <errno.h>
 #include <string.h>
 
@@ -83,12 +84,30 @@ int main(int argc, char *argv[])
     if (memcmp(buf, cmp_buf, sizeof(buf)) != 0)
         sf_err_goto(err_fop, "sendfile() failed!!\n");
 
+    /* a unix socket takes the copying path, not the lwIP one */
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        sf_err_goto(err_fop, "socketpair error %d\n", errno);
+    lseek(fd_in, 0, SEEK_SET);
+    ret = sendfile(sv[0], fd_in, NULL, BUF_LEN);
+    if (ret != BUF_LEN)
+        sf_err_goto(err_sv, "sendfile to socketpair error %d. wrote %d of %d\n", errno, ret, BUF_LEN);
+    memset(cmp_buf, 0, sizeof(cmp_buf));
+    ret = read(sv[1], cmp_buf, sizeof(cmp_buf));
+    if (ret != BUF_LEN || memcmp(buf, cmp_buf, sizeof(buf)) != 0)
+        sf_err_goto(err_sv, "sendfile() to socketpair failed!!\n");
+    close(sv[0]);
+    close(sv[1]);
+
     close(fd_out);
     close(fd_in);
 
     printf("!!!Success!!!\n");
     exit (0);
 
+err_sv:
+    close(sv[0]);
+    close(sv[1]);
 err_fop:
     close(fd_out);
 err_fdout:
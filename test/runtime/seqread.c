@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+/* Sequential read throughput over one large file. The file is written and
+   synced first so that its extent layout is whatever the filesystem
+   chose for a large streaming write. */
+
+#define BUFSIZE (1ull << 20)
+#define DEFAULT_SIZE_MB 1024
+#define BILLION 1000000000ull
+
+static void fail(const char * s)
+{
+    printf("%s failed: %s (errno %d)\n", s, strerror(errno), errno);
+    exit(EXIT_FAILURE);
+}
+
+static unsigned long long elapsed_ns(struct timespec * start, struct timespec * end)
+{
+    return (end->tv_sec - start->tv_sec) * BILLION + (end->tv_nsec - start->tv_nsec);
+}
+
+static void report(const char * what, unsigned long long bytes, unsigned long long ns)
+{
+    unsigned long long mbps = ns ? (bytes * 1000ull) / ns : 0; /* bytes/ns * 1000 = MB/s */
+    printf("%s: %lld MB in %lld.%.3lld s, %lld MB/s\n", what, bytes >> 20,
+           ns / BILLION, (ns % BILLION) / 1000000ull, mbps);
+}
+
+int main(int argc, char ** argv)
+{
+    const char * path = "/seqread.dat";
+    unsigned long long size = (unsigned long long)DEFAULT_SIZE_MB << 20;
+    struct timespec start, end;
+    unsigned long long n;
+
+    if (argc > 1)
+        size = strtoull(argv[1], 0, 0) << 20;
+    if (argc > 2)
+        path = argv[2];
+
+    char * buf = malloc(BUFSIZE);
+    if (!buf)
+        fail("malloc");
+    for (n = 0; n < BUFSIZE; n++)
+        buf[n] = n * 7;
+
+    int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0)
+        fail("open");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (n = 0; n < size; n += BUFSIZE) {
+        ssize_t rv = write(fd, buf, BUFSIZE);
+        if (rv != BUFSIZE)
+            fail("write");
+    }
+    if (fsync(fd) < 0)
+        fail("fsync");
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    report("write", size, elapsed_ns(&start, &end));
+    close(fd);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        fail("open");
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        fail("fstat");
+    if (st.st_size != size) {
+        printf("file size mismatch: %lld, expected %lld\n", (long long)st.st_size, size);
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (n = 0; n < size;) {
+        ssize_t rv = read(fd, buf, BUFSIZE);
+        if (rv < 0)
+            fail("read");
+        if (rv == 0)
+            break;
+        if (buf[0] != (char)((n & (BUFSIZE - 1)) * 7)) {
+            printf("data mismatch at offset %lld\n", n);
+            exit(EXIT_FAILURE);
+        }
+        n += rv;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (n != size) {
+        printf("short read: %lld of %lld bytes\n", n, size);
+        exit(EXIT_FAILURE);
+    }
+    report("read", size, elapsed_ns(&start, &end));
+    close(fd);
+    printf("seqread test passed\n");
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/* TCP socket options, held output and splice. The test listens for a peer
+   that echoes everything it receives, e.g.
+
+     socat TCP:<guest address>:5310 EXEC:cat
+
+   and checks each echo against a bound well below the 200 ms for which
+   the kernel may hold output, so data left held shows up as a failure. */
+
+#define DEFAULT_PORT 5310
+#define BILLION 1000000000ull
+#define ECHO_MAX_NS (BILLION / 10)
+#define BUFLEN 256
+
+static void fail(const char *s)
+{
+    printf("%s failed: %s (errno %d)\n", s, strerror(errno), errno);
+    exit(EXIT_FAILURE);
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+static int get_tcp_opt(int fd, int opt)
+{
+    int val;
+    socklen_t len = sizeof(val);
+    if (getsockopt(fd, IPPROTO_TCP, opt, &val, &len) < 0)
+        fail("getsockopt");
+    return val;
+}
+
+static void set_tcp_opt(int fd, int opt, int val)
+{
+    if (setsockopt(fd, IPPROTO_TCP, opt, &val, sizeof(val)) < 0)
+        fail("setsockopt");
+}
+
+static void expect_tcp_opt(int fd, int opt, const char *name, int val)
+{
+    int got = get_tcp_opt(fd, opt);
+    if (got != val) {
+        printf("%s is %d, expected %d\n", name, got, val);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void test_options(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        fail("socket");
+    expect_tcp_opt(fd, TCP_NODELAY, "TCP_NODELAY", 0);
+    expect_tcp_opt(fd, TCP_CORK, "TCP_CORK", 0);
+    set_tcp_opt(fd, TCP_NODELAY, 1);
+    expect_tcp_opt(fd, TCP_NODELAY, "TCP_NODELAY", 1);
+    set_tcp_opt(fd, TCP_NODELAY, 0);
+    expect_tcp_opt(fd, TCP_NODELAY, "TCP_NODELAY", 0);
+    set_tcp_opt(fd, TCP_CORK, 1);
+    expect_tcp_opt(fd, TCP_CORK, "TCP_CORK", 1);
+    set_tcp_opt(fd, TCP_CORK, 0);
+    expect_tcp_opt(fd, TCP_CORK, "TCP_CORK", 0);
+    close(fd);
+}
+
+/* TCP_NODELAY is set on the listener, after listen(), and must carry
+   over to the accepted connection. It also keeps Nagle from delaying
+   the small writes below. */
+static int accept_peer(int port)
+{
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0)
+        fail("socket");
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+        fail("bind");
+    if (listen(lfd, 1) < 0)
+        fail("listen");
+    set_tcp_opt(lfd, TCP_NODELAY, 1);
+    expect_tcp_opt(lfd, TCP_NODELAY, "listener TCP_NODELAY", 1);
+
+    printf("waiting for echo peer on port %d\n", port);
+    int fd = accept(lfd, 0, 0);
+    if (fd < 0)
+        fail("accept");
+    expect_tcp_opt(fd, TCP_NODELAY, "accepted TCP_NODELAY", 1);
+    close(lfd);
+    return fd;
+}
+
+static void expect_echo(int fd, const char *what, const char *expect, unsigned long long start)
+{
+    char buf[BUFLEN];
+    size_t len = strlen(expect);
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n <= 0)
+            fail("read");
+        got += n;
+    }
+    unsigned long long elapsed = now_ns() - start;
+    if (memcmp(buf, expect, len)) {
+        printf("%s: echo mismatch\n", what);
+        exit(EXIT_FAILURE);
+    }
+    if (elapsed > ECHO_MAX_NS) {
+        printf("%s: echo took %lld ms; output was held\n", what, elapsed / 1000000);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void write_all(int fd, const char *s)
+{
+    if (write(fd, s, strlen(s)) != strlen(s))
+        fail("write");
+}
+
+static void test_held_output(int fd)
+{
+    /* corked writes go out when TCP_CORK is cleared */
+    unsigned long long start = now_ns();
+    set_tcp_opt(fd, TCP_CORK, 1);
+    write_all(fd, "corked ");
+    write_all(fd, "data\n");
+    set_tcp_opt(fd, TCP_CORK, 0);
+    expect_echo(fd, "uncork", "corked data\n", start);
+
+    /* a send with MSG_MORE goes out with the next send without it */
+    start = now_ns();
+    if (send(fd, "more ", 5, MSG_MORE) != 5 || send(fd, "data\n", 5, 0) != 5)
+        fail("send");
+    expect_echo(fd, "MSG_MORE", "more data\n", start);
+
+    /* sendmmsg implies MSG_MORE for all but the last message; an empty
+       last message must not leave the data before it held */
+    struct iovec iov[2] = {
+        { .iov_base = "mmsg data\n", .iov_len = 10 },
+        { .iov_base = "", .iov_len = 0 },
+    };
+    struct mmsghdr msgs[2];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < 2; i++) {
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    start = now_ns();
+    if (sendmmsg(fd, msgs, 2, 0) < 1)
+        fail("sendmmsg");
+    expect_echo(fd, "sendmmsg", "mmsg data\n", start);
+}
+
+#define SPLICE_CHUNK 1000        /* within the default lwIP send buffer */
+#define SPLICE_ROUNDS 8
+
+static void read_all(int fd, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n <= 0)
+            fail("read");
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Each round's echo arrives as a chain of segments. It is taken apart
+   by splices into a pipe and reads that alternate in odd sizes, so the
+   receive cursor is left partway into a segment both by the zero-copy
+   splice path and by read. The spliced data is then spliced back out
+   to the socket and must come back unchanged. */
+static void test_splice(int fd)
+{
+    char chunk[SPLICE_CHUNK], spliced[SPLICE_CHUNK], buf[SPLICE_CHUNK];
+    int pfd[2];
+    if (pipe(pfd) < 0)
+        fail("pipe");
+
+    for (int round = 0; round < SPLICE_ROUNDS; round++) {
+        for (int i = 0; i < SPLICE_CHUNK; i++)
+            chunk[i] = (round * SPLICE_CHUNK + i) % 251;
+        if (write(fd, chunk, SPLICE_CHUNK) != SPLICE_CHUNK)
+            fail("write");
+
+        size_t consumed = 0, nspliced = 0;
+        int step = 0;
+        while (consumed < SPLICE_CHUNK) {
+            size_t want = (step & 1) ? 29 + 13 * round : 301 + 41 * round;
+            want = want < SPLICE_CHUNK - consumed ? want : SPLICE_CHUNK - consumed;
+            ssize_t n;
+            if (step & 1) {
+                n = read(fd, buf, want);
+                if (n <= 0)
+                    fail("read");
+                if (memcmp(buf, chunk + consumed, n)) {
+                    printf("round %d: read at %zu mismatched\n", round, consumed);
+                    exit(EXIT_FAILURE);
+                }
+            } else {
+                n = splice(fd, 0, pfd[1], 0, want, 0);
+                if (n <= 0)
+                    fail("splice from socket");
+                memcpy(spliced + nspliced, chunk + consumed, n);
+                nspliced += n;
+            }
+            consumed += n;
+            step++;
+        }
+
+        for (size_t out = 0; out < nspliced; ) {
+            ssize_t n = splice(pfd[0], 0, fd, 0, nspliced - out, 0);
+            if (n <= 0)
+                fail("splice to socket");
+            out += n;
+        }
+        read_all(fd, buf, nspliced);
+        if (memcmp(buf, spliced, nspliced)) {
+            printf("round %d: spliced data mismatched\n", round);
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(pfd[0]);
+    close(pfd[1]);
+}
+
+int main(int argc, char **argv)
+{
+    int port = argc > 1 ? atoi(argv[1]) : DEFAULT_PORT;
+
+    test_options();
+    int fd = accept_peer(port);
+    test_held_output(fd);
+    test_splice(fd);
+    close(fd);
+
+    printf("test passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+/* UDP echo throughput, as udploop but batched: datagrams are received
+   with recvmmsg and echoed with sendmmsg, up to a batch at a time. A
+   datagram starting with "terminate" ends the run and the received
+   rate is reported. */
+
+#define DEFAULT_PORT 5309
+#define DEFAULT_BATCH 64
+#define MAX_BATCH 1024
+#define BUFLEN 1500
+#define BILLION 1000000000ull
+
+static char bufs[MAX_BATCH][BUFLEN];
+static struct iovec iovs[MAX_BATCH];
+static struct sockaddr_in addrs[MAX_BATCH];
+static struct mmsghdr msgs[MAX_BATCH];
+
+static void fail(const char *s)
+{
+    printf("%s failed: %s (errno %d)\n", s, strerror(errno), errno);
+    exit(EXIT_FAILURE);
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    int port = argc > 1 ? atoi(argv[1]) : DEFAULT_PORT;
+    int batch = argc > 2 ? atoi(argv[2]) : DEFAULT_BATCH;
+    const char *tstr = "terminate";
+    int tlen = strlen(tstr);
+
+    if (batch <= 0 || batch > MAX_BATCH) {
+        printf("invalid batch size %d\n", batch);
+        exit(EXIT_FAILURE);
+    }
+    printf("using local port %d, batch %d\n", port, batch);
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        fail("socket");
+    struct sockaddr_in lsin;
+    memset(&lsin, 0, sizeof(lsin));
+    lsin.sin_family = AF_INET;
+    lsin.sin_port = htons(port);
+    lsin.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr *)&lsin, sizeof(lsin)) < 0)
+        fail("bind");
+
+    unsigned long long start = 0, datagrams = 0, bytes = 0, calls = 0;
+    while (1) {
+        for (int i = 0; i < batch; i++) {
+            iovs[i].iov_base = bufs[i];
+            iovs[i].iov_len = BUFLEN;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = 0;
+            msgs[i].msg_hdr.msg_controllen = 0;
+        }
+        int n = recvmmsg(fd, msgs, batch, MSG_WAITFORONE, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fail("recvmmsg");
+        }
+        if (start == 0)
+            start = now_ns();
+        calls++;
+
+        int done = 0;
+        for (int i = 0; i < n; i++) {
+            iovs[i].iov_len = msgs[i].msg_len;
+            bytes += msgs[i].msg_len;
+            if (msgs[i].msg_len >= tlen && strncmp(tstr, bufs[i], tlen) == 0)
+                done = 1;
+        }
+        datagrams += n;
+
+        for (int sent = 0; sent < n;) {
+            int m = sendmmsg(fd, msgs + sent, n - sent, 0);
+            if (m < 0) {
+                if (errno == ENOBUFS || errno == ENOMEM)
+                    break;      /* drop the rest of this batch */
+                fail("sendmmsg");
+            }
+            sent += m;
+        }
+
+        if (done)
+            break;
+    }
+
+    unsigned long long ns = now_ns() - start;
+    if (ns == 0)
+        ns = 1;
+    printf("%lld datagrams, %lld bytes in %lld.%03lld s\n", datagrams, bytes,
+           ns / BILLION, (ns % BILLION) / 1000000ull);
+    printf("%lld datagrams/s, %lld KB/s, %lld.%02lld datagrams per recvmmsg\n",
+           datagrams * BILLION / ns, bytes * BILLION / ns / 1024,
+           datagrams / calls, (datagrams * 100 / calls) % 100);
+    printf("udpbench test passed\n");
+    close(fd);
+    exit(EXIT_SUCCESS);
+}
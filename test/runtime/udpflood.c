@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+/* Send a flood of UDP datagrams and report, from the kernel's virtqueue
+   statistics, how many vqmsgs and heap allocations the transmit path
+   took per packet. The destination need not be listening. */
+
+#define DEFAULT_ADDR "10.0.2.2"
+#define DEFAULT_PORT 5309
+#define DEFAULT_COUNT 100000
+#define DEFAULT_SIZE 64
+#define STATS_PATH "/sys/kernel/virtio/virtqueue/stats"
+
+struct vq_totals {
+    unsigned long long msgs;
+    unsigned long long heap_msgs;
+    unsigned long long heap_descs;
+};
+
+static void fail(const char *s)
+{
+    printf("%s failed: %s (errno %d)\n", s, strerror(errno), errno);
+    exit(EXIT_FAILURE);
+}
+
+static void read_totals(struct vq_totals *t)
+{
+    char buf[1024];
+    int fd = open(STATS_PATH, O_RDONLY);
+    if (fd < 0)
+        fail("open " STATS_PATH);
+    int n = read(fd, buf, sizeof(buf) - 1);
+    if (n < 0)
+        fail("read " STATS_PATH);
+    close(fd);
+    buf[n] = '\0';
+
+    memset(t, 0, sizeof(*t));
+    for (char *line = strtok(buf, "\n"); line; line = strtok(0, "\n")) {
+        int vq, index, entries;
+        unsigned long long msgs, heap_msgs, heap_descs;
+        if (sscanf(line, "vq%d: index %d entries %d msgs %llu heap_msgs %llu heap_descs %llu",
+                   &vq, &index, &entries, &msgs, &heap_msgs, &heap_descs) != 6) {
+            printf("unexpected stats line: \"%s\"\n", line);
+            exit(EXIT_FAILURE);
+        }
+        t->msgs += msgs;
+        t->heap_msgs += heap_msgs;
+        t->heap_descs += heap_descs;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *addr = argc > 1 ? argv[1] : DEFAULT_ADDR;
+    int port = argc > 2 ? atoi(argv[2]) : DEFAULT_PORT;
+    long count = argc > 3 ? atol(argv[3]) : DEFAULT_COUNT;
+    int size = argc > 4 ? atoi(argv[4]) : DEFAULT_SIZE;
+    char buf[1500];
+    struct vq_totals before, after;
+
+    if (size <= 0 || size > sizeof(buf)) {
+        printf("invalid datagram size %d\n", size);
+        exit(EXIT_FAILURE);
+    }
+    memset(buf, 0xa5, size);
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        fail("socket");
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    if (inet_aton(addr, &sin.sin_addr) == 0) {
+        printf("invalid address %s\n", addr);
+        exit(EXIT_FAILURE);
+    }
+
+    /* prime ARP so the flood measures the steady state */
+    if (sendto(fd, buf, size, 0, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+        fail("sendto");
+    usleep(100000);
+
+    read_totals(&before);
+    long sent = 0;
+    for (long i = 0; i < count; i++) {
+        if (sendto(fd, buf, size, 0, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+            if (errno == ENOBUFS || errno == ENOMEM)
+                continue;
+            fail("sendto");
+        }
+        sent++;
+    }
+    read_totals(&after);
+    close(fd);
+
+    if (sent == 0) {
+        printf("no datagrams sent\n");
+        exit(EXIT_FAILURE);
+    }
+    unsigned long long msgs = after.msgs - before.msgs;
+    unsigned long long heap = (after.heap_msgs - before.heap_msgs) +
+        (after.heap_descs - before.heap_descs);
+    printf("%ld datagrams of %d bytes to %s:%d\n", sent, size, addr, port);
+    printf("vqmsgs: %llu (%llu.%03llu per packet)\n", msgs,
+           msgs / sent, (msgs * 1000 / sent) % 1000);
+    printf("vqmsg heap allocations: %llu (%llu.%03llu per packet)\n", heap,
+           heap / sent, (heap * 1000 / sent) % 1000);
+    printf("udpflood test passed\n");
+    exit(EXIT_SUCCESS);
+}
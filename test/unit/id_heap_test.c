@@ -1,5 +1,6 @@
 #include <runtime.h>
 #include <stdlib.h>
+#include <time.h>
 #define EXIT_FAILURE 1
 #define EXIT_SUCCESS 0
 
@@ -346,6 +347,197 @@ static boolean alloc_subrange_test(heap h)
     return true;
 }
 
+#define HINT_TEST_RANGES	8
+#define HINT_TEST_PAGES		16
+
+/* the per-order hints must skip full ranges yet return to freed ones */
+static boolean hint_test(heap h)
+{
+    heap id = allocate_id_heap(h, PAGESIZE);
+    if (id == INVALID_ADDRESS)
+        return false;
+    for (int i = 0; i < HINT_TEST_RANGES; i++) {
+        if (!id_heap_add_range(id, i * 2 * HINT_TEST_PAGES * PAGESIZE, HINT_TEST_PAGES * PAGESIZE)) {
+            msg_err("%s: failed to add range %d\n", __func__, i);
+            return false;
+        }
+    }
+
+    /* fill all ranges with single pages, in order */
+    u64 res;
+    for (int i = 0; i < HINT_TEST_RANGES * HINT_TEST_PAGES; i++) {
+        u64 expect = ((i / HINT_TEST_PAGES) * 2 * HINT_TEST_PAGES + (i % HINT_TEST_PAGES)) * PAGESIZE;
+        if ((res = allocate_u64(id, PAGESIZE)) != expect) {
+            msg_err("%s: fill alloc returned 0x%lx, should be 0x%lx\n", __func__, res, expect);
+            return false;
+        }
+    }
+    if ((res = allocate_u64(id, PAGESIZE)) != INVALID_PHYSICAL ||
+        (res = allocate_u64(id, 2 * PAGESIZE)) != INVALID_PHYSICAL) {
+        msg_err("%s: alloc from full heap returned 0x%lx\n", __func__, res);
+        return false;
+    }
+
+    /* a free in the last range, then in the first, must both be found */
+    u64 last = ((HINT_TEST_RANGES - 1) * 2 * HINT_TEST_PAGES + 4) * PAGESIZE;
+    deallocate_u64(id, last, 2 * PAGESIZE);
+    if ((res = allocate_u64(id, 2 * PAGESIZE)) != last) {
+        msg_err("%s: alloc after free returned 0x%lx, should be 0x%lx\n", __func__, res, last);
+        return false;
+    }
+    deallocate_u64(id, 3 * PAGESIZE, PAGESIZE);
+    if ((res = allocate_u64(id, 2 * PAGESIZE)) != INVALID_PHYSICAL) {
+        msg_err("%s: 2-page alloc should have failed, got 0x%lx\n", __func__, res);
+        return false;
+    }
+    if ((res = allocate_u64(id, PAGESIZE)) != 3 * PAGESIZE) {
+        msg_err("%s: alloc after free returned 0x%lx, should be 0x%lx\n", __func__, res, 3 * PAGESIZE);
+        return false;
+    }
+
+    /* same for pages released through id_heap_set_area */
+    if (!id_heap_set_area(id, 2 * HINT_TEST_PAGES * PAGESIZE, 4 * PAGESIZE, true, false)) {
+        msg_err("%s: set_area release failed\n", __func__);
+        return false;
+    }
+    if ((res = allocate_u64(id, 4 * PAGESIZE)) != 2 * HINT_TEST_PAGES * PAGESIZE) {
+        msg_err("%s: alloc after release returned 0x%lx, should be 0x%lx\n", __func__, res,
+                2 * HINT_TEST_PAGES * PAGESIZE);
+        return false;
+    }
+
+    id->destroy(id);
+    return true;
+}
+
+/* Allocation cost on fragmented maps, where a linear scan of the bitmap
+   has to step over long stretches of full or partially-used words. */
+#define BENCH_BITS_ORDER	22
+#define BENCH_HOLE_ORDER	14	/* one free page per 2^14 in the sparse map */
+#define BENCH_ROUNDS		64
+#define BENCH_RUN_PAGES		256
+#define BENCH_RUN_OPS		4096
+#define BENCH_RANGES		4096
+#define BENCH_RANGE_PAGES	64
+#define BENCH_RANGE_OPS		4096
+
+static u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+/* single pages from holes spread thinly over an otherwise full map */
+static boolean bench_sparse(heap h)
+{
+    u64 length = U64_FROM_BIT(BENCH_BITS_ORDER);
+    u64 holes = length >> BENCH_HOLE_ORDER;
+    heap id = create_id_heap(h, 0, length, 1);
+    if (id == INVALID_ADDRESS || allocate_u64(id, length) != 0) {
+        msg_err("%s: heap setup failed\n", __func__);
+        return false;
+    }
+    for (u64 i = 0; i < holes; i++)
+        deallocate_u64(id, (i << BENCH_HOLE_ORDER) + (i & 63), 1);
+
+    u64 start = now_ns();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (u64 i = 0; i < holes; i++) {
+            u64 expect = (i << BENCH_HOLE_ORDER) + (i & 63);
+            u64 a = allocate_u64(id, 1);
+            if (a != expect) {
+                msg_err("%s: allocation returned 0x%lx, expecting 0x%lx\n", __func__, a, expect);
+                return false;
+            }
+        }
+        if (allocate_u64(id, 1) != INVALID_PHYSICAL) {
+            msg_err("%s: allocation from full map should fail\n", __func__);
+            return false;
+        }
+        /* free from the top down so that next-fit restarts at the bottom */
+        for (u64 i = holes; i > 0; i--)
+            deallocate_u64(id, ((i - 1) << BENCH_HOLE_ORDER) + ((i - 1) & 63), 1);
+    }
+    u64 elapsed = now_ns() - start;
+    u64 ops = BENCH_ROUNDS * (holes + 1);
+    rprintf("sparse holes: %ld allocations in %ld us, %ld ns/alloc\n",
+            ops, elapsed / THOUSAND, elapsed / ops);
+    id->destroy(id);
+    return true;
+}
+
+/* multi-page runs past a region where every 64-page word holds one page */
+static boolean bench_fragmented(heap h)
+{
+    u64 length = U64_FROM_BIT(BENCH_BITS_ORDER);
+    u64 frag_end = length - 4 * BENCH_RUN_PAGES;
+    heap id = create_id_heap(h, 0, length, 1);
+    if (id == INVALID_ADDRESS) {
+        msg_err("%s: heap setup failed\n", __func__);
+        return false;
+    }
+    for (u64 p = 0; p < frag_end; p += 64) {
+        u64 q = p + ((p >> 6) & 63);
+        if (id_heap_alloc_subrange(id, 1, q, q + 1) != q) {
+            msg_err("%s: heap setup failed\n", __func__);
+            return false;
+        }
+    }
+
+    u64 start = now_ns();
+    for (int i = 0; i < BENCH_RUN_OPS; i++) {
+        /* freeing a low page pulls next-fit back to the start of the map */
+        deallocate_u64(id, 0, 1);
+        u64 a = allocate_u64(id, BENCH_RUN_PAGES);
+        if (a != frag_end) {
+            msg_err("%s: allocation returned 0x%lx, expecting 0x%lx\n", __func__, a, frag_end);
+            return false;
+        }
+        deallocate_u64(id, a, BENCH_RUN_PAGES);
+        id_heap_alloc_subrange(id, 1, 0, 1);
+    }
+    u64 elapsed = now_ns() - start;
+    rprintf("fragmented %d-page runs: %d allocations in %ld us, %ld ns/alloc\n",
+            BENCH_RUN_PAGES, BENCH_RUN_OPS, elapsed / THOUSAND, elapsed / BENCH_RUN_OPS);
+    id->destroy(id);
+    return true;
+}
+
+/* single pages from the last of many ranges, all others full */
+static boolean bench_ranges(heap h)
+{
+    heap id = allocate_id_heap(h, 1);
+    if (id == INVALID_ADDRESS) {
+        msg_err("%s: heap setup failed\n", __func__);
+        return false;
+    }
+    for (u64 i = 0; i < BENCH_RANGES; i++) {
+        u64 base = i * 2 * BENCH_RANGE_PAGES;
+        if (!id_heap_add_range(id, base, BENCH_RANGE_PAGES) ||
+            (i < BENCH_RANGES - 1 && !id_heap_set_area(id, base, BENCH_RANGE_PAGES, true, true))) {
+            msg_err("%s: heap setup failed\n", __func__);
+            return false;
+        }
+    }
+
+    u64 expect = (BENCH_RANGES - 1) * 2 * BENCH_RANGE_PAGES;
+    u64 start = now_ns();
+    for (int i = 0; i < BENCH_RANGE_OPS; i++) {
+        u64 a = allocate_u64(id, 1);
+        if (a != expect) {
+            msg_err("%s: allocation returned 0x%lx, expecting 0x%lx\n", __func__, a, expect);
+            return false;
+        }
+        deallocate_u64(id, a, 1);
+    }
+    u64 elapsed = now_ns() - start;
+    rprintf("%d ranges: %d allocations in %ld us, %ld ns/alloc\n",
+            BENCH_RANGES, BENCH_RANGE_OPS, elapsed / THOUSAND, elapsed / BENCH_RANGE_OPS);
+    id->destroy(id);
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     heap h = init_process_runtime();
@@ -368,6 +560,12 @@ int main(int argc, char **argv)
     if (!alloc_subrange_test(h))
         goto fail;
 
+    if (!hint_test(h))
+        goto fail;
+
+    if (!bench_sparse(h) || !bench_fragmented(h) || !bench_ranges(h))
+        goto fail;
+
     msg_debug("test passed\n");
     exit(EXIT_SUCCESS);
   fail:
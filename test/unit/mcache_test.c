@@ -0,0 +1,103 @@
+//#define ENABLE_MSG_DEBUG
+#include <runtime.h>
+#include <stdlib.h>
+#include <time.h>
+#define EXIT_FAILURE 1
+#define EXIT_SUCCESS 0
+
+#define TEST_PAGESIZE   U64_FROM_BIT(21)
+#define MIN_ORDER       5
+#define MAX_ORDER       20
+#define BENCH_PAIRS     (1ull << 22)
+#define BENCH_SIZES     64
+
+/* Every size maps to the smallest class that holds it. */
+boolean size_class_test(heap m)
+{
+    for (u64 size = 1; size <= U64_FROM_BIT(MAX_ORDER); size = size < 4096 ? size + 1 : size * 3 / 2) {
+        u64 expect = MAX(U64_FROM_BIT(find_order(size)), U64_FROM_BIT(MIN_ORDER));
+        bytes before = m->allocated;
+        void *p = allocate(m, size);
+        if (p == INVALID_ADDRESS) {
+            msg_err("allocation of %ld bytes failed\n", size);
+            return false;
+        }
+        if (m->allocated - before != expect) {
+            msg_err("size %ld: charged %ld, expected class %ld\n", size,
+                    m->allocated - before, expect);
+            return false;
+        }
+        heap o = objcache_from_object(u64_from_pointer(p), TEST_PAGESIZE);
+        if (o == INVALID_ADDRESS || o->pagesize != expect) {
+            msg_err("size %ld: object not from class %ld\n", size, expect);
+            return false;
+        }
+        deallocate(m, p, size);
+    }
+    if (allocate_u64(m, U64_FROM_BIT(MAX_ORDER) + 1) != INVALID_PHYSICAL) {
+        msg_err("allocation beyond largest class succeeded\n");
+        return false;
+    }
+    if (m->allocated != 0) {
+        msg_err("allocated (%ld) should be 0\n", m->allocated);
+        return false;
+    }
+    return true;
+}
+
+static u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+/* Allocate/free pairs over a spread of sizes up to 4K, like the mix of
+   closures, buffers and small structures the kernel general heap sees. */
+boolean alloc_bench(heap m)
+{
+    bytes sizes[BENCH_SIZES];
+    for (int i = 0; i < BENCH_SIZES; i++)
+        sizes[i] = 16 + (random_u64() % 4080);
+
+    u64 start = now_ns();
+    for (u64 i = 0; i < BENCH_PAIRS; i++) {
+        bytes size = sizes[i & (BENCH_SIZES - 1)];
+        void *p = allocate(m, size);
+        if (p == INVALID_ADDRESS) {
+            msg_err("allocation of %ld bytes failed\n", size);
+            return false;
+        }
+        deallocate(m, p, size);
+    }
+    u64 elapsed = now_ns() - start;
+    rprintf("%ld allocate/free pairs across size classes: %ld ns/pair\n",
+            BENCH_PAIRS, elapsed / BENCH_PAIRS);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    heap h = init_process_runtime();
+
+    /* make a parent heap for pages */
+    heap mm = allocate_mmapheap(h, TEST_PAGESIZE * 4);
+    heap pageheap = create_id_heap_backed(h, mm, TEST_PAGESIZE);
+    heap m = allocate_mcache(h, pageheap, MIN_ORDER, MAX_ORDER, TEST_PAGESIZE);
+    if (m == INVALID_ADDRESS) {
+        msg_err("failed to allocate mcache\n");
+        goto fail;
+    }
+
+    if (!size_class_test(m))
+        goto fail;
+
+    if (!alloc_bench(m))
+        goto fail;
+
+    msg_debug("mcache test passed\n");
+    exit(EXIT_SUCCESS);
+  fail:
+    msg_err("mcache test failed\n");
+    exit(EXIT_FAILURE);
+}
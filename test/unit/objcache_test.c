@@ -112,6 +112,48 @@ boolean objcache_test(heap meta, heap parent, int objsize)
     return true;
 }
 
+#ifdef OBJCACHE_DEBUG
+/* repeated frees, whether the object sits in the magazine or on its
+   page's free list, must be rejected rather than handed out twice */
+boolean double_free_test(heap meta, heap parent, int objsize)
+{
+    int opp = (TEST_PAGESIZE - FOOTER_SIZE) / objsize;
+    heap h = allocate_objcache(meta, parent, objsize, TEST_PAGESIZE);
+    vector objs = allocate_vector(meta, opp);
+
+    if (h == INVALID_ADDRESS) {
+	msg_err("tb: failed to allocate objcache heap\n");
+	return false;
+    }
+
+    if (!alloc_vec(h, opp, objsize, objs))
+	return false;
+
+    void *first = vector_get(objs, 0);
+    void *last = vector_get(objs, opp - 1);
+    if (!dealloc_vec(h, objsize, objs))
+	return false;
+
+    deallocate(h, first, objsize);
+    deallocate(h, last, objsize);
+    if (h->allocated > 0) {
+	msg_err("double free accounted; allocated %d\n", h->allocated);
+	return false;
+    }
+
+    void *a = allocate(h, objsize);
+    void *b = allocate(h, objsize);
+    if (a == b) {
+	msg_err("same object %p returned twice\n", a);
+	return false;
+    }
+    deallocate(h, a, objsize);
+    deallocate(h, b, objsize);
+    h->destroy(h);
+    return true;
+}
+#endif
+
 int main(int argc, char **argv)
 {
     heap h = init_process_runtime();
@@ -125,6 +167,11 @@ int main(int argc, char **argv)
     if (!objcache_test(h, pageheap, 32))
 	exit(EXIT_FAILURE);
 
+#ifdef OBJCACHE_DEBUG
+    if (!double_free_test(h, pageheap, 32))
+	exit(EXIT_FAILURE);
+#endif
+
     msg_debug("test passed\n");
     
     exit(EXIT_SUCCESS);
@@ -0,0 +1,220 @@
+//#define ENABLE_MSG_DEBUG
+#include <runtime.h>
+#include <x86_64.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#define EXIT_FAILURE 1
+#define EXIT_SUCCESS 0
+
+#define ITEM(p, i) ((void *)(((u64)(p) << 32) | ((i) + 1)))
+
+boolean basic_test(heap h)
+{
+    char *msg = "";
+    void *buf[8];
+    queue q = allocate_queue(h, 6);     /* 8 slots, holds 6 */
+
+    if (q == INVALID_ADDRESS) {
+        msg = "allocate";
+        goto fail;
+    }
+    if (q->size != 8 || q->capacity != 6) {
+        msg = "size not rounded to power of two or capacity not kept";
+        goto fail;
+    }
+    if (dequeue(q) != 0 || queue_peek(q) != 0 || queue_length(q) != 0) {
+        msg = "new queue not empty";
+        goto fail;
+    }
+
+    /* fill, overflow, drain in order - across several laps */
+    for (int lap = 0; lap < 3; lap++) {
+        for (u64 i = 0; i < 6; i++) {
+            if (!enqueue(q, ITEM(lap, i))) {
+                msg = "enqueue failed before full";
+                goto fail;
+            }
+        }
+        if (enqueue(q, ITEM(lap, 6))) {
+            msg = "enqueue succeeded on full queue";
+            goto fail;
+        }
+        if (queue_length(q) != 6 || queue_peek(q) != ITEM(lap, 0)) {
+            msg = "length or peek on full queue";
+            goto fail;
+        }
+        for (u64 i = 0; i < 6; i++) {
+            if (dequeue(q) != ITEM(lap, i)) {
+                msg = "dequeue out of order";
+                goto fail;
+            }
+        }
+        if (dequeue(q) != 0) {
+            msg = "dequeue from empty queue";
+            goto fail;
+        }
+    }
+
+    /* batch dequeue, including a partial batch and wraparound */
+    for (u64 i = 0; i < 5; i++)
+        enqueue(q, ITEM(9, i));
+    if (dequeue_n(q, buf, 3) != 3 || buf[0] != ITEM(9, 0) || buf[2] != ITEM(9, 2)) {
+        msg = "dequeue_n full batch";
+        goto fail;
+    }
+    for (u64 i = 5; i < 9; i++)
+        enqueue(q, ITEM(9, i));
+    if (enqueue(q, ITEM(9, 9))) {
+        msg = "enqueue beyond capacity";
+        goto fail;
+    }
+    if (dequeue_n(q, buf, 8) != 6) {
+        msg = "dequeue_n partial batch";
+        goto fail;
+    }
+    for (u64 i = 0; i < 6; i++) {
+        if (buf[i] != ITEM(9, i + 3)) {
+            msg = "dequeue_n out of order";
+            goto fail;
+        }
+    }
+    if (dequeue_n(q, buf, 8) != 0) {
+        msg = "dequeue_n from empty queue";
+        goto fail;
+    }
+    deallocate_queue(q);
+    return true;
+  fail:
+    msg_err("basic_test fail: %s\n", msg);
+    return false;
+}
+
+/* Producers enqueue tagged sequence numbers; consumers check that each
+   producer's items arrive in order and that every item arrives once. */
+#define STRESS_PRODUCERS 4
+#define STRESS_CONSUMERS 4
+#define STRESS_ITEMS (1ull << 16)       /* per producer */
+#define STRESS_BATCH 8
+
+struct stress {
+    queue q;
+    u64 producer;
+    u64 consumed;
+    u64 sum;
+    boolean batch;
+    boolean failed;
+};
+
+static u64 stress_done;
+
+static void *stress_producer(void *arg)
+{
+    struct stress *s = arg;
+    for (u64 i = 0; i < STRESS_ITEMS; i++) {
+        while (!enqueue(s->q, ITEM(s->producer, i)))
+            sched_yield();
+    }
+    return 0;
+}
+
+static void *stress_consumer(void *arg)
+{
+    struct stress *s = arg;
+    u64 last[STRESS_PRODUCERS] = {0};
+    void *buf[STRESS_BATCH];
+
+    while (1) {
+        u64 n = s->batch ? dequeue_n(s->q, buf, STRESS_BATCH) : (buf[0] = dequeue(s->q)) != 0;
+        if (n == 0) {
+            if (__atomic_load_n(&stress_done, __ATOMIC_ACQUIRE) && queue_length(s->q) == 0)
+                break;
+            sched_yield();
+            continue;
+        }
+        for (u64 i = 0; i < n; i++) {
+            u64 v = (u64)buf[i];
+            u64 p = v >> 32;
+            u64 seq = v & MASK(32);
+            if (p >= STRESS_PRODUCERS || seq <= last[p]) {
+                msg_err("consumer got 0x%lx out of order (last 0x%lx)\n", v, p < STRESS_PRODUCERS ? last[p] : 0);
+                s->failed = true;
+                return 0;
+            }
+            last[p] = seq;
+            s->sum += seq;
+            s->consumed++;
+        }
+    }
+    return 0;
+}
+
+static u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+boolean stress_test(heap h, boolean batch)
+{
+    pthread_t producers[STRESS_PRODUCERS], consumers[STRESS_CONSUMERS];
+    struct stress ps[STRESS_PRODUCERS], cs[STRESS_CONSUMERS];
+    queue q = allocate_queue(h, 1024);
+    stress_done = 0;
+
+    u64 start = now_ns();
+    for (int i = 0; i < STRESS_CONSUMERS; i++) {
+        cs[i] = (struct stress){ .q = q, .batch = batch };
+        pthread_create(&consumers[i], 0, stress_consumer, &cs[i]);
+    }
+    for (int i = 0; i < STRESS_PRODUCERS; i++) {
+        ps[i] = (struct stress){ .q = q, .producer = i };
+        pthread_create(&producers[i], 0, stress_producer, &ps[i]);
+    }
+    for (int i = 0; i < STRESS_PRODUCERS; i++)
+        pthread_join(producers[i], 0);
+    __atomic_store_n(&stress_done, 1, __ATOMIC_RELEASE);
+
+    u64 consumed = 0, sum = 0;
+    boolean failed = false;
+    for (int i = 0; i < STRESS_CONSUMERS; i++) {
+        pthread_join(consumers[i], 0);
+        consumed += cs[i].consumed;
+        sum += cs[i].sum;
+        failed |= cs[i].failed;
+    }
+    u64 elapsed = now_ns() - start;
+    deallocate_queue(q);
+
+    u64 total = STRESS_PRODUCERS * STRESS_ITEMS;
+    if (failed || consumed != total || sum != STRESS_PRODUCERS * (STRESS_ITEMS * (STRESS_ITEMS + 1) / 2)) {
+        msg_err("stress_test fail: consumed %ld of %ld items\n", consumed, total);
+        return false;
+    }
+    rprintf("%d producers, %d consumers%s: %ld items in %ld ms, %ld ns/item\n",
+            STRESS_PRODUCERS, STRESS_CONSUMERS, batch ? " (dequeue_n)" : "",
+            total, elapsed / MILLION, elapsed / total);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    heap h = init_process_runtime();
+
+    if (!basic_test(h))
+        goto fail;
+
+    if (!stress_test(h, false))
+        goto fail;
+
+    if (!stress_test(h, true))
+        goto fail;
+
+    msg_debug("queue test passed\n");
+    exit(EXIT_SUCCESS);
+  fail:
+    msg_err("queue test failed\n");
+    exit(EXIT_FAILURE);
+}
@@ -1,4 +1,4 @@
-/* This test is only suitable for the sorted list implementation. It
+/* The basic test relies on in-order traversal of range lookups. It
    will need doctoring if the behavior of range search, etc., changes. */
 
 //#define ENABLE_MSG_DEBUG
@@ -209,6 +209,127 @@ boolean basic_test(heap h)
     return false;
 }
 
+closure_function(1, 1, void, scale_count_node,
+                 u64 *, count,
+                 rmnode, n)
+{
+    (*bound(count))++;
+}
+
+closure_function(1, 1, void, scale_count_gap,
+                 u64 *, count,
+                 range, r)
+{
+    (*bound(count))++;
+}
+
+/* Insert n nodes of random width in shuffled order, then time point
+   lookups, range lookups, gap searches and removals, validating each
+   against the known layout. */
+static boolean scale_test(heap h, int n)
+{
+    rangemap rm = allocate_rangemap(h);
+    test_node nodes = malloc(n * sizeof(struct test_node));
+    int *order = malloc(n * sizeof(int));
+    u64 *points = malloc(n * sizeof(u64));
+    if (rm == INVALID_ADDRESS || !nodes || !order || !points) {
+        msg_err("allocation failed\n");
+        return false;
+    }
+
+    /* nodes of width 1-4 separated by gaps of 0-3 */
+    u64 base = 0;
+    for (int i = 0; i < n; i++) {
+        base += random_u64() & 3;
+        u64 width = 1 + (random_u64() & 3);
+        rmnode_init(&nodes[i].node, irange(base, base + width));
+        nodes[i].val = i;
+        base += width;
+        order[i] = i;
+    }
+    for (int i = n - 1; i > 0; i--) {
+        int j = random_u64() % (i + 1);
+        int t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    for (int i = 0; i < n; i++) {
+        test_node tn = &nodes[order[i]];
+        points[i] = tn->node.r.start + random_u64() % range_span(tn->node.r);
+    }
+
+    timestamp t0 = now(CLOCK_ID_MONOTONIC);
+    for (int i = 0; i < n; i++) {
+        if (!rangemap_insert(rm, &nodes[order[i]].node)) {
+            msg_err("insert of %R failed\n", nodes[order[i]].node.r);
+            return false;
+        }
+    }
+    timestamp t1 = now(CLOCK_ID_MONOTONIC);
+
+    for (int i = 0; i < n; i++) {
+        if (rangemap_lookup(rm, points[i]) != &nodes[order[i]].node) {
+            msg_err("lookup of 0x%lx failed\n", points[i]);
+            return false;
+        }
+    }
+    timestamp t2 = now(CLOCK_ID_MONOTONIC);
+
+    /* a range lookup or gap search over a window starting inside a node
+       visits that node and whatever follows it in the window */
+    u64 count = 0;
+    rmnode_handler nh = stack_closure(scale_count_node, &count);
+    for (int i = 0; i < n; i++) {
+        u64 c = count;
+        rangemap_range_lookup(rm, irange(points[i], points[i] + 8), nh);
+        if (count == c) {
+            msg_err("range lookup at 0x%lx found nothing\n", points[i]);
+            return false;
+        }
+    }
+    timestamp t3 = now(CLOCK_ID_MONOTONIC);
+    u64 gaps = 0;
+    range_handler rh = stack_closure(scale_count_gap, &gaps);
+    for (int i = 0; i < n; i++)
+        rangemap_range_find_gaps(rm, irange(points[i], points[i] + 8), rh);
+    timestamp t4 = now(CLOCK_ID_MONOTONIC);
+
+    /* traversal must yield nodes in order */
+    rmnode prev = rangemap_first_node(rm);
+    for (int i = 1; i < n; i++) {
+        rmnode next = rangemap_next_node(rm, prev);
+        if (next != &nodes[i].node || rangemap_prev_node(rm, next) != prev) {
+            msg_err("traversal mismatch at %d\n", i);
+            return false;
+        }
+        prev = next;
+    }
+
+    /* remove every other node and recheck lookups */
+    timestamp t5 = now(CLOCK_ID_MONOTONIC);
+    for (int i = 0; i < n; i += 2)
+        rangemap_remove_node(rm, &nodes[i].node);
+    timestamp t6 = now(CLOCK_ID_MONOTONIC);
+    for (int i = 0; i < n; i++) {
+        rmnode r = rangemap_lookup(rm, nodes[i].node.r.start);
+        if (r != ((i & 1) ? &nodes[i].node : INVALID_ADDRESS)) {
+            msg_err("lookup after remove mismatch at %d\n", i);
+            return false;
+        }
+    }
+
+    rprintf("%d nodes: insert %ld ns/op, lookup %ld ns/op, range lookup %ld ns/op, "
+            "find gaps %ld ns/op, remove %ld ns/op\n", n,
+            nsec_from_timestamp(t1 - t0) / n, nsec_from_timestamp(t2 - t1) / n,
+            nsec_from_timestamp(t3 - t2) / n, nsec_from_timestamp(t4 - t3) / n,
+            nsec_from_timestamp(t6 - t5) / ((n + 1) / 2));
+    deallocate_rangemap(rm);
+    free(points);
+    free(order);
+    free(nodes);
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     heap h = init_process_runtime();
@@ -216,6 +337,11 @@ int main(int argc, char **argv)
     if (!basic_test(h))
         goto fail;
 
+    for (int n = 1000; n <= 1000000; n *= 10) {
+        if (!scale_test(h, n))
+            goto fail;
+    }
+
     /*
       if (!random_test(h, 100, 1000))
       goto fail;
@@ -0,0 +1,165 @@
+//#define ENABLE_MSG_DEBUG
+#include <runtime.h>
+#include <stdlib.h>
+#include <time.h>
+#define EXIT_FAILURE 1
+#define EXIT_SUCCESS 0
+
+#define TIMERS 1024
+#define CHURN_TIMERS (1ull << 20)
+
+struct expect {
+    timestamp deadline;
+    timestamp fired;
+    boolean cancelled;
+    int count;
+};
+
+static struct expect expects[TIMERS];
+static timer timers[TIMERS];
+static boolean failed;
+
+closure_function(1, 0, void, test_timer_fired,
+                 struct expect *, e)
+{
+    struct expect *e = bound(e);
+    timestamp here = now(CLOCK_ID_MONOTONIC);
+    if (e->cancelled) {
+        msg_err("cancelled timer fired\n");
+        failed = true;
+    }
+    if (here < e->deadline) {
+        msg_err("timer fired early: now %T, deadline %T\n", here, e->deadline);
+        failed = true;
+    }
+    e->fired = here;
+    e->count++;
+}
+
+/* Poll timer_check until it reports no more timers, or until limit. */
+static boolean run_timers(timestamp limit)
+{
+    timestamp end = now(CLOCK_ID_MONOTONIC) + limit;
+    while (timer_check() != infinity) {
+        if (now(CLOCK_ID_MONOTONIC) > end)
+            return false;
+    }
+    return true;
+}
+
+/* One-shot timers over a range spanning several wheel levels, with every
+   third one cancelled before it can expire. */
+boolean oneshot_test(heap h)
+{
+    timestamp base = now(CLOCK_ID_MONOTONIC);
+    for (int i = 0; i < TIMERS; i++) {
+        timestamp interval = microseconds((random_u64() % 200000) + 1);
+        expects[i] = (struct expect){ .deadline = base + interval };
+        timers[i] = register_timer(interval, CLOCK_ID_MONOTONIC,
+                                   closure(h, test_timer_fired, &expects[i]));
+        if (timers[i] == INVALID_ADDRESS) {
+            msg_err("register_timer failed\n");
+            return false;
+        }
+    }
+    for (int i = 0; i < TIMERS; i += 3) {
+        expects[i].cancelled = true;
+        remove_timer(timers[i]);
+    }
+    if (!run_timers(seconds(5))) {
+        msg_err("timers still pending\n");
+        return false;
+    }
+    for (int i = 0; i < TIMERS; i++) {
+        if (!expects[i].cancelled && expects[i].count != 1) {
+            msg_err("timer %d fired %d times\n", i, expects[i].count);
+            return false;
+        }
+    }
+    return !failed;
+}
+
+closure_function(2, 0, void, test_periodic_fired,
+                 struct expect *, e, timer *, t)
+{
+    struct expect *e = bound(e);
+    e->count++;
+    if (e->count == 5)
+        remove_timer(*bound(t));
+}
+
+/* A periodic timer that cancels itself from its own thunk. */
+boolean periodic_test(heap h)
+{
+    struct expect e = {0};
+    timer t;
+    t = register_periodic_timer(milliseconds(2), CLOCK_ID_MONOTONIC,
+                                closure(h, test_periodic_fired, &e, &t));
+    if (!run_timers(seconds(5))) {
+        msg_err("periodic timer still pending\n");
+        return false;
+    }
+    if (e.count != 5) {
+        msg_err("periodic timer fired %d times\n", e.count);
+        return false;
+    }
+    return true;
+}
+
+static u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+/* Register and cancel a timer per iteration, as a blockq timeout does
+   when the resource arrives first, with a standing population of timers
+   on the wheel. */
+boolean churn_bench(heap h)
+{
+    for (int i = 0; i < TIMERS; i++)
+        timers[i] = register_timer(seconds(60 + i), CLOCK_ID_MONOTONIC, ignore);
+
+    u64 start = now_ns();
+    for (u64 i = 0; i < CHURN_TIMERS; i++) {
+        timer t = register_timer(milliseconds(1 + (i & 1023)), CLOCK_ID_MONOTONIC, ignore);
+        remove_timer(t);
+    }
+    u64 elapsed = now_ns() - start;
+
+    for (int i = 0; i < TIMERS; i++)
+        remove_timer(timers[i]);
+    if (timer_check() != infinity) {
+        msg_err("timers remain after cancelling all\n");
+        return false;
+    }
+    rprintf("%ld register/remove pairs with %d standing timers: %ld ns/pair\n",
+            CHURN_TIMERS, TIMERS, elapsed / CHURN_TIMERS);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    heap h = init_process_runtime();
+
+    if (timer_check() != infinity) {
+        msg_err("timers pending at start\n");
+        goto fail;
+    }
+
+    if (!oneshot_test(h))
+        goto fail;
+
+    if (!periodic_test(h))
+        goto fail;
+
+    if (!churn_bench(h))
+        goto fail;
+
+    msg_debug("timer test passed\n");
+    exit(EXIT_SUCCESS);
+  fail:
+    msg_err("timer test failed\n");
+    exit(EXIT_FAILURE);
+}